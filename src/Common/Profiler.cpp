@@ -4,4 +4,5 @@ using namespace stm;
 
 list<shared_ptr<Profiler::sample_t>> Profiler::mFrameHistory;
 shared_ptr<Profiler::sample_t> Profiler::mCurrentSample;
+thread::id Profiler::mThread = this_thread::get_id();
 size_t Profiler::mFrameHistoryCount = 256;
\ No newline at end of file
@@ -13,6 +13,7 @@ public:
 		chrono::nanoseconds mDuration;
 		Vector4f mColor;
 		string mLabel;
+		unordered_map<string, size_t> mCounters;
 		
 		sample_t() = default;
 		sample_t(sample_t&& s) = default;
@@ -20,7 +21,9 @@ public:
 			: mParent(parent), mColor(color), mLabel(label), mStartTime(chrono::high_resolution_clock::now()), mDuration(chrono::nanoseconds::zero()) {}
 	};
 
+	// Samples are only recorded on the thread that loaded the profiler, and not e.g. by pipelines compiling on worker threads
 	inline static void begin_sample(const string& label, const Vector4f& color = Vector4f(.3f, .9f, .3f, 1)) {
+		if (this_thread::get_id() != mThread) return;
 		auto s = make_unique<sample_t>(mCurrentSample, label, color);
 		if (mCurrentSample)
 			mCurrentSample = mCurrentSample->mChildren.emplace_back(move(s));
@@ -30,6 +33,7 @@ public:
 		}
 	}
 	inline static shared_ptr<sample_t> end_sample() {
+		if (this_thread::get_id() != mThread) return nullptr;
 		if (!mCurrentSample) throw logic_error("cannot call end_sample without first calling begin_sample");
 		mCurrentSample->mDuration += chrono::high_resolution_clock::now() - mCurrentSample->mStartTime;
 		auto tmp = mCurrentSample;
@@ -37,6 +41,19 @@ public:
 		return tmp;
 	}
 
+	// Adds to a counter on the current sample, e.g. the number of times a command was recorded
+	inline static void add_counter(const string& name, size_t value = 1) {
+		if (mCurrentSample && this_thread::get_id() == mThread) mCurrentSample->mCounters[name] += value;
+	}
+	// Sum of a counter over a sample and all of its children
+	inline static size_t counter_total(const sample_t& sample, const string& name) {
+		auto it = sample.mCounters.find(name);
+		size_t total = (it == sample.mCounters.end()) ? 0 : it->second;
+		for (const auto& c : sample.mChildren)
+			total += counter_total(*c, name);
+		return total;
+	}
+
 	inline static const auto& history() { return mFrameHistory; }
 	inline static void clear_history() { mFrameHistory.clear(); }
 
@@ -46,6 +63,7 @@ private:
 	STRATUM_API static size_t mFrameHistoryCount;
 	STRATUM_API static list<shared_ptr<sample_t>> mFrameHistory;
 	STRATUM_API static shared_ptr<sample_t> mCurrentSample;
+	STRATUM_API static thread::id mThread;
 };
 
 }
\ No newline at end of file
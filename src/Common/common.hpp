@@ -555,6 +555,17 @@ inline vk::AccessFlags guess_access_flags(vk::ImageLayout layout) {
 	return vk::AccessFlagBits::eShaderRead;
 }
 
+inline bool has_write_access(vk::AccessFlags access) {
+	return (bool)(access & (
+		vk::AccessFlagBits::eShaderWrite |
+		vk::AccessFlagBits::eColorAttachmentWrite |
+		vk::AccessFlagBits::eDepthStencilAttachmentWrite |
+		vk::AccessFlagBits::eTransferWrite |
+		vk::AccessFlagBits::eHostWrite |
+		vk::AccessFlagBits::eMemoryWrite |
+		vk::AccessFlagBits::eAccelerationStructureWriteKHR));
+}
+
 inline auto format_bytes(size_t bytes) { 
 	const char* units[] { "B", "KB", "MB", "GB", "TB" };
 	uint32_t i = 0;
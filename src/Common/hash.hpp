@@ -24,35 +24,94 @@ constexpr size_t hash_array(const T(& arr)[N]) {
 		return hash_combine(hash_array<T,N-1>(arr), hasher(arr[N-1]));
 }
 
+// 64-bit hash of size bytes. The 32 byte blocks are split between four independent lanes, so that the loop
+// has no dependency from one word to the next and the compiler can pipeline or vectorize it
+inline uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0) {
+	constexpr uint64_t k0 = 0x9e3779b97f4a7c15ull;
+	constexpr uint64_t k1 = 0xc2b2ae3d27d4eb4full;
+	constexpr uint64_t k2 = 0x165667b19e3779f9ull;
+	const auto round = [](uint64_t h, uint64_t w) { return rotl(h + w*k1, 31) * k0; };
+
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+	uint64_t lanes[4] = { seed + k0 + k1, seed + k1, seed, seed - k0 };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+		for (uint32_t l = 0; l < 4; l++) {
+			uint64_t w;
+			memcpy(&w, p + i + l*8, sizeof(w));
+			lanes[l] = round(lanes[l], w);
+		}
+	uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + k2 + size;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, sizeof(w));
+		h = rotl(h ^ round(0, w), 27) * k0 + k2;
+	}
+	if (i < size) {
+		uint64_t w = 0;
+		memcpy(&w, p + i, size - i);
+		h = rotl(h ^ round(0, w), 27) * k0 + k2;
+	}
+	// avalanche
+	h ^= h >> 33;
+	h *= k1;
+	h ^= h >> 29;
+	h *= k2;
+	h ^= h >> 32;
+	return h;
+}
+
 template<hashable T>
 inline size_t hash_args(const T& v) {
 	return hash<T>()(v);
 }
 
-template<typename T> requires(!hashable<T> && !ranges::range<T>)
+// types whose bytes are their value are hashed directly
+template<typename T> requires(!hashable<T> && !ranges::range<T> && has_unique_object_representations_v<T>)
+inline size_t hash_args(const T& v) {
+	return (size_t)hash_bytes(&v, sizeof(T));
+}
+
+// other types are hashed through binary_write, which is buffered so that hash_bytes sees blocks of bytes
+template<typename T> requires(!hashable<T> && !ranges::range<T> && !has_unique_object_representations_v<T>)
 inline size_t hash_args(const T& v) {
 	class hash_streambuf : public basic_streambuf<char, char_traits<char>> {
 	public:
 		using base_t = basic_streambuf<char, char_traits<char>>;
-		size_t mValue = 0;
+		uint64_t mValue = 0;
+		char mBuffer[256];
+		inline hash_streambuf() { setp(mBuffer, mBuffer + size(mBuffer)); }
+		inline void flush() {
+			if (pptr() == pbase()) return;
+			mValue = hash_bytes(pbase(), pptr() - pbase(), mValue);
+			setp(mBuffer, mBuffer + size(mBuffer));
+		}
 		inline base_t::int_type overflow(base_t::int_type v) {
-			mValue = hash_combine(mValue, v);
+			flush();
+			if (!base_t::traits_type::eq_int_type(v, base_t::traits_type::eof()))
+				sputc(base_t::traits_type::to_char_type(v));
 			return v;
 		}
 	};
 	hash_streambuf h;
 	ostream os(&h);
 	binary_write(os, v);
-	return h.mValue;
+	h.flush();
+	return (size_t)h.mValue;
+}
+
+template<ranges::contiguous_range R> requires(!hashable<R> && has_unique_object_representations_v<ranges::range_value_t<R>>)
+inline size_t hash_args(const R& r) {
+	return (size_t)hash_bytes(ranges::data(r), ranges::size(r)*sizeof(ranges::range_value_t<R>));
 }
 
-template<ranges::range R> requires(!hashable<R>)
+template<ranges::range R> requires(!hashable<R> && !(ranges::contiguous_range<R> && has_unique_object_representations_v<ranges::range_value_t<R>>))
 inline size_t hash_args(const R& r) {
 	auto it = ranges::begin(r);
 	if (it == ranges::end(r)) return 0;
 	size_t h = 0;
 	do {
-		if constexpr(is_specialization_v<R::value_type, pair>)
+		if constexpr(is_specialization_v<typename R::value_type, pair>)
 			h = hash_combine(h, hash_combine(hash_args(it->first), hash_args(it->second)));
 		else
 			h = hash_combine(h, hash_args(*it));
@@ -2,8 +2,11 @@
 
 #include <bit>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
 #include <functional>
+#include <future>
 #include <locale>
 #include <mutex>
 #include <numeric>
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace stm {
+
+// Move-only replacement for std::function that stores its callable inline and never allocates.
+// Callables larger than Capacity fail to compile instead of falling back to the heap
+template<typename Signature, size_t Capacity = 64>
+class inline_function;
+
+template<typename R, typename... Args, size_t Capacity>
+class inline_function<R(Args...), Capacity> {
+public:
+	inline_function() = default;
+	inline_function(nullptr_t) {}
+	inline_function(const inline_function&) = delete;
+	inline_function& operator=(const inline_function&) = delete;
+
+	template<typename F> requires(!same_as<remove_cvref_t<F>, inline_function> && invocable<remove_cvref_t<F>&, Args...>)
+	inline inline_function(F&& f) {
+		using T = remove_cvref_t<F>;
+		static_assert(sizeof(T) <= Capacity, "callable is too large for inline_function, capture less or raise Capacity");
+		static_assert(alignof(T) <= alignof(max_align_t), "callable is over-aligned for inline_function");
+		new (mStorage) T(forward<F>(f));
+		mInvoke = [](void* p, Args&&... args) -> R { return invoke(*reinterpret_cast<T*>(p), forward<Args>(args)...); };
+		mManage = [](void* dst, void* src) {
+			if (src) {
+				new (dst) T(move(*reinterpret_cast<T*>(src)));
+				reinterpret_cast<T*>(src)->~T();
+			} else
+				reinterpret_cast<T*>(dst)->~T();
+		};
+	}
+	inline inline_function(inline_function&& f) { take(f); }
+	inline inline_function& operator=(inline_function&& f) {
+		if (&f != this) {
+			reset();
+			take(f);
+		}
+		return *this;
+	}
+	inline ~inline_function() { reset(); }
+
+	inline void reset() {
+		if (mManage) mManage(mStorage, nullptr);
+		mInvoke = nullptr;
+		mManage = nullptr;
+	}
+
+	inline explicit operator bool() const { return mInvoke != nullptr; }
+	// like std::function, the callable is invoked as non-const
+	inline R operator()(Args... args) const { return mInvoke(mStorage, forward<Args>(args)...); }
+
+private:
+	alignas(max_align_t) mutable byte mStorage[Capacity];
+	R(*mInvoke)(void*, Args&&...) = nullptr;
+	void(*mManage)(void* dst, void* src) = nullptr; // moves src into dst and destroys src, or destroys dst when src is null
+
+	inline void take(inline_function& f) {
+		if (!f.mManage) return;
+		f.mManage(mStorage, f.mStorage);
+		mInvoke = f.mInvoke;
+		mManage = f.mManage;
+		f.mInvoke = nullptr;
+		f.mManage = nullptr;
+	}
+};
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace stm {
+
+// Threads that run submitted functions in the order they were submitted. The destructor finishes the queued functions before joining
+class worker_pool {
+private:
+	vector<thread> mThreads;
+	queue<function<void()>> mQueue;
+	mutex mMutex;
+	condition_variable mCondition;
+	bool mStop = false;
+
+	inline void run() {
+		while (true) {
+			function<void()> fn;
+			{
+				unique_lock<mutex> lock(mMutex);
+				mCondition.wait(lock, [&]{ return mStop || !mQueue.empty(); });
+				if (mQueue.empty()) return;
+				fn = move(mQueue.front());
+				mQueue.pop();
+			}
+			fn();
+		}
+	}
+
+public:
+	inline worker_pool(size_t threadCount = max(thread::hardware_concurrency(), 2u) - 1) {
+		mThreads.reserve(threadCount);
+		for (size_t i = 0; i < threadCount; i++)
+			mThreads.emplace_back(&worker_pool::run, this);
+	}
+	inline ~worker_pool() {
+		{
+			scoped_lock<mutex> lock(mMutex);
+			mStop = true;
+		}
+		mCondition.notify_all();
+		for (thread& t : mThreads)
+			t.join();
+	}
+
+	inline size_t size() const { return mThreads.size(); }
+
+	// Exceptions thrown by fn are rethrown by the future's get()
+	template<invocable F>
+	inline shared_future<invoke_result_t<F>> submit(F&& fn) {
+		auto task = make_shared<packaged_task<invoke_result_t<F>()>>(forward<F>(fn));
+		shared_future<invoke_result_t<F>> result = task->get_future().share();
+		{
+			scoped_lock<mutex> lock(mMutex);
+			mQueue.emplace([task]() { (*task)(); });
+		}
+		mCondition.notify_one();
+		return result;
+	}
+};
+
+}
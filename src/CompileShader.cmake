@@ -1,11 +1,12 @@
 function(stm_compile_shader SRC_PATH DST_FOLDER)
-  cmake_parse_arguments(PARSED "" "" "INCLUDES" ${ARGN})
+  cmake_parse_arguments(PARSED "" "TARGET_SUFFIX" "INCLUDES;DEFINES" ${ARGN})
 
   get_filename_component(SRC_NAME ${SRC_PATH} NAME_WLE)
   file(STRINGS ${SRC_PATH} LINES)
 
   set(DST_TARGETS "")
   set(DST_FILES "")
+  file(MAKE_DIRECTORY ${DST_FOLDER})
   
   # Scan the file for any lines beginning with '#pragma compile'
   foreach(LINE IN LISTS LINES)
@@ -54,14 +55,17 @@ function(stm_compile_shader SRC_PATH DST_FOLDER)
     foreach (INC_PATH ${PARSED_INCLUDES})
       list(APPEND COMPILE_CMD "-I" "${INC_PATH}")
     endforeach()
+    foreach (DEFINE ${PARSED_DEFINES})
+      list(APPEND COMPILE_CMD "-D${DEFINE}")
+    endforeach()
 
     add_custom_command(OUTPUT "${SPV_PATH}" "${SPV_JSON_PATH}"
       COMMAND ${COMPILE_CMD} ${SRC_PATH} && spirv-cross ${SPV_PATH} --output ${SPV_JSON_PATH} --reflect
       DEPENDS "${SRC_PATH}" IMPLICIT_DEPENDS CXX "${SRC_PATH}")
     
-    add_custom_target(${DST_NAME} ALL DEPENDS "${SPV_PATH}" "${SPV_JSON_PATH}")    
+    add_custom_target(${DST_NAME}${PARSED_TARGET_SUFFIX} ALL DEPENDS "${SPV_PATH}" "${SPV_JSON_PATH}")    
     
-    list(APPEND DST_TARGETS ${DST_NAME})
+    list(APPEND DST_TARGETS ${DST_NAME}${PARSED_TARGET_SUFFIX})
     list(APPEND DST_FILES "${SPV_PATH}" "${SPV_JSON_PATH}")
   endforeach()
   
@@ -70,10 +74,10 @@ function(stm_compile_shader SRC_PATH DST_FOLDER)
 endfunction()
 
 function(stm_add_shaders)
-  cmake_parse_arguments(PARSED "" "" "SOURCES;DEPENDS;INCLUDES" ${ARGN})
+  cmake_parse_arguments(PARSED "" "VARIANT_MATCH" "SOURCES;DEPENDS;INCLUDES;DEFINES;VARIANT_DEFINES" ${ARGN})
 
   foreach(SHADER_FILE ${PARSED_SOURCES})
-    stm_compile_shader("${SHADER_FILE}" "${CMAKE_CURRENT_BINARY_DIR}/Shaders" INCLUDES ${PARSED_INCLUDES})
+    stm_compile_shader("${SHADER_FILE}" "${CMAKE_CURRENT_BINARY_DIR}/Shaders" INCLUDES ${PARSED_INCLUDES} DEFINES ${PARSED_DEFINES})
     
     if (DST_TARGETS)
       foreach(DEP ${PARSED_DEPENDS})
@@ -84,5 +88,24 @@ function(stm_add_shaders)
     foreach(DST_FILE ${DST_FILES})
         install(FILES ${DST_FILE} DESTINATION bin/Shaders)
     endforeach()
+
+    # VARIANT_DEFINES compiles shaders a second time, so that the configuration that isn't in use keeps compiling. Only the sources
+    # whose contents match the VARIANT_MATCH regex get a variant. The variants go to their own folder and are never installed or loaded,
+    # so Stratum only passes VARIANT_DEFINES when STRATUM_COMPILE_SHADER_VARIANTS is on
+    set(COMPILE_VARIANT FALSE)
+    if (PARSED_VARIANT_DEFINES)
+      file(READ "${SHADER_FILE}" SHADER_SOURCE)
+      if ("${SHADER_SOURCE}" MATCHES "${PARSED_VARIANT_MATCH}")
+        set(COMPILE_VARIANT TRUE)
+      endif()
+    endif()
+    if (COMPILE_VARIANT)
+      stm_compile_shader("${SHADER_FILE}" "${CMAKE_CURRENT_BINARY_DIR}/ShaderVariants" INCLUDES ${PARSED_INCLUDES} DEFINES ${PARSED_VARIANT_DEFINES} TARGET_SUFFIX "_variant")
+      if (DST_TARGETS)
+        foreach(DEP ${PARSED_DEPENDS})
+          add_dependencies(${DEP} ${DST_TARGETS})
+        endforeach()
+      endif()
+    endif()
   endforeach()
 endfunction()
\ No newline at end of file
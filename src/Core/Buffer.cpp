@@ -38,4 +38,74 @@ const vk::BufferView& Buffer::TexelView::operator*() const {
     buffer()->mDevice.set_debug_name(v, buffer()->name()+"/View");
     return buffer()->mTexelViews.emplace(mHashKey, v).first->second;
   }
-}
\ No newline at end of file
+}
+
+UploadRing::UploadRing(Device& device, vk::DeviceSize size) : mDevice(device) {
+  mMinAlignment = max<vk::DeviceSize>({ 16, mDevice.limits().minStorageBufferOffsetAlignment, mDevice.limits().minUniformBufferOffsetAlignment });
+  grow(size);
+  mGrowCount = 0;
+}
+
+vk::DeviceSize UploadRing::size_in_use() const {
+  if (mRegions.empty()) return 0;
+  const vk::DeviceSize head = mRegions.back()->mEnd;
+  const vk::DeviceSize tail = mRegions.front()->mBegin;
+  return head > tail ? head - tail : size() - tail + head;
+}
+
+void UploadRing::retire() {
+  // regions are retired in allocation order, a region that completes early waits for the ones before it
+  while (!mRegions.empty() && !mRegions.front()->in_use())
+    mRegions.pop_front();
+}
+
+void UploadRing::grow(vk::DeviceSize minSize) {
+  vk::BufferUsageFlags usage = vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eUniformBuffer|vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eIndexBuffer|vk::BufferUsageFlagBits::eVertexBuffer;
+  if (mDevice.buffer_device_address().bufferDeviceAddress) {
+    usage |= vk::BufferUsageFlagBits::eShaderDeviceAddress;
+    if (mDevice.acceleration_structure_features().accelerationStructure)
+      usage |= vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
+  }
+  const vk::DeviceSize size = max(align_up(minSize, mMinAlignment), mBuffer ? mBuffer->size()*2 : 0);
+  // regions that are still in flight keep the old buffer alive through their CommandBuffers
+  mRegions.clear();
+  mBuffer = make_shared<Buffer>(mDevice, "UploadRing", size, usage, VMA_MEMORY_USAGE_CPU_TO_GPU, (uint32_t)mMinAlignment);
+  mGrowCount++;
+}
+
+Buffer::View<byte> UploadRing::allocate_bytes(CommandBuffer& commandBuffer, vk::DeviceSize size, vk::DeviceSize alignment) {
+  alignment = max(alignment, mMinAlignment);
+  size = max<vk::DeviceSize>(size, 1);
+
+  retire();
+
+  vk::DeviceSize offset = 0;
+  bool fits;
+  if (mRegions.empty())
+    fits = size <= mBuffer->size();
+  else {
+    const vk::DeviceSize head = mRegions.back()->mEnd;
+    const vk::DeviceSize tail = mRegions.front()->mBegin;
+    offset = align_up(head, alignment);
+    if (head > tail) {
+      // free space is [head, size()) and [0, tail)
+      if (offset + size > mBuffer->size()) offset = 0;
+      fits = offset != 0 || size <= tail;
+    } else
+      // wrapped, free space is [head, tail)
+      fits = offset + size <= tail;
+  }
+  if (!fits) {
+    grow(size);
+    offset = 0;
+  }
+
+  if (!mRegions.empty() && mRegions.back()->mCommandBuffer == &commandBuffer && offset >= mRegions.back()->mEnd && mRegions.back()->in_use())
+    mRegions.back()->mEnd = offset + size;
+  else {
+    const shared_ptr<Region>& region = mRegions.emplace_back(make_shared<Region>(mBuffer, &commandBuffer, offset));
+    region->mEnd = offset + size;
+    commandBuffer.hold_resource(region);
+  }
+  return Buffer::View<byte>(mBuffer, offset, size);
+}
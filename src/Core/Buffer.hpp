@@ -299,6 +299,58 @@ private:
 	vk::SharingMode mSharingMode;
 };
 
+// Persistently mapped, host-visible ring buffer for small per-frame uploads (uniforms, instance data, TLAS instances).
+// Each allocation belongs to the CommandBuffer that reads it, and its space is reused once that CommandBuffer completes.
+// Allocations are retired in order, so the ring only grows when a CommandBuffer is kept in flight for longer than the ring can cover
+class UploadRing {
+public:
+	UploadRing() = delete;
+	UploadRing(const UploadRing&) = delete;
+	UploadRing(UploadRing&&) = delete;
+	STRATUM_API UploadRing(Device& device, vk::DeviceSize size);
+
+	inline const shared_ptr<Buffer>& buffer() const { return mBuffer; }
+	inline vk::DeviceSize size() const { return mBuffer->size(); }
+	inline size_t grow_count() const { return mGrowCount; }
+	// bytes between the oldest allocation still in use and the newest allocation
+	STRATUM_API vk::DeviceSize size_in_use() const;
+
+	// The returned memory is valid until commandBuffer finishes executing, and must not be read by any other CommandBuffer
+	STRATUM_API Buffer::View<byte> allocate_bytes(CommandBuffer& commandBuffer, vk::DeviceSize size, vk::DeviceSize alignment = 0);
+	template<typename T>
+	inline Buffer::View<T> allocate(CommandBuffer& commandBuffer, vk::DeviceSize count, vk::DeviceSize alignment = alignof(T)) {
+		const Buffer::View<byte> v = allocate_bytes(commandBuffer, count*sizeof(T), alignment);
+		return Buffer::View<T>(v.buffer(), v.offset(), count);
+	}
+	template<ranges::contiguous_range R>
+	inline Buffer::View<ranges::range_value_t<R>> upload(CommandBuffer& commandBuffer, const R& data, vk::DeviceSize alignment = alignof(ranges::range_value_t<R>)) {
+		Buffer::View<ranges::range_value_t<R>> v = allocate<ranges::range_value_t<R>>(commandBuffer, ranges::size(data), alignment);
+		memcpy(v.data(), ranges::data(data), v.size_bytes());
+		return v;
+	}
+
+private:
+	// A contiguous range of mBuffer used by a single CommandBuffer. The CommandBuffer holds the region until it completes
+	class Region : public DeviceResource {
+	public:
+		shared_ptr<Buffer> mBuffer;
+		CommandBuffer* mCommandBuffer;
+		vk::DeviceSize mBegin;
+		vk::DeviceSize mEnd;
+		inline Region(const shared_ptr<Buffer>& buffer, CommandBuffer* commandBuffer, vk::DeviceSize begin)
+			: DeviceResource(buffer->mDevice, "UploadRing::Region"), mBuffer(buffer), mCommandBuffer(commandBuffer), mBegin(begin), mEnd(begin) {}
+	};
+
+	Device& mDevice;
+	shared_ptr<Buffer> mBuffer;
+	deque<shared_ptr<Region>> mRegions; // in allocation order
+	vk::DeviceSize mMinAlignment;
+	size_t mGrowCount = 0;
+
+	void retire();
+	void grow(vk::DeviceSize minSize);
+};
+
 template<typename T>
 struct hash<stm::Buffer::View<T>> {
 	inline size_t operator()(const stm::Buffer::View<T>& v) const {
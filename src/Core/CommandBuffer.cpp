@@ -1,7 +1,57 @@
+#include <atomic>
+
 #include "CommandBuffer.hpp"
 
 using namespace stm;
 
+static atomic<uint64_t> gWorkId = 0;
+
+void CommandBuffer::mark_work() {
+	flush_barriers();
+	mWorkId = ++gWorkId;
+}
+
+static bool overlaps(const vk::ImageMemoryBarrier& a, const vk::ImageMemoryBarrier& b) {
+	const vk::ImageSubresourceRange& ra = a.subresourceRange;
+	const vk::ImageSubresourceRange& rb = b.subresourceRange;
+	return a.image == b.image && (ra.aspectMask & rb.aspectMask) &&
+		ra.baseMipLevel < rb.baseMipLevel + rb.levelCount && rb.baseMipLevel < ra.baseMipLevel + ra.levelCount &&
+		ra.baseArrayLayer < rb.baseArrayLayer + rb.layerCount && rb.baseArrayLayer < ra.baseArrayLayer + ra.layerCount;
+}
+
+void CommandBuffer::barrier(const vk::ArrayProxy<const vk::MemoryBarrier>& memoryBarriers, const vk::ArrayProxy<const vk::BufferMemoryBarrier>& bufferBarriers, const vk::ArrayProxy<const vk::ImageMemoryBarrier>& imageBarriers, vk::PipelineStageFlags srcStage, vk::PipelineStageFlags dstStage) {
+	// the barriers in one pipelineBarrier are unordered, so a transition that partially overlaps a batched one has to go in the next batch
+	for (const vk::ImageMemoryBarrier& b : imageBarriers)
+		if (ranges::any_of(mImageBarriers, [&](const vk::ImageMemoryBarrier& p) { return p.subresourceRange != b.subresourceRange && overlaps(p, b); })) {
+			flush_barriers();
+			break;
+		}
+
+	for (const vk::ImageMemoryBarrier& b : imageBarriers) {
+		// nothing was recorded since the batched transition of the same subresources, so it can transition straight to the new layout
+		auto it = ranges::find_if(mImageBarriers, [&](const vk::ImageMemoryBarrier& p) { return p.image == b.image && p.subresourceRange == b.subresourceRange; });
+		if (it != mImageBarriers.end()) {
+			it->newLayout = b.newLayout;
+			it->dstAccessMask |= b.dstAccessMask;
+		} else
+			mImageBarriers.emplace_back(b);
+	}
+	ranges::copy(memoryBarriers, back_inserter(mMemoryBarriers));
+	ranges::copy(bufferBarriers, back_inserter(mBufferBarriers));
+	mBarrierSrcStage |= srcStage;
+	mBarrierDstStage |= dstStage;
+}
+void CommandBuffer::flush_barriers() {
+	if (mMemoryBarriers.empty() && mBufferBarriers.empty() && mImageBarriers.empty()) return;
+	mCommandBuffer.pipelineBarrier(mBarrierSrcStage, mBarrierDstStage, {}, mMemoryBarriers, mBufferBarriers, mImageBarriers);
+	Profiler::add_counter("vkCmdPipelineBarrier");
+	mMemoryBarriers.clear();
+	mBufferBarriers.clear();
+	mImageBarriers.clear();
+	mBarrierSrcStage = {};
+	mBarrierDstStage = {};
+}
+
 CommandBuffer::CommandBuffer(Device::QueueFamily& queueFamily, const string& name, vk::CommandBufferLevel level)
 	: DeviceResource(queueFamily.mDevice, name), mQueueFamily(queueFamily) {
 	mCompletionFence = make_unique<Fence>(mDevice, name + "/CompletionFence");
@@ -17,6 +67,7 @@ CommandBuffer::CommandBuffer(Device::QueueFamily& queueFamily, const string& nam
 	clear();
 	mCommandBuffer.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
 	mState = CommandBufferState::eRecording;
+	mark_work();
 }
 CommandBuffer::~CommandBuffer() {
 	if (mState == CommandBufferState::eInFlight)
@@ -39,6 +90,11 @@ void CommandBuffer::clear() {
 	for (const auto& resource : mHeldResources)
 		resource->mTracking.erase(this); 
 	mHeldResources.clear();
+	mMemoryBarriers.clear();
+	mBufferBarriers.clear();
+	mImageBarriers.clear();
+	mBarrierSrcStage = {};
+	mBarrierDstStage = {};
 	mPrimitiveCount = 0;
 	mBoundFramebuffer.reset();
 	mSubpassIndex = 0;
@@ -56,6 +112,7 @@ void CommandBuffer::reset(const string& name) {
 
 	mCommandBuffer.begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
 	mState = CommandBufferState::eRecording;
+	mark_work();
 }
 
 void CommandBuffer::bind_descriptor_set(uint32_t index, const shared_ptr<DescriptorSet>& descriptorSet, const vk::ArrayProxy<const uint32_t>& dynamicOffsets) {
@@ -75,6 +132,7 @@ void CommandBuffer::begin_render_pass(const shared_ptr<RenderPass>& renderPass,
 	for (uint32_t i = 0; i < framebuffer->size(); i++)
 		(*framebuffer)[i].image()->transition_barrier(*this, get<vk::AttachmentDescription>(renderPass->attachments()[i]).initialLayout);
 
+	mark_work();
 	mCommandBuffer.beginRenderPass(vk::RenderPassBeginInfo(**renderPass, **framebuffer, renderArea, clearValues), contents);
 
 	mBoundFramebuffer = framebuffer;
@@ -83,6 +141,7 @@ void CommandBuffer::begin_render_pass(const shared_ptr<RenderPass>& renderPass,
 	hold_resource(framebuffer);
 }
 void CommandBuffer::next_subpass(vk::SubpassContents contents) {
+	mark_work();
 	mCommandBuffer.nextSubpass(contents);
 	mSubpassIndex++;
 	for (uint32_t i = 0; i < mBoundFramebuffer->size(); i++) {
@@ -95,11 +154,12 @@ void CommandBuffer::next_subpass(vk::SubpassContents contents) {
 			aspectMask &= ~aspect;
 			for (uint32_t layer = attachment.subresource_range().baseArrayLayer; layer < attachment.subresource_range().baseArrayLayer+attachment.subresource_range().layerCount; layer++)
 				for (uint32_t level = attachment.subresource_range().baseMipLevel; level < attachment.subresource_range().baseMipLevel+attachment.subresource_range().levelCount; level++)
-					attachment.image()->tracked_state((vk::ImageAspectFlags)aspect, layer, level) = make_tuple(layout, guess_stage(layout), guess_access_flags(layout));
+					attachment.image()->tracked_state((vk::ImageAspectFlags)aspect, layer, level) = Image::TrackedState{ layout, guess_stage(layout), guess_access_flags(layout) };
 		}
 	}
 }
 void CommandBuffer::end_render_pass() {
+	mark_work();
 	mCommandBuffer.endRenderPass();
 
 	// Update tracked image layouts
@@ -112,7 +172,7 @@ void CommandBuffer::end_render_pass() {
 			aspectMask &= ~aspect;
 			for (uint32_t layer = attachment.subresource_range().baseArrayLayer; layer < attachment.subresource_range().baseArrayLayer+attachment.subresource_range().layerCount; layer++)
 				for (uint32_t level = attachment.subresource_range().baseMipLevel; level < attachment.subresource_range().baseMipLevel+attachment.subresource_range().levelCount; level++)
-					attachment.image()->tracked_state((vk::ImageAspectFlags)aspect, layer, level) = make_tuple(layout, guess_stage(layout), guess_access_flags(layout));
+					attachment.image()->tracked_state((vk::ImageAspectFlags)aspect, layer, level) = Image::TrackedState{ layout, guess_stage(layout), guess_access_flags(layout) };
 		}
 	}
 	
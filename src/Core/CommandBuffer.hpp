@@ -14,14 +14,20 @@ public:
 	STRATUM_API CommandBuffer(Device::QueueFamily& queueFamily, const string& name, vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary);
 	STRATUM_API ~CommandBuffer();
 
-	inline vk::CommandBuffer& operator*() { return mCommandBuffer; }
-	inline vk::CommandBuffer* operator->() { return &mCommandBuffer; }
-	inline const vk::CommandBuffer& operator*() const { return mCommandBuffer; }
-	inline const vk::CommandBuffer* operator->() const { return &mCommandBuffer; }
+	// direct access may record anything, so it counts as work (see work_id())
+	inline vk::CommandBuffer& operator*() { mark_work(); return mCommandBuffer; }
+	inline vk::CommandBuffer* operator->() { mark_work(); return &mCommandBuffer; }
 
 	inline Fence& completion_fence() const { return *mCompletionFence; }
 	inline Device::QueueFamily& queue_family() const { return mQueueFamily; }
 	
+	// Records the batched barriers. Only needed when recording through a vk::CommandBuffer obtained earlier
+	STRATUM_API void flush_barriers();
+
+	// Changes whenever a command other than a barrier is recorded, and is never reused by another CommandBuffer.
+	// Image::transition_barrier remembers it to skip barriers that are already covered by one recorded with nothing in between
+	inline uint64_t work_id() const { return mWorkId; }
+
 	inline const shared_ptr<Framebuffer>& bound_framebuffer() const { return mBoundFramebuffer; }
 	inline uint32_t subpass_index() const { return mSubpassIndex; }
 	inline const shared_ptr<Pipeline>& bound_pipeline() const { return mBoundPipeline; }
@@ -67,14 +73,16 @@ public:
 		return v;
 	}
 
+	// Barriers are batched, and recorded with a single pipelineBarrier by flush_barriers(), which happens before any other command is recorded
+	STRATUM_API void barrier(const vk::ArrayProxy<const vk::MemoryBarrier>& memoryBarriers, const vk::ArrayProxy<const vk::BufferMemoryBarrier>& bufferBarriers, const vk::ArrayProxy<const vk::ImageMemoryBarrier>& imageBarriers, vk::PipelineStageFlags srcStage, vk::PipelineStageFlags dstStage);
 	inline void barrier(const vk::ArrayProxy<const vk::MemoryBarrier>& b, vk::PipelineStageFlags srcStage, vk::PipelineStageFlags dstStage) {
-		mCommandBuffer.pipelineBarrier(srcStage, dstStage, {}, b, {}, {});
+		barrier(b, {}, {}, srcStage, dstStage);
 	}
 	inline void barrier(const vk::ArrayProxy<const vk::BufferMemoryBarrier>& b, vk::PipelineStageFlags srcStage, vk::PipelineStageFlags dstStage) {
-		mCommandBuffer.pipelineBarrier(srcStage, dstStage, {}, {}, b, {});
+		barrier({}, b, {}, srcStage, dstStage);
 	}
 	inline void barrier(const vk::ArrayProxy<const vk::ImageMemoryBarrier>& b, vk::PipelineStageFlags srcStage, vk::PipelineStageFlags dstStage) {
-		mCommandBuffer.pipelineBarrier(srcStage, dstStage, {}, {}, {}, b);
+		barrier({}, {}, b, srcStage, dstStage);
 	}
 	template<typename T = byte>
 	inline void barrier(const Buffer::View<T>& buffer, vk::PipelineStageFlags srcStage, vk::AccessFlags srcAccessMask, vk::PipelineStageFlags dstStage, vk::AccessFlags dstAccessMask) {
@@ -84,18 +92,21 @@ public:
 	template<typename T = byte, typename S = T>
 	inline const Buffer::View<S>& copy_buffer(const Buffer::View<T>& src, const Buffer::View<S>& dst) {
 		if (src.size_bytes() > dst.size_bytes()) throw invalid_argument("src size must be less than or equal to dst size");
+		mark_work();
 		mCommandBuffer.copyBuffer(*hold_resource(src.buffer()), *hold_resource(dst.buffer()), { vk::BufferCopy(src.offset(), dst.offset(), src.size_bytes()) });
 		return dst;
 	}
 	template<typename T = byte>
 	inline Buffer::View<T> copy_buffer(const Buffer::View<T>& src, vk::BufferUsageFlagBits bufferUsage, VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY) {
 		shared_ptr<Buffer> dst = make_shared<Buffer>(mDevice, src.buffer()->name(), src.size_bytes(), bufferUsage|vk::BufferUsageFlagBits::eTransferDst, memoryUsage);
+		mark_work();
 		mCommandBuffer.copyBuffer(*hold_resource(src.buffer()), *hold_resource(dst), { vk::BufferCopy(src.offset(), 0, src.size_bytes()) });
 		return Buffer::View<T>(dst);
 	}
 	template<typename T = byte>
 	inline Buffer::View<T> copy_buffer(const buffer_vector<T>& src, vk::BufferUsageFlagBits bufferUsage, VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY) {
 		shared_ptr<Buffer> dst = make_shared<Buffer>(mDevice, src.buffer()->name(), src.size_bytes(), bufferUsage|vk::BufferUsageFlagBits::eTransferDst, memoryUsage);
+		mark_work();
 		mCommandBuffer.copyBuffer(*hold_resource(src.buffer()), *hold_resource(dst), { vk::BufferCopy(0, 0, src.size_bytes()) });
 		return Buffer::View<T>(dst);
 	}
@@ -106,6 +117,7 @@ public:
 		for (uint32_t i = 0; i < dst.subresource_range().levelCount; i++)
 			copies[i] = vk::BufferImageCopy(src.offset(), 0, 0, dst.subresource(i), {}, dst.extent());
 		dst.transition_barrier(*this, vk::ImageLayout::eTransferDstOptimal);
+		mark_work();
 		mCommandBuffer.copyBufferToImage(*hold_resource(src.buffer()), *hold_resource(dst.image()), vk::ImageLayout::eTransferDstOptimal, copies);
 		return dst;
 	}
@@ -116,17 +128,20 @@ public:
 		for (uint32_t i = 0; i < src.subresource_range().levelCount; i++)
 			copies[i] = vk::BufferImageCopy(dst.offset(), 0, 0, src.subresource(i), {}, src.extent());
 		src.transition_barrier(*this, vk::ImageLayout::eTransferSrcOptimal);
+		mark_work();
 		mCommandBuffer.copyImageToBuffer(*hold_resource(src.image()), vk::ImageLayout::eTransferSrcOptimal, *hold_resource(dst.buffer()), copies);
 		return dst;
 	}
 
 	inline const Image::View& clear_color_image(const Image::View& img, const vk::ClearColorValue& clear) {
 		img.transition_barrier(*this, vk::ImageLayout::eTransferDstOptimal);
+		mark_work();
 		mCommandBuffer.clearColorImage(*hold_resource(img.image()), vk::ImageLayout::eTransferDstOptimal, clear, img.subresource_range());
 		return img;
 	}
 	inline const Image::View& clear_color_image(const Image::View& img, const vk::ClearDepthStencilValue& clear) {
 		img.transition_barrier(*this, vk::ImageLayout::eTransferDstOptimal);
+		mark_work();
 		mCommandBuffer.clearDepthStencilImage(*hold_resource(img.image()), vk::ImageLayout::eTransferDstOptimal, clear, img.subresource_range());
 		return img;
 	}
@@ -145,6 +160,7 @@ public:
 			dstOffset[1].z = dst.extent().depth;
 			blits[i] = vk::ImageBlit(src.subresource(i), srcOffset, src.subresource(i), dstOffset);
 		}
+		mark_work();
 		mCommandBuffer.blitImage(*hold_resource(src.image()), vk::ImageLayout::eTransferSrcOptimal, *hold_resource(dst.image()), vk::ImageLayout::eTransferDstOptimal, blits, filter);
 		return dst;
 	}
@@ -154,6 +170,7 @@ public:
 		vector<vk::ImageCopy> copies(src.subresource_range().levelCount);
 		for (uint32_t i = 0; i < copies.size(); i++)
 			copies[i] = vk::ImageCopy(src.subresource(i), vk::Offset3D{}, src.subresource(i), vk::Offset3D{}, src.extent());
+		mark_work();
 		mCommandBuffer.copyImage(*hold_resource(src.image()), vk::ImageLayout::eTransferSrcOptimal, *hold_resource(dst.image()), vk::ImageLayout::eTransferDstOptimal, copies);
 		return dst;
 	}
@@ -163,17 +180,19 @@ public:
 		vector<vk::ImageResolve> resolves(src.subresource_range().levelCount);
 		for (uint32_t i = 0; i < resolves.size(); i++)
 			resolves[i] = vk::ImageResolve(src.subresource(i), vk::Offset3D{}, src.subresource(i), vk::Offset3D{}, src.extent());
+		mark_work();
 		mCommandBuffer.resolveImage(*hold_resource(src.image()), vk::ImageLayout::eTransferSrcOptimal, *hold_resource(dst.image()), vk::ImageLayout::eTransferDstOptimal, resolves);
 		return dst;
 	}
 
-	inline void dispatch(const vk::Extent2D& dim) { mCommandBuffer.dispatch(dim.width, dim.height, 1); }
-	inline void dispatch(const vk::Extent3D& dim) { mCommandBuffer.dispatch(dim.width, dim.height, dim.depth); }
-	inline void dispatch(uint32_t x, uint32_t y=1, uint32_t z=1) { mCommandBuffer.dispatch(x, y, z); }
+	inline void dispatch(const vk::Extent2D& dim) { mark_work(); mCommandBuffer.dispatch(dim.width, dim.height, 1); }
+	inline void dispatch(const vk::Extent3D& dim) { mark_work(); mCommandBuffer.dispatch(dim.width, dim.height, dim.depth); }
+	inline void dispatch(uint32_t x, uint32_t y=1, uint32_t z=1) { mark_work(); mCommandBuffer.dispatch(x, y, z); }
 	
 	// dispatch on ceil(size / workgroupSize)
 	inline void dispatch_over(const vk::Extent2D& dim) {
 		auto cp = dynamic_pointer_cast<ComputePipeline>(mBoundPipeline);
+		mark_work();
 		mCommandBuffer.dispatch(
 			(dim.width + cp->workgroup_size()[0] - 1) / cp->workgroup_size()[0],
 			(dim.height + cp->workgroup_size()[1] - 1) / cp->workgroup_size()[1],
@@ -181,6 +200,7 @@ public:
 	}
 	inline void dispatch_over(const vk::Extent3D& dim) {
 		auto cp = dynamic_pointer_cast<ComputePipeline>(mBoundPipeline);
+		mark_work();
 		mCommandBuffer.dispatch(
 			(dim.width + cp->workgroup_size()[0] - 1) / cp->workgroup_size()[0],
 			(dim.height + cp->workgroup_size()[1] - 1) / cp->workgroup_size()[1], 
@@ -275,15 +295,23 @@ private:
 	enum class CommandBufferState { eRecording, eInFlight, eDone };
 	
 	STRATUM_API void clear();
+	STRATUM_API void mark_work();
 	
 	vk::CommandBuffer mCommandBuffer;
 
 	Device::QueueFamily& mQueueFamily;
 	vk::CommandPool mCommandPool;
 	CommandBufferState mState;
+	uint64_t mWorkId;
 	
 	unique_ptr<Fence> mCompletionFence;
 
+	vector<vk::MemoryBarrier> mMemoryBarriers;
+	vector<vk::BufferMemoryBarrier> mBufferBarriers;
+	vector<vk::ImageMemoryBarrier> mImageBarriers;
+	vk::PipelineStageFlags mBarrierSrcStage;
+	vk::PipelineStageFlags mBarrierDstStage;
+
 	unordered_set<shared_ptr<DeviceResource>> mHeldResources;
 
 	// Currently bound objects
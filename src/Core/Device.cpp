@@ -4,6 +4,7 @@
 #include <vk_mem_alloc.h>
 #undef VMA_IMPLEMENTATION
 
+#include "ResourcePool.hpp"
 #include "Window.hpp"
 
 using namespace stm;
@@ -80,24 +81,39 @@ Device::Device(stm::Instance& instance, vk::PhysicalDevice physicalDevice, const
 	#pragma endregion
 
 	#pragma region Create PipelineCache and DescriptorPool
+	// the pipeline cache persists at --pipelineCache:<path>, and is only used if its header matches this device
 	vk::PipelineCacheCreateInfo cacheInfo = {};
-	string tmp;
+	vector<byte> cacheData;
 	if (!mInstance.find_argument("noPipelineCache")) {
+		auto path = mInstance.find_argument("pipelineCache");
+		mPipelineCachePath = path ? fs::path(*path) : fs::temp_directory_path()/"stm_pipeline_cache";
 		try {
-			ifstream cacheFile(fs::temp_directory_path() / "pcache", ios::binary | ios::ate);
+			ifstream cacheFile(mPipelineCachePath, ios::binary | ios::ate);
 			if (cacheFile.is_open()) {
-				cacheInfo.initialDataSize = cacheFile.tellg();
-				cacheInfo.pInitialData = new char[cacheInfo.initialDataSize];
+				cacheData.resize(cacheFile.tellg());
 				cacheFile.seekg(0, ios::beg);
-				cacheFile.read((char*)cacheInfo.pInitialData, cacheInfo.initialDataSize);
-				printf("Read pipeline cache (%.2f kb)\n", cacheInfo.initialDataSize/(float)1_mB);
+				cacheFile.read(reinterpret_cast<char*>(cacheData.data()), cacheData.size());
+
+				vk::PipelineCacheHeaderVersionOne header;
+				if (cacheData.size() < sizeof(header))
+					throw runtime_error("truncated header");
+				memcpy(&header, cacheData.data(), sizeof(header));
+				if (header.headerSize < sizeof(header) || header.headerVersion != vk::PipelineCacheHeaderVersion::eOne)
+					throw runtime_error("unknown header version");
+				if (header.vendorID != properties.vendorID || header.deviceID != properties.deviceID || header.pipelineCacheUUID != properties.pipelineCacheUUID)
+					throw runtime_error("created by a different device or driver");
+
+				cacheInfo.setInitialData<byte>(cacheData);
+				mPipelineCacheWarm = true;
+				mPipelineCacheSavedSize = cacheData.size();
+				printf("Read pipeline cache %s (%.2f kb)\n", mPipelineCachePath.string().c_str(), cacheData.size()/(float)1_kB);
 			}
 		} catch (exception& e) {
-			fprintf_color(ConsoleColor::eYellow, stderr, "Warning: Failed to read pipeline cache: %s\n", e.what());
+			fprintf_color(ConsoleColor::eYellow, stderr, "Warning: Ignoring pipeline cache %s: %s\n", mPipelineCachePath.string().c_str(), e.what());
 		}
 	}
 	mPipelineCache = mDevice.createPipelineCache(cacheInfo);
-	if (cacheInfo.pInitialData) delete reinterpret_cast<const byte*>(cacheInfo.pInitialData);
+	cacheData = {};
 	
 	vector<vk::DescriptorPoolSize> poolSizes {
 		vk::DescriptorPoolSize(vk::DescriptorType::eSampler, 								min(16384u, mLimits.maxDescriptorSetSamplers)),
@@ -142,7 +158,11 @@ Device::Device(stm::Instance& instance, vk::PhysicalDevice physicalDevice, const
 	vmaCreateAllocator(&allocatorInfo, &mAllocator);
 }
 Device::~Device() {
+	// finish compiling pipelines first, so that they're in the saved pipeline cache
+	mPipelineWorkers.reset();
 	flush();
+	mResourcePool.reset();
+	mUploadRing.reset();
 
 	auto queueFamilies = mQueueFamilies.lock();
 	for (auto& [idx, queueFamily] : *queueFamilies) {
@@ -157,17 +177,29 @@ Device::~Device() {
 
 	vmaDestroyAllocator(mAllocator);
 
-	if (!mInstance.find_argument("noPipelineCache")) {
-		try {
-			auto cacheData = mDevice.getPipelineCacheData(mPipelineCache);
-			ofstream output(fs::temp_directory_path()/"stm_pipeline_cache", ios::binary);
+	save_pipeline_cache();
+	mDevice.destroyPipelineCache(mPipelineCache);
+	mDevice.destroy();
+}
+
+void Device::save_pipeline_cache() {
+	if (mPipelineCachePath.empty()) return;
+	try {
+		auto cacheData = mDevice.getPipelineCacheData(mPipelineCache);
+		if (cacheData.size() == mPipelineCacheSavedSize) return;
+		// write a temporary file and rename it over the cache, so that a crash mid-write can't leave a truncated cache behind
+		fs::path tmp = mPipelineCachePath;
+		tmp += ".tmp";
+		{
+			ofstream output(tmp, ios::binary | ios::trunc);
 			output.write((const char*)cacheData.data(), cacheData.size());
-		} catch (exception& e) {
-			fprintf_color(ConsoleColor::eYellow, stderr, "Warning: Failed to write pipeline cache: %s\n", e.what());
+			if (!output) throw runtime_error("failed to write " + tmp.string());
 		}
+		fs::rename(tmp, mPipelineCachePath);
+		mPipelineCacheSavedSize = cacheData.size();
+	} catch (exception& e) {
+		fprintf_color(ConsoleColor::eYellow, stderr, "Warning: Failed to write pipeline cache: %s\n", e.what());
 	}
-	mDevice.destroyPipelineCache(mPipelineCache);
-	mDevice.destroy();
 }
 
 shared_ptr<CommandBuffer> Device::get_command_buffer(const string& name, vk::QueueFlags queueFlags, vk::CommandBufferLevel level) {
@@ -231,4 +263,19 @@ void Device::flush() {
 		for (auto& [tid,p] : queueFamily.mCommandBuffers)
 			for (auto& commandBuffer : p.second)
 				commandBuffer->clear_if_done();
+}
+
+UploadRing& Device::upload_ring() {
+	if (!mUploadRing) mUploadRing = make_unique<UploadRing>(*this, mUploadRingSize);
+	return *mUploadRing;
+}
+
+ResourcePool& Device::resource_pool() {
+	if (!mResourcePool) mResourcePool = make_unique<ResourcePool>(*this);
+	return *mResourcePool;
+}
+
+worker_pool& Device::pipeline_workers() {
+	if (!mPipelineWorkers) mPipelineWorkers = make_unique<worker_pool>();
+	return *mPipelineWorkers;
 }
\ No newline at end of file
@@ -2,12 +2,16 @@
 
 #include "Instance.hpp"
 #include <Common/locked_object.hpp>
+#include <Common/worker_pool.hpp>
+#include <atomic>
 #include <vk_mem_alloc.h>
 
 namespace stm {
 
 class CommandBuffer;
 class Semaphore;
+class UploadRing;
+class ResourcePool;
 
 class DeviceResource {
 private:
@@ -74,6 +78,7 @@ public:
 	
 	stm::Instance& mInstance;
 	static const vk::DeviceSize mMinAllocSize = 256_mB;
+	static const vk::DeviceSize mUploadRingSize = 16_mB;
 
 	STRATUM_API Device(stm::Instance& instance, vk::PhysicalDevice physicalDevice, const unordered_set<string>& deviceExtensions, const vector<const char*>& validationLayers);
 	STRATUM_API ~Device();
@@ -86,6 +91,17 @@ public:
 	inline vk::PhysicalDevice physical() const { return mPhysicalDevice; }
 	inline const vk::PhysicalDeviceLimits& limits() const { return mLimits; }
 	inline vk::PipelineCache pipeline_cache() const { return mPipelineCache; }
+	// empty if --noPipelineCache
+	inline const fs::path& pipeline_cache_path() const { return mPipelineCachePath; }
+	// whether the pipeline cache was loaded from disk
+	inline bool pipeline_cache_warm() const { return mPipelineCacheWarm; }
+	inline uint32_t pipeline_count() const { return mPipelineCount; }
+	inline chrono::nanoseconds pipeline_create_time() const { return chrono::nanoseconds(mPipelineCreateTime); }
+	// called by Pipelines, which may be created from multiple threads
+	inline void count_pipeline(chrono::nanoseconds createTime) {
+		mPipelineCount++;
+		mPipelineCreateTime += createTime.count();
+	}
 	inline VmaAllocator allocator() const { return mAllocator; }
 	inline uint32_t descriptor_set_count() const { return mDescriptorSetCount; }
 
@@ -121,6 +137,15 @@ public:
 	STRATUM_API shared_ptr<CommandBuffer> get_command_buffer(const string& name, vk::QueueFlags queueFlags = vk::QueueFlagBits::eGraphics, vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary);
 	STRATUM_API void submit(shared_ptr<CommandBuffer> commandBuffer, const vk::ArrayProxy<pair<shared_ptr<Semaphore>, vk::PipelineStageFlags>>& waitSemaphores = {}, const vk::ArrayProxy<shared_ptr<Semaphore>>& signalSemaphores = {});
 	STRATUM_API void flush();
+	// Writes the pipeline cache to pipeline_cache_path() if it grew since it was last read or written
+	STRATUM_API void save_pipeline_cache();
+	// Threads that compile pipelines in the background, created on first use. See PipelineState::compile_async
+	STRATUM_API worker_pool& pipeline_workers();
+
+	// Shared ring of host-visible memory for per-frame uploads, created on first use. Defined in Buffer.hpp
+	STRATUM_API UploadRing& upload_ring();
+	// Recycles transient images and buffers, created on first use. Defined in ResourcePool.hpp
+	STRATUM_API ResourcePool& resource_pool();
 
 private:
 	friend class Instance;
@@ -132,6 +157,11 @@ private:
  	vk::PhysicalDevice mPhysicalDevice;
 	VmaAllocator mAllocator;
 	vk::PipelineCache mPipelineCache;
+	fs::path mPipelineCachePath;
+	size_t mPipelineCacheSavedSize = 0;
+	bool mPipelineCacheWarm = false;
+	atomic<uint32_t> mPipelineCount = 0;
+	atomic<int64_t> mPipelineCreateTime = 0; // in nanoseconds
 	
 	vk::PhysicalDeviceFeatures mFeatures;
 	vk::PhysicalDeviceBufferDeviceAddressFeatures mBufferDeviceAddressFeatures;
@@ -144,6 +174,10 @@ private:
 	locked_object<unordered_map<uint32_t, QueueFamily>> mQueueFamilies;
 	locked_object<vk::DescriptorPool> mDescriptorPool;
 	uint32_t mDescriptorSetCount = 0;
+
+	unique_ptr<UploadRing> mUploadRing;
+	unique_ptr<ResourcePool> mResourcePool;
+	unique_ptr<worker_pool> mPipelineWorkers;
 };
 
 }
\ No newline at end of file
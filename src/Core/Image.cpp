@@ -121,7 +121,7 @@ void Image::init_state() {
 		aspectMask &= ~aspect;
 		for (uint32_t layer = 0; layer < mLayerCount; layer++)	
 			for (uint32_t level = 0; level < mLevelCount; level++)	
-				tracked_state((vk::ImageAspectFlags)aspect, layer, level) = make_tuple(vk::ImageLayout::eUndefined, vk::PipelineStageFlagBits::eTopOfPipe, vk::AccessFlags{});
+				tracked_state((vk::ImageAspectFlags)aspect, layer, level) = TrackedState{ vk::ImageLayout::eUndefined, vk::PipelineStageFlagBits::eTopOfPipe, vk::AccessFlags{} };
 	}
 }
 void Image::create() {
@@ -141,7 +141,7 @@ void Image::create() {
 	mDevice.set_debug_name(mImage, name());
 }
 
-void Image::transition_barrier(CommandBuffer& commandBuffer, vk::PipelineStageFlags dstStage, vk::ImageLayout newLayout, vk::AccessFlags accessFlags, vk::ImageSubresourceRange subresourceRange) {
+void Image::transition_barrier(CommandBuffer& commandBuffer, vector<vk::ImageMemoryBarrier>& barriers, vk::PipelineStageFlags& srcStage, vk::PipelineStageFlags dstStage, vk::ImageLayout newLayout, vk::AccessFlags accessFlags, vk::ImageSubresourceRange subresourceRange) {
 	if (subresourceRange.levelCount == 0) subresourceRange.levelCount = mLevelCount - subresourceRange.baseMipLevel;
 	if (subresourceRange.layerCount == 0) subresourceRange.layerCount = mLayerCount - subresourceRange.baseArrayLayer;
 	uint32_t aspectMask = (subresourceRange.aspectMask == vk::ImageAspectFlags{0}) ? (uint32_t)mAspect : (uint32_t)subresourceRange.aspectMask;
@@ -151,27 +151,53 @@ void Image::transition_barrier(CommandBuffer& commandBuffer, vk::PipelineStageFl
 		for (uint32_t layer = subresourceRange.baseArrayLayer; layer < subresourceRange.baseArrayLayer+subresourceRange.layerCount; layer++) {
 			for (uint32_t level = subresourceRange.baseMipLevel; level < subresourceRange.baseMipLevel+subresourceRange.levelCount; level++) {
 				auto& state = tracked_state((vk::ImageAspectFlags)aspect, layer, level);
-				if (get<vk::ImageLayout>(state) != newLayout || get<vk::AccessFlags>(state) != accessFlags || (get<vk::AccessFlags>(state) & vk::AccessFlagBits::eShaderWrite) || (accessFlags & vk::AccessFlagBits::eShaderWrite)) {
-					vk::ImageMemoryBarrier b;
+				// the last barrier already made earlier writes visible to this access. If it left the image writable, nothing may have been recorded since
+				if (state.mLayout == newLayout && (state.mStage & dstStage) == dstStage && (state.mAccess & accessFlags) == accessFlags &&
+					(!has_write_access(state.mAccess) || state.mBarrierWorkId == commandBuffer.work_id()))
+					continue;
+
+				srcStage |= state.mStage;
+				
+				// extend the previous barrier when this is the next mip level of the same transition
+				vk::ImageMemoryBarrier* prev = barriers.empty() ? nullptr : &barriers.back();
+				if (prev && prev->image == mImage && prev->oldLayout == state.mLayout && prev->newLayout == newLayout && prev->srcAccessMask == state.mAccess && prev->dstAccessMask == accessFlags &&
+					prev->subresourceRange.aspectMask == (vk::ImageAspectFlags)aspect && prev->subresourceRange.baseArrayLayer == layer && prev->subresourceRange.layerCount == 1 &&
+					prev->subresourceRange.baseMipLevel + prev->subresourceRange.levelCount == level)
+					prev->subresourceRange.levelCount++;
+				else {
+					vk::ImageMemoryBarrier& b = barriers.emplace_back();
 					b.image = mImage;
 					b.newLayout = newLayout;
 					b.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 					b.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 					b.dstAccessMask = accessFlags;
-					b.oldLayout = get<vk::ImageLayout>(state);
+					b.oldLayout = state.mLayout;
 					b.subresourceRange.aspectMask = (vk::ImageAspectFlags)aspect;
 					b.subresourceRange.baseArrayLayer = layer;
 					b.subresourceRange.layerCount = 1;
 					b.subresourceRange.baseMipLevel = level;
 					b.subresourceRange.levelCount = 1;
-					b.srcAccessMask = get<vk::AccessFlags>(state);
-					commandBuffer.barrier(b, get<vk::PipelineStageFlags>(state), dstStage);
+					b.srcAccessMask = state.mAccess;
 				}
-				state = make_tuple(newLayout, dstStage, accessFlags);
+				
+				if (state.mLayout == newLayout && !has_write_access(state.mAccess) && !has_write_access(accessFlags)) {
+					// read after read: earlier reads stay visible
+					state.mStage |= dstStage;
+					state.mAccess |= accessFlags;
+				} else
+					state = TrackedState{ newLayout, dstStage, accessFlags };
+				state.mBarrierWorkId = commandBuffer.work_id();
 			}
 		}
 	}
 }
+void Image::transition_barrier(CommandBuffer& commandBuffer, vk::PipelineStageFlags dstStage, vk::ImageLayout newLayout, vk::AccessFlags accessFlags, vk::ImageSubresourceRange subresourceRange) {
+	vector<vk::ImageMemoryBarrier> barriers;
+	vk::PipelineStageFlags srcStage;
+	transition_barrier(commandBuffer, barriers, srcStage, dstStage, newLayout, accessFlags, subresourceRange);
+	if (!barriers.empty())
+		commandBuffer.barrier(barriers, srcStage ? srcStage : vk::PipelineStageFlagBits::eTopOfPipe, dstStage);
+}
 
 void Image::generate_mip_maps(CommandBuffer& commandBuffer) {
 	transition_barrier(commandBuffer, vk::ImageLayout::eTransferDstOptimal);
@@ -49,15 +49,16 @@ public:
 	}
 
 	class View;
+	// Binds to memory at memoryOffset, which may be shared with other resources (see ResourcePool::get_aliased_images)
 	// If mipLevels = 0, will auto-determine according to extent
-	inline Image(shared_ptr<Device::MemoryAllocation> memory, const string& name,
+	inline Image(shared_ptr<Device::MemoryAllocation> memory, vk::DeviceSize memoryOffset, const string& name,
 		const vk::Extent3D& extent, vk::Format format, uint32_t arrayLayers = 1, uint32_t mipLevels = 0, vk::SampleCountFlagBits numSamples = vk::SampleCountFlagBits::e1,
 		vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eSampled, vk::ImageCreateFlags createFlags = {}, vk::ImageType type = (vk::ImageType)VK_IMAGE_TYPE_MAX_ENUM, vk::ImageTiling tiling = vk::ImageTiling::eOptimal)
 			: DeviceResource(memory->mDevice, name), mMemory(memory), mExtent(extent), mFormat(format), mLayerCount(arrayLayers), mSampleCount(numSamples), mUsage(usage), 
 			mLevelCount(mipLevels ? mipLevels : (numSamples > vk::SampleCountFlagBits::e1) ? 1 : max_mips(extent)), mCreateFlags(createFlags), mType(type != (vk::ImageType)VK_IMAGE_TYPE_MAX_ENUM ? type : mExtent.depth > 1 ? vk::ImageType::e3D : vk::ImageType::e2D), mTiling(tiling) {
 		init_state();
 		create();
-		vmaBindImageMemory(mDevice.allocator(), mMemory->allocation(), mImage);
+		vmaBindImageMemory2(mDevice.allocator(), mMemory->allocation(), memoryOffset, mImage, nullptr);
 	}
 
 	// If mipLevels = 0, will auto-determine according to extent
@@ -120,6 +121,14 @@ public:
 	// Image must support vk::ImageLayout::eTransferSrcOptimal and vk::ImageLayout::eTransferDstOptimal
 	STRATUM_API void generate_mip_maps(CommandBuffer& commandBuffer);
 	
+	// Forgets the image's contents, so that the next transition_barrier is from eUndefined. Used when another image aliases the same memory
+	inline void discard_contents() {
+		for (auto&[key, state] : mTrackedState)
+			state.mLayout = vk::ImageLayout::eUndefined;
+	}
+	// Appends the barriers needed before accessing subresourceRange with newLayout/dstStage/accessFlags to barriers, and adds their source stages to srcStage.
+	// No barrier is needed for reads that the previous barrier already made visible, or for an access covered by the previous barrier when no work has been recorded since
+	STRATUM_API void transition_barrier(CommandBuffer& commandBuffer, vector<vk::ImageMemoryBarrier>& barriers, vk::PipelineStageFlags& srcStage, vk::PipelineStageFlags dstStage, vk::ImageLayout newLayout, vk::AccessFlags accessFlags, vk::ImageSubresourceRange subresourceRange = {});
 	STRATUM_API void transition_barrier(CommandBuffer& commandBuffer, vk::PipelineStageFlags dstStage, vk::ImageLayout newLayout, vk::AccessFlags accessFlag, vk::ImageSubresourceRange subresourceRange = {});
 	inline void transition_barrier(CommandBuffer& commandBuffer, vk::ImageLayout newLayout, vk::ImageSubresourceRange subresourceRange = {}) {
 		transition_barrier(commandBuffer, guess_stage(newLayout), newLayout, guess_access_flags(newLayout), subresourceRange);
@@ -165,6 +174,16 @@ public:
 		inline void transition_barrier(CommandBuffer& commandBuffer, vk::PipelineStageFlags dstStage, vk::ImageLayout newLayout, vk::AccessFlags accessFlags) const {
 			mImage->transition_barrier(commandBuffer, dstStage, newLayout, accessFlags, mSubresource);
 		}
+		inline void transition_barrier(CommandBuffer& commandBuffer, vector<vk::ImageMemoryBarrier>& barriers, vk::PipelineStageFlags& srcStage, vk::PipelineStageFlags dstStage, vk::ImageLayout newLayout, vk::AccessFlags accessFlags) const {
+			mImage->transition_barrier(commandBuffer, barriers, srcStage, dstStage, newLayout, accessFlags, mSubresource);
+		}
+	};
+
+	struct TrackedState {
+		vk::ImageLayout mLayout;
+		vk::PipelineStageFlags mStage;
+		vk::AccessFlags mAccess;
+		uint64_t mBarrierWorkId = 0; // CommandBuffer::work_id() when the last barrier was recorded
 	};
 
 private:
@@ -191,8 +210,8 @@ private:
 	
 	unordered_map<pair<vk::ImageSubresourceRange, vk::ComponentMapping>, vk::ImageView> mViews;
 	
-	unordered_map<size_t, tuple<vk::ImageLayout, vk::PipelineStageFlags, vk::AccessFlags>> mTrackedState;
-	inline tuple<vk::ImageLayout, vk::PipelineStageFlags, vk::AccessFlags>& tracked_state(vk::ImageAspectFlags aspect, uint32_t layer, uint32_t level) {
+	unordered_map<size_t, TrackedState> mTrackedState;
+	inline TrackedState& tracked_state(vk::ImageAspectFlags aspect, uint32_t layer, uint32_t level) {
 		return mTrackedState[hash_args(aspect, layer, level)];
 	}
 };
@@ -88,7 +88,9 @@ ComputePipeline::ComputePipeline(const string& name, const ShaderSpecialization&
   shader.get_specialization_info(entries, data);
   vk::SpecializationInfo specializationInfo((uint32_t)entries.size(), entries.data(), data.size()*sizeof(uint32_t), data.data());
   vk::PipelineShaderStageCreateInfo stageInfo({}, shader.mShader->stage(), **shader.mShader, shader.mShader->entry_point().c_str(), specializationInfo.mapEntryCount ? &specializationInfo : nullptr);
+  const auto t0 = chrono::high_resolution_clock::now();
   mPipeline = mDevice->createComputePipeline(mDevice.pipeline_cache(), vk::ComputePipelineCreateInfo({}, stageInfo, mLayout)).value;
+  mDevice.count_pipeline(chrono::high_resolution_clock::now() - t0);
   mDevice.set_debug_name(mPipeline, name);
 }
 
@@ -147,8 +149,10 @@ GraphicsPipeline::GraphicsPipeline(const string& name, const stm::RenderPass& re
   mMultisampleState = { {}, sampleCount, sampleShading };
   vk::PipelineColorBlendStateCreateInfo blendState({}, false, vk::LogicOp::eCopy, mBlendStates);
   vk::PipelineDynamicStateCreateInfo dynamicState({}, dynamicStates);
+  const auto t0 = chrono::high_resolution_clock::now();
   mPipeline = mDevice->createGraphicsPipeline(mDevice.pipeline_cache(), 
     vk::GraphicsPipelineCreateInfo({}, vkstages, &vertexInfo, &mInputAssemblyState, nullptr, &mViewportState,
     &mRasterizationState, &mMultisampleState, &mDepthStencilState, &blendState, &dynamicState, mLayout, *renderPass, subpassIndex)).value;
+  mDevice.count_pipeline(chrono::high_resolution_clock::now() - t0);
   mDevice.set_debug_name(mPipeline, name);
 }
\ No newline at end of file
@@ -190,14 +190,23 @@ shared_ptr<ComputePipeline> ComputePipelineState::get_pipeline() {
 	return static_pointer_cast<ComputePipeline>(pipeline);
 }
 
+void ComputePipelineState::compile_async(const unordered_map<string, uint32_t>& specializationConstants) {
+	unordered_map<string, uint32_t> constants = mSpecializationConstants;
+	for (const auto&[name, value] : specializationConstants)
+		constants.insert_or_assign(name, value);
+	Pipeline::ShaderSpecialization shader = { mShaders.at(vk::ShaderStageFlagBits::eCompute), constants, mDescriptorBindingFlags };
+	size_t key = hash_args(shader, mImmutableSamplers);
+	if (has_pipeline(key)) return;
+
+	mCompilingPipelines.emplace(key, shader.mShader->mDevice.pipeline_workers().submit([name = mName, shader, immutableSamplers = mImmutableSamplers]() -> shared_ptr<Pipeline> {
+		return make_shared<ComputePipeline>(name, shader, immutableSamplers);
+	}));
+}
+
 shared_ptr<GraphicsPipeline> GraphicsPipelineState::get_pipeline(const RenderPass& renderPass, uint32_t subpassIndex, const VertexLayoutDescription& vertexDescription, vk::ShaderStageFlags stageMask) {
 	ProfilerRegion ps("PipelineState::get_pipeline");
 
-	vector<Pipeline::ShaderSpecialization> shaders;
-	shaders.reserve(mShaders.size());
-	for (const auto& [stage, shader] : mShaders)
-		if (stage & stageMask)
-			shaders.emplace_back(shader, mSpecializationConstants, mDescriptorBindingFlags);
+	vector<Pipeline::ShaderSpecialization> shaders = specialize(stageMask);
 	
 	size_t key = 0;
 	{
@@ -212,3 +221,14 @@ shared_ptr<GraphicsPipeline> GraphicsPipelineState::get_pipeline(const RenderPas
 	}
 	return static_pointer_cast<GraphicsPipeline>(pipeline);
 }
+
+void GraphicsPipelineState::compile_async(const shared_ptr<RenderPass>& renderPass, uint32_t subpassIndex, const VertexLayoutDescription& vertexDescription, vk::ShaderStageFlags stageMask) {
+	vector<Pipeline::ShaderSpecialization> shaders = specialize(stageMask);
+	size_t key = hash_args(*renderPass, subpassIndex, vertexDescription, shaders, mImmutableSamplers, mRasterState, mSampleShading, mDepthStencilState, mBlendStates);
+	if (has_pipeline(key)) return;
+
+	mCompilingPipelines.emplace(key, renderPass->mDevice.pipeline_workers().submit(
+		[name = mName, renderPass, subpassIndex, vertexDescription, shaders, immutableSamplers = mImmutableSamplers, rasterState = mRasterState, sampleShading = mSampleShading, depthStencilState = mDepthStencilState, blendStates = mBlendStates]() -> shared_ptr<Pipeline> {
+			return make_shared<GraphicsPipeline>(name, *renderPass, subpassIndex, vertexDescription, shaders, immutableSamplers, rasterState, sampleShading, depthStencilState, blendStates);
+		}));
+}
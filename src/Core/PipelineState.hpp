@@ -22,6 +22,7 @@ public:
 		auto it = mImmutableSamplers.find(name);
 		mImmutableSamplers.emplace(name, sampler);
 		mPipelines.clear();
+		mCompilingPipelines.clear();
 	}
 
 	inline uint32_t& specialization_constant(const string& name) {
@@ -107,14 +108,26 @@ protected:
 	unordered_map<string, vk::DescriptorBindingFlags> mDescriptorBindingFlags;
 
 	unordered_map<size_t, shared_ptr<Pipeline>> mPipelines;
+	// pipelines from compile_async that haven't been used yet
+	unordered_map<size_t, shared_future<shared_ptr<Pipeline>>> mCompilingPipelines;
 	unordered_multimap<const DescriptorSetLayout*, shared_ptr<DescriptorSet>> mDescriptorSets;
 	
-	inline shared_ptr<Pipeline> find_pipeline(size_t key) const {
+	inline bool has_pipeline(size_t key) const {
+		return mPipelines.contains(key) || mCompilingPipelines.contains(key);
+	}
+	// waits for the pipeline if it is still compiling, but not for any other pipeline
+	inline shared_ptr<Pipeline> find_pipeline(size_t key) {
 		auto it = mPipelines.find(key);
-		if (it == mPipelines.end())
-			return nullptr;
-		else
+		if (it != mPipelines.end())
 			return it->second;
+		auto compiling = mCompilingPipelines.find(key);
+		if (compiling == mCompilingPipelines.end())
+			return nullptr;
+		shared_future<shared_ptr<Pipeline>> future = move(compiling->second);
+		mCompilingPipelines.erase(compiling);
+		shared_ptr<Pipeline> pipeline = future.get();
+		add_pipeline(key, pipeline);
+		return pipeline;
 	}
 	inline void add_pipeline(size_t key, const shared_ptr<Pipeline>& pipeline) { 
 		mPipelines.emplace(key, pipeline);
@@ -125,6 +138,9 @@ class ComputePipelineState : public PipelineState {
 public:
 	inline ComputePipelineState(const string& name, const shared_ptr<ShaderModule>& module) : PipelineState(name, { module }) {}
 	STRATUM_API shared_ptr<ComputePipeline> get_pipeline();
+	// Compiles the pipeline on the device's pipeline_workers(), with specializationConstants overriding the current ones.
+	// get_pipeline only waits for it if it is still compiling, and the pipeline is in the pipeline cache for other PipelineStates with the same shader
+	STRATUM_API void compile_async(const unordered_map<string, uint32_t>& specializationConstants = {});
 };
 
 class GraphicsPipelineState : public PipelineState {
@@ -147,12 +163,23 @@ public:
 	inline const auto& depth_stencil() const { return mDepthStencilState; }
 
 	STRATUM_API shared_ptr<GraphicsPipeline> get_pipeline(const RenderPass& renderPass, uint32_t subpassIndex, const VertexLayoutDescription& vertexDescription = {}, vk::ShaderStageFlags stageMask = vk::ShaderStageFlagBits::eAll);
+	// Compiles the pipeline that get_pipeline would make with these arguments on the device's pipeline_workers()
+	STRATUM_API void compile_async(const shared_ptr<RenderPass>& renderPass, uint32_t subpassIndex, const VertexLayoutDescription& vertexDescription = {}, vk::ShaderStageFlags stageMask = vk::ShaderStageFlagBits::eAll);
 
 private:
 	vk::PipelineRasterizationStateCreateInfo mRasterState = { {}, false, false, vk::PolygonMode::eFill, vk::CullModeFlagBits::eBack };
 	vk::PipelineDepthStencilStateCreateInfo mDepthStencilState = vk::PipelineDepthStencilStateCreateInfo({}, true, true, vk::CompareOp::eLessOrEqual);
 	vector<vk::PipelineColorBlendAttachmentState> mBlendStates;
 	bool mSampleShading = false;
+
+	inline vector<Pipeline::ShaderSpecialization> specialize(vk::ShaderStageFlags stageMask) const {
+		vector<Pipeline::ShaderSpecialization> shaders;
+		shaders.reserve(mShaders.size());
+		for (const auto& [stage, shader] : mShaders)
+			if (stage & stageMask)
+				shaders.emplace_back(shader, mSpecializationConstants, mDescriptorBindingFlags);
+		return shaders;
+	}
 };
 
 }
@@ -0,0 +1,119 @@
+#include "RenderGraph.hpp"
+
+using namespace stm;
+
+static bool has_read_access(vk::AccessFlags access) {
+	return (bool)(access & (
+		vk::AccessFlagBits::eIndirectCommandRead |
+		vk::AccessFlagBits::eIndexRead |
+		vk::AccessFlagBits::eVertexAttributeRead |
+		vk::AccessFlagBits::eUniformRead |
+		vk::AccessFlagBits::eInputAttachmentRead |
+		vk::AccessFlagBits::eShaderRead |
+		vk::AccessFlagBits::eColorAttachmentRead |
+		vk::AccessFlagBits::eDepthStencilAttachmentRead |
+		vk::AccessFlagBits::eTransferRead |
+		vk::AccessFlagBits::eHostRead |
+		vk::AccessFlagBits::eMemoryRead |
+		vk::AccessFlagBits::eAccelerationStructureReadKHR));
+}
+
+void RenderGraph::execute(CommandBuffer& commandBuffer) {
+	ProfilerRegion ps("RenderGraph::execute");
+
+	// walk backwards, keeping the set of resources whose current contents are still going to be read
+	unordered_set<const void*> live = mExports;
+	mCulledCount = 0;
+	for (auto it = mPasses.rbegin(); it != mPasses.rend(); it++) {
+		Pass& pass = *it;
+		pass.mCulled = !pass.mSideEffect;
+		for (const auto& a : pass.mImages)
+			if (has_write_access(a.mAccess) && live.contains(a.mImage.image().get()))
+				pass.mCulled = false;
+		for (const auto& a : pass.mBuffers)
+			if (has_write_access(a.mAccess) && live.contains(a.mBuffer.buffer().get()))
+				pass.mCulled = false;
+		if (pass.mCulled) {
+			mCulledCount++;
+			continue;
+		}
+
+		for (const auto& a : pass.mImages)
+			if (!has_read_access(a.mAccess)) live.erase(a.mImage.image().get());
+		for (const auto& a : pass.mBuffers)
+			if (!has_read_access(a.mAccess)) live.erase(a.mBuffer.buffer().get());
+		for (const auto& a : pass.mImages)
+			if (has_read_access(a.mAccess)) live.emplace(a.mImage.image().get());
+		for (const auto& a : pass.mBuffers)
+			if (has_read_access(a.mAccess)) live.emplace(a.mBuffer.buffer().get());
+	}
+
+	// buffers have no tracked state of their own, so their last access is only known within the graph
+	unordered_map<const Buffer*, pair<vk::PipelineStageFlags, vk::AccessFlags>> bufferStates;
+
+	vector<vk::MemoryBarrier> memoryBarriers;
+	vector<vk::BufferMemoryBarrier> bufferBarriers;
+	vector<vk::ImageMemoryBarrier> imageBarriers;
+	mBarrierCount = 0;
+	for (Pass& pass : mPasses) {
+		if (pass.mCulled) continue;
+		ProfilerRegion ps(pass.mName, commandBuffer);
+
+		vk::PipelineStageFlags srcStage, dstStage;
+
+		if (!pass.mAliases.empty()) {
+			memoryBarriers.emplace_back(vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eTransferRead|vk::AccessFlagBits::eTransferWrite);
+			srcStage |= vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer;
+			dstStage |= vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer;
+			for (const Image::View& v : pass.mAliases)
+				v.image()->discard_contents();
+		}
+
+		for (const auto& a : pass.mImages) {
+			a.mImage.transition_barrier(commandBuffer, imageBarriers, srcStage, a.mStage, a.mLayout, a.mAccess);
+			dstStage |= a.mStage;
+		}
+
+		for (const auto& a : pass.mBuffers) {
+			auto[it, first] = bufferStates.emplace(a.mBuffer.buffer().get(), make_pair(a.mStage, a.mAccess));
+			if (first) continue;
+			auto&[stage, access] = it->second;
+			const bool readAfterRead = !has_write_access(access) && !has_write_access(a.mAccess);
+			if (readAfterRead && (stage & a.mStage) == a.mStage && (access & a.mAccess) == a.mAccess)
+				continue;
+			bufferBarriers.emplace_back(access, a.mAccess, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, **a.mBuffer.buffer(), 0, VK_WHOLE_SIZE);
+			srcStage |= stage;
+			dstStage |= a.mStage;
+			if (readAfterRead) {
+				stage |= a.mStage;
+				access |= a.mAccess;
+			} else {
+				stage = a.mStage;
+				access = a.mAccess;
+			}
+		}
+
+		if (!memoryBarriers.empty() || !bufferBarriers.empty() || !imageBarriers.empty()) {
+			commandBuffer.barrier(memoryBarriers, bufferBarriers, imageBarriers, srcStage ? srcStage : vk::PipelineStageFlagBits::eTopOfPipe, dstStage);
+			mBarrierCount++;
+			memoryBarriers.clear();
+			bufferBarriers.clear();
+			imageBarriers.clear();
+		}
+
+		pass.mExecute(commandBuffer);
+	}
+
+	// only the names and culling results are kept
+	for (Pass& pass : mPasses) {
+		pass.mExecute = nullptr;
+		pass.mAliases.clear();
+		pass.mImages.clear();
+		pass.mBuffers.clear();
+	}
+}
+
+void RenderGraph::clear() {
+	mPasses.clear();
+	mExports.clear();
+}
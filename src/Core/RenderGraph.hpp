@@ -0,0 +1,120 @@
+#pragma once
+
+#include "CommandBuffer.hpp"
+
+namespace stm {
+
+// Collects passes along with the images and buffers they access, then executes them in order with one pipelineBarrier per pass,
+// covering all of the pass's transitions. Passes whose writes are never read by a later pass or exported are culled.
+// A write without read access is assumed to overwrite what it writes, so earlier writes to the resource don't keep their passes alive
+class RenderGraph {
+public:
+	class Pass {
+	public:
+		inline Pass& read(const Image::View& image, vk::PipelineStageFlags stage = vk::PipelineStageFlagBits::eComputeShader, vk::ImageLayout layout = vk::ImageLayout::eGeneral, vk::AccessFlags access = vk::AccessFlagBits::eShaderRead) {
+			return use(image, stage, layout, access);
+		}
+		inline Pass& write(const Image::View& image, vk::PipelineStageFlags stage = vk::PipelineStageFlagBits::eComputeShader, vk::ImageLayout layout = vk::ImageLayout::eGeneral, vk::AccessFlags access = vk::AccessFlagBits::eShaderWrite) {
+			return use(image, stage, layout, access);
+		}
+		template<typename T>
+		inline Pass& read(const Buffer::View<T>& buffer, vk::PipelineStageFlags stage = vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlags access = vk::AccessFlagBits::eShaderRead) {
+			return use(buffer, stage, access);
+		}
+		template<typename T>
+		inline Pass& write(const Buffer::View<T>& buffer, vk::PipelineStageFlags stage = vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlags access = vk::AccessFlagBits::eShaderWrite) {
+			return use(buffer, stage, access);
+		}
+		// The pass is the first to use image's memory this frame (see ResourcePool::get_aliased_images).
+		// Its previous contents are discarded, and the pass's barrier waits for writes through the images it aliases, like ResourcePool::begin_phase
+		inline Pass& begin_alias(const Image::View& image) {
+			mAliases.emplace_back(image);
+			return *this;
+		}
+		// The pass has effects outside of the graph (e.g. writing to a swapchain image) and is never culled
+		inline Pass& side_effect() {
+			mSideEffect = true;
+			return *this;
+		}
+
+		inline const string& name() const { return mName; }
+		inline bool culled() const { return mCulled; }
+
+	private:
+		friend class RenderGraph;
+		struct ImageAccess {
+			Image::View mImage;
+			vk::PipelineStageFlags mStage;
+			vk::ImageLayout mLayout;
+			vk::AccessFlags mAccess;
+		};
+		struct BufferAccess {
+			Buffer::View<byte> mBuffer;
+			vk::PipelineStageFlags mStage;
+			vk::AccessFlags mAccess;
+		};
+
+		// accesses to the same view in the same layout are combined, since a barrier can't transition a subresource twice
+		inline Pass& use(const Image::View& image, vk::PipelineStageFlags stage, vk::ImageLayout layout, vk::AccessFlags access) {
+			auto it = ranges::find_if(mImages, [&](const ImageAccess& a) { return a.mImage == image && a.mLayout == layout; });
+			if (it == mImages.end())
+				mImages.emplace_back(ImageAccess{ image, stage, layout, access });
+			else {
+				it->mStage |= stage;
+				it->mAccess |= access;
+			}
+			return *this;
+		}
+		inline Pass& use(const Buffer::View<byte>& buffer, vk::PipelineStageFlags stage, vk::AccessFlags access) {
+			auto it = ranges::find_if(mBuffers, [&](const BufferAccess& a) { return a.mBuffer.buffer() == buffer.buffer(); });
+			if (it == mBuffers.end())
+				mBuffers.emplace_back(BufferAccess{ buffer, stage, access });
+			else {
+				it->mStage |= stage;
+				it->mAccess |= access;
+			}
+			return *this;
+		}
+
+		string mName;
+		function<void(CommandBuffer&)> mExecute;
+		vector<Image::View> mAliases;
+		vector<ImageAccess> mImages;
+		vector<BufferAccess> mBuffers;
+		bool mSideEffect = false;
+		bool mCulled = false;
+	};
+
+	// The callback records the pass. Images it binds that were declared on the pass are transitioned by the pass's barrier,
+	// so PipelineState::transition_images finds them in the requested state and records nothing
+	inline Pass& add_pass(const string& name, function<void(CommandBuffer&)>&& execute) {
+		Pass& p = mPasses.emplace_back();
+		p.mName = name;
+		p.mExecute = move(execute);
+		return p;
+	}
+
+	// The contents of exported resources are used after the graph executes, e.g. history for the next frame
+	inline void export_resource(const Image::View& image) { mExports.emplace(image.image().get()); }
+	template<typename T>
+	inline void export_resource(const Buffer::View<T>& buffer) { mExports.emplace(buffer.buffer().get()); }
+
+	// Culls passes, then records the remaining ones. Buffers are assumed to be synchronized with anything recorded before execute().
+	// Afterwards the passes only keep their names and whether they were culled
+	STRATUM_API void execute(CommandBuffer& commandBuffer);
+	// Removes all passes and exports, keeping the statistics of the last execute()
+	STRATUM_API void clear();
+
+	inline const deque<Pass>& passes() const { return mPasses; }
+	inline size_t culled_count() const { return mCulledCount; }
+	inline size_t barrier_count() const { return mBarrierCount; }
+
+private:
+	deque<Pass> mPasses;
+	unordered_set<const void*> mExports;
+
+	size_t mCulledCount = 0;
+	size_t mBarrierCount = 0;
+};
+
+}
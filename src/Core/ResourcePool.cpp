@@ -0,0 +1,136 @@
+#include "ResourcePool.hpp"
+
+using namespace stm;
+
+static bool matches(const ResourcePool::ImageDescription& a, const ResourcePool::ImageDescription& b) {
+	return a.mExtent == b.mExtent && a.mFormat == b.mFormat && a.mUsage == b.mUsage;
+}
+static bool matches(const Image& image, const ResourcePool::ImageDescription& description) {
+	return image.extent() == description.mExtent && image.format() == description.mFormat && image.usage() == description.mUsage;
+}
+
+Image::View ResourcePool::get_image(const ImageDescription& description) {
+	for (PooledImage& p : mImages)
+		if (p.mImage.use_count() == 1 && matches(*p.mImage, description)) {
+			p.mLastUsed = mFrame;
+			mReusedCount++;
+			return p.mImage;
+		}
+
+	auto image = make_shared<Image>(mDevice, description.mName, description.mExtent, description.mFormat, 1, 1, vk::SampleCountFlagBits::e1, description.mUsage);
+	mImages.emplace_back(PooledImage{ image, mFrame });
+	mAllocatedBytes += image->memory()->size();
+	mCreatedCount++;
+	return image;
+}
+
+Buffer::View<byte> ResourcePool::get_buffer(const string& name, vk::DeviceSize size, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage) {
+	// take the smallest free buffer that is large enough, but don't waste more than half of it
+	PooledBuffer* best = nullptr;
+	for (PooledBuffer& p : mBuffers)
+		if (p.mBuffer.use_count() == 1 && p.mBuffer->usage() == usage && p.mMemoryUsage == memoryUsage && p.mBuffer->size() >= size && p.mBuffer->size() <= 2*size)
+			if (!best || p.mBuffer->size() < best->mBuffer->size())
+				best = &p;
+	if (best) {
+		best->mLastUsed = mFrame;
+		mReusedCount++;
+		return Buffer::View<byte>(best->mBuffer, 0, size);
+	}
+
+	auto buffer = make_shared<Buffer>(mDevice, name, size, usage, memoryUsage, 16);
+	mBuffers.emplace_back(PooledBuffer{ buffer, memoryUsage, mFrame });
+	mAllocatedBytes += buffer->memory()->size();
+	mCreatedCount++;
+	return buffer;
+}
+
+vector<vector<Image::View>> ResourcePool::get_aliased_images(const vector<vector<ImageDescription>>& phases) {
+	auto to_views = [](const vector<vector<shared_ptr<Image>>>& images) {
+		vector<vector<Image::View>> views(images.size());
+		for (uint32_t i = 0; i < images.size(); i++)
+			for (const shared_ptr<Image>& image : images[i])
+				views[i].emplace_back(image);
+		return views;
+	};
+
+	for (AliasedImages& a : mAliasedImages) {
+		if (a.mPhases.size() != phases.size()) continue;
+		bool match = true;
+		for (uint32_t i = 0; i < phases.size() && match; i++) {
+			match = a.mPhases[i].size() == phases[i].size();
+			for (uint32_t j = 0; j < phases[i].size() && match; j++)
+				match = matches(a.mPhases[i][j], phases[i][j]) && a.mImages[i][j].use_count() == 1;
+		}
+		if (match) {
+			a.mLastUsed = mFrame;
+			mReusedCount++;
+			return to_views(a.mImages);
+		}
+	}
+
+	// lay out each phase's images back to back, all phases starting at offset 0
+	vector<vector<vk::DeviceSize>> offsets(phases.size());
+	vk::MemoryRequirements requirements(0, 1, ~0u);
+	vk::DeviceSize totalSize = 0;
+	for (uint32_t i = 0; i < phases.size(); i++) {
+		vk::DeviceSize phaseSize = 0;
+		for (const ImageDescription& d : phases[i]) {
+			vk::Image tmp = mDevice->createImage(vk::ImageCreateInfo({}, vk::ImageType::e2D, d.mFormat, d.mExtent, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageTiling::eOptimal, d.mUsage, vk::SharingMode::eExclusive));
+			const vk::MemoryRequirements r = mDevice->getImageMemoryRequirements(tmp);
+			mDevice->destroyImage(tmp);
+			phaseSize = align_up(phaseSize, r.alignment);
+			offsets[i].emplace_back(phaseSize);
+			phaseSize += r.size;
+			totalSize += r.size;
+			requirements.alignment = max(requirements.alignment, r.alignment);
+			requirements.memoryTypeBits &= r.memoryTypeBits;
+		}
+		requirements.size = max(requirements.size, phaseSize);
+	}
+	if (!requirements.memoryTypeBits) throw logic_error("aliased images have no memory type in common");
+
+	auto memory = make_shared<Device::MemoryAllocation>(mDevice, requirements, VMA_MEMORY_USAGE_GPU_ONLY);
+	AliasedImages& a = mAliasedImages.emplace_back(AliasedImages{ phases, vector<vector<shared_ptr<Image>>>(phases.size()), memory, totalSize - min(totalSize, requirements.size), mFrame });
+	for (uint32_t i = 0; i < phases.size(); i++)
+		for (uint32_t j = 0; j < phases[i].size(); j++) {
+			const ImageDescription& d = phases[i][j];
+			a.mImages[i].emplace_back(make_shared<Image>(memory, offsets[i][j], d.mName, d.mExtent, d.mFormat, 1, 1, vk::SampleCountFlagBits::e1, d.mUsage));
+		}
+	mAllocatedBytes += memory->size();
+	mAliasedBytesSaved += a.mBytesSaved;
+	mCreatedCount++;
+	return to_views(a.mImages);
+}
+
+void ResourcePool::begin_phase(CommandBuffer& commandBuffer, const vk::ArrayProxy<const Image::View>& images, vk::PipelineStageFlags stage) {
+	// image barriers only cover their own image, so writes through the other aliases need a global barrier
+	commandBuffer.barrier(vk::MemoryBarrier(vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eTransferRead|vk::AccessFlagBits::eTransferWrite),
+		vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer, stage|vk::PipelineStageFlagBits::eTransfer);
+	for (const Image::View& v : images)
+		v.image()->discard_contents();
+}
+
+void ResourcePool::next_frame() {
+	mFrame++;
+	auto idle = [&](const auto& resource, uint64_t lastUsed) {
+		return resource.use_count() == 1 && mFrame - lastUsed > mMaxIdleFrames;
+	};
+	erase_if(mImages, [&](const PooledImage& p) {
+		if (!idle(p.mImage, p.mLastUsed)) return false;
+		mAllocatedBytes -= p.mImage->memory()->size();
+		return true;
+	});
+	erase_if(mBuffers, [&](const PooledBuffer& p) {
+		if (!idle(p.mBuffer, p.mLastUsed)) return false;
+		mAllocatedBytes -= p.mBuffer->memory()->size();
+		return true;
+	});
+	erase_if(mAliasedImages, [&](const AliasedImages& a) {
+		for (const auto& phase : a.mImages)
+			for (const shared_ptr<Image>& image : phase)
+				if (!idle(image, a.mLastUsed)) return false;
+		mAllocatedBytes -= a.mMemory->size();
+		mAliasedBytesSaved -= a.mBytesSaved;
+		return true;
+	});
+}
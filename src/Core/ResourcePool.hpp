@@ -0,0 +1,75 @@
+#pragma once
+
+#include "CommandBuffer.hpp"
+
+namespace stm {
+
+// Recycles transient Images and Buffers, such as render targets that are recreated whenever the render extent changes.
+// A pooled resource is handed out again once nothing outside the pool references it, which includes CommandBuffers that are still executing.
+// Resources that stay unused for mMaxIdleFrames calls to next_frame() are freed
+class ResourcePool {
+public:
+	struct ImageDescription {
+		string mName;
+		vk::Extent3D mExtent;
+		vk::Format mFormat;
+		vk::ImageUsageFlags mUsage;
+	};
+
+	uint32_t mMaxIdleFrames = 8;
+
+	ResourcePool() = delete;
+	ResourcePool(const ResourcePool&) = delete;
+	ResourcePool(ResourcePool&&) = delete;
+	inline ResourcePool(Device& device) : mDevice(device) {}
+
+	STRATUM_API Image::View get_image(const ImageDescription& description);
+	STRATUM_API Buffer::View<byte> get_buffer(const string& name, vk::DeviceSize size, vk::BufferUsageFlags usage, VmaMemoryUsage memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY);
+
+	// Creates one set of images per phase. The phases share a single allocation, so it only needs to be as large as the largest phase.
+	// Images within a phase may be used together, but the phases' lifetimes must not overlap within a frame,
+	// and begin_phase() must be called with a phase's images before they are first used in a CommandBuffer
+	STRATUM_API vector<vector<Image::View>> get_aliased_images(const vector<vector<ImageDescription>>& phases);
+	// Makes images the current owners of their aliased memory: their previous contents are discarded, and they are ordered after earlier writes to the memory
+	STRATUM_API static void begin_phase(CommandBuffer& commandBuffer, const vk::ArrayProxy<const Image::View>& images, vk::PipelineStageFlags stage = vk::PipelineStageFlagBits::eComputeShader);
+
+	// Advances the pool's frame counter and frees resources that have been idle for longer than mMaxIdleFrames
+	STRATUM_API void next_frame();
+
+	inline vk::DeviceSize allocated_bytes() const { return mAllocatedBytes; }
+	// memory that would be needed on top of allocated_bytes() if the aliased images had their own allocations
+	inline vk::DeviceSize aliased_bytes_saved() const { return mAliasedBytesSaved; }
+	inline size_t created_count() const { return mCreatedCount; }
+	inline size_t reused_count() const { return mReusedCount; }
+
+private:
+	struct PooledImage {
+		shared_ptr<Image> mImage;
+		uint64_t mLastUsed;
+	};
+	struct PooledBuffer {
+		shared_ptr<Buffer> mBuffer;
+		VmaMemoryUsage mMemoryUsage;
+		uint64_t mLastUsed;
+	};
+	struct AliasedImages {
+		vector<vector<ImageDescription>> mPhases;
+		vector<vector<shared_ptr<Image>>> mImages;
+		shared_ptr<Device::MemoryAllocation> mMemory;
+		vk::DeviceSize mBytesSaved;
+		uint64_t mLastUsed;
+	};
+
+	Device& mDevice;
+	vector<PooledImage> mImages;
+	vector<PooledBuffer> mBuffers;
+	vector<AliasedImages> mAliasedImages;
+	uint64_t mFrame = 0;
+
+	vk::DeviceSize mAllocatedBytes = 0;
+	vk::DeviceSize mAliasedBytesSaved = 0;
+	size_t mCreatedCount = 0;
+	size_t mReusedCount = 0;
+};
+
+}
@@ -1,6 +1,8 @@
 #include "ShaderModule.hpp"
 
+#include <Common/binary_io.hpp>
 #include <json.hpp>
+#include <sstream>
 
 using namespace stm;
 
@@ -87,8 +89,7 @@ ShaderModule::ShaderModule(Device& device, const fs::path& spv) : DeviceResource
 	std::ifstream s(json_path);
 	if (!s.is_open()) throw runtime_error("Could not open " + json_path.string());
 	
-	auto shader = read_file<vector<uint32_t>>(spv);
-	mShaderModule = device->createShaderModule(vk::ShaderModuleCreateInfo({}, shader));
+	mSpirv = read_file<vector<uint32_t>>(spv);
 	
 	nlohmann::json j;
 	s >> j;
@@ -203,12 +204,178 @@ ShaderModule::ShaderModule(Device& device, const fs::path& spv) : DeviceResource
 
 	for (const auto& v : j["acceleration_structures"])
 		mDescriptorMap.emplace(v["name"], DescriptorBinding(v["set"], v["binding"], vk::DescriptorType::eAccelerationStructureKHR, spirv_array_size(j, v)));
+}
+
+namespace stm {
+
+// the reflection in the shader archive
 
-	cout << "Loaded " << spv << endl;
+inline void binary_read(istream& lhs, vector<variant<uint32_t, string>>& rhs) {
+	size_t n;
+	binary_read(lhs, n);
+	rhs.resize(n);
+	for (variant<uint32_t, string>& v : rhs) {
+		uint8_t index;
+		binary_read(lhs, index);
+		if (index == 0) {
+			uint32_t size;
+			binary_read(lhs, size);
+			v = size;
+		} else {
+			string name;
+			binary_read(lhs, name);
+			v = name;
+		}
+	}
+}
+inline void binary_write(ostream& lhs, const vector<variant<uint32_t, string>>& rhs) {
+	binary_write(lhs, rhs.size());
+	for (const variant<uint32_t, string>& v : rhs) {
+		binary_write(lhs, (uint8_t)v.index());
+		if (v.index() == 0)
+			binary_write(lhs, get<uint32_t>(v));
+		else
+			binary_write(lhs, get<string>(v));
+	}
 }
 
+inline void binary_read(istream& lhs, ShaderModule::DescriptorBinding& rhs) {
+	binary_read(lhs, rhs.mSet);
+	binary_read(lhs, rhs.mBinding);
+	binary_read(lhs, rhs.mDescriptorType);
+	binary_read(lhs, rhs.mArraySize);
+	binary_read(lhs, rhs.mInputAttachmentIndex);
+}
+inline void binary_write(ostream& lhs, const ShaderModule::DescriptorBinding& rhs) {
+	binary_write(lhs, rhs.mSet);
+	binary_write(lhs, rhs.mBinding);
+	binary_write(lhs, rhs.mDescriptorType);
+	binary_write(lhs, rhs.mArraySize);
+	binary_write(lhs, rhs.mInputAttachmentIndex);
+}
+
+inline void binary_read(istream& lhs, ShaderModule::PushConstant& rhs) {
+	binary_read(lhs, rhs.mOffset);
+	binary_read(lhs, rhs.mTypeSize);
+	binary_read(lhs, rhs.mArrayStride);
+	binary_read(lhs, rhs.mArraySize);
+}
+inline void binary_write(ostream& lhs, const ShaderModule::PushConstant& rhs) {
+	binary_write(lhs, rhs.mOffset);
+	binary_write(lhs, rhs.mTypeSize);
+	binary_write(lhs, rhs.mArrayStride);
+	binary_write(lhs, rhs.mArraySize);
+}
+
+}
+
+inline string read_name(istream& stream) {
+	string name;
+	binary_read(stream, name);
+	return name;
+}
+
+ShaderModule::ShaderModule(Device& device, istream& stream) : DeviceResource(device, read_name(stream)) {
+	binary_read(stream, mSpirv);
+	binary_read(stream, mStage);
+	binary_read(stream, mEntryPoint);
+	binary_read(stream, mDescriptorMap);
+	binary_read(stream, mSpecializationConstants);
+	binary_read(stream, mPushConstants);
+	binary_read(stream, mStageInputs);
+	binary_read(stream, mStageOutputs);
+	for (uint32_t& v : mWorkgroupSize)
+		binary_read(stream, v);
+}
+
+void ShaderModule::write(ostream& stream) const {
+	binary_write(stream, name());
+	binary_write(stream, mSpirv);
+	binary_write(stream, mStage);
+	binary_write(stream, mEntryPoint);
+	binary_write(stream, mDescriptorMap);
+	binary_write(stream, mSpecializationConstants);
+	binary_write(stream, mPushConstants);
+	binary_write(stream, mStageInputs);
+	binary_write(stream, mStageOutputs);
+	for (const uint32_t& v : mWorkgroupSize)
+		binary_write(stream, v);
+}
+
+static const uint32_t gShaderArchiveVersion = 1;
+
 void ShaderModule::load_from_dir(ShaderDatabase& dst, Device& device, const fs::path& dir) {
+	const auto t0 = chrono::high_resolution_clock::now();
+	// dir may be read-only, so the archive can also live in the temp directory, named after dir so that several installs don't share it
+	const array<fs::path, 2> archivePaths {
+		dir / "shaders.pack",
+		fs::temp_directory_path() / ("stm_shaders_" + to_string(hash<string>()(fs::absolute(dir).string())) + ".pack") };
+
+	vector<fs::path> spvs;
+	fs::file_time_type newest = fs::file_time_type::min();
 	for (const fs::path& p : fs::directory_iterator(dir))
-		if (p.extension() == ".spv")
-			dst.emplace(p.stem().string(), make_shared<ShaderModule>(device, p)).first->first;
+		if (p.extension() == ".spv") {
+			spvs.emplace_back(p);
+			newest = max(newest, fs::last_write_time(p));
+		}
+
+	// the archive holds every shader in dir, so any shader that is newer than it, or missing from it, means it is out of date
+	for (const fs::path& archivePath : archivePaths) {
+		if (!fs::exists(archivePath) || fs::last_write_time(archivePath) < newest) continue;
+		try {
+			istringstream stream(read_file<string>(archivePath));
+			uint32_t version = 0;
+			size_t count = 0;
+			binary_read(stream, version);
+			binary_read(stream, count);
+			if (stream && version == gShaderArchiveVersion && count == spvs.size()) {
+				ShaderDatabase shaders;
+				for (size_t i = 0; i < count && stream; i++) {
+					auto shader = make_shared<ShaderModule>(device, stream);
+					shaders.emplace(shader->name(), shader);
+				}
+				if (stream && ranges::all_of(spvs, [&](const fs::path& p) { return shaders.contains(p.stem().string()); })) {
+					dst.insert(shaders.begin(), shaders.end());
+					cout << "Loaded " << shaders.size() << " shaders from " << archivePath << " in " << chrono::duration_cast<chrono::duration<float, milli>>(chrono::high_resolution_clock::now() - t0).count() << "ms" << endl;
+					return;
+				}
+			}
+		} catch (exception&) {
+			// a truncated archive can read a garbage size
+		}
+		cerr << "Ignoring out of date shader archive " << archivePath << endl;
+	}
+
+	// parse the reflection json on worker threads
+	vector<shared_future<shared_ptr<ShaderModule>>> futures;
+	futures.reserve(spvs.size());
+	{
+		worker_pool workers;
+		for (const fs::path& p : spvs)
+			futures.emplace_back(workers.submit([&device, p]() { return make_shared<ShaderModule>(device, p); }));
+	}
+	ShaderDatabase shaders;
+	for (const auto& shader : futures)
+		shaders.emplace(shader.get()->name(), shader.get());
+	dst.insert(shaders.begin(), shaders.end());
+	cout << "Loaded " << shaders.size() << " shaders in " << chrono::duration_cast<chrono::duration<float, milli>>(chrono::high_resolution_clock::now() - t0).count() << "ms" << endl;
+
+	// none of the modules have been created yet, so their SPIR-V is still there to write
+	for (const fs::path& archivePath : archivePaths) {
+		try {
+			const fs::path tmp = fs::path(archivePath).concat(".tmp");
+			{
+				ofstream stream(tmp, ios::binary);
+				binary_write(stream, gShaderArchiveVersion);
+				binary_write(stream, shaders.size());
+				for (const auto& shader : shaders | views::values)
+					shader->write(stream);
+				if (!stream) throw runtime_error("failed to write " + tmp.string());
+			}
+			fs::rename(tmp, archivePath);
+			return;
+		} catch (exception& e) {
+			cerr << "Failed to write shader archive: " << e.what() << endl;
+		}
+	}
 }
\ No newline at end of file
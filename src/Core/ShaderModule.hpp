@@ -29,13 +29,16 @@ public:
 		uint32_t mTypeIndex;
 	};
 
+	// Reads the reflection json next to spv
 	STRATUM_API ShaderModule(Device& device, const fs::path& spv);
+	// Reads a ShaderModule that was written with write()
+	STRATUM_API ShaderModule(Device& device, istream& stream);
 	inline ~ShaderModule() { if (mShaderModule) mDevice->destroyShaderModule(mShaderModule); }
 	
-	inline vk::ShaderModule* operator->() { return &mShaderModule; }
-	inline vk::ShaderModule& operator*() { return mShaderModule; }
-	inline const vk::ShaderModule* operator->() const { return &mShaderModule; }
-	inline const vk::ShaderModule& operator*() const { return mShaderModule; }
+	inline vk::ShaderModule* operator->() { create_module(); return &mShaderModule; }
+	inline vk::ShaderModule& operator*() { create_module(); return mShaderModule; }
+	inline const vk::ShaderModule* operator->() const { create_module(); return &mShaderModule; }
+	inline const vk::ShaderModule& operator*() const { create_module(); return mShaderModule; }
 
 	inline const auto& stage() const { return mStage; }
 	inline const auto& entry_point() const { return mEntryPoint; }
@@ -46,10 +49,17 @@ public:
 	inline const auto& descriptors() const { return mDescriptorMap; }
 	inline const auto& workgroup_size() const { return mWorkgroupSize; }
 
+	// Only valid before the vk::ShaderModule is created, as the SPIR-V is released then
+	STRATUM_API void write(ostream& stream) const;
+
+	// Loads every shader in dir from the archive that a previous call wrote, or from the reflection json when a shader is newer than the archive.
+	// The archive is written to dir, or to the temp directory when dir isn't writable (e.g. a read-only install)
 	STRATUM_API static void load_from_dir(ShaderDatabase& dst, Device& device, const fs::path& dir);
 
 private:
-	vk::ShaderModule mShaderModule; // created when the ShaderModule is used to create a Pipeline
+	mutable vk::ShaderModule mShaderModule; // created when the ShaderModule is used to create a Pipeline
+	mutable once_flag mCreateModule; // Pipelines may be created on worker threads
+	mutable vector<uint32_t> mSpirv; // released once mShaderModule is created
 	vk::ShaderStageFlagBits mStage;
 	string mEntryPoint;
 	unordered_map<string, DescriptorBinding> mDescriptorMap;
@@ -58,6 +68,13 @@ private:
 	unordered_map<string, Variable> mStageInputs;
 	unordered_map<string, Variable> mStageOutputs;
 	array<uint32_t,3> mWorkgroupSize;
+
+	inline void create_module() const {
+		call_once(mCreateModule, [&]() {
+			mShaderModule = mDevice->createShaderModule(vk::ShaderModuleCreateInfo({}, mSpirv));
+			vector<uint32_t>().swap(mSpirv);
+		});
+	}
 };
 
 }
@@ -194,61 +194,55 @@ inline void build_distributions(const span<float4>& img, const vk::Extent2D& ext
 	}
 }
 
-inline void build_distributions(CommandBuffer& commandBuffer, const ShaderDatabase& shaders) {	
-	auto build_row_dist = make_shared<ComputePipelineState>("build_row_dist", shaders.at("build_row_dist"));
-	auto sum_row_cdf = make_shared<ComputePipelineState>("sum_row_cdf", shaders.at("sum_row_cdf"));
-	auto build_marginal_dist = make_shared<ComputePipelineState>("build_marginal_dist", shaders.at("build_marginal_dist"));
-	auto build_marginal_sample_dist = make_shared<ComputePipelineState>("build_marginal_sample_dist", shaders.at("build_marginal_sample_dist"));
-	auto build_conditional_sample_dist = make_shared<ComputePipelineState>("build_conditional_sample_dist", shaders.at("build_conditional_sample_dist"));
+// Builds the same distributions as above on the GPU, from the uploaded image. The buffers must be storage buffers of the sizes in load_environment
+inline void build_distributions(CommandBuffer& commandBuffer, const ShaderDatabase& shaders, const Image::View& image, const Buffer::View<float>& pdf_marginals, const Buffer::View<float>& pdf_rows, const Buffer::View<float>& cdf_marginals, const Buffer::View<float>& cdf_rows) {
+	auto build_row_dist = make_shared<ComputePipelineState>("build_row_dist", shaders.at("dist2_build_row_dist"));
+	auto sum_row_cdf = make_shared<ComputePipelineState>("sum_row_cdf", shaders.at("dist2_sum_row_cdf"));
+	auto build_marginal_dist = make_shared<ComputePipelineState>("build_marginal_dist", shaders.at("dist2_build_marginal_dist"));
+
+	for (const auto& p : { build_row_dist, sum_row_cdf, build_marginal_dist }) {
+		p->descriptor("gImage") = image_descriptor(image, vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits::eShaderRead);
+		p->descriptor("gRowCDF") = cdf_rows;
+		if (p != sum_row_cdf) p->descriptor("gRowPDF") = pdf_rows;
+		if (p != build_row_dist) {
+			p->descriptor("gMarginalCDF") = cdf_marginals;
+			if (p != sum_row_cdf) p->descriptor("gMarginalPDF") = pdf_marginals;
+		}
+	}
+
+	// one group per row
+	commandBuffer.bind_pipeline(build_row_dist->get_pipeline());
+	build_row_dist->bind_descriptor_sets(commandBuffer);
+	commandBuffer.dispatch(1, image.extent().height);
+
+	commandBuffer.barrier(cdf_rows, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+	commandBuffer.bind_pipeline(sum_row_cdf->get_pipeline());
+	sum_row_cdf->bind_descriptor_sets(commandBuffer);
+	commandBuffer.dispatch(1);
+
+	// build_marginal_dist reads pdf_rows and cdf_rows from build_row_dist as well as cdf_marginals from sum_row_cdf
+	commandBuffer.barrier(vk::MemoryBarrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite), vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader);
+	commandBuffer.bind_pipeline(build_marginal_dist->get_pipeline());
+	build_marginal_dist->bind_descriptor_sets(commandBuffer);
+	commandBuffer.dispatch_over(image.extent().height);
+
+	for (const Buffer::View<float>& b : { pdf_marginals, pdf_rows, cdf_marginals, cdf_rows })
+		commandBuffer.barrier(b, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderWrite, vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eTransferRead);
 }
 
-inline Environment load_environment(CommandBuffer& commandBuffer, const fs::path& filename) {
+inline Environment load_environment(CommandBuffer& commandBuffer, const ShaderDatabase& shaders, const fs::path& filename) {
 	ImageData image = load_image_data(commandBuffer.mDevice, filename, false);
 	Environment e;
 	e.emission.value = float3::Ones();
 	e.emission.image = make_shared<Image>(commandBuffer, filename.stem().string(), image, 1);
-	
-	Buffer::View<float> marginalPDF = make_shared<Buffer>(commandBuffer.mDevice, "marginal_pdf_tmp", image.extent.height*sizeof(float), vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_CPU_TO_GPU);
-	Buffer::View<float> rowPDF      = make_shared<Buffer>(commandBuffer.mDevice, "row_pdf_tmp"     , image.extent.width*image.extent.height*sizeof(float), vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_CPU_TO_GPU);
-	Buffer::View<float> marginalCDF = make_shared<Buffer>(commandBuffer.mDevice, "marginal_cdf_tmp", (image.extent.height+1)*sizeof(float), vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_CPU_TO_GPU);
-	Buffer::View<float> rowCDF      = make_shared<Buffer>(commandBuffer.mDevice, "row_cdf_tmp"     , (image.extent.width+1)*image.extent.height*sizeof(float), vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_CPU_TO_GPU);
-
-	fs::path cacheFile = filename.string() + ".dists";
-	if (fs::exists(cacheFile)) {
-		ifstream file(cacheFile, ios::binary);
-		file.read(reinterpret_cast<char*>(marginalPDF.data()), marginalPDF.size_bytes());
-		file.read(reinterpret_cast<char*>(rowPDF.data()), rowPDF.size_bytes());
-		file.read(reinterpret_cast<char*>(marginalCDF.data()), marginalCDF.size_bytes());
-		file.read(reinterpret_cast<char*>(rowCDF.data()), rowCDF.size_bytes());
-	} else {
-		build_distributions(
-			span<float4>(reinterpret_cast<float4*>(image.pixels.data()), image.pixels.size_bytes()/sizeof(float4)), vk::Extent2D(image.extent.width, image.extent.height),
-			span(marginalPDF.data(), marginalPDF.size()),
-			span(rowPDF.data(), rowPDF.size()),
-			span(marginalCDF.data(), marginalCDF.size()),
-			span(rowCDF.data(), rowCDF.size()) );
-		
-		ofstream file(cacheFile, ios::binary);
-		file.write(reinterpret_cast<char*>(marginalPDF.data()), marginalPDF.size_bytes());
-		file.write(reinterpret_cast<char*>(rowPDF.data()), rowPDF.size_bytes());
-		file.write(reinterpret_cast<char*>(marginalCDF.data()), marginalCDF.size_bytes());
-		file.write(reinterpret_cast<char*>(rowCDF.data()), rowCDF.size_bytes());
-	}
-
-	commandBuffer.barrier(marginalPDF, vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostWrite, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead);
-	commandBuffer.barrier(rowPDF, vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostWrite, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead);
-	commandBuffer.barrier(marginalCDF, vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostWrite, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead);
-	commandBuffer.barrier(rowCDF, vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostWrite, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead);
 
-	e.marginal_pdf = make_shared<Buffer>(commandBuffer.mDevice, "marginal_PDF", marginalPDF.size_bytes(), vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY);
-	e.row_pdf = make_shared<Buffer>(commandBuffer.mDevice, "row_pdf", rowPDF.size_bytes(), vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY);
-	e.marginal_cdf = make_shared<Buffer>(commandBuffer.mDevice, "marginal_cdf", marginalCDF.size_bytes(), vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY);
-	e.row_cdf = make_shared<Buffer>(commandBuffer.mDevice, "row_cdf", rowCDF.size_bytes(), vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY);
+	const vk::BufferUsageFlags usage = vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer;
+	e.marginal_pdf = make_shared<Buffer>(commandBuffer.mDevice, "marginal_PDF", image.extent.height*sizeof(float), usage, VMA_MEMORY_USAGE_GPU_ONLY);
+	e.row_pdf = make_shared<Buffer>(commandBuffer.mDevice, "row_pdf", image.extent.width*image.extent.height*sizeof(float), usage, VMA_MEMORY_USAGE_GPU_ONLY);
+	e.marginal_cdf = make_shared<Buffer>(commandBuffer.mDevice, "marginal_cdf", (image.extent.height+1)*sizeof(float), usage, VMA_MEMORY_USAGE_GPU_ONLY);
+	e.row_cdf = make_shared<Buffer>(commandBuffer.mDevice, "row_cdf", (image.extent.width+1)*image.extent.height*sizeof(float), usage, VMA_MEMORY_USAGE_GPU_ONLY);
 
-	commandBuffer.copy_buffer(marginalPDF, e.marginal_pdf);
-	commandBuffer.copy_buffer(rowPDF, e.row_pdf);
-	commandBuffer.copy_buffer(marginalCDF, e.marginal_cdf);
-	commandBuffer.copy_buffer(rowCDF, e.row_cdf);
+	build_distributions(commandBuffer, shaders, e.emission.image, e.marginal_pdf, e.row_pdf, e.marginal_cdf, e.row_cdf);
 
 	return e;
 }
@@ -95,11 +95,11 @@ void main(uint3 index : SV_DispatchThreadId) {
 	uint res;
 	InterlockedCompareExchange(gGradientSamples[tile_pos_curr], 0u, gradient_idx_curr, res);
 	if (res == 0) {
-		for (uint i = 0; i < VISIBILITY_BUFFER_COUNT; i++) {
-			if (i == 2)
-				gVisibility[i][idx_curr] = uint4( gPrevVisibility[i][idx_prev].xy, asuint( (idx_view_prev + 0.5) / float2(view_size)) );
-			else
-				gVisibility[i][idx_curr] = gPrevVisibility[i][idx_prev];
-		}
+		VisibilityInfo v;
+		for (uint i = 0; i < VISIBILITY_BUFFER_COUNT; i++)
+			v.data[i] = gPrevVisibility[i][idx_prev];
+		v.set_prev_uv((idx_view_prev + 0.5) / float2(view_size));
+		for (uint i = 0; i < VISIBILITY_BUFFER_COUNT; i++)
+			gVisibility[i][idx_curr] = v.data[i];
 	}
 }
\ No newline at end of file
@@ -0,0 +1,131 @@
+#pragma compile dxc -spirv -T cs_6_7 -E estimate_priority
+#pragma compile dxc -spirv -T cs_6_7 -E sum_priority
+#pragma compile dxc -spirv -T cs_6_7 -E allocate_samples
+#pragma compile dxc -spirv -T cs_6_7 -E resolve_samples
+
+#include "a-svgf/svgf_shared.hlsli"
+
+StructuredBuffer<ViewData> gViews;
+#include "../visibility_buffer.hlsli"
+
+// estimate_priority: the A-SVGF variance estimate and history length of the current frame
+Texture2D<float4> gAccumColor; // .a is the history length
+Texture2D<float4> gVariance; // .a is the luminance variance
+RWTexture2D<float> gSamplePriority;
+
+// the previous frame's gSamplePriority, reprojected with the current visibility
+Texture2D<float> gPrevSamplePriority;
+
+// The dispatch args for the sample slots (x,y,z), the number of allocated slots, and the sum of the priorities in 1/PRIORITY_SCALE
+RWByteAddressBuffer gAdaptiveArgs;
+RWStructuredBuffer<uint> gAdaptiveSamples; // the pixel index of each slot
+RWStructuredBuffer<uint> gSampleCounts; // per pixel: the first slot, and the number of slots above SAMPLE_COUNT_SHIFT
+
+RWTexture2D<float4> gRadiance;
+StructuredBuffer<float4> gSampleRadiance;
+
+#define PRIORITY_SCALE 256
+#define SAMPLE_COUNT_SHIFT 27
+#define SAMPLE_SLOT_MASK ((1u << SAMPLE_COUNT_SHIFT) - 1)
+#define SLOT_GROUP_SIZE 64 // PATH_QUEUE_GROUP_SIZE in pt.hlsl
+
+[[vk::push_constant]] const struct {
+	uint gViewCount;
+	uint gHasPriority;
+	uint gSampleBudget;
+	uint gMaxSamples;
+	float gErrorThreshold;
+	uint gRandomSeed;
+} gPushConstants;
+
+// Relative standard error of the accumulated mean. Converged pixels, and pixels that see the background, get no extra samples
+[numthreads(8,8,1)]
+void estimate_priority(uint3 index : SV_DispatchThreadID) {
+	const uint viewIndex = get_view_index(index.xy, gViews, gPushConstants.gViewCount);
+	if (viewIndex == -1) return;
+
+	float priority = 0;
+	if (load_visibility(index.xy).instance_index() != INVALID_INSTANCE) {
+		const float4 c = gAccumColor[index.xy];
+		const float e = sqrt(gVariance[index.xy].a / max(c.a, 1)) / (luminance(c.rgb) + 1e-3);
+		if (!(e < gPushConstants.gErrorThreshold))
+			priority = isnan(e) ? 1 : saturate(e);
+	}
+	gSamplePriority[index.xy] = priority;
+}
+
+inline float reprojected_priority(const uint2 index, const uint viewIndex) {
+	const VisibilityInfo v = load_visibility(index);
+	if (v.instance_index() == INVALID_INSTANCE) return 0;
+	if (!gPushConstants.gHasPriority) return 1;
+	const ViewData view = gViews[viewIndex];
+	const int2 p = view.image_min + v.prev_uv()*float2(view.image_max - view.image_min);
+	// pixels that reproject off screen have no estimate, and the shortest history
+	return test_inside_screen(p, view) ? gPrevSamplePriority[p] : 1;
+}
+
+[numthreads(8,8,1)]
+void sum_priority(uint3 index : SV_DispatchThreadID) {
+	const uint viewIndex = get_view_index(index.xy, gViews, gPushConstants.gViewCount);
+	const uint priority = viewIndex == -1 ? 0 : (uint)(reprojected_priority(index.xy, viewIndex)*PRIORITY_SCALE);
+	const uint sum = WaveActiveSum(priority);
+	if (WaveIsFirstLane() && sum > 0)
+		gAdaptiveArgs.InterlockedAdd(16, sum);
+}
+
+// Splits gSampleBudget slots between the pixels in proportion to their priority, with stochastic rounding, so that the expected total is the budget.
+// Each pixel's slots are consecutive, and appended with one atomic per wave. Slots past the budget are dropped
+[numthreads(8,8,1)]
+void allocate_samples(uint3 index : SV_DispatchThreadID) {
+	uint w,h;
+	gVisibility[0].GetDimensions(w,h);
+	const bool inside = all(index.xy < uint2(w,h));
+	const uint pixelIndex = index.y*w + index.x;
+
+	uint count = 0;
+	const uint viewIndex = inside ? get_view_index(index.xy, gViews, gPushConstants.gViewCount) : -1;
+	if (viewIndex != -1) {
+		const float sum = gAdaptiveArgs.Load(16) / (float)PRIORITY_SCALE;
+		const float priority = (uint)(reprojected_priority(index.xy, viewIndex)*PRIORITY_SCALE) / (float)PRIORITY_SCALE;
+		if (priority > 0 && sum > 0) {
+			uint4 h4 = uint4(index.xy, gPushConstants.gRandomSeed, 0) * 1664525u + 1013904223u;
+			h4 ^= h4 >> 16;
+			h4 *= 0x45d9f3bu;
+			const float rnd = ((h4.x ^ h4.y ^ h4.z) >> 8) / float(1 << 24);
+			count = min(gPushConstants.gMaxSamples, (uint)(priority / sum * gPushConstants.gSampleBudget + rnd));
+		}
+	}
+
+	const uint total = WaveActiveSum(count);
+	uint first = 0;
+	if (total > 0) {
+		uint base;
+		if (WaveIsFirstLane()) {
+			gAdaptiveArgs.InterlockedAdd(12, total, base);
+			uint tmp;
+			gAdaptiveArgs.InterlockedMax(0, (min(base + total, gPushConstants.gSampleBudget) + SLOT_GROUP_SIZE-1) / SLOT_GROUP_SIZE, tmp);
+		}
+		first = WaveReadLaneFirst(base) + WavePrefixSum(count);
+		count = first >= gPushConstants.gSampleBudget ? 0 : min(count, gPushConstants.gSampleBudget - first);
+		for (uint i = 0; i < count; i++)
+			gAdaptiveSamples[first + i] = pixelIndex;
+	}
+	if (inside)
+		gSampleCounts[pixelIndex] = (first & SAMPLE_SLOT_MASK) | (count << SAMPLE_COUNT_SHIFT);
+}
+
+// Averages the extra paths into the pixel's own path. gRadiance.a counts the samples, which temporal accumulation weighs the new samples by
+[numthreads(8,8,1)]
+void resolve_samples(uint3 index : SV_DispatchThreadID) {
+	uint w,h;
+	gRadiance.GetDimensions(w,h);
+	if (any(index.xy >= uint2(w,h))) return;
+	const uint packed = gSampleCounts[index.y*w + index.x];
+	const uint count = packed >> SAMPLE_COUNT_SHIFT;
+	if (count == 0) return;
+	const uint first = packed & SAMPLE_SLOT_MASK;
+	float4 r = gRadiance[index.xy];
+	for (uint i = 0; i < count; i++)
+		r.rgb += gSampleRadiance[first + i].rgb;
+	gRadiance[index.xy] = float4(r.rgb / (1 + count), r.a + count);
+}
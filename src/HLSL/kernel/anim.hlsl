@@ -1,12 +1,7 @@
 #pragma compile dxc -spirv -T cs_6_7 -E skin
 #pragma compile dxc -spirv -T cs_6_7 -E blend
 
-#include "../transform.hlsli"
-
-struct VertexWeight {
-	float4 weights;
-	uint4 indices;
-};
+#include "../scene.hlsli"
 
 [[vk::binding(0)]] RWByteAddressBuffer gVertices;
 [[vk::binding(1)]] ByteAddressBuffer gBlendTarget0;
@@ -14,7 +9,7 @@ struct VertexWeight {
 [[vk::binding(3)]] ByteAddressBuffer gBlendTarget2;
 [[vk::binding(4)]] ByteAddressBuffer gBlendTarget3;
 [[vk::binding(5)]] StructuredBuffer<VertexWeight> gWeights;
-[[vk::binding(6)]] StructuredBuffer<float3x4> gPose;
+[[vk::binding(6)]] StructuredBuffer<float4> gPose; // 3 rows of a 3x4 matrix per joint
 
 [[vk::push_constant]] const struct {
 	uint gVertexCount;
@@ -22,8 +17,13 @@ struct VertexWeight {
 	uint gNormalOffset;
 	uint gTangentOffset;
 	float4 gBlendFactors;
+	uint gBaseAddress; // address of the first vertex in gVertices, gBlendTargets and gWeights are indexed from 0
 } gPushConstants;
 
+float3x4 joint_transform(uint joint) {
+	return float3x4(gPose[3*joint], gPose[3*joint + 1], gPose[3*joint + 2]);
+}
+
 [numthreads(64, 1, 1)]
 void skin(uint3 index : SV_DispatchThreadID) {
 	if (index.x >= gPushConstants.gVertexCount) return;
@@ -31,12 +31,12 @@ void skin(uint3 index : SV_DispatchThreadID) {
 	VertexWeight w = gWeights[index.x];
 
 	float3x4 transform = 0;
-	transform += gPose[w.indices[0]] * w.weights[0];
-	transform += gPose[w.indices[1]] * w.weights[1];
-	transform += gPose[w.indices[2]] * w.weights[2];
-	transform += gPose[w.indices[3]] * w.weights[3];
+	transform += joint_transform(w.indices[0]) * w.weights[0];
+	transform += joint_transform(w.indices[1]) * w.weights[1];
+	transform += joint_transform(w.indices[2]) * w.weights[2];
+	transform += joint_transform(w.indices[3]) * w.weights[3];
 	
-	uint address = index.x * gPushConstants.gVertexStride;
+	uint address = gPushConstants.gBaseAddress + index.x * gPushConstants.gVertexStride;
 	float3 vertex = asfloat(gVertices.Load3(address));
 	float3 normal = asfloat(gVertices.Load3(address + gPushConstants.gNormalOffset));
 	float3 tangent = asfloat(gVertices.Load3(address + gPushConstants.gTangentOffset));
@@ -50,34 +50,33 @@ void skin(uint3 index : SV_DispatchThreadID) {
 	gVertices.Store3(address + gPushConstants.gTangentOffset, asuint(tangent));
 }
 
+// adds gBlendFactors-weighted displacements to the vertices. Targets have the same layout as gVertices, more than 4 targets take several dispatches
 [numthreads(64, 1, 1)]
 void blend(uint3 index : SV_DispatchThreadID) {
 	if (index.x >= gPushConstants.gVertexCount) return;
 	
-	uint address = index.x * gPushConstants.gVertexStride;
+	uint address = gPushConstants.gBaseAddress + index.x * gPushConstants.gVertexStride;
+	uint targetAddress = index.x * gPushConstants.gVertexStride;
 
-	float sum = dot(1, abs(gPushConstants.gBlendFactors));
-	float isum = max(0, 1 - sum);
-
-	float3 vertex  = isum * asfloat(gVertices.Load3(address));
-	float3 normal  = isum * asfloat(gVertices.Load3(address + gPushConstants.gNormalOffset));
-	float3 tangent = isum * asfloat(gVertices.Load3(address + gPushConstants.gTangentOffset));
+	float3 vertex  = asfloat(gVertices.Load3(address));
+	float3 normal  = asfloat(gVertices.Load3(address + gPushConstants.gNormalOffset));
+	float3 tangent = asfloat(gVertices.Load3(address + gPushConstants.gTangentOffset));
 
-	vertex  += gPushConstants.gBlendFactors[0] * asfloat(gBlendTarget0.Load3(address));
-	normal  += gPushConstants.gBlendFactors[0] * asfloat(gBlendTarget0.Load3(address + gPushConstants.gNormalOffset));
-	tangent += gPushConstants.gBlendFactors[0] * asfloat(gBlendTarget0.Load3(address + gPushConstants.gTangentOffset));
+	vertex  += gPushConstants.gBlendFactors[0] * asfloat(gBlendTarget0.Load3(targetAddress));
+	normal  += gPushConstants.gBlendFactors[0] * asfloat(gBlendTarget0.Load3(targetAddress + gPushConstants.gNormalOffset));
+	tangent += gPushConstants.gBlendFactors[0] * asfloat(gBlendTarget0.Load3(targetAddress + gPushConstants.gTangentOffset));
 
-	vertex  += gPushConstants.gBlendFactors[1] * asfloat(gBlendTarget1.Load3(address));
-	normal  += gPushConstants.gBlendFactors[1] * asfloat(gBlendTarget1.Load3(address + gPushConstants.gNormalOffset));
-	tangent += gPushConstants.gBlendFactors[1] * asfloat(gBlendTarget1.Load3(address + gPushConstants.gTangentOffset));
+	vertex  += gPushConstants.gBlendFactors[1] * asfloat(gBlendTarget1.Load3(targetAddress));
+	normal  += gPushConstants.gBlendFactors[1] * asfloat(gBlendTarget1.Load3(targetAddress + gPushConstants.gNormalOffset));
+	tangent += gPushConstants.gBlendFactors[1] * asfloat(gBlendTarget1.Load3(targetAddress + gPushConstants.gTangentOffset));
 
-	vertex  += gPushConstants.gBlendFactors[2] * asfloat(gBlendTarget2.Load3(address));
-	normal  += gPushConstants.gBlendFactors[2] * asfloat(gBlendTarget2.Load3(address + gPushConstants.gNormalOffset));
-	tangent += gPushConstants.gBlendFactors[2] * asfloat(gBlendTarget2.Load3(address + gPushConstants.gTangentOffset));
+	vertex  += gPushConstants.gBlendFactors[2] * asfloat(gBlendTarget2.Load3(targetAddress));
+	normal  += gPushConstants.gBlendFactors[2] * asfloat(gBlendTarget2.Load3(targetAddress + gPushConstants.gNormalOffset));
+	tangent += gPushConstants.gBlendFactors[2] * asfloat(gBlendTarget2.Load3(targetAddress + gPushConstants.gTangentOffset));
 
-	vertex  += gPushConstants.gBlendFactors[3] * asfloat(gBlendTarget3.Load3(address));
-	normal  += gPushConstants.gBlendFactors[3] * asfloat(gBlendTarget3.Load3(address + gPushConstants.gNormalOffset));
-	tangent += gPushConstants.gBlendFactors[3] * asfloat(gBlendTarget3.Load3(address + gPushConstants.gTangentOffset));
+	vertex  += gPushConstants.gBlendFactors[3] * asfloat(gBlendTarget3.Load3(targetAddress));
+	normal  += gPushConstants.gBlendFactors[3] * asfloat(gBlendTarget3.Load3(targetAddress + gPushConstants.gNormalOffset));
+	tangent += gPushConstants.gBlendFactors[3] * asfloat(gBlendTarget3.Load3(targetAddress + gPushConstants.gTangentOffset));
 
 	normal = normalize(normal);
 
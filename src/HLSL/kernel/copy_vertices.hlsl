@@ -10,6 +10,7 @@
 
 [[vk::push_constant]] const struct {
 	uint gCount;
+	uint gFirstVertex;
 	uint gPositionStride;
 	uint gNormalStride;
 	uint gTangentStride;
@@ -26,5 +27,5 @@ void main(uint3 index : SV_DispatchThreadId) {
 	v.normal = asfloat(gNormals.Load3(index.x*gPushConstants.gNormalStride));
 	v.v = uv.y;
 	v.tangent = gPushConstants.gTangentStride > 0 ? asfloat(gTangents.Load4(index.x*gPushConstants.gTangentStride)) : 0;
-	gVertices[index.x] = v;
+	gVertices[gPushConstants.gFirstVertex + index.x] = v;
 }
\ No newline at end of file
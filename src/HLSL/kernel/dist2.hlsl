@@ -4,47 +4,79 @@
 
 #include "../common.hlsli"
 
+// Builds the environment map sampling distributions in the layout of the CPU build_distributions in environment.hlsli
+
 Texture2D<float4> gImage;
-RWTexture2D<float> gRowCDF; // height x (width + 1);
-RWTexture2D<float> gRowPDF; // height x width;
-RWTexture2D<uint> gConditionalLowerBound;
-RWStructuredBuffer<float> gMarginalCDF; // height + 1;
-RWStructuredBuffer<float> gMarginalPDF; // height;
-RWStructuredBuffer<uint> gMarginalLowerBound;
+RWStructuredBuffer<float> gRowCDF; // height x (width + 1)
+RWStructuredBuffer<float> gRowPDF; // height x width
+RWStructuredBuffer<float> gMarginalCDF; // height + 1
+RWStructuredBuffer<float> gMarginalPDF; // height
+
+#define ROW_GROUP_SIZE 256
+// Vulkan only guarantees subgroups of at least one lane
+#define MIN_WAVE_SIZE 1
+
+static_assert(ROW_GROUP_SIZE % MIN_WAVE_SIZE == 0, "ROW_GROUP_SIZE must be a multiple of MIN_WAVE_SIZE");
+groupshared float gWaveSums[ROW_GROUP_SIZE/MIN_WAVE_SIZE];
 
 inline float sample_image(const uint2 index, const float sinTheta) {
   return luminance(gImage[index].rgb) * sinTheta;
 }
 
-[numthreads(64,1,1)]
-void build_row_dist(uint3 index : SV_DispatchThreadId) {
+// One group per row, which scans the row ROW_GROUP_SIZE texels at a time.
+// The last CDF entry of each row is left unnormalized, for sum_row_cdf
+[numthreads(ROW_GROUP_SIZE,1,1)]
+void build_row_dist(uint3 group : SV_GroupID, uint3 thread : SV_GroupThreadID) {
   uint width,height;
   gImage.GetDimensions(width,height);
-  if (index.x >= height) return;
 
-  const uint y = index.x;
+  const uint y = group.y;
+  const uint rowCDF = y * (width + 1);
+  const uint rowPDF = y * width;
   const float sinTheta = sin(M_PI * (y + 0.5) / height);
+  const uint waveIndex = thread.x / WaveGetLaneCount();
+  const uint waveCount = ROW_GROUP_SIZE / WaveGetLaneCount();
+
+  if (thread.x == 0)
+    gRowCDF[rowCDF] = 0;
 
-  gRowCDF[uint2(0, y)] = 0;
-  for (uint x = 0; x < width; x++)
-    gRowCDF[uint2(x + 1, y)] = gRowCDF[uint2(x, y)] + sample_image(uint2(x, y), sinTheta);
-  
-  const float integral = gRowCDF[uint2(width, y)];
+  float integral = 0;
+  for (uint x0 = 0; x0 < width; x0 += ROW_GROUP_SIZE) {
+    const uint x = x0 + thread.x;
+    const float f = x < width ? sample_image(uint2(x, y), sinTheta) : 0;
+    const float wavePrefix = WavePrefixSum(f) + f;
+    if (WaveGetLaneIndex() == WaveGetLaneCount() - 1)
+      gWaveSums[waveIndex] = wavePrefix;
+    GroupMemoryBarrierWithGroupSync();
+
+    float prefix = integral + wavePrefix;
+    for (uint i = 0; i < waveIndex; i++)
+      prefix += gWaveSums[i];
+    if (x < width) {
+      gRowCDF[rowCDF + x + 1] = prefix;
+      gRowPDF[rowPDF + x] = f;
+    }
+    for (uint i = 0; i < waveCount; i++)
+      integral += gWaveSums[i];
+    GroupMemoryBarrierWithGroupSync();
+  }
+
+  // each thread normalizes the entries it wrote
   if (integral > 0) {
     const float norm = 1 / integral;
-    for (uint x = 0; x < width; x++) {
-      gRowPDF[uint2(x, y)] = sample_image(uint2(x, y), sinTheta) * norm;
-      gRowCDF[uint2(x, y)] *= norm;
+    for (uint x = thread.x; x < width; x += ROW_GROUP_SIZE) {
+      gRowPDF[rowPDF + x] *= norm;
+      if (x + 1 < width)
+        gRowCDF[rowCDF + x + 1] *= norm;
     }
   } else {
     // We shouldn't sample this row, but just in case we
     // set up a uniform distribution.
     const float norm = 1 / (float)width;
-    for (uint x = 0; x < width; x++) {
-      gRowPDF[uint2(x, y)] = norm;
-      gRowCDF[uint2(x, y)] = x * norm;
+    for (uint x = thread.x; x < width; x += ROW_GROUP_SIZE) {
+      gRowPDF[rowPDF + x] = norm;
+      gRowCDF[rowCDF + x + 1] = (x + 1) * norm;
     }
-    gRowCDF[uint2(width, y)] = 1;
   }
 }
 
@@ -52,11 +84,11 @@ void build_row_dist(uint3 index : SV_DispatchThreadId) {
 void sum_row_cdf(uint3 index : SV_DispatchThreadId) {
   uint width,height;
   gImage.GetDimensions(width,height);
-  
+
   // Now construct the marginal CDF for each column.
   gMarginalCDF[0] = 0;
-  for (int y = 0; y < height; y++)
-    gMarginalCDF[y + 1] = gMarginalCDF[y] + gRowCDF[uint2(width, y)];
+  for (uint y = 0; y < height; y++)
+    gMarginalCDF[y + 1] = gMarginalCDF[y] + gRowCDF[y * (width + 1) + width];
 }
 
 [numthreads(64,1,1)]
@@ -66,13 +98,13 @@ void build_marginal_dist(uint3 index : SV_DispatchThreadId) {
   if (index.x >= height) return;
 
   const uint y = index.x;
-  
+
   const float total_values = gMarginalCDF[height];
   if (total_values > 0) {
     // Normalize
     const float norm = 1 / total_values;
     gMarginalCDF[y] *= norm;
-    gMarginalPDF[y] = gRowCDF[uint2(width, y)] * norm;
+    gMarginalPDF[y] = gRowCDF[y * (width + 1) + width] * norm;
   } else {
     // The whole thing is black...why are we even here?
     // Still set up a uniform distribution.
@@ -80,7 +112,7 @@ void build_marginal_dist(uint3 index : SV_DispatchThreadId) {
     gMarginalPDF[y] = norm;
     gMarginalCDF[y] = y * norm;
   }
-  gRowCDF[uint2(width, y)] = 1;
+  gRowCDF[y * (width + 1) + width] = 1;
   if (y == height-1)
     gMarginalCDF[height] = 1;
-}
\ No newline at end of file
+}
@@ -1,20 +1,50 @@
 #pragma compile dxc -spirv -fspv-target-env=vulkan1.2 -fspv-extension=SPV_EXT_descriptor_indexing -fspv-extension=SPV_KHR_ray_tracing -fspv-extension=SPV_KHR_ray_query -T cs_6_7 -E trace_visibility
 #pragma compile dxc -spirv -fspv-target-env=vulkan1.2 -fspv-extension=SPV_EXT_descriptor_indexing -fspv-extension=SPV_KHR_ray_tracing -fspv-extension=SPV_KHR_ray_query -T cs_6_7 -E trace_direct_light
 #pragma compile dxc -spirv -fspv-target-env=vulkan1.2 -fspv-extension=SPV_EXT_descriptor_indexing -fspv-extension=SPV_KHR_ray_tracing -fspv-extension=SPV_KHR_ray_query -T cs_6_7 -E trace_path_bounce
+#pragma compile dxc -spirv -fspv-target-env=vulkan1.2 -fspv-extension=SPV_EXT_descriptor_indexing -fspv-extension=SPV_KHR_ray_tracing -fspv-extension=SPV_KHR_ray_query -T cs_6_7 -E trace_path_bounce_queued
+#pragma compile dxc -spirv -fspv-target-env=vulkan1.2 -fspv-extension=SPV_EXT_descriptor_indexing -fspv-extension=SPV_KHR_ray_tracing -fspv-extension=SPV_KHR_ray_query -T cs_6_7 -E sort_paths
+#pragma compile dxc -spirv -fspv-target-env=vulkan1.2 -fspv-extension=SPV_EXT_descriptor_indexing -fspv-extension=SPV_KHR_ray_tracing -fspv-extension=SPV_KHR_ray_query -T cs_6_7 -E trace_adaptive_samples
+#pragma compile dxc -spirv -fspv-target-env=vulkan1.2 -fspv-extension=SPV_EXT_descriptor_indexing -fspv-extension=SPV_KHR_ray_tracing -fspv-extension=SPV_KHR_ray_query -T cs_6_7 -E spatial_reuse
 
 #include "../scene.hlsli"
+#include "../visibility_buffer.hlsli"
+#include "../reservoir.hlsli"
+#include "a-svgf/svgf_shared.hlsli"
+
+// PATH_BOUNCE_STATE_SIZE bytes. rng() and bary_or_z() hide the difference between the layouts
+#if COMPACT_ENCODING
+struct PathBounceState {
+	uint3 packed_dP;
+	uint instance_primitive_index;
+	float3 ray_origin;
+	uint packed_ray_direction;
+	uint3 packed_dD;
+	uint packed_bary_or_z; // unorm16 barycentrics, or the float distance to a sphere
+	uint2 rng_state; // rng_t::v.zw, xy is the pixel
+	uint2 packed_throughput;
 
+	inline uint4 rng(const uint2 pixel) { return uint4(pixel, rng_state); }
+	inline float2 bary_or_z() {
+		if (BF_GET(instance_primitive_index, 16, 16) == INVALID_PRIMITIVE)
+			return asfloat(packed_bary_or_z);
+		return float2(BF_GET_UNORM(packed_bary_or_z, 0, 16), BF_GET_UNORM(packed_bary_or_z, 16, 16));
+	}
+#else
 struct PathBounceState {
-	uint4 rng;
+	uint4 rng_state;
 	float3 ray_origin;
 	uint packed_ray_direction;
 	uint3 packed_dP;
 	uint instance_primitive_index;
 	uint3 packed_dD;
 	uint pad;
-	float2 bary_or_z;
+	float2 packed_bary_or_z;
 	uint2 packed_throughput;
 
+	inline uint4 rng(const uint2 pixel) { return rng_state; }
+	inline float2 bary_or_z() { return packed_bary_or_z; }
+#endif
+
 	inline uint instance_index() { return BF_GET(instance_primitive_index, 0, 16); }
 	inline uint primitive_index() { return BF_GET(instance_primitive_index, 16, 16); }
 	inline float3 throughput() { return float3(unpack_f16_2(packed_throughput[0]), f16tof32(packed_throughput[1])); }
@@ -33,10 +63,21 @@ struct PathBounceState {
 	}
 };
 inline void store_path_bounce_state(out PathBounceState p, const uint4 rng, const float3 throughput, const float eta_scale, const float2 bary_or_z, const RayDifferential ray, const uint instance_primitive_index) {
-	p.rng = rng;
+#if COMPACT_ENCODING
+	p.rng_state = rng.zw;
+	if (BF_GET(instance_primitive_index, 16, 16) == INVALID_PRIMITIVE)
+		p.packed_bary_or_z = asuint(bary_or_z.x);
+	else {
+		p.packed_bary_or_z = 0;
+		BF_SET_UNORM(p.packed_bary_or_z, saturate(bary_or_z.x), 0, 16);
+		BF_SET_UNORM(p.packed_bary_or_z, saturate(bary_or_z.y), 16, 16);
+	}
+#else
+	p.rng_state = rng;
+	p.packed_bary_or_z = bary_or_z;
+#endif
 	p.packed_throughput[0] = pack_f16_2(throughput.xy);
 	p.packed_throughput[1] = pack_f16_2(float2(throughput.z, eta_scale));
-	p.bary_or_z = bary_or_z;
 	p.instance_primitive_index = instance_primitive_index;
 	p.ray_origin = ray.origin;
 	p.packed_ray_direction = pack_normal_octahedron(ray.direction);
@@ -63,23 +104,58 @@ StructuredBuffer<uint> gLightInstances;
 StructuredBuffer<ViewData> gViews;
 StructuredBuffer<ViewData> gPrevViews;
 
-#include "../visibility_buffer.hlsli"
-
 RWTexture2D<float4> gRadiance;
 RWTexture2D<float4> gAlbedo;
 
+// ReSTIR DI reservoirs (see reservoir.hlsli). trace_visibility and spatial_reuse write gReservoirs from gInputReservoirs,
+// which hold the previous frame's final reservoirs and the previous spatial iteration's, respectively. The first bounce shades the final ones
+RWTexture2D<float4> gReservoirs;
+RWTexture2D<uint4> gReservoirRNG;
+Texture2D<float4> gInputReservoirs;
+Texture2D<uint4> gInputReservoirRNG;
+StructuredBuffer<uint> gInstanceIndexMap;
+#define RESERVOIR_SPATIAL_SAMPLES 5
+#define RESERVOIR_SPATIAL_RADIUS 30
+#define RESERVOIR_HISTORY_LIMIT 20 // reused reservoirs count as at most this many times the current reservoir's candidates
+
 StructuredBuffer<float> gDistributions;
 SamplerState gSampler;
 RWStructuredBuffer<PathBounceState> gPathStates;
 Texture2D<float4> gImages[gImageCount];
 
+// Two queues of path state indices, one per bounce parity. A bounce reads the paths that the previous bounce queued and queues the ones that survive it.
+// With gSortPaths, queued entries also hold the sort key of the path's next vertex, and a third queue holds the sorted state indices
+RWStructuredBuffer<uint> gPathQueue;
+// One header per bounce: the indirect dispatch args for the paths it queued (x,y,z), the number of queued paths, and the number of paths it traced
+RWByteAddressBuffer gPathQueueArgs;
+// Per bounce: the number of queued paths with each sort key, followed by the number of them sort_paths has placed
+RWByteAddressBuffer gPathBins;
+// Extra paths from adaptive_sampling.hlsl: the pixel index of each sample slot, its radiance, and the slots' dispatch args (x,y,z) followed by the number of allocated slots.
+// Their path states follow the pixels' states, so a path state index below w*h is a pixel index, and above it is w*h + the slot
+StructuredBuffer<uint> gAdaptiveSamples;
+RWStructuredBuffer<float4> gSampleRadiance;
+ByteAddressBuffer gAdaptiveArgs;
+#define PATH_QUEUE_HEADER_SIZE 32
+#define PATH_QUEUE_GROUP_SIZE 64
+#define PATH_SORT_BIN_COUNT (1 << PATH_SORT_KEY_BITS)
+#define PATH_SORT_BINS_SIZE (PATH_SORT_BIN_COUNT*2*4)
+// path_sort_key packs the BSDF type in 3 bits above 3 bits of material hash
+static_assert(BSDFType::eBSDFTypeCount <= 8, "path_sort_key has 3 bits for the BSDF type");
+static_assert(PATH_SORT_KEY_BITS == 6, "path_sort_key is 6 bits");
+
 [[vk::push_constant]] const struct {
 	uint gRandomSeed;
 	uint gLightCount;
+	uint gLightDistribution; // address of the light alias tables in gDistributions, see light.hlsli
 	uint gViewCount;
 	uint gEnvironmentMaterialAddress;
 	float gEnvironmentSampleProbability;	
 	uint gSamplingFlags;
+	uint gBounce;
+	uint gSortPaths;
+	uint gReservoirSamples; // initial light candidates per pixel, 0 disables ReSTIR
+	uint gTemporalReuse;
+	uint gSpatialIteration;
 } gPushConstants;
 
 static const bool gSampleBG = (gPushConstants.gSamplingFlags & SAMPLE_FLAG_BG_IS) && gPushConstants.gEnvironmentSampleProbability > 0;
@@ -297,6 +373,122 @@ inline void intersect(inout ray_query_t rayQuery, const RayDifferential ray, out
 
 #define GROUP_SIZE 8
 
+#include "../light.hlsli"
+
+inline bool light_sample_visible(const PathVertex vertex, const RayDifferential ray_in, const LightSampleRecord light_sample, inout ray_query_t rayQuery) {
+	RayDifferential shadowRay;
+	shadowRay.origin = ray_offset(vertex.g.position, dot(light_sample.to_light, vertex.g.geometry_normal) < 0 ? -vertex.g.geometry_normal : vertex.g.geometry_normal);
+	shadowRay.direction = light_sample.to_light;
+	shadowRay.t_min = 0;
+	shadowRay.t_max = light_sample.dist*.999;
+	shadowRay.dP = vertex.g.d_position;
+	shadowRay.dD = ray_in.dD;
+	return !do_ray_query(rayQuery, shadowRay);
+}
+
+inline float3 sample_direct_light(const PathVertex vertex, const RayDifferential ray_in, inout ray_query_t rayQuery, inout rng_t rng, const bool apply_mis) {
+	if (!(gSampleLights || gSampleBG)) return 0;
+
+	const LightSampleRecord light_sample = sample_light_or_environment(rng, vertex.g, ray_in);
+	if (light_sample.pdf.pdf <= 0) return 0;
+
+	const BSDFEvalRecord f = vertex.eval_material(-ray_in.direction, light_sample.to_light);
+	if (f.pdfW <= 0) return 0;
+
+	if (!light_sample_visible(vertex, ray_in, light_sample, rayQuery))
+		return 0;
+
+	float3 C1 = f.f * light_sample.radiance;
+	if (light_sample.pdf.is_solid_angle)
+		C1 /= light_sample.pdf.pdf;
+	else
+		C1 *= light_sample.pdf.G / light_sample.pdf.pdf;
+
+	const float w = apply_mis ? mis_heuristic(light_sample.pdf.solid_angle(), f.pdfW) : 1;
+	return C1 * w;
+}
+
+// ReSTIR's target function: the luminance of the unshadowed contribution of the light sample that rng state y draws at vertex,
+// in the measure of the sample's pdf. contribution times a reservoir's W estimates the direct light
+inline float light_sample_target_pdf(const PathVertex vertex, const RayDifferential ray_in, const uint4 y, out LightSampleRecord light_sample, out float3 contribution) {
+	rng_t rng = { y };
+	light_sample = sample_light_or_environment(rng, vertex.g, ray_in);
+	contribution = 0;
+	if (light_sample.pdf.pdf <= 0) return 0;
+	const BSDFEvalRecord f = vertex.eval_material(-ray_in.direction, light_sample.to_light);
+	if (f.pdfW <= 0) return 0;
+	contribution = f.f * light_sample.radiance;
+	if (!light_sample.pdf.is_solid_angle)
+		contribution *= light_sample.pdf.G;
+	return luminance(contribution);
+}
+
+// Resampled importance sampling of gReservoirSamples light candidates. Each candidate's rng state is a hash of rng's, so that it can be replayed
+inline Reservoir sample_reservoir(const PathVertex vertex, const RayDifferential ray_in, inout rng_t rng) {
+	Reservoir r;
+	r.init();
+	for (uint i = 0; i < gPushConstants.gReservoirSamples; i++) {
+		const uint4 x = pcg4d(uint4(rng.v.xyz, rng.v.w + i));
+		LightSampleRecord light_sample;
+		float3 contribution;
+		const float p_hat = light_sample_target_pdf(vertex, ray_in, x, light_sample, contribution);
+		r.update(rng.next(), x, p_hat > 0 ? p_hat / light_sample.pdf.pdf : 0, p_hat);
+	}
+	r.finalize();
+	return r;
+}
+
+// The direct light of the pixel's final reservoir, shadowed. Replaces light sampling at the primary vertex
+inline float3 shade_reservoir(const PathVertex vertex, const RayDifferential ray_in, inout ray_query_t rayQuery, const uint2 pixel) {
+	Reservoir r;
+	r.load(gReservoirRNG[pixel], gReservoirs[pixel]);
+	if (r.W <= 0) return 0;
+	LightSampleRecord light_sample;
+	float3 contribution;
+	if (light_sample_target_pdf(vertex, ray_in, r.y, light_sample, contribution) <= 0) return 0;
+	if (!light_sample_visible(vertex, ray_in, light_sample, rayQuery)) return 0;
+	return contribution * r.W;
+}
+
+// With skip_light_emission, emission that light sampling can reach is left to a reservoir that already accounts for it
+inline float3 sample_bsdf(inout PathVertex vertex, inout RayDifferential ray_in, inout ray_query_t rayQuery, inout rng_t rng, inout float3 throughput, inout float eta_scale, const bool apply_mis, const bool skip_light_emission = false) {
+	const BSDFSampleRecord bsdf_sample = vertex.sample_material(float3(rng.next(), rng.next(), rng.next()), -ray_in.direction);
+	if (bsdf_sample.eval.pdfW <= 0) {
+		throughput = 0;
+		return 0;
+	}
+	throughput *= bsdf_sample.eval.f / bsdf_sample.eval.pdfW;
+
+	// modify eta_scale, trace bsdf ray
+	RayDifferential bsdf_ray;
+	bsdf_ray.origin = ray_offset(vertex.g.position, bsdf_sample.eta == 0 ? vertex.g.geometry_normal : -vertex.g.geometry_normal);
+	bsdf_ray.direction = bsdf_sample.dir_out;
+	bsdf_ray.t_min = 0;
+	bsdf_ray.t_max = 1.#INF;
+	bsdf_ray.dP = vertex.g.d_position;
+	if (bsdf_sample.eta == 0) {
+		const float3 H = normalize(-ray_in.direction + bsdf_sample.dir_out);
+		bsdf_ray.dD = reflect(ray_in.dD, H);
+	} else {
+		float3 H = normalize(-ray_in.direction + bsdf_sample.dir_out * bsdf_sample.eta);
+		if (dot(H, ray_in.direction) > 0) H = -H;
+		bsdf_ray.dD = refract(ray_in.dD, H, bsdf_sample.eta);
+		eta_scale /= bsdf_sample.eta*bsdf_sample.eta;
+	}
+	ray_in = bsdf_ray;
+
+	intersect(rayQuery, ray_in, vertex);
+
+	const float3 L = vertex.eval_material_emission();
+	if (any(L > 0)) {
+		const PDFMeasure pdf = light_sample_pdf(vertex, ray_in, rayQuery.CommittedRayT());
+		if (pdf.pdf > 0 && skip_light_emission) return 0;
+		const float w = (pdf.pdf > 0 && apply_mis) ? mis_heuristic(bsdf_sample.eval.pdfW, pdf.solid_angle()) : 1;
+		return throughput * L * w;
+	}
+	return 0;
+}
+
 [numthreads(GROUP_SIZE,GROUP_SIZE,1)]
 void trace_visibility(uint3 index : SV_DispatchThreadID) {
 	const uint viewIndex = get_view_index(index.xy, gViews, gPushConstants.gViewCount);
@@ -334,6 +526,41 @@ void trace_visibility(uint3 index : SV_DispatchThreadID) {
 		prev_uv = (prevScreenPos.xy / prevScreenPos.w)*.5 + .5;
 	}
 
+	// ReSTIR DI: initial candidates, merged with the previous frame's reservoir at the reprojected pixel if it sees the same surface
+	Reservoir r;
+	r.init();
+	if (gPushConstants.gReservoirSamples > 0 && primary_vertex.instance_index() != INVALID_INSTANCE && (gSampleLights || gSampleBG)) {
+		rng_t reservoir_rng = { index.xy, pcg4d(uint4(index.xy, gPushConstants.gRandomSeed, 1)).x, 0 };
+		r = sample_reservoir(primary_vertex, view_ray, reservoir_rng);
+		if (gPushConstants.gTemporalReuse) {
+			const ViewData view = gPrevViews[viewIndex];
+			const int2 p = view.image_min + prev_uv*float2(view.image_max - view.image_min);
+			if (test_inside_screen(p, view)) {
+				const VisibilityInfo vis_prev = load_prev_visibility(p, gInstanceIndexMap);
+				if (vis_prev.instance_index() == primary_vertex.instance_index() &&
+					test_reprojected_depth(prev_z, vis_prev.z(), 2, vis_prev.dz_dx(), vis_prev.dz_dy()) &&
+					test_reprojected_normal(primary_vertex.g.shading_normal, vis_prev.normal())) {
+					Reservoir q;
+					q.load(gInputReservoirRNG[p], gInputReservoirs[p]);
+					q.M = min(q.M, RESERVOIR_HISTORY_LIMIT*max(r.M, 1));
+					LightSampleRecord light_sample;
+					float3 contribution;
+					Reservoir s;
+					s.init();
+					s.merge(reservoir_rng.next(), r, r.p_hat_y);
+					s.merge(reservoir_rng.next(), q, light_sample_target_pdf(primary_vertex, view_ray, q.y, light_sample, contribution));
+					s.finalize();
+					r = s;
+				}
+			}
+		}
+	}
+	uint4 reservoir_rng_state;
+	float4 reservoir_data;
+	r.store(reservoir_rng_state, reservoir_data);
+	gReservoirRNG[index.xy] = reservoir_rng_state;
+	gReservoirs[index.xy] = reservoir_data;
+
 	store_visibility(index.xy,
 									 rng.v,
 									 primary_vertex.instance_index(),
@@ -356,71 +583,97 @@ void trace_visibility(uint3 index : SV_DispatchThreadID) {
 		primary_vertex.instance_primitive_index);
 }
 
-#include "../light.hlsli"
+// Primary hits of the extra paths that adaptive sampling allocated. Like trace_visibility, but writes only the path states, after the pixels' states
+[numthreads(PATH_QUEUE_GROUP_SIZE,1,1)]
+void trace_adaptive_samples(uint3 index : SV_DispatchThreadID) {
+	uint slotCount, stride;
+	gAdaptiveSamples.GetDimensions(slotCount, stride);
+	if (index.x >= min(gAdaptiveArgs.Load(12), slotCount)) return;
 
-inline float3 sample_direct_light(const PathVertex vertex, const RayDifferential ray_in, inout ray_query_t rayQuery, inout rng_t rng, const bool apply_mis) {
-	if (!(gSampleLights || gSampleBG)) return 0;
-
-	const LightSampleRecord light_sample = sample_light_or_environment(rng, vertex.g, ray_in);
-	if (light_sample.pdf.pdf <= 0) return 0;
+	uint w,h;
+	gRadiance.GetDimensions(w,h);
+	const uint pixelIndex = gAdaptiveSamples[index.x];
+	const uint2 pixel = uint2(pixelIndex % w, pixelIndex / w);
+	const uint viewIndex = get_view_index(pixel, gViews, gPushConstants.gViewCount);
 
-	const BSDFEvalRecord f = vertex.eval_material(-ray_in.direction, light_sample.to_light);
-	if (f.pdfW <= 0) return 0;
+	// the pixel's samples get consecutive slots, so the slot decorrelates them from each other and from the pixel's own path
+	rng_t rng = { pixel, pcg4d(uint4(pixel, gPushConstants.gRandomSeed, index.x + 1)).x, 0 };
 
-	RayDifferential shadowRay;
-	shadowRay.origin = ray_offset(vertex.g.position, dot(light_sample.to_light, vertex.g.geometry_normal) < 0 ? -vertex.g.geometry_normal : vertex.g.geometry_normal);
-	shadowRay.direction = light_sample.to_light;
-	shadowRay.t_min = 0;
-	shadowRay.t_max = light_sample.dist*.999;
-	shadowRay.dP = vertex.g.d_position;
-	shadowRay.dD = ray_in.dD;
-	if (do_ray_query(rayQuery, shadowRay))
-		return 0;
+	ray_query_t rayQuery;
+	PathVertex primary_vertex;
+	const RayDifferential view_ray = gViews[viewIndex].create_ray((pixel + 0.5 - gViews[viewIndex].image_min)/float2(gViews[viewIndex].image_max - gViews[viewIndex].image_min));
+	intersect(rayQuery, view_ray, primary_vertex);
 
-	float3 C1 = f.f * light_sample.radiance;
-	if (light_sample.pdf.is_solid_angle)
-		C1 /= light_sample.pdf.pdf;
-	else
-		C1 *= light_sample.pdf.G / light_sample.pdf.pdf;
+	gSampleRadiance[index.x] = float4(primary_vertex.eval_material_emission(), 1);
 
-	const float w = apply_mis ? mis_heuristic(light_sample.pdf.solid_angle(), f.pdfW) : 1;
-	return C1 * w;
-}
-inline float3 sample_bsdf(inout PathVertex vertex, inout RayDifferential ray_in, inout ray_query_t rayQuery, inout rng_t rng, inout float3 throughput, inout float eta_scale, const bool apply_mis) {
-	const BSDFSampleRecord bsdf_sample = vertex.sample_material(float3(rng.next(), rng.next(), rng.next()), -ray_in.direction);
-	if (bsdf_sample.eval.pdfW <= 0) {
-		throughput = 0;
-		return 0;
+	float2 bary_or_z = 0;
+	if (primary_vertex.instance_index() != INVALID_INSTANCE) {
+		if (rayQuery.CommittedStatus() == COMMITTED_TRIANGLE_HIT)
+			bary_or_z = rayQuery.CommittedTriangleBarycentrics();
+		else
+			bary_or_z = rayQuery.CommittedRayT();
 	}
-	throughput *= bsdf_sample.eval.f / bsdf_sample.eval.pdfW;
 
-	// modify eta_scale, trace bsdf ray
-	RayDifferential bsdf_ray;
-	bsdf_ray.origin = ray_offset(vertex.g.position, bsdf_sample.eta == 0 ? vertex.g.geometry_normal : -vertex.g.geometry_normal);
-	bsdf_ray.direction = bsdf_sample.dir_out;
-	bsdf_ray.t_min = 0;
-	bsdf_ray.t_max = 1.#INF;
-	bsdf_ray.dP = vertex.g.d_position;
-	if (bsdf_sample.eta == 0) {
-		const float3 H = normalize(-ray_in.direction + bsdf_sample.dir_out);
-		bsdf_ray.dD = reflect(ray_in.dD, H);
-	} else {
-		float3 H = normalize(-ray_in.direction + bsdf_sample.dir_out * bsdf_sample.eta);
-		if (dot(H, ray_in.direction) > 0) H = -H;
-		bsdf_ray.dD = refract(ray_in.dD, H, bsdf_sample.eta);
-		eta_scale /= bsdf_sample.eta*bsdf_sample.eta;
-	}
-	ray_in = bsdf_ray;
+	store_path_bounce_state(gPathStates[w*h + index.x],
+		rng.v,
+		primary_vertex.instance_index() == INVALID_INSTANCE ? 0 : 1, // throughput
+		1, // eta_scale
+		bary_or_z,
+		view_ray,
+		primary_vertex.instance_primitive_index);
+}
 
-	intersect(rayQuery, ray_in, vertex);
+// One ReSTIR spatial reuse iteration: merges the reservoirs of random neighbours that see a surface of similar depth and normal
+[numthreads(GROUP_SIZE,GROUP_SIZE,1)]
+void spatial_reuse(uint3 index : SV_DispatchThreadID) {
+	const uint viewIndex = get_view_index(index.xy, gViews, gPushConstants.gViewCount);
+	if (viewIndex == -1) return;
 
-	const float3 L = vertex.eval_material_emission();
-	if (any(L > 0)) {
-		const PDFMeasure pdf = light_sample_pdf(vertex, ray_in, rayQuery.CommittedRayT());
-		const float w = (pdf.pdf > 0 && apply_mis) ? mis_heuristic(bsdf_sample.eval.pdfW, pdf.solid_angle()) : 1;
-		return throughput * L * w;
+	Reservoir r;
+	r.load(gInputReservoirRNG[index.xy], gInputReservoirs[index.xy]);
+
+	const VisibilityInfo v = load_visibility(index.xy);
+	if (v.instance_index() != INVALID_INSTANCE && r.M > 0) {
+		// the primary vertex, from the path state that trace_visibility stored
+		uint w,h;
+		gVisibility[0].GetDimensions(w,h);
+		PathBounceState state = gPathStates[index.y*w + index.x];
+		const RayDifferential ray = state.ray();
+		PathVertex vertex;
+		make_vertex(state.instance_primitive_index, state.bary_or_z(), ray, vertex);
+
+		rng_t rng = { index.xy, pcg4d(uint4(index.xy, gPushConstants.gRandomSeed, gPushConstants.gSpatialIteration + 2)).x, 0 };
+		const ViewData view = gViews[viewIndex];
+
+		Reservoir s;
+		s.init();
+		s.merge(rng.next(), r, r.p_hat_y);
+		for (uint i = 0; i < RESERVOIR_SPATIAL_SAMPLES; i++) {
+			const int2 o = RESERVOIR_SPATIAL_RADIUS*(2*float2(rng.next(), rng.next()) - 1);
+			if (all(o == 0)) continue;
+			const int2 p = int2(index.xy) + o;
+			if (!test_inside_screen(p, view)) continue;
+			const VisibilityInfo v_p = load_visibility(p);
+			if (v_p.instance_index() == INVALID_INSTANCE) continue;
+			if (!test_reprojected_depth(v.z(), v_p.z(), o, v.dz_dx(), v.dz_dy())) continue;
+			if (!test_reprojected_normal(v.normal(), v_p.normal())) continue;
+
+			Reservoir q;
+			q.load(gInputReservoirRNG[p], gInputReservoirs[p]);
+			q.M = min(q.M, RESERVOIR_HISTORY_LIMIT*r.M);
+			LightSampleRecord light_sample;
+			float3 contribution;
+			s.merge(rng.next(), q, light_sample_target_pdf(vertex, ray, q.y, light_sample, contribution));
+		}
+		s.finalize();
+		r = s;
 	}
-	return 0;
+
+	uint4 reservoir_rng_state;
+	float4 reservoir_data;
+	r.store(reservoir_rng_state, reservoir_data);
+	gReservoirRNG[index.xy] = reservoir_rng_state;
+	gReservoirs[index.xy] = reservoir_data;
 }
 
 [numthreads(GROUP_SIZE,GROUP_SIZE,1)]
@@ -437,39 +690,82 @@ void trace_direct_light(uint3 index : SV_DispatchThreadID) {
 	if (all(throughput <= 1e-6)) return;
 
 	PathVertex vertex;
-	make_vertex(state.instance_primitive_index, state.bary_or_z, state.ray(), vertex);
-	rng_t rng = { state.rng };
+	make_vertex(state.instance_primitive_index, state.bary_or_z(), state.ray(), vertex);
+	rng_t rng = { state.rng(index.xy) };
 
 	ray_query_t rayQuery;
 
 	gRadiance[index.xy].rgb += throughput * sample_direct_light(vertex, state.ray(), rayQuery, rng, true);
 }
 
-[numthreads(GROUP_SIZE,GROUP_SIZE,1)]
-void trace_path_bounce(uint3 index : SV_DispatchThreadID) {
-	const uint viewIndex = get_view_index(index.xy, gViews, gPushConstants.gViewCount);
-	if (viewIndex == -1) return;
-	
+// One atomic per wave instead of one per path
+inline void count_traced_paths() {
+	const uint n = WaveActiveCountBits(true);
+	if (WaveIsFirstLane())
+		gPathQueueArgs.InterlockedAdd(gPushConstants.gBounce*PATH_QUEUE_HEADER_SIZE + 16, n);
+}
+// BSDF type in the high bits, so that sorted paths are grouped by BSDF first, then by (a hash of) their material
+inline uint path_sort_key(const uint materialAddress) {
+	return ((gMaterialData.Load(materialAddress) & 7) << 3) | ((materialAddress >> 4) & 7);
+}
+
+inline void queue_path(const uint stateIndex, const bool alive, const uint sortKey, const uint queueSize) {
+	const uint n = WaveActiveCountBits(alive);
+	if (n == 0) return;
+	const uint header = gPushConstants.gBounce*PATH_QUEUE_HEADER_SIZE;
+	uint base;
+	if (WaveIsFirstLane()) {
+		gPathQueueArgs.InterlockedAdd(header + 12, n, base);
+		uint tmp;
+		gPathQueueArgs.InterlockedMax(header, (base + n + PATH_QUEUE_GROUP_SIZE-1) / PATH_QUEUE_GROUP_SIZE, tmp);
+	}
+	base = WaveReadLaneFirst(base);
+	if (alive) {
+		gPathQueue[(gPushConstants.gBounce%2)*queueSize + base + WavePrefixCountBits(alive)] = stateIndex | (sortKey << PATH_SORT_KEY_SHIFT);
+		if (gPushConstants.gSortPaths)
+			gPathBins.InterlockedAdd(gPushConstants.gBounce*PATH_SORT_BINS_SIZE + sortKey*4, 1);
+	}
+}
+
+// Radiance of the pixel's own path, or of an adaptive sample's path
+inline void add_path_radiance(const uint stateIndex, const uint2 pixel, const uint pixelCount, const float3 radiance) {
+	if (stateIndex < pixelCount)
+		gRadiance[pixel].rgb += radiance;
+	else
+		gSampleRadiance[stateIndex - pixelCount].rgb += radiance;
+}
+
+// Returns false once the path has terminated. sortKey is the path_sort_key of the path's next vertex
+inline bool path_bounce(const uint stateIndex, const uint2 pixel, out uint sortKey) {
+	sortKey = 0;
+
 	uint w,h;
 	gRadiance.GetDimensions(w,h);
-	w = index.y*w + index.x;
-	#define state gPathStates[w]
+	const uint pixelCount = w*h;
+	#define state gPathStates[stateIndex]
 
 	float3 throughput = state.throughput();
-	if (all(throughput <= 1e-6)) return;
+	if (all(throughput <= 1e-6)) return false;
+
+	count_traced_paths();
 
 	PathVertex vertex;
-	make_vertex(state.instance_primitive_index, state.bary_or_z, state.ray(), vertex);
-	rng_t rng = { state.rng };
+	make_vertex(state.instance_primitive_index, state.bary_or_z(), state.ray(), vertex);
+	rng_t rng = { state.rng(pixel) };
 
 	RayDifferential ray_in = state.ray();
 
 	ray_query_t rayQuery;
 
-	gRadiance[index.xy].rgb += throughput * sample_direct_light(vertex, ray_in, rayQuery, rng, true);
+	// the pixel's own path takes its primary vertex's direct light from the ReSTIR reservoir, which light sampling and MIS would count again
+	const bool reservoir = gPushConstants.gBounce == 0 && gPushConstants.gReservoirSamples > 0 && stateIndex < pixelCount;
+	if (reservoir)
+		add_path_radiance(stateIndex, pixel, pixelCount, throughput * shade_reservoir(vertex, ray_in, rayQuery, pixel));
+	else
+		add_path_radiance(stateIndex, pixel, pixelCount, throughput * sample_direct_light(vertex, ray_in, rayQuery, rng, true));
 
 	float eta_scale = state.eta_scale();
-	gRadiance[index.xy].rgb += sample_bsdf(vertex, ray_in, rayQuery, rng, throughput, eta_scale, true);
+	add_path_radiance(stateIndex, pixel, pixelCount, sample_bsdf(vertex, ray_in, rayQuery, rng, throughput, eta_scale, !reservoir, reservoir));
 
 	float2 bary_or_z = 0;
 	if (vertex.instance_index() == INVALID_INSTANCE) {
@@ -492,4 +788,75 @@ void trace_path_bounce(uint3 index : SV_DispatchThreadID) {
 	store_path_bounce_state(state, rng.v, throughput, eta_scale, bary_or_z, ray_in, vertex.instance_primitive_index);
 
 	#undef state
+
+	if (all(throughput <= 1e-6)) return false;
+	if (gPushConstants.gSortPaths)
+		sortKey = path_sort_key(vertex.material_address);
+	return true;
+}
+
+[numthreads(GROUP_SIZE,GROUP_SIZE,1)]
+void trace_path_bounce(uint3 index : SV_DispatchThreadID) {
+	const uint viewIndex = get_view_index(index.xy, gViews, gPushConstants.gViewCount);
+	if (viewIndex == -1) return;
+	uint w,h;
+	gRadiance.GetDimensions(w,h);
+	uint sortKey;
+	path_bounce(index.y*w + index.x, index.xy, sortKey);
+}
+
+// Wavefront bounce: the first bounce runs over every pixel, later bounces run only over the paths that the previous bounce queued,
+// with dispatch args that the previous bounce wrote. Terminated paths stop occupying threads, and the surviving paths are packed into full waves
+[numthreads(PATH_QUEUE_GROUP_SIZE,1,1)]
+void trace_path_bounce_queued(uint3 index : SV_DispatchThreadID) {
+	uint w,h;
+	gRadiance.GetDimensions(w,h);
+	uint queueSize, stride;
+	gPathStates.GetDimensions(queueSize, stride);
+	uint stateIndex;
+	uint2 pixel;
+	if (gPushConstants.gBounce == 0) {
+		// every pixel, followed by the adaptive samples' slots
+		uint slotCount;
+		gAdaptiveSamples.GetDimensions(slotCount, stride);
+		if (index.x >= w*h + min(gAdaptiveArgs.Load(12), slotCount)) return;
+		stateIndex = index.x;
+		const uint pixelIndex = stateIndex < w*h ? stateIndex : gAdaptiveSamples[stateIndex - w*h];
+		pixel = uint2(pixelIndex % w, pixelIndex / w);
+		if (get_view_index(pixel, gViews, gPushConstants.gViewCount) == -1) return;
+	} else {
+		if (index.x >= gPathQueueArgs.Load((gPushConstants.gBounce-1)*PATH_QUEUE_HEADER_SIZE + 12)) return;
+		stateIndex = gPathQueue[(gPushConstants.gSortPaths ? 2 : (gPushConstants.gBounce-1)%2)*queueSize + index.x] & PATH_QUEUE_PIXEL_MASK;
+		const uint pixelIndex = stateIndex < w*h ? stateIndex : gAdaptiveSamples[stateIndex - w*h];
+		pixel = uint2(pixelIndex % w, pixelIndex / w);
+	}
+	uint sortKey;
+	const bool alive = path_bounce(stateIndex, pixel, sortKey);
+	queue_path(stateIndex, alive, sortKey, queueSize);
+}
+
+// One counting sort pass over the paths that bounce gBounce queued, by the keys in their entries. The next bounce reads the sorted queue,
+// so neighbouring threads shade the same BSDF, and mostly the same material, instead of diverging in the BSDF switch
+groupshared uint gBinOffsets[PATH_SORT_BIN_COUNT];
+[numthreads(PATH_QUEUE_GROUP_SIZE,1,1)]
+void sort_paths(uint3 index : SV_DispatchThreadID, uint groupIndex : SV_GroupIndex) {
+	const uint bins = gPushConstants.gBounce*PATH_SORT_BINS_SIZE;
+	if (groupIndex == 0) {
+		uint offset = 0;
+		for (uint i = 0; i < PATH_SORT_BIN_COUNT; i++) {
+			gBinOffsets[i] = offset;
+			offset += gPathBins.Load(bins + i*4);
+		}
+	}
+	GroupMemoryBarrierWithGroupSync();
+
+	if (index.x >= gPathQueueArgs.Load(gPushConstants.gBounce*PATH_QUEUE_HEADER_SIZE + 12)) return;
+
+	uint queueSize, stride;
+	gPathStates.GetDimensions(queueSize, stride);
+	const uint entry = gPathQueue[(gPushConstants.gBounce%2)*queueSize + index.x];
+	const uint key = entry >> PATH_SORT_KEY_SHIFT;
+	uint slot;
+	gPathBins.InterlockedAdd(bins + (PATH_SORT_BIN_COUNT + key)*4, 1, slot);
+	gPathQueue[2*queueSize + gBinOffsets[key] + slot] = entry & PATH_QUEUE_PIXEL_MASK;
 }
@@ -41,7 +41,7 @@ Texture2D<float4> gAlbedo;
 
 Texture2D<float4> gDebug1;
 Texture2D<float2> gDebug2;
-Texture2D<uint4> gDebug3;
+#include "../visibility_buffer.hlsli"
 
 [[vk::push_constant]] const struct {
 	float gExposure;
@@ -89,21 +89,24 @@ void main(uint3 index : SV_DispatchThreadID) {
 
 	if (gGammaCorrection) radiance = rgb_to_srgb(radiance);
 	
+	// the visibility views decode through VisibilityInfo, which hides the COMPACT_ENCODING layout
 	switch (gDebugMode) {
 	case DebugMode::eZ:
-		radiance = viridis_quintic(1 - exp(-0.1*asfloat(f16tof32(gDebug3[index.xy].x))*gPushConstants.gExposure));
+		radiance = viridis_quintic(1 - exp(-0.1*load_visibility(index.xy).z()*gPushConstants.gExposure));
 		break;
-	case DebugMode::eDz:
-		radiance = viridis_quintic(saturate(length(unpack_f16_2(gDebug3[index.xy].y)))*gPushConstants.gExposure);
+	case DebugMode::eDz: {
+		VisibilityInfo v = load_visibility(index.xy);
+		radiance = viridis_quintic(saturate(length(float2(v.dz_dx(), v.dz_dy()))*gPushConstants.gExposure));
 		break;
+	}
 	case DebugMode::eNormals:
-		radiance = unpack_normal_octahedron(gDebug3[index.xy].w)*.5 + .5;
+		radiance = load_visibility(index.xy).normal()*.5 + .5;
 		break;
 	case DebugMode::eAlbedo:
 		radiance = gAlbedo[index.xy].rgb;
 		break;
 	case DebugMode::ePrevUV:
-		radiance = float3(asfloat(gDebug3[index.xy].zw), 0);
+		radiance = float3(load_visibility(index.xy).prev_uv(), 0);
 		break;
 	case DebugMode::eVariance:
 		radiance = viridis_quintic(saturate(gInput[index.xy].a*gPushConstants.gExposure));
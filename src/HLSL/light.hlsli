@@ -15,6 +15,27 @@ struct LightSampleRecord {
 	inline uint primitive_index() { return BF_GET(instance_primitive_index, 16, 16); }
 };
 
+// Light selection data in gDistributions, at gLightDistribution:
+//   gLightCount light alias table entries, 2 floats each: probability, asfloat(alias)
+//   per instance, 2 floats: the probability of selecting the instance, asfloat(address of its triangle alias table) or ~0 for uniform triangle selection
+// A triangle alias table has 3 floats per triangle: probability, asfloat(alias), the probability of selecting the triangle
+#define LIGHT_ALIAS_STRIDE 2
+#define LIGHT_INSTANCE_STRIDE 2
+#define TRIANGLE_ALIAS_STRIDE 3
+
+// Samples an alias table of count entries, stride floats apart, with a single random number
+inline uint sample_alias_table(const uint address, const uint count, const uint stride, const float u) {
+	const float x = u * count;
+	const uint i = min(uint(x), count - 1);
+	return (x - i) < gDistributions[address + stride*i] ? i : asuint(gDistributions[address + stride*i + 1]);
+}
+inline float light_instance_pmf(const uint instance_index) {
+	return gDistributions[gPushConstants.gLightDistribution + LIGHT_ALIAS_STRIDE*gPushConstants.gLightCount + LIGHT_INSTANCE_STRIDE*instance_index];
+}
+inline uint light_triangle_table(const uint instance_index) {
+	return asuint(gDistributions[gPushConstants.gLightDistribution + LIGHT_ALIAS_STRIDE*gPushConstants.gLightCount + LIGHT_INSTANCE_STRIDE*instance_index + 1]);
+}
+
 inline LightSampleRecord sample_light_or_environment(inout rng_t rng, const PathVertexGeometry v, const RayDifferential ray) {
 	LightSampleRecord ls;
 	if (gSampleBG && (!gSampleLights || rng.next() <= gPushConstants.gEnvironmentSampleProbability)) {
@@ -28,11 +49,12 @@ inline LightSampleRecord sample_light_or_environment(inout rng_t rng, const Path
 		ls.dist = 1.#INF;
 		ls.pdf = make_solid_angle_pdf(s.eval.pdfW, 1, 1);
 	} else if (gSampleLights) {
-		// sample a light
-		BF_SET(ls.instance_primitive_index, min(uint(rng.next() * gPushConstants.gLightCount), gPushConstants.gLightCount-1), 0, 16);
+		// sample a light in proportion to its power
+		BF_SET(ls.instance_primitive_index, sample_alias_table(gPushConstants.gLightDistribution, gPushConstants.gLightCount, LIGHT_ALIAS_STRIDE, rng.next()), 0, 16);
 		
 		PathVertexGeometry g;
-		const InstanceData instance = gInstances[gLightInstances[ls.instance_index()]];
+		const uint instance_index = gLightInstances[ls.instance_index()];
+		const InstanceData instance = gInstances[instance_index];
 		ls.material_address = instance.material_address();
 		switch (instance.type()) {
 			case INSTANCE_TYPE_SPHERE: {
@@ -80,7 +102,10 @@ inline LightSampleRecord sample_light_or_environment(inout rng_t rng, const Path
 				break;
 			}
 			case INSTANCE_TYPE_TRIANGLES: {
-				const uint prim_index = min(rng.next()*instance.prim_count(), instance.prim_count() - 1);
+				// sample a triangle in proportion to its area, or uniformly until the mesh's table is built
+				const uint table = light_triangle_table(instance_index);
+				const uint prim_index = table == ~0u ? min(rng.next()*instance.prim_count(), instance.prim_count() - 1) : sample_alias_table(table, instance.prim_count(), TRIANGLE_ALIAS_STRIDE, rng.next());
+				const float prim_pmf = table == ~0u ? 1 / (float)instance.prim_count() : gDistributions[table + TRIANGLE_ALIAS_STRIDE*prim_index + 2];
 				BF_SET(ls.instance_primitive_index, prim_index, 16, 16);
 				const float a = sqrt(rng.next());
 				const float2 bary = float2(1 - a, a*rng.next());
@@ -91,12 +116,12 @@ inline LightSampleRecord sample_light_or_environment(inout rng_t rng, const Path
 				ls.dist = length(ls.to_light);
 				ls.to_light /= ls.dist;
 
-				ls.pdf = make_area_pdf(1 / (g.shape_area * (float)instance.prim_count()), abs(dot(ls.to_light, g.geometry_normal)), ls.dist);
+				ls.pdf = make_area_pdf(prim_pmf / g.shape_area, abs(dot(ls.to_light, g.geometry_normal)), ls.dist);
 				break;
 			}
 		}
 		ls.radiance = eval_material_emission(gMaterialData, ls.material_address, g);
-		ls.pdf.pdf /= (float)gPushConstants.gLightCount;
+		ls.pdf.pdf *= light_instance_pmf(instance_index);
 	}
 	if (gSampleBG && gSampleLights)
 		ls.pdf.pdf *= gSampleBG ? gPushConstants.gEnvironmentSampleProbability : 1 - gPushConstants.gEnvironmentSampleProbability;
@@ -123,11 +148,13 @@ inline PDFMeasure light_sample_pdf(const PathVertex light_vertex, const RayDiffe
 			}
 			
 			case INSTANCE_TYPE_TRIANGLES: {
-				pdf = make_area_pdf(1 / ((float)light_vertex.g.shape_area * instance.prim_count()), abs(dot(ray.direction, light_vertex.g.geometry_normal)), dist);
+				const uint table = light_triangle_table(light_vertex.instance_index());
+				const float prim_pmf = table == ~0u ? 1 / (float)instance.prim_count() : gDistributions[table + TRIANGLE_ALIAS_STRIDE*light_vertex.primitive_index() + 2];
+				pdf = make_area_pdf(prim_pmf / (float)light_vertex.g.shape_area, abs(dot(ray.direction, light_vertex.g.geometry_normal)), dist);
 				break;
 			}
 		}
-		pdf.pdf /= (float)gPushConstants.gLightCount;
+		pdf.pdf *= light_instance_pmf(light_vertex.instance_index());
 		if (gSampleBG) pdf.pdf *= 1 - gPushConstants.gEnvironmentSampleProbability;
 		return pdf;
 	}
@@ -71,6 +71,12 @@ struct PackedVertexData {
 	float4 tangent;
 };
 
+// joints and weights of a skinned vertex, see kernel/anim.hlsl
+struct VertexWeight {
+	float4 weights;
+	uint4 indices;
+};
+
 #ifdef __HLSL_VERSION
 #include "ray_differential.hlsli"
 #endif
@@ -1,17 +1,95 @@
 #ifndef VISBUFFER_H
 #define VISBUFFER_H
 
+// Compact encodings for the visibility buffer and the path tracer's PathBounceState, to cut per-pixel memory and bandwidth.
+// RayTraceScene allocates its images and buffers from the defines below. COMPACT_ENCODING is set for both the C++ code and the shaders by
+// the STRATUM_COMPACT_ENCODING CMake option, and the shaders are also compiled with the other setting so that neither layout goes stale.
+// Compact visibility stores barycentrics and the previous frame's uv as unorm16 and only the RNG seed (the pixel is implied), 32 instead of 48 bytes.
+// The compact PathBounceState does the same for its RNG state and barycentrics, 64 instead of 80 bytes
+#ifndef COMPACT_ENCODING
+#define COMPACT_ENCODING 0
+#endif
+
+#if COMPACT_ENCODING
+#define VISIBILITY_BUFFER_COUNT 2
+#define PATH_BOUNCE_STATE_SIZE 64
+#else
 #define VISIBILITY_BUFFER_COUNT 3
+#define PATH_BOUNCE_STATE_SIZE 80
+#endif
+
+// Wavefront path queue entries store a path state index in the low PATH_SORT_KEY_SHIFT bits and the path's sort key above it,
+// so RayTraceScene::render keeps the number of paths at or below PATH_QUEUE_MAX_PATHS
+#define PATH_SORT_KEY_BITS 6
+#define PATH_SORT_KEY_SHIFT 26
+#define PATH_QUEUE_PIXEL_MASK ((1u << PATH_SORT_KEY_SHIFT) - 1)
+#define PATH_QUEUE_MAX_PATHS (PATH_QUEUE_PIXEL_MASK + 1)
+static_assert(PATH_SORT_KEY_SHIFT + PATH_SORT_KEY_BITS <= 32, "path queue entries are 32 bits");
 
 #ifdef __HLSL_VERSION
 
 RWTexture2D<uint4> gVisibility[VISIBILITY_BUFFER_COUNT];
 RWTexture2D<uint4> gPrevVisibility[VISIBILITY_BUFFER_COUNT];
 
+#if COMPACT_ENCODING
+
+// the previous uv is stored offset by .25 and halved, so that it can be off-screen by half a view in any direction
 struct VisibilityInfo {
 	uint4 data[VISIBILITY_BUFFER_COUNT];
 
-	inline uint4 rng_seed() { return data[0]; }
+	inline uint4 rng_seed(const uint2 pixel) { return uint4(pixel, data[1].zw); }
+	inline uint instance_index() { return BF_GET(data[0].x, 0, 16); }
+	inline uint primitive_index() { return BF_GET(data[0].x, 16, 16); }
+	inline float2 bary()    { return float2(BF_GET_UNORM(data[0].y, 0, 16), BF_GET_UNORM(data[0].y, 16, 16)); }
+	inline min16float3 normal()  { return unpack_normal_octahedron(data[0].z); }
+	inline float z()        { return f16tof32(BF_GET(data[0].w, 0, 16)); }
+	inline float prev_z()   { return f16tof32(BF_GET(data[0].w, 16, 16)); }
+	inline float dz_dx()    { return f16tof32(BF_GET(data[1].x, 0, 16)); }
+	inline float dz_dy()    { return f16tof32(BF_GET(data[1].x, 16, 16)); }
+	inline float2 prev_uv() { return float2(BF_GET_UNORM(data[1].y, 0, 16), BF_GET_UNORM(data[1].y, 16, 16))*2 - 0.5; }
+
+	inline void set_instance_index(const uint instance_index) { BF_SET(data[0].x, instance_index, 0, 16); }
+	inline void set_prev_uv(const float2 prev_uv) {
+		const float2 u = saturate(prev_uv*.5 + .25);
+		BF_SET_UNORM(data[1].y, u.x, 0, 16);
+		BF_SET_UNORM(data[1].y, u.y, 16, 16);
+	}
+};
+inline void store_visibility(const uint2 index,
+														 const uint4 rng_seed,
+														 const uint instance_index,
+														 const uint primitive_index,
+														 const float2 bary,
+														 const float3 normal,
+														 const float z,
+														 const float prev_z,
+														 const differential dz,
+														 const float2 prev_uv) {
+	VisibilityInfo v;
+	v.data[0] = 0;
+	v.data[1] = 0;
+	BF_SET(v.data[0].x, instance_index, 0, 16);
+	BF_SET(v.data[0].x, primitive_index, 16, 16);
+	BF_SET_UNORM(v.data[0].y, saturate(bary.x), 0, 16);
+	BF_SET_UNORM(v.data[0].y, saturate(bary.y), 16, 16);
+	v.data[0].z = pack_normal_octahedron(normal);
+	BF_SET(v.data[0].w, f32tof16(z), 0, 16);
+	BF_SET(v.data[0].w, f32tof16(prev_z), 16, 16);
+	BF_SET(v.data[1].x, f32tof16(dz.dx), 0, 16);
+	BF_SET(v.data[1].x, f32tof16(dz.dy), 16, 16);
+	v.set_prev_uv(prev_uv);
+	v.data[1].zw = rng_seed.zw;
+
+	for (uint i = 0; i < VISIBILITY_BUFFER_COUNT; i++)
+		gVisibility[i][index] = v.data[i];
+}
+
+#else
+
+struct VisibilityInfo {
+	uint4 data[VISIBILITY_BUFFER_COUNT];
+
+	inline uint4 rng_seed(const uint2 pixel) { return data[0]; }
 	inline uint instance_index() { return BF_GET(data[1].x, 0, 16); }
 	inline uint primitive_index() { return BF_GET(data[1].x, 16, 16); }
 	inline float2 bary()    { return asfloat(data[1].yz); }
@@ -21,6 +99,9 @@ struct VisibilityInfo {
 	inline float dz_dx()    { return f16tof32(BF_GET(data[2].y, 0, 16)); }
 	inline float dz_dy()    { return f16tof32(BF_GET(data[2].y, 16, 16)); }
 	inline float2 prev_uv() { return asfloat(data[2].zw); }
+
+	inline void set_instance_index(const uint instance_index) { BF_SET(data[1].x, instance_index, 0, 16); }
+	inline void set_prev_uv(const float2 prev_uv) { data[2].zw = asuint(prev_uv); }
 };
 inline void store_visibility(const uint2 index,
 														 const uint4 rng_seed,
@@ -47,6 +128,9 @@ inline void store_visibility(const uint2 index,
 	for (uint i = 0; i < VISIBILITY_BUFFER_COUNT; i++)
 		gVisibility[i][index] = data[i];
 }
+
+#endif
+
 inline VisibilityInfo load_visibility(const uint2 index) {
 	VisibilityInfo v;
 	for (uint i = 0; i < VISIBILITY_BUFFER_COUNT; i++)
@@ -57,7 +141,7 @@ inline VisibilityInfo load_prev_visibility(const uint2 prev_index, StructuredBuf
 	VisibilityInfo v;
 	for (uint i = 0; i < VISIBILITY_BUFFER_COUNT; i++)
 		v.data[i] = gPrevVisibility[i][prev_index];
-	BF_SET(v.data[0].x, instance_map[v.instance_index()], 0, 16);
+	v.set_instance_index(instance_map[v.instance_index()]);
 	return v;
 }
 
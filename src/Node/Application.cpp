@@ -2,10 +2,17 @@
 #include "Scene.hpp"
 #include "Gui.hpp"
 
+#include <Core/ResourcePool.hpp>
+
 using namespace stm;
 using namespace stm::hlsl;
 
 Application::Application(Node& node, Window& window) : mNode(node), mWindow(window) {
+  uint32_t framesInFlight = 2;
+  if (auto arg = mWindow.mInstance.find_argument("framesInFlight"))
+    framesInFlight = clamp(stoi(*arg), 1, 8);
+  mFramesInFlight.resize(framesInFlight);
+
 	auto mainCamera = mNode.make_child("Default Camera").make_component<Camera>( make_perspective(radians(70.f), 1.f, float2::Zero(), -1/1024.f) );
 	mainCamera.node().make_component<TransformData>(make_transform(float3(0,1,0), quatf_identity(), float3::Ones()));
 
@@ -30,6 +37,7 @@ Application::Application(Node& node, Window& window) : mNode(node), mWindow(wind
           #else
           cameraTransform->m.block<3,3>(0,0) = Quaternionf(r.w, r.xyz[0], r.xyz[1], r.xyz[2]).matrix();
           #endif
+          cameraTransform.mark_dirty();
         }
       }
       if (!ImGui::GetIO().WantCaptureKeyboard) {
@@ -42,7 +50,10 @@ Application::Application(Node& node, Window& window) : mNode(node), mWindow(wind
         if (input.pressed(KeyCode::eKeyControl)) mv += float3(0,-1,0);
         if (input.pressed(KeyCode::eKeyShift)) mv *= 3;
         if (input.pressed(KeyCode::eKeyAlt)) mv /= 2;
-        *cameraTransform = tmul(*cameraTransform, make_transform(mv*deltaTime, quatf_identity(), float3::Ones()));
+        if (!mv.isZero()) {
+          *cameraTransform = tmul(*cameraTransform, make_transform(mv*deltaTime, quatf_identity(), float3::Ones()));
+          cameraTransform.mark_dirty();
+        }
       }
       
       mainCamera->mImageRect = vk::Rect2D { { 0, 0 }, window.swapchain_extent() };
@@ -67,13 +78,20 @@ void Application::load_shaders() {
     ranges::uninitialized_fill(exepath, 0);
   #endif
   mNode.erase_component<ShaderDatabase>();
-  ShaderModule::load_from_dir(*mNode.make_component<ShaderDatabase>(), mWindow.mInstance.device(), fs::path(exepath).parent_path()/"Shaders");
+  auto shaders = mNode.make_component<ShaderDatabase>();
+  ShaderModule::load_from_dir(*shaders, mWindow.mInstance.device(), fs::path(exepath).parent_path()/"Shaders");
   #pragma endregion
+
+  // The loaders make their pipelines when they run, so compile them into the pipeline cache while the scene loads
+  for (const char* name : { "alpha_to_roughness", "dist2_build_row_dist", "dist2_sum_row_cdf", "dist2_build_marginal_dist" })
+    if (auto it = shaders->find(name); it != shaders->end())
+      ComputePipelineState(name, it->second).compile_async();
 }
 
 void Application::run() {
   size_t frameCount = 0;
   auto t0 = chrono::high_resolution_clock::now();
+  auto lastCacheSave = t0;
   while (true) {
     ProfilerRegion ps("Frame " + to_string(frameCount++));
 
@@ -88,7 +106,21 @@ void Application::run() {
     float deltaTime = chrono::duration_cast<chrono::duration<float>>(t1 - t0).count();
     t0 = t1;
 
+    FrameInFlight& frame = mFramesInFlight[mFrameIndex];
+    mFrameIndex = (mFrameIndex + 1) % mFramesInFlight.size();
+    if (frame.mCommandBuffer) {
+      // wait for the frame that last used this slot, so that the CPU runs at most mFramesInFlight.size() frames ahead of the GPU
+      ProfilerRegion ps("Application::WaitForFrame");
+      auto tw = chrono::high_resolution_clock::now();
+      frame.mCommandBuffer->completion_fence().wait();
+      mCpuWaitTime = chrono::high_resolution_clock::now() - tw;
+      frame.mCommandBuffer.reset();
+    } else
+      mCpuWaitTime = chrono::nanoseconds::zero();
+
     auto commandBuffer = mWindow.mInstance.device().get_command_buffer("Frame");
+    frame.mCommandBuffer = commandBuffer;
+    mWindow.mInstance.device().resource_pool().next_frame();
     
     {
       ProfilerRegion ps("Application::OnUpdate");
@@ -102,7 +134,12 @@ void Application::run() {
         mWindow.resolve(*commandBuffer);
       }
 
-      auto renderFinishSemaphore = make_shared<Semaphore>(commandBuffer->mDevice, "RenderSemaphore");
+      // one render finished semaphore per swapchain image: an image is only acquired again once its previous present, which waits on the semaphore, is done with it
+      const uint32_t imageIndex = mWindow.back_buffer_index();
+      while (mRenderFinishSemaphores.size() < mWindow.back_buffer_count())
+        mRenderFinishSemaphores.emplace_back(make_shared<Semaphore>(mWindow.mInstance.device(), "RenderSemaphore " + to_string(mRenderFinishSemaphores.size())));
+      const shared_ptr<Semaphore>& renderFinishSemaphore = mRenderFinishSemaphores[imageIndex];
+
       pair<shared_ptr<Semaphore>, vk::PipelineStageFlags> imageAvailableSemaphore(mWindow.image_available_semaphore(), vk::PipelineStageFlagBits::eTransfer);
       commandBuffer->mDevice.submit(commandBuffer, imageAvailableSemaphore, renderFinishSemaphore);
       
@@ -114,5 +151,17 @@ void Application::run() {
       ProfilerRegion ps("Application::PostFrame");
       PostFrame();
     }
+
+    Device& device = mWindow.mInstance.device();
+    if (frameCount == 1) {
+      cout << "First frame " << chrono::duration<float, milli>(chrono::high_resolution_clock::now() - mCreateTime).count() << " ms after startup" << endl;
+      cout << "Created " << device.pipeline_count() << " pipelines in " << chrono::duration<float, milli>(device.pipeline_create_time()).count() << " ms ("
+           << (device.pipeline_cache_path().empty() ? "no" : device.pipeline_cache_warm() ? "warm" : "cold") << " pipeline cache)" << endl;
+    }
+    // save the pipeline cache every minute, so that long sessions don't lose their pipelines to a crash
+    if (t1 - lastCacheSave > chrono::minutes(1)) {
+      device.save_pipeline_cache();
+      lastCacheSave = t1;
+    }
   }
 }
@@ -25,11 +25,26 @@ public:
 	inline Node& node() const { return mNode; }
 	inline Window& window() const { return mWindow; }
 
+	// Number of frames that may be queued on the GPU while the CPU records the next one, set with --framesInFlight:N (default 2).
+	// Resources written by the CPU each frame must be buffered at least this many times
+	inline uint32_t max_frames_in_flight() const { return (uint32_t)mFramesInFlight.size(); }
+	// Time the CPU spent waiting for a frame in flight to finish at the start of the current frame
+	inline chrono::nanoseconds cpu_wait_time() const { return mCpuWaitTime; }
+
 	component_ptr<Camera> mMainCamera;
 
 private:
+	struct FrameInFlight {
+		shared_ptr<CommandBuffer> mCommandBuffer;
+	};
+
 	Node& mNode;
 	Window& mWindow;
+	chrono::high_resolution_clock::time_point mCreateTime = chrono::high_resolution_clock::now(); // for the time to the first frame
+	vector<FrameInFlight> mFramesInFlight;
+	vector<shared_ptr<Semaphore>> mRenderFinishSemaphores; // indexed by the acquired swapchain image
+	uint32_t mFrameIndex = 0;
+	chrono::nanoseconds mCpuWaitTime = chrono::nanoseconds::zero();
 };
 
 }
\ No newline at end of file
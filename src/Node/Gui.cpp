@@ -6,6 +6,7 @@
 #include <stb_image_write.h>
 
 #include <Core/Window.hpp>
+#include <Core/ResourcePool.hpp>
 
 using namespace stm;
 using namespace stm::hlsl;
@@ -80,6 +81,17 @@ inline void inspector_gui_fn(Instance* instance) {
   ImGui::LabelText("Unused memory", "%zu %s", unused.first, unused.second);
   ImGui::LabelText("Device allocations", "%u", stats.total.blockCount);
   ImGui::LabelText("Descriptor Sets", "%u", instance->device().descriptor_set_count());
+  ImGui::LabelText("Pipelines", "%u created in %.1f ms (%s pipeline cache)", instance->device().pipeline_count(),
+    chrono::duration<float, milli>(instance->device().pipeline_create_time()).count(),
+    instance->device().pipeline_cache_path().empty() ? "no" : instance->device().pipeline_cache_warm() ? "warm" : "cold");
+  auto ringUsed = format_bytes(instance->device().upload_ring().size_in_use());
+  auto ringSize = format_bytes(instance->device().upload_ring().size());
+  ImGui::LabelText("Upload ring", "%zu %s / %zu %s (grew %zu times)", ringUsed.first, ringUsed.second, ringSize.first, ringSize.second, instance->device().upload_ring().grow_count());
+  const ResourcePool& pool = instance->device().resource_pool();
+  auto poolSize = format_bytes(pool.allocated_bytes());
+  auto poolSaved = format_bytes(pool.aliased_bytes_saved());
+  ImGui::LabelText("Resource pool", "%zu %s (%zu created, %zu reused)", poolSize.first, poolSize.second, pool.created_count(), pool.reused_count());
+  ImGui::LabelText("Saved by aliasing", "%zu %s", poolSaved.first, poolSaved.second);
 
   ImGui::LabelText("Window resolution", "%ux%u", instance->window().swapchain_extent().width, instance->window().swapchain_extent().height);
   ImGui::LabelText("Render target format", to_string(instance->window().back_buffer().image()->format()).c_str());
@@ -404,6 +416,21 @@ void Profiler::on_gui() {
     }
     ImGui::Text("%.1f fps", frameCount/(timeAccum/1000));
 
+    // time spent blocked on the frames-in-flight ring, see Application::run
+    float waitAccum = 0;
+    for (const auto& s : mFrameHistory | views::drop(1) | views::take(frameCount))
+      for (const auto& c : s->mChildren)
+        if (c->mLabel == "Application::WaitForFrame")
+          waitAccum += chrono::duration_cast<chrono::duration<float, milli>>(c->mDuration).count();
+    ImGui::SameLine();
+    ImGui::Text("%.2f ms CPU wait", waitAccum/max(frameCount, 1u));
+
+    size_t barrierAccum = 0;
+    for (const auto& s : mFrameHistory | views::drop(1) | views::take(frameCount))
+      barrierAccum += counter_total(*s, "vkCmdPipelineBarrier");
+    ImGui::SameLine();
+    ImGui::Text("%.1f barriers/frame", barrierAccum/(float)max(frameCount, 1u));
+
     const float graphScale = 2;
     
     float width = ImGui::GetWindowContentRegionMax().x - ImGui::GetWindowContentRegionMin().x;
@@ -522,7 +549,7 @@ Gui::Gui(Node& node) : mNode(node) {
 								load_mitsuba(app->node().make_child(name), commandBuffer, filepath);
 								break;
 							case AssetType::eEnvironmentMap: {
-								app->node().make_child(filepath.stem().string()).make_component<Material>(load_environment(commandBuffer, filepath));
+								app->node().make_child(filepath.stem().string()).make_component<Material>(load_environment(commandBuffer, *mNode.node_graph().find_components<ShaderDatabase>().front(), filepath));
 								break;
 							}
 						}
@@ -557,8 +584,13 @@ Gui::Gui(Node& node) : mNode(node) {
 								else {
 									void* ptr = selected->find(type);
 									auto it = mInspectorGuiFns.find(type);
-									if (it != mInspectorGuiFns.end())
+									if (it != mInspectorGuiFns.end()) {
+										ImGui::BeginGroup();
 										it->second(ptr);
+										ImGui::EndGroup();
+										if (ImGui::IsItemEdited())
+											selected->mark_dirty(type);
+									}
 								}
 							}
 						}
@@ -575,6 +607,18 @@ Gui::~Gui() {
 	ImGui::DestroyContext(mContext);
 }
 
+inline shared_ptr<RenderPass> make_render_pass(const Image::View& dst) {
+	RenderPass::SubpassDescription subpass {
+		{ "colorBuffer", {
+			AttachmentType::eColor, blend_mode_state(), vk::AttachmentDescription{ {},
+				dst.image()->format(), dst.image()->sample_count(),
+				vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+				vk::ImageLayout::eColorAttachmentOptimal, vk::ImageLayout::eColorAttachmentOptimal } }
+		}
+	};
+	return make_shared<RenderPass>(dst.image()->mDevice, "Gui RenderPass", ranges::single_view { subpass });
+}
+
 void Gui::create_pipelines() {
 	const ShaderDatabase& shader = *mNode.node_graph().find_components<ShaderDatabase>().front();
 	const auto& color_image_fs = shader.at("raster_color_image_fs");
@@ -593,6 +637,12 @@ void Gui::create_pipelines() {
 		0, true, 8, false, vk::CompareOp::eAlways, 0, VK_LOD_CLAMP_NONE)));
 	
 	mPipeline->descriptor_binding_flag("gImages", vk::DescriptorBindingFlagBits::ePartiallyBound);
+
+	// compile the pipeline for the window's render targets before the first draw
+	if (auto app = mNode.find_in_ancestor<Application>(); app && app->window().back_buffer_count() > 0) {
+		const VertexLayoutDescription vertexLayout(*mPipeline->stage(vk::ShaderStageFlagBits::eVertex), *mMesh.vertices(), mMesh.topology(), sizeof(ImDrawIdx) == sizeof(uint32_t) ? vk::IndexType::eUint32 : vk::IndexType::eUint16);
+		mPipeline->compile_async(make_render_pass(app->window().back_buffer(0)), 0, vertexLayout);
+	}
 }
 
 void Gui::create_font_image(CommandBuffer& commandBuffer) {
@@ -686,28 +736,20 @@ void Gui::render(CommandBuffer& commandBuffer, const Image::View& dst) {
 
 	ProfilerRegion ps("Draw Gui", commandBuffer);
 
-	RenderPass::SubpassDescription subpass {
-		{ "colorBuffer", {
-			AttachmentType::eColor, blend_mode_state(), vk::AttachmentDescription{ {},
-				dst.image()->format(), dst.image()->sample_count(),
-				vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
-				vk::ImageLayout::eColorAttachmentOptimal, vk::ImageLayout::eColorAttachmentOptimal } }
-		}
-	};
-  auto renderPass = make_shared<RenderPass>(dst.image()->mDevice, "Gui RenderPass", ranges::single_view { subpass });
+  auto renderPass = make_render_pass(dst);
   auto framebuffer = make_shared<Framebuffer>(*renderPass, "Gui Framebuffer", ranges::single_view { dst });
   commandBuffer.begin_render_pass(renderPass, framebuffer, vk::Rect2D{ {}, framebuffer->extent() }, { {} });
 
 	float2 scale = float2::Map(&mDrawData->DisplaySize.x);
 	float2 offset = float2::Map(&mDrawData->DisplayPos.x);
 	
-	Buffer::View<hlsl::ViewData> views = make_shared<Buffer>(commandBuffer.mDevice, "gCameraData", sizeof(hlsl::ViewData), vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU);
+	Buffer::View<hlsl::ViewData> views = commandBuffer.mDevice.upload_ring().allocate<hlsl::ViewData>(commandBuffer, 1);
 	views[0].world_to_camera = views[0].camera_to_world = make_transform(float3(0,0,1), quatf_identity(), float3::Ones());
 	views[0].projection = make_orthographic(scale, -1 - offset.array()*2/scale.array(), 0, 1);
 	views[0].image_min = { 0, 0 };
 	views[0].image_max = { framebuffer->extent().width, framebuffer->extent().height };
 
-	mPipeline->descriptor("gViews") = commandBuffer.hold_resource(views);
+	mPipeline->descriptor("gViews") = views;
 	mPipeline->push_constant<uint32_t>("gViewIndex") = 0;
 	mPipeline->push_constant<float4>("gImageST") = float4(1,1,0,0);
 	mPipeline->push_constant<float4>("gColor") = float4::Ones();
@@ -3,10 +3,22 @@
 using namespace stm;
 
 Node& NodeGraph::emplace(const string& name) {
-  Node* ptr = new Node(*this, name);
+  uint32_t id = (uint32_t)mNodes.size();
+  if (!mFreeNodeIds.empty()) {
+    id = mFreeNodeIds.back();
+    mFreeNodeIds.pop_back();
+  }
+  Node* ptr = new Node(*this, name, id);
   mNodes.emplace(ptr, ptr);
+  mStructureVersion = ++mVersion;
   return *ptr;
 }
+void NodeGraph::erase(Node& node) {
+  const uint32_t id = node.id();
+  if (mNodes.erase(&node))
+    mFreeNodeIds.emplace_back(id);
+  mStructureVersion = ++mVersion;
+}
 
 Node::~Node() {
   for (auto edge_it = mNodeGraph.mEdges.find(this); edge_it != mNodeGraph.mEdges.end(); ) {
@@ -19,8 +31,9 @@ Node::~Node() {
   }
   clear_parent();
 
+  mNodeGraph.mStructureVersion = ++mNodeGraph.mVersion;
   for (type_index t : mComponents)
-    mNodeGraph.mComponentMap.at(t).erase(this);
+    mNodeGraph.mComponentMap.at(t).erase(this, mNodeGraph.mVersion);
 }
 
 void Node::clear_parent() {
@@ -29,6 +42,7 @@ void Node::clear_parent() {
     auto[first,last] = mNodeGraph.mEdges.equal_range(mParent);
     mNodeGraph.mEdges.erase(ranges::find(first, last, this, &unordered_multimap<const Node*, Node*>::value_type::second));
     mParent = nullptr;
+    mNodeGraph.mStructureVersion = ++mNodeGraph.mVersion;
     OnParentChanged();
   }
 }
@@ -42,6 +56,7 @@ void Node::set_parent(Node& parent) {
   }
   mNodeGraph.mEdges.emplace(&parent, this);
   mParent = &parent;
+  mNodeGraph.mStructureVersion = ++mNodeGraph.mVersion;
   parent.OnChildAdded(*this);
   OnParentChanged();
 }
\ No newline at end of file
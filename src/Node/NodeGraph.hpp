@@ -1,12 +1,15 @@
 #pragma once
 
 #include <Common/hash.hpp>
+#include <Common/inline_function.hpp>
 
 namespace stm {
 
 class Node;
 class NodeGraph;
 template<typename T> class component_ptr;
+class TransformCache;
+STRATUM_API const TransformCache& transform_cache(const NodeGraph& nodeGraph); // defined in Scene.cpp
 
 enum EventPriority : uint32_t {
 	eFirst       = 0,
@@ -16,10 +19,13 @@ enum EventPriority : uint32_t {
 	eLast        = 0xFFFFFFFF
 };
 
+// Listeners are invoked in order of priority. Dispatch does not allocate: listeners added or erased while the event is being
+// dispatched are applied once the outermost dispatch returns, and sorting only happens when the listener set changed.
+// Listeners are stored inline in an inline_function, so their captures are limited to its capacity
 template<typename... Args>
 class NodeEvent {
 public:
-	using function_t = function<void(Args...)>;
+	using function_t = inline_function<void(Args...)>;
 
 	NodeEvent() = default;
 	NodeEvent(NodeEvent&&) = default;
@@ -28,30 +34,53 @@ public:
 	NodeEvent(const NodeEvent&) = delete;
 	NodeEvent& operator=(const NodeEvent&) = delete;
 
-	inline void clear() { mListeners.clear(); }
-	inline bool empty() const { return mListeners.empty(); }
-	inline size_t count(const Node& node) const { return mListeners.count(&node); }
+	inline void clear() {
+		if (mDispatchDepth) {
+			for (listener_t& l : mListeners) l.mNode = nullptr;
+			mPending.clear();
+			mDirty = true;
+		} else {
+			mListeners.clear();
+			mPending.clear();
+		}
+	}
+	inline bool empty() const { return ranges::all_of(mListeners, [](const listener_t& l) { return l.mNode == nullptr; }) && mPending.empty(); }
+	inline size_t count(const Node& node) const {
+		return ranges::count(mListeners, &node, &listener_t::mNode) + ranges::count(mPending, &node, &listener_t::mNode);
+	}
 	
 	void listen(const Node& node, function_t&& fn, uint32_t priority = EventPriority::eDefault);
 	inline void erase(const Node& node) {
-		for (auto it = mListeners.begin(); it != mListeners.end();)
-			if (get<const Node*>(*it) == &node)
-				it = mListeners.erase(it);
-			else
-				++it;
+		erase_if(mPending, [&](const listener_t& l) { return l.mNode == &node; });
+		if (mDispatchDepth) {
+			// mListeners is being iterated, mark the listeners and remove them after dispatch
+			for (listener_t& l : mListeners)
+				if (l.mNode == &node) {
+					l.mNode = nullptr;
+					mDirty = true;
+				}
+		} else
+			erase_if(mListeners, [&](const listener_t& l) { return l.mNode == &node; });
 	}
 
-	inline void operator()(Args... args) const {
-		vector<tuple<const Node*, function_t, uint32_t>> tmp(mListeners.size());
-		ranges::copy(mListeners, tmp.begin());
-		for (const auto&[n, fn, p] : tmp)
-			if (mNodeGraph->contains(n))
-				invoke(fn, forward<Args>(args)...);
-	}
+	inline void operator()(Args... args) const;
 
 private:
+	struct listener_t {
+		const Node* mNode;
+		function_t mFunction;
+		uint32_t mPriority;
+	};
+
 	const NodeGraph* mNodeGraph = nullptr;
-	vector<tuple<const Node*, function_t, uint32_t>> mListeners;
+	// mutable, as dispatch is const but applies deferred changes
+	mutable vector<listener_t> mListeners;
+	mutable vector<listener_t> mPending; // listeners added during dispatch
+	mutable uint64_t mValidatedVersion = 0; // NodeGraph::structure_version() when all listener nodes were last known to be alive
+	mutable uint32_t mDispatchDepth = 0;
+	mutable bool mDirty = false; // mListeners contains erased listeners or needs sorting
+
+	inline void flush() const;
 };
 
 template<typename T>
@@ -81,6 +110,10 @@ public:
 	inline T* get() const { return mComponent; }
 	inline void reset() { mNode = nullptr; mComponent = nullptr; }
 
+	// Stamps the component with a new version. Every in-place modification must be followed by mark_dirty(), as version-based consumers
+	// (NodeGraph::for_each_changed_component, TransformCache, RayTraceScene) never see unstamped changes. Debug builds assert this for components without padding
+	inline void mark_dirty() const;
+
 	inline operator component_ptr<const T>() const {
 		return component_ptr<const T>(mNode, mComponent);
 	}
@@ -93,12 +126,27 @@ private:
 class NodeGraph {
 public:
 	inline bool empty() const { return mNodes.empty(); }
+	inline size_t size() const { return mNodes.size(); }
 	inline bool contains(const Node* ptr) const { return mNodes.count(ptr); }
+	inline auto nodes() const {
+		return views::transform(mNodes, [](const auto& p) -> Node& { return *p.second; });
+	}
 	inline size_t count(type_index type) const { return mComponentMap.count(type); }
 	template<typename T> inline size_t count() const { return count(typeid(T)); }
 
+	// Monotonic change counter. Every component modification and structural change is stamped with a new version
+	inline uint64_t version() const { return mVersion; }
+	// Version of the last node, edge or component insertion/removal
+	inline uint64_t structure_version() const { return mStructureVersion; }
+	// Version of the last change to any component of the given type
+	inline uint64_t component_version(type_index type) const {
+		auto it = mComponentMap.find(type);
+		return it == mComponentMap.end() ? 0 : it->second.version();
+	}
+	template<typename T> inline uint64_t component_version() const { return component_version(typeid(T)); }
+
 	STRATUM_API Node& emplace(const string& name);
-	inline void erase(Node& node) { mNodes.erase(&node); }
+	STRATUM_API void erase(Node& node);
 	inline void erase_recurse(Node& node) {
 		list<Node*> nodes;
 		queue<Node*> todo;
@@ -119,46 +167,120 @@ public:
 		if (it == mComponentMap.end()) return 0;
 		return it->second.size();
 	}
+	// Linear scan over the dense storage of all components of type T, in no particular order
 	template<typename T> inline auto find_components() const {
-		return views::transform(mComponentMap.at(typeid(T)), [](const auto& p) -> component_ptr<T> {
-			return component_ptr<T>(p.first, reinterpret_cast<T*>(p.second));
+		return views::transform(mComponentMap.at(typeid(T)), [](const auto& e) -> component_ptr<T> {
+			return component_ptr<T>(e.mNode, reinterpret_cast<T*>(e.mComponent));
 		});
 	}
+	// Calls fn on every component of type T that was created or marked dirty after the given version.
+	// In debug builds, also asserts that the components it skips were not modified without mark_dirty
+	template<typename T, invocable<component_ptr<T>, uint64_t> F>
+	inline void for_each_changed_component(uint64_t version, F&& fn) const {
+		auto it = mComponentMap.find(typeid(T));
+		if (it == mComponentMap.end() || it->second.version() <= version) return;
+		for (const auto& e : it->second) {
+#ifndef NDEBUG
+			it->second.validate(e, e.mVersion > version);
+#endif
+			if (e.mVersion > version)
+				fn(component_ptr<T>(e.mNode, reinterpret_cast<T*>(e.mComponent)), e.mVersion);
+		}
+	}
 
 private:
 	friend class Node;
 
+	// Sparse set of the components of one type. Components are allocated in pages of contiguous slots, so their addresses are stable,
+	// mDense packs the components for linear iteration and mSparse maps Node::id() to an index in mDense
 	class component_map {
+	public:
+		struct entry {
+			const Node* mNode;
+			void* mComponent;
+			uint64_t mVersion;
+#ifndef NDEBUG
+			mutable uint64_t mContentHash = 0;
+			mutable bool mContentHashed = false;
+#endif
+		};
+		static constexpr size_t gPageSize = 64;
+
 	private:
-		void(*mDestructor)(const void*);
-		unordered_map<const Node*, void*> mComponents;
+		void(*mDestructor)(void*);
+		size_t mStride;
+		size_t mAlignment;
+		vector<entry> mDense;
+		vector<uint32_t> mSparse;
+		vector<void*> mPages;
+		vector<void*> mFreeSlots;
+		uint64_t mVersion = 0;
+
 	public:
-		inline component_map(auto dtor) : mDestructor(dtor) {}
-
-		inline auto begin() { return mComponents.begin(); }
-		inline auto end() { return mComponents.end(); }
-		inline auto begin() const { return mComponents.begin(); }
-		inline auto end() const { return mComponents.end(); }
-		inline size_t size() const { return mComponents.size(); }
-		inline void* find(const Node* node) {
-			auto it = mComponents.find(node);
-			return (it == mComponents.end()) ? nullptr : it->second;
+		inline component_map(void(*dtor)(void*), size_t size, size_t alignment) : mDestructor(dtor), mStride(align_up(size, alignment)), mAlignment(alignment) {}
+		component_map(const component_map&) = delete;
+		component_map(component_map&&) = default;
+		inline ~component_map() {
+			for (const entry& e : mDense)
+				mDestructor(e.mComponent);
+			for (void* page : mPages)
+				::operator delete(page, align_val_t(mAlignment));
 		}
-		inline void*& emplace(const Node* node, void* ptr) {
-			return mComponents.emplace(node, ptr).first->second;
-		}
-		inline void erase(const Node* node) {
-			auto it = mComponents.find(node);
-			if (it != mComponents.end()) {
-				mDestructor(it->second);
-				mComponents.erase(it);
+
+		inline auto begin() const { return mDense.begin(); }
+		inline auto end() const { return mDense.end(); }
+		inline size_t size() const { return mDense.size(); }
+		inline uint64_t version() const { return mVersion; }
+
+		// Returns uninitialized storage for one component
+		inline void* allocate() {
+			if (mFreeSlots.empty()) {
+				byte* page = reinterpret_cast<byte*>(::operator new(mStride*gPageSize, align_val_t(mAlignment)));
+				mPages.emplace_back(page);
+				for (size_t i = gPageSize; i-- > 0;)
+					mFreeSlots.emplace_back(page + i*mStride);
 			}
+			void* ptr = mFreeSlots.back();
+			mFreeSlots.pop_back();
+			return ptr;
+		}
+		// Returns storage from allocate() that no component was constructed in
+		inline void deallocate(void* ptr) {
+			mFreeSlots.emplace_back(ptr);
+		}
+
+#ifndef NDEBUG
+		// Debug check of the mark_dirty contract, for component types whose bytes are their value (no padding, see has_unique_object_representations): components are hashed when they are
+		// stamped or observed as changed, and must still match that hash whenever a consumer observes them as unchanged
+		uint64_t(*mContentHashFn)(const void*) = nullptr;
+		inline void validate(const entry& e, bool changed) const {
+			if (!mContentHashFn) return;
+			const uint64_t h = mContentHashFn(e.mComponent);
+			if (changed || !e.mContentHashed) {
+				e.mContentHash = h;
+				e.mContentHashed = true;
+			} else
+				assert(h == e.mContentHash && "component modified without mark_dirty()");
 		}
+#endif
+
+		inline void* find(const Node* node) const;
+		inline uint64_t version(const Node* node) const;
+		inline void mark_dirty(const Node* node, uint64_t version);
+		inline void emplace(const Node* node, void* ptr, uint64_t version);
+		inline void erase(const Node* node, uint64_t version);
 	};
 	
-	unordered_map<const Node*, unique_ptr<Node>> mNodes;
+	friend const TransformCache& transform_cache(const NodeGraph& nodeGraph);
+
 	unordered_map<type_index, component_map> mComponentMap;
 	unordered_multimap<const Node*, Node*> mEdges;
+	mutable shared_ptr<TransformCache> mTransformCache; // created by transform_cache() in Scene.hpp
+	uint64_t mVersion = 0;
+	uint64_t mStructureVersion = 0;
+	vector<uint32_t> mFreeNodeIds;
+	// declared last so that nodes are destroyed while the component maps and edges are still alive
+	unordered_map<const Node*, unique_ptr<Node>> mNodes;
 };
 
 class Node {
@@ -174,6 +296,8 @@ public:
 	STRATUM_API ~Node();
 
 	inline const string& name() const { return mName; }
+	// Unique among the live nodes of the graph, ids of erased nodes are reused
+	inline uint32_t id() const { return mId; }
 	inline NodeGraph& node_graph() const { return mNodeGraph; }
 	inline Node* parent() const { return mParent; }
 	inline auto children() const {
@@ -197,15 +321,28 @@ public:
 	
 	template<typename T, typename... Args> requires(constructible_from<T, Args...>)
 	inline component_ptr<T> make_component(Args&&... args) {
-		if (mComponents.count(typeid(T))) throw logic_error("Cannot make multiple components of the same type within the same node");
+		if (ranges::find(mComponents, type_index(typeid(T))) != mComponents.end()) throw logic_error("Cannot make multiple components of the same type within the same node");
 		auto cmap_it = mNodeGraph.mComponentMap.find(typeid(T));
-		if (cmap_it == mNodeGraph.mComponentMap.end()) cmap_it = mNodeGraph.mComponentMap.emplace(typeid(T), NodeGraph::component_map([](const void* p) {
-			delete reinterpret_cast<const T*>(p);
-		})).first;
-		mComponents.emplace(typeid(T));
-		void*& ptr = cmap_it->second.emplace(this, nullptr);
-		ptr = new T(forward<Args>(args)...);
-		return component_ptr<T>(this, reinterpret_cast<T*>(ptr));
+		if (cmap_it == mNodeGraph.mComponentMap.end()) cmap_it = mNodeGraph.mComponentMap.emplace(typeid(T), NodeGraph::component_map([](void* p) {
+			reinterpret_cast<T*>(p)->~T();
+		}, sizeof(T), alignof(T))).first;
+#ifndef NDEBUG
+		if constexpr (has_unique_object_representations_v<T>)
+			cmap_it->second.mContentHashFn = [](const void* p) { return hash_bytes(p, sizeof(T)); };
+#endif
+		// construct the component before registering it, so that a throwing constructor leaves the graph unchanged
+		void* ptr = cmap_it->second.allocate();
+		T* component;
+		try {
+			component = new (ptr) T(forward<Args>(args)...);
+		} catch (...) {
+			cmap_it->second.deallocate(ptr);
+			throw;
+		}
+		mComponents.emplace_back(typeid(T));
+		mNodeGraph.mStructureVersion = ++mNodeGraph.mVersion;
+		cmap_it->second.emplace(this, ptr, mNodeGraph.mVersion);
+		return component_ptr<T>(this, component);
 	}
 	template<typename T, typename... Args> requires(constructible_from<T, Node*, Args...>)
 	inline component_ptr<T> make_component(Args&&... args) {
@@ -219,13 +356,29 @@ public:
 	inline void erase_component(type_index type) {
 		auto cmap_it = mNodeGraph.mComponentMap.find(type);
 		if (cmap_it != mNodeGraph.mComponentMap.end()) {
-			cmap_it->second.erase(this);
-			mComponents.erase(type);
+			mNodeGraph.mStructureVersion = ++mNodeGraph.mVersion;
+			cmap_it->second.erase(this, mNodeGraph.mVersion);
+			if (auto it = ranges::find(mComponents, type); it != mComponents.end())
+				mComponents.erase(it);
 		}
 	}
 	template<typename T> inline void erase_component() { erase_component(typeid(T)); }
 
-	inline const unordered_set<type_index>& components() const { return mComponents; }
+	// Version of this node's component of the given type, or 0 if there is none
+	inline uint64_t version(type_index type) const {
+		auto it = mNodeGraph.mComponentMap.find(type);
+		return it == mNodeGraph.mComponentMap.end() ? 0 : it->second.version(this);
+	}
+	template<typename T> inline uint64_t version() const { return version(typeid(T)); }
+
+	inline void mark_dirty(type_index type) {
+		auto it = mNodeGraph.mComponentMap.find(type);
+		if (it != mNodeGraph.mComponentMap.end())
+			it->second.mark_dirty(this, ++mNodeGraph.mVersion);
+	}
+	template<typename T> inline void mark_dirty() { mark_dirty(typeid(T)); }
+
+	inline const vector<type_index>& components() const { return mComponents; }
 
 	inline void* find(type_index type) const {
 		auto it = mNodeGraph.mComponentMap.find(type);
@@ -301,17 +454,108 @@ public:
 private:
 	NodeGraph& mNodeGraph;
 	string mName;
+	uint32_t mId;
 	Node* mParent;
-	unordered_set<type_index> mComponents;
+	vector<type_index> mComponents;
 	friend class NodeGraph;
-	inline Node(NodeGraph& nodeGraph, const string& name) : mNodeGraph(nodeGraph), mName(name), mParent(nullptr) {}
+	inline Node(NodeGraph& nodeGraph, const string& name, uint32_t id) : mNodeGraph(nodeGraph), mName(name), mId(id), mParent(nullptr) {}
 };
 
+inline void* NodeGraph::component_map::find(const Node* node) const {
+	return (node->id() < mSparse.size() && mSparse[node->id()] != ~0u) ? mDense[mSparse[node->id()]].mComponent : nullptr;
+}
+inline uint64_t NodeGraph::component_map::version(const Node* node) const {
+	return (node->id() < mSparse.size() && mSparse[node->id()] != ~0u) ? mDense[mSparse[node->id()]].mVersion : 0;
+}
+inline void NodeGraph::component_map::mark_dirty(const Node* node, uint64_t version) {
+	if (node->id() < mSparse.size() && mSparse[node->id()] != ~0u) {
+		mDense[mSparse[node->id()]].mVersion = version;
+		mVersion = version;
+#ifndef NDEBUG
+		validate(mDense[mSparse[node->id()]], true);
+#endif
+	}
+}
+inline void NodeGraph::component_map::emplace(const Node* node, void* ptr, uint64_t version) {
+	if (node->id() >= mSparse.size())
+		mSparse.resize(node->id() + 1, ~0u);
+	mSparse[node->id()] = (uint32_t)mDense.size();
+	mDense.emplace_back(entry{ node, ptr, version });
+	mVersion = version;
+}
+inline void NodeGraph::component_map::erase(const Node* node, uint64_t version) {
+	if (node->id() >= mSparse.size() || mSparse[node->id()] == ~0u) return;
+	const uint32_t i = mSparse[node->id()];
+	void* ptr = mDense[i].mComponent;
+	// move the last entry into the hole to keep mDense packed
+	mDense[i] = mDense.back();
+	mSparse[mDense[i].mNode->id()] = i;
+	mDense.pop_back();
+	mSparse[node->id()] = ~0u;
+	mVersion = version;
+	// the entry is removed first, as the destructor may add or remove other components
+	mDestructor(ptr);
+	mFreeSlots.emplace_back(ptr);
+}
+
+template<typename T>
+inline void component_ptr<T>::mark_dirty() const {
+	mNode->mark_dirty<remove_const_t<T>>();
+}
+
 template<typename... Args>
 inline void NodeEvent<Args...>::listen(const Node& listener, function_t&& fn, uint32_t priority) {
-	mListeners.emplace_back(&listener, forward<function_t>(fn), priority);
-	ranges::stable_sort(mListeners, {}, [](const auto& a) { return get<uint32_t>(a); });
+	if (mDispatchDepth)
+		mPending.emplace_back(listener_t{ &listener, forward<function_t>(fn), priority });
+	else
+		mListeners.emplace_back(listener_t{ &listener, forward<function_t>(fn), priority });
+	mDirty = true;
 	if (!mNodeGraph) mNodeGraph = &listener.node_graph();
 }
 
+template<typename... Args>
+inline void NodeEvent<Args...>::flush() const {
+	// listeners added during dispatch are merged first, so that the liveness check below covers them too
+	if (!mPending.empty()) {
+		for (listener_t& l : mPending)
+			mListeners.emplace_back(move(l));
+		mPending.clear();
+		mDirty = true;
+	}
+	if (mNodeGraph && mValidatedVersion != mNodeGraph->structure_version()) {
+		// listeners whose node was destroyed are dropped
+		for (listener_t& l : mListeners)
+			if (l.mNode && !mNodeGraph->contains(l.mNode)) {
+				l.mNode = nullptr;
+				mDirty = true;
+			}
+		mValidatedVersion = mNodeGraph->structure_version();
+	}
+	if (!mDirty) return;
+	erase_if(mListeners, [](const listener_t& l) { return l.mNode == nullptr; });
+	ranges::stable_sort(mListeners, {}, &listener_t::mPriority);
+	mDirty = false;
+}
+
+template<typename... Args>
+inline void NodeEvent<Args...>::operator()(Args... args) const {
+	if (mDispatchDepth == 0) flush();
+
+	struct dispatch_scope {
+		const NodeEvent& mEvent;
+		inline dispatch_scope(const NodeEvent& e) : mEvent(e) { mEvent.mDispatchDepth++; }
+		inline ~dispatch_scope() { if (--mEvent.mDispatchDepth == 0 && mEvent.mDirty) mEvent.flush(); }
+	} scope(*this);
+
+	// mListeners is not resized during dispatch, so indexing stays valid even if a listener modifies this event
+	const size_t n = mListeners.size();
+	for (size_t i = 0; i < n; i++) {
+		const listener_t& l = mListeners[i];
+		if (!l.mNode) continue;
+		// a previous listener may have destroyed this listener's node
+		if (mValidatedVersion != mNodeGraph->structure_version() && !mNodeGraph->contains(l.mNode)) continue;
+		invoke(l.mFunction, args...);
+	}
+}
+
 }
\ No newline at end of file
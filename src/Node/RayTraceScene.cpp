@@ -2,6 +2,8 @@
 #include "Application.hpp"
 #include "Gui.hpp"
 
+#include <Core/ResourcePool.hpp>
+
 #include <stb_image_write.h>
 
 #include <random>
@@ -17,8 +19,13 @@ namespace hlsl{
 
 void inspector_gui_fn(RayTraceScene* v) { v->on_inspector_gui(); }
 
-AccelerationStructure::AccelerationStructure(CommandBuffer& commandBuffer, const string& name, vk::AccelerationStructureTypeKHR type, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureGeometryKHR>& geometries,  const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureBuildRangeInfoKHR>& buildRanges) : DeviceResource(commandBuffer.mDevice, name) {
-	vk::AccelerationStructureBuildGeometryInfoKHR buildGeometry(type,vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace, vk::BuildAccelerationStructureModeKHR::eBuild);
+// gDistributions layout of the light alias tables, see light.hlsli
+static const uint32_t LIGHT_ALIAS_STRIDE = 2;
+static const uint32_t LIGHT_INSTANCE_STRIDE = 2;
+
+AccelerationStructure::AccelerationStructure(CommandBuffer& commandBuffer, const string& name, vk::AccelerationStructureTypeKHR type, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureGeometryKHR>& geometries, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureBuildRangeInfoKHR>& buildRanges, vk::BuildAccelerationStructureFlagsKHR flags)
+	: DeviceResource(commandBuffer.mDevice, name), mType(type), mFlags(flags) {
+	vk::AccelerationStructureBuildGeometryInfoKHR buildGeometry(type, flags, vk::BuildAccelerationStructureModeKHR::eBuild);
 	buildGeometry.setGeometries(geometries);
 
 	vector<uint32_t> counts((uint32_t)geometries.size());
@@ -26,21 +33,174 @@ AccelerationStructure::AccelerationStructure(CommandBuffer& commandBuffer, const
 		counts[i] = (buildRanges.data() + i)->primitiveCount;
 	vk::AccelerationStructureBuildSizesInfoKHR buildSizes = commandBuffer.mDevice->getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, buildGeometry, counts);
 
-	mBuffer = make_shared<Buffer>(commandBuffer.mDevice, name, buildSizes.accelerationStructureSize, vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR|vk::BufferUsageFlagBits::eShaderDeviceAddress);
-	Buffer::View<byte> scratchBuf = make_shared<Buffer>(commandBuffer.mDevice, name + "/ScratchBuffer", buildSizes.buildScratchSize, vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR|vk::BufferUsageFlagBits::eShaderDeviceAddress|vk::BufferUsageFlagBits::eStorageBuffer);
+	create(buildSizes.accelerationStructureSize);
+
+	build(commandBuffer, geometries, buildRanges, vk::BuildAccelerationStructureModeKHR::eBuild);
+}
+AccelerationStructure::AccelerationStructure(Device& device, const string& name, vk::AccelerationStructureTypeKHR type, vk::DeviceSize size, vk::BuildAccelerationStructureFlagsKHR flags)
+	: DeviceResource(device, name), mType(type), mFlags(flags) {
+	create(size);
+}
+void AccelerationStructure::create(vk::DeviceSize size) {
+	mBuffer = make_shared<Buffer>(mDevice, name(), size, vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR|vk::BufferUsageFlagBits::eShaderDeviceAddress);
+	mAccelerationStructure = mDevice->createAccelerationStructureKHR(vk::AccelerationStructureCreateInfoKHR({}, **mBuffer.buffer(), mBuffer.offset(), mBuffer.size_bytes(), mType));
+}
+bool AccelerationStructure::build(CommandBuffer& commandBuffer, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureGeometryKHR>& geometries, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureBuildRangeInfoKHR>& buildRanges, vk::BuildAccelerationStructureModeKHR mode) {
+	if (mode == vk::BuildAccelerationStructureModeKHR::eUpdate && !(mFlags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate))
+		throw logic_error("Acceleration structure " + name() + " was not created with eAllowUpdate");
+
+	vk::AccelerationStructureBuildGeometryInfoKHR buildGeometry(mType, mFlags, mode);
+	buildGeometry.setGeometries(geometries);
+
+	vector<uint32_t> counts((uint32_t)geometries.size());
+	for (uint32_t i = 0; i < geometries.size(); i++)
+		counts[i] = (buildRanges.data() + i)->primitiveCount;
+	vk::AccelerationStructureBuildSizesInfoKHR buildSizes = commandBuffer.mDevice->getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, buildGeometry, counts);
+	if (buildSizes.accelerationStructureSize > mBuffer.size_bytes())
+		return false;
 
-	mAccelerationStructure = commandBuffer.mDevice->createAccelerationStructureKHR(vk::AccelerationStructureCreateInfoKHR({}, **mBuffer.buffer(), mBuffer.offset(), mBuffer.size_bytes(), type));
+	const vk::DeviceSize scratchSize = (mFlags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate) ? max(buildSizes.buildScratchSize, buildSizes.updateScratchSize) : buildSizes.buildScratchSize;
+	if (!mScratchBuffer || mScratchBuffer.size_bytes() < scratchSize)
+		mScratchBuffer = make_shared<Buffer>(commandBuffer.mDevice, name() + "/ScratchBuffer", scratchSize, vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR|vk::BufferUsageFlagBits::eShaderDeviceAddress|vk::BufferUsageFlagBits::eStorageBuffer);
 
+	if (mode == vk::BuildAccelerationStructureModeKHR::eUpdate)
+		buildGeometry.srcAccelerationStructure = mAccelerationStructure;
 	buildGeometry.dstAccelerationStructure = mAccelerationStructure;
-	buildGeometry.scratchData = scratchBuf.device_address();
+	buildGeometry.scratchData = mScratchBuffer.device_address();
 	commandBuffer->buildAccelerationStructuresKHR(buildGeometry, buildRanges.data());
-	commandBuffer.hold_resource(scratchBuf);
+	commandBuffer.hold_resource(mScratchBuffer);
+	mBuilt = true;
+
+	// only structures that can be refit need to keep their scratch memory around
+	if (!(mFlags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate))
+		mScratchBuffer.reset();
+	return true;
 }
 AccelerationStructure::~AccelerationStructure() {
 	if (mAccelerationStructure)
 		mDevice->destroyAccelerationStructureKHR(mAccelerationStructure);
 }
 
+BlasBuildQueue::~BlasBuildQueue() {
+	for (const PendingCompaction& c : mCompactions)
+		(*mDevice)->destroyQueryPool(c.mQueryPool);
+}
+
+shared_ptr<AccelerationStructure> BlasBuildQueue::push(Device& device, const string& name, const vk::AccelerationStructureGeometryKHR& geometry, const vk::AccelerationStructureBuildRangeInfoKHR& range, vector<Buffer::View<byte>>&& inputs, vk::BuildAccelerationStructureFlagsKHR flags) {
+	vk::AccelerationStructureBuildGeometryInfoKHR buildGeometry(vk::AccelerationStructureTypeKHR::eBottomLevel, flags, vk::BuildAccelerationStructureModeKHR::eBuild);
+	buildGeometry.setGeometries(geometry);
+	vk::AccelerationStructureBuildSizesInfoKHR buildSizes = device->getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, buildGeometry, range.primitiveCount);
+
+	auto as = make_shared<AccelerationStructure>(device, name, vk::AccelerationStructureTypeKHR::eBottomLevel, buildSizes.accelerationStructureSize, flags);
+	mDevice = &device;
+	mPending.emplace_back(PendingBuild{ as, geometry, range, buildSizes.buildScratchSize, move(inputs) });
+	return as;
+}
+size_t BlasBuildQueue::flush(CommandBuffer& commandBuffer) {
+	if (mPending.empty()) return 0;
+	ProfilerRegion ps("BlasBuildQueue::flush", commandBuffer);
+
+	if (!mScratchAlignment) {
+		auto properties = commandBuffer.mDevice.physical().getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
+		mScratchAlignment = properties.get<vk::PhysicalDeviceAccelerationStructurePropertiesKHR>().minAccelerationStructureScratchOffsetAlignment;
+	}
+
+	// take builds until the budget is used up, and place their scratch memory back to back
+	size_t count = 0;
+	uint64_t primitiveCount = 0;
+	vk::DeviceSize scratchSize = 0;
+	vector<vk::DeviceSize> scratchOffsets;
+	while (count < mPending.size() && (count == 0 || primitiveCount + mPending[count].mRange.primitiveCount <= mPrimitiveBudget)) {
+		scratchOffsets.emplace_back(scratchSize);
+		scratchSize = align_up(scratchSize + mPending[count].mScratchSize, mScratchAlignment);
+		primitiveCount += mPending[count].mRange.primitiveCount;
+		count++;
+	}
+
+	if (!mScratch || mScratch.size_bytes() < scratchSize)
+		mScratch = make_shared<Buffer>(commandBuffer.mDevice, "BLAS scratch", scratchSize, vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR|vk::BufferUsageFlagBits::eShaderDeviceAddress|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY, (uint32_t)mScratchAlignment);
+	else // the previous batch may still be using the scratch memory
+		commandBuffer.barrier(mScratch,
+			vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR|vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+			vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR|vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+	commandBuffer.hold_resource(mScratch);
+
+	vector<vk::AccelerationStructureBuildGeometryInfoKHR> buildGeometries(count);
+	vector<const vk::AccelerationStructureBuildRangeInfoKHR*> buildRanges(count);
+	for (size_t i = 0; i < count; i++) {
+		PendingBuild& b = mPending[i];
+		buildGeometries[i] = vk::AccelerationStructureBuildGeometryInfoKHR(vk::AccelerationStructureTypeKHR::eBottomLevel, b.mAccelerationStructure->flags(), vk::BuildAccelerationStructureModeKHR::eBuild);
+		buildGeometries[i].setGeometries(b.mGeometry);
+		buildGeometries[i].dstAccelerationStructure = **b.mAccelerationStructure;
+		buildGeometries[i].scratchData = mScratch.device_address() + scratchOffsets[i];
+		buildRanges[i] = &b.mRange;
+		commandBuffer.hold_resource(b.mAccelerationStructure);
+		for (const Buffer::View<byte>& input : b.mInputs)
+			commandBuffer.hold_resource(input);
+	}
+	commandBuffer->buildAccelerationStructuresKHR(buildGeometries, buildRanges);
+
+	commandBuffer.barrier(vk::MemoryBarrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR),
+		vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+		vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR|vk::PipelineStageFlagBits::eComputeShader);
+
+	PendingCompaction compaction;
+	vector<vk::AccelerationStructureKHR> compactable;
+	for (size_t i = 0; i < count; i++) {
+		const shared_ptr<AccelerationStructure>& as = mPending[i].mAccelerationStructure;
+		as->mBuilt = true;
+		if (as->flags() & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction) {
+			compaction.mAccelerationStructures.emplace_back(as);
+			compactable.emplace_back(**as);
+		}
+	}
+	if (!compactable.empty()) {
+		// the barrier above orders the queries after the builds
+		compaction.mQueryPool = commandBuffer.mDevice->createQueryPool(vk::QueryPoolCreateInfo({}, vk::QueryType::eAccelerationStructureCompactedSizeKHR, (uint32_t)compactable.size()));
+		commandBuffer->resetQueryPool(compaction.mQueryPool, 0, (uint32_t)compactable.size());
+		commandBuffer->writeAccelerationStructuresPropertiesKHR(compactable, vk::QueryType::eAccelerationStructureCompactedSizeKHR, compaction.mQueryPool, 0);
+		compaction.mBuildCompletion = make_shared<DeviceResource>(commandBuffer.mDevice, "BLAS compaction queries");
+		commandBuffer.hold_resource(compaction.mBuildCompletion);
+		mCompactions.emplace_back(move(compaction));
+	}
+
+	mPending.erase(mPending.begin(), mPending.begin() + count);
+	mBuildCount += count;
+	mBatchCount++;
+	return count;
+}
+vector<pair<shared_ptr<AccelerationStructure>, shared_ptr<AccelerationStructure>>> BlasBuildQueue::compact(CommandBuffer& commandBuffer) {
+	vector<pair<shared_ptr<AccelerationStructure>, shared_ptr<AccelerationStructure>>> compacted;
+	while (!mCompactions.empty()) {
+		PendingCompaction& c = mCompactions.front();
+		const uint32_t count = (uint32_t)c.mAccelerationStructures.size();
+		// the queries are only reset once the command buffer that built the structures executes, so don't poll them before it finishes
+		if (c.mBuildCompletion->in_use()) break;
+		auto[result, sizes] = commandBuffer.mDevice->getQueryPoolResults<vk::DeviceSize>(c.mQueryPool, 0, count, count*sizeof(vk::DeviceSize), sizeof(vk::DeviceSize), vk::QueryResultFlagBits::e64);
+		if (result == vk::Result::eNotReady) break;
+
+		ProfilerRegion ps("BlasBuildQueue::compact", commandBuffer);
+		for (uint32_t i = 0; i < count; i++) {
+			const shared_ptr<AccelerationStructure>& src = c.mAccelerationStructures[i];
+			auto dst = make_shared<AccelerationStructure>(commandBuffer.mDevice, src->name(), vk::AccelerationStructureTypeKHR::eBottomLevel, sizes[i], src->flags());
+			commandBuffer->copyAccelerationStructureKHR(vk::CopyAccelerationStructureInfoKHR(**src, **dst, vk::CopyAccelerationStructureModeKHR::eCompact));
+			commandBuffer.hold_resource(src);
+			commandBuffer.hold_resource(dst);
+			dst->mBuilt = true;
+			mUncompactedBytes += src->buffer().size_bytes();
+			mCompactedBytes += dst->buffer().size_bytes();
+			compacted.emplace_back(src, dst);
+		}
+		commandBuffer.mDevice->destroyQueryPool(c.mQueryPool);
+		mCompactions.pop_front();
+	}
+	if (!compacted.empty())
+		commandBuffer.barrier(vk::MemoryBarrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR),
+			vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+			vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR|vk::PipelineStageFlagBits::eComputeShader);
+	return compacted;
+}
+
 RayTraceScene::RayTraceScene(Node& node) : mNode(node), mCurFrame(make_unique<FrameData>()), mPrevFrame(make_unique<FrameData>()) {
 	auto app = mNode.find_in_ancestor<Application>();
 	app.node().find_in_descendants<Gui>()->register_inspector_gui_fn(&inspector_gui_fn);
@@ -48,6 +208,15 @@ RayTraceScene::RayTraceScene(Node& node) : mNode(node), mCurFrame(make_unique<Fr
 	create_pipelines();
 
 	mCurFrame->mFrameId = mPrevFrame->mFrameId = 0;
+	for (uint32_t i = 2; i < app->max_frames_in_flight(); i++)
+		mInFlightFrames.emplace_back(make_unique<FrameData>())->mFrameId = 0;
+}
+RayTraceScene::~RayTraceScene() {
+	Device& device = mNode.find_in_ancestor<Instance>()->device();
+	for (const BounceTiming& t : mBounceTimings)
+		device->destroyQueryPool(t.mQueryPool);
+	for (vk::QueryPool pool : mFreeBounceQueryPools)
+		device->destroyQueryPool(pool);
 }
 
 void RayTraceScene::create_pipelines() {
@@ -65,6 +234,8 @@ void RayTraceScene::create_pipelines() {
 	const ShaderDatabase& shaders = *mNode.node_graph().find_components<ShaderDatabase>().front();
 	
 	mCopyVerticesPipeline = n.make_child("copy_vertices").make_component<ComputePipelineState>("copy_vertices", shaders.at("copy_vertices"));
+	mSkinPipeline = n.make_child("anim_skin").make_component<ComputePipelineState>("anim_skin", shaders.at("anim_skin"));
+	mBlendPipeline = n.make_child("anim_blend").make_component<ComputePipelineState>("anim_blend", shaders.at("anim_blend"));
 	
 	mTraceVisibilityPipeline = n.make_child("pt_trace_visibility").make_component<ComputePipelineState>("pt_trace_visibility", shaders.at("pt_trace_visibility"));
 	mTraceVisibilityPipeline->set_immutable_sampler("gSampler", samplerRepeat);
@@ -75,9 +246,18 @@ void RayTraceScene::create_pipelines() {
 	mTraceBouncePipeline->descriptor_binding_flag("gImages", vk::DescriptorBindingFlagBits::ePartiallyBound);
 	mTraceBouncePipeline->push_constant<uint32_t>("gSamplingFlags") = SAMPLE_FLAG_BG_IS | SAMPLE_FLAG_LIGHT_IS;
 	
-	//mSpatialReusePipeline = n.make_child("pathtrace_spatial_reuse").make_component<ComputePipelineState>("pathtrace_spatial_reuse", shaders.at("pathtrace_spatial_reuse"));
-	//mSpatialReusePipeline->set_immutable_sampler("gSampler", samplerRepeat);
-	//mSpatialReusePipeline->descriptor_binding_flag("gImages", vk::DescriptorBindingFlagBits::ePartiallyBound);
+	// binds the same descriptors as mTraceBouncePipeline, and is pushed mTraceBouncePipeline's push constants
+	mTraceBounceQueuedPipeline = n.make_child("pt_trace_path_bounce_queued").make_component<ComputePipelineState>("pt_trace_path_bounce_queued", shaders.at("pt_trace_path_bounce_queued"));
+	mTraceBounceQueuedPipeline->set_immutable_sampler("gSampler", samplerRepeat);
+	mTraceBounceQueuedPipeline->descriptor_binding_flag("gImages", vk::DescriptorBindingFlagBits::ePartiallyBound);
+	mSortPathsPipeline = n.make_child("pt_sort_paths").make_component<ComputePipelineState>("pt_sort_paths", shaders.at("pt_sort_paths"));
+	mTraceAdaptivePipeline = n.make_child("pt_trace_adaptive_samples").make_component<ComputePipelineState>("pt_trace_adaptive_samples", shaders.at("pt_trace_adaptive_samples"));
+	mTraceAdaptivePipeline->set_immutable_sampler("gSampler", samplerRepeat);
+	mTraceAdaptivePipeline->descriptor_binding_flag("gImages", vk::DescriptorBindingFlagBits::ePartiallyBound);
+	
+	mSpatialReusePipeline = n.make_child("pt_spatial_reuse").make_component<ComputePipelineState>("pt_spatial_reuse", shaders.at("pt_spatial_reuse"));
+	mSpatialReusePipeline->set_immutable_sampler("gSampler", samplerRepeat);
+	mSpatialReusePipeline->descriptor_binding_flag("gImages", vk::DescriptorBindingFlagBits::ePartiallyBound);
 
 	mDemodulateAlbedoPipeline = n.make_child("tonemap_demodulate_albedo").make_component<ComputePipelineState>("tonemap_demodulate_albedo", shaders.at("tonemap_demodulate_albedo"));
 	mTonemapPipeline = n.make_child("tonemap").make_component<ComputePipelineState>("tonemap", shaders.at("tonemap"));
@@ -93,6 +273,23 @@ void RayTraceScene::create_pipelines() {
 	mEstimateVariancePipeline = n.make_child("estimate_variance").make_component<ComputePipelineState>("estimate_variance", shaders.at("estimate_variance"));
 	mAtrousPipeline = n.make_child("atrous").make_component<ComputePipelineState>("atrous", shaders.at("atrous"));
 	mAtrousPipeline->push_constant<float>("gSigmaLuminanceBoost") = 3;
+
+	mEstimatePriorityPipeline = n.make_child("adaptive_sampling_estimate_priority").make_component<ComputePipelineState>("adaptive_sampling_estimate_priority", shaders.at("adaptive_sampling_estimate_priority"));
+	mSumPriorityPipeline = n.make_child("adaptive_sampling_sum_priority").make_component<ComputePipelineState>("adaptive_sampling_sum_priority", shaders.at("adaptive_sampling_sum_priority"));
+	mAllocateSamplesPipeline = n.make_child("adaptive_sampling_allocate_samples").make_component<ComputePipelineState>("adaptive_sampling_allocate_samples", shaders.at("adaptive_sampling_allocate_samples"));
+	mResolveSamplesPipeline = n.make_child("adaptive_sampling_resolve_samples").make_component<ComputePipelineState>("adaptive_sampling_resolve_samples", shaders.at("adaptive_sampling_resolve_samples"));
+
+	// compile the pipelines on worker threads now, instead of one after another on the first frame
+	mTonemapPipeline->specialization_constant("gModulateAlbedo") = mDemodulateAlbedo;
+	for (const auto& p : {
+		mCopyVerticesPipeline, mSkinPipeline, mBlendPipeline,
+		mTraceVisibilityPipeline, mTraceBouncePipeline, mTraceBounceQueuedPipeline, mSortPathsPipeline, mTraceAdaptivePipeline, mSpatialReusePipeline,
+		mDemodulateAlbedoPipeline, mTonemapPipeline,
+		mGradientForwardProjectPipeline, mCreateGradientSamplesPipeline, mAtrousGradientPipeline, mTemporalAccumulationPipeline, mEstimateVariancePipeline, mAtrousPipeline,
+		mEstimatePriorityPipeline, mSumPriorityPipeline, mAllocateSamplesPipeline, mResolveSamplesPipeline })
+		p->compile_async();
+	// the variant that the Demodulate Albedo checkbox switches to
+	mTonemapPipeline->compile_async({ { "gModulateAlbedo", !mDemodulateAlbedo } });
 }
 
 void RayTraceScene::on_inspector_gui() {
@@ -101,6 +298,39 @@ void RayTraceScene::on_inspector_gui() {
 		ImGui::InputScalar("Max Depth", ImGuiDataType_U32, &mMaxDepth);
 		ImGui::InputScalar("Min Depth", ImGuiDataType_U32, &mMinDepth);
 		ImGui::PopItemWidth();
+		ImGui::Checkbox("Wavefront", &mWavefront);
+		if (mWavefront) {
+			ImGui::Checkbox("Sort Paths By Material", &mSortPaths);
+			ImGui::Checkbox("Adaptive Sampling", &mAdaptiveSampling);
+			if (mAdaptiveSampling) {
+				ImGui::PushItemWidth(40);
+				ImGui::DragFloat("Extra Paths Per Pixel", &mAdaptiveBudget, .01f, 0, 4);
+				ImGui::InputScalar("Max Extra Paths", ImGuiDataType_U32, &mAdaptiveMaxSamples);
+				ImGui::DragFloat("Convergence Threshold", &mAdaptiveThreshold, .001f, 0, 1);
+				ImGui::PopItemWidth();
+			}
+		}
+		if (mBounceStats.mTime > 0) {
+			// each traced path vertex casts a shadow ray and a BSDF ray
+			ImGui::LabelText("Bounces", "%s%s, depth %u: %.2fms", mBounceStats.mWavefront ? "wavefront" : "per pixel", mBounceStats.mSortPaths ? " (sorted)" : "", mBounceStats.mDepth, mBounceStats.mTime);
+			ImGui::LabelText("Rays/sec", "%.1fM", mBounceStats.mRays / (mBounceStats.mTime * 1e3));
+			if (mBounceStats.mAdaptiveBudget > 0)
+				ImGui::LabelText("Adaptive paths", "%u / %u", mBounceStats.mAdaptiveSamples, mBounceStats.mAdaptiveBudget);
+			if (ImGui::TreeNode("Traced paths")) {
+				for (uint32_t i = 0; i < mBounceStats.mTracedPaths.size(); i++)
+					ImGui::LabelText(("Bounce " + to_string(i)).c_str(), "%u", mBounceStats.mTracedPaths[i]);
+				ImGui::TreePop();
+			}
+		}
+		ImGui::PushItemWidth(40);
+		ImGui::InputScalar("ReSTIR Candidates", ImGuiDataType_U32, &mReservoirSamples);
+		ImGui::PopItemWidth();
+		if (mReservoirSamples > 0) {
+			ImGui::Checkbox("Temporal Reservoir Reuse", &mTemporalReservoirReuse);
+			ImGui::PushItemWidth(40);
+			ImGui::InputScalar("Spatial Reuse Iterations", ImGuiDataType_U32, &mSpatialReservoirIterations);
+			ImGui::PopItemWidth();
+		}
 		ImGui::Checkbox("Demodulate Albedo", &mDemodulateAlbedo);
 
 		ImGui::Checkbox("Random Frame Seed", &mRandomPerFrame);
@@ -114,7 +344,47 @@ void RayTraceScene::on_inspector_gui() {
 		}
 	}
 
+	if (ImGui::CollapsingHeader("Acceleration Structures")) {
+		ImGui::Checkbox("Refit TLAS", &mTopLevelRefit);
+		if (mTopLevelRefit) {
+			ImGui::PushItemWidth(40);
+			ImGui::InputScalar("Max Consecutive Refits", ImGuiDataType_U32, &mTopLevelMaxRefits);
+			ImGui::PopItemWidth();
+		}
+		ImGui::LabelText("TLAS instances", "%zu", mTopLevelInstances.size());
+		ImGui::LabelText("TLAS builds", "%zu", mTopLevelStats.mBuilds);
+		ImGui::LabelText("TLAS refits", "%zu", mTopLevelStats.mRefits);
+		ImGui::LabelText("TLAS skipped", "%zu", mTopLevelStats.mSkipped);
+		ImGui::PushItemWidth(40);
+		ImGui::InputScalar("BLAS Primitive Budget", ImGuiDataType_U32, &mBlasBuildQueue.primitive_budget());
+		ImGui::PopItemWidth();
+		auto scratchBytes = format_bytes(mBlasBuildQueue.scratch_size());
+		ImGui::LabelText("BLAS builds", "%zu in %zu batches, %zu pending", mBlasBuildQueue.build_count(), mBlasBuildQueue.batch_count(), mBlasBuildQueue.pending_count());
+		ImGui::LabelText("BLAS scratch", "%zu %s", scratchBytes.first, scratchBytes.second);
+		ImGui::Checkbox("Compact BLAS", &mCompactBlas);
+		vk::DeviceSize blasBytes = 0;
+		for (const auto&[mesh, blas] : mMeshAccelerationStructures)
+			blasBytes += blas.mAccelerationStructure->buffer().size_bytes();
+		auto blasSize = format_bytes(blasBytes);
+		auto uncompactedSize = format_bytes(mBlasBuildQueue.uncompacted_bytes());
+		auto compactedSize = format_bytes(mBlasBuildQueue.compacted_bytes());
+		ImGui::LabelText("BLAS memory", "%zu %s", blasSize.first, blasSize.second);
+		ImGui::LabelText("Compacted", "%zu %s -> %zu %s", uncompactedSize.first, uncompactedSize.second, compactedSize.first, compactedSize.second);
+		ImGui::LabelText("Resident meshes", "%zu", mMeshGeometry.size());
+		// the arenas hold each mesh once, instead of once per instance
+		auto vertexBytes = format_bytes(mVertices ? mVertices.size_bytes() : 0);
+		auto indexBytes = format_bytes(mIndices ? mIndices.size_bytes() : 0);
+		auto instancedBytes = format_bytes(mInstancedGeometryBytes);
+		ImGui::LabelText("gVertices", "%zu %s", vertexBytes.first, vertexBytes.second);
+		ImGui::LabelText("gIndices", "%zu %s", indexBytes.first, indexBytes.second);
+		ImGui::LabelText("Without sharing", "%zu %s", instancedBytes.first, instancedBytes.second);
+		ImGui::Checkbox("Refit Animated BLAS", &mRefitAnimatedBlas);
+		ImGui::LabelText("Animated instances", "%zu (%zu deformed)", mAnimatedInstances.size(), mAnimatedStats.mDeformed);
+		ImGui::LabelText("Animated BLAS", "%zu refits, %zu builds", mAnimatedStats.mRefits, mAnimatedStats.mBuilds);
+	}
+
 	if (ImGui::CollapsingHeader("Denoising")) {
+		ImGui::Checkbox("Alias Temporary Images", &mAliasTemporaries);
 		ImGui::Checkbox("Reprojection", &mReprojection);
 		if (mReprojection) {
 			ImGui::InputFloat("History Limit", &mTemporalAccumulationPipeline->push_constant<float>("gHistoryLimit"));
@@ -161,6 +431,64 @@ void RayTraceScene::on_inspector_gui() {
 		ImGui::PopItemWidth();
 	}
 
+	if (ImGui::CollapsingHeader("Frame Memory") && mCurFrame->mRadiance) {
+		// per frame in flight. COMPACT_ENCODING in visibility_buffer.hlsli selects the visibility and path state layouts
+		ImGui::Text(COMPACT_ENCODING ? "Compact encoding" : "Full encoding");
+		const vk::DeviceSize pixels = mCurFrame->mRadiance.extent().width*mCurFrame->mRadiance.extent().height;
+		auto image_bytes = [](const Image::View& v) -> vk::DeviceSize {
+			return v ? v.extent().width*v.extent().height*texel_size(v.image()->format()) : 0;
+		};
+		vk::DeviceSize total = 0;
+		auto memory_row = [&](const char* label, vk::DeviceSize bytes) {
+			total += bytes;
+			auto size = format_bytes(bytes);
+			ImGui::LabelText(label, "%zu %s (%zu B/px)", size.first, size.second, (size_t)(bytes/pixels));
+		};
+		vk::DeviceSize visibilityBytes = 0;
+		for (const Image::View& v : mCurFrame->mVisibility)
+			visibilityBytes += image_bytes(v);
+		memory_row("Visibility", visibilityBytes);
+		memory_row("Path states", mCurFrame->mPathBounceData ? mCurFrame->mPathBounceData.size_bytes() : 0);
+		memory_row("Path queues", mCurFrame->mPathQueue ? mCurFrame->mPathQueue.size_bytes() : 0);
+		memory_row("Radiance, albedo", image_bytes(mCurFrame->mRadiance) + image_bytes(mCurFrame->mAlbedo));
+		memory_row("Reservoirs", image_bytes(mCurFrame->mReservoirs[0]) + image_bytes(mCurFrame->mReservoirs[1]) + image_bytes(mCurFrame->mReservoirRNG[0]) + image_bytes(mCurFrame->mReservoirRNG[1]));
+		memory_row("Accumulation", image_bytes(mCurFrame->mAccumColor) + image_bytes(mCurFrame->mAccumMoments));
+		vk::DeviceSize adaptiveBytes = image_bytes(mCurFrame->mSamplePriority);
+		for (const Buffer::View<byte>& b : { mCurFrame->mAdaptiveArgs, mCurFrame->mAdaptiveSamples, mCurFrame->mSampleCounts, mCurFrame->mSampleRadiance })
+			if (b) adaptiveBytes += b.size_bytes();
+		memory_row("Adaptive sampling", adaptiveBytes);
+		vk::DeviceSize tempBytes = 0;
+		for (const Image::View& v : mCurFrame->mTemp)
+			tempBytes += image_bytes(v);
+		for (const auto& d : mCurFrame->mDiffTemp)
+			tempBytes += image_bytes(d[0]) + image_bytes(d[1]);
+		memory_row(mCurFrame->mAliasedTemp ? "Temporaries (aliased)" : "Temporaries", tempBytes);
+		auto totalSize = format_bytes(total);
+		ImGui::LabelText("Total", "%zu %s", totalSize.first, totalSize.second);
+
+		// each traced path reads and writes its state and its pixel's radiance once per bounce
+		const vk::DeviceSize pathBytes = 2*(PATH_BOUNCE_STATE_SIZE + texel_size(mCurFrame->mRadiance.image()->format()));
+		ImGui::LabelText("Traffic per path bounce", "%zu B", (size_t)pathBytes);
+		if (mBounceStats.mTime > 0) {
+			uint64_t paths = 0;
+			for (uint32_t n : mBounceStats.mTracedPaths)
+				paths += n;
+			auto traffic = format_bytes(paths*pathBytes);
+			ImGui::LabelText("Bounce traffic", "%zu %s (%.1f GB/s)", traffic.first, traffic.second, paths*pathBytes / (mBounceStats.mTime * 1e6));
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Render Graph")) {
+		ImGui::LabelText("Passes", "%zu", mRenderGraph.passes().size());
+		ImGui::LabelText("Culled passes", "%zu", mRenderGraph.culled_count());
+		ImGui::LabelText("Barriers", "%zu", mRenderGraph.barrier_count());
+		for (const RenderGraph::Pass& pass : mRenderGraph.passes())
+			if (pass.culled())
+				ImGui::TextDisabled("%s (culled)", pass.name().c_str());
+			else
+				ImGui::Text("%s", pass.name().c_str());
+	}
+
 	uint32_t m = mTonemapPipeline->specialization_constant("gDebugMode");
   if (ImGui::BeginCombo("Debug Mode", to_string((DebugMode)m).c_str())) {
     for (uint32_t i = 0; i < DebugMode::eDebugModeCount; i++)
@@ -189,13 +517,97 @@ void RayTraceScene::on_inspector_gui() {
 	}
 }
 
+// removes the scale from a sphere's transform and applies it to the radius instead
+inline TransformData sphere_transform(TransformData transform, float& r) {
+	#ifdef TRANSFORM_UNIFORM_SCALING
+	r *= transform.mScale;
+	transform.mScale = 1;
+	#else
+	const float3 scale = float3(
+		transform.m.block(0, 0, 3, 1).matrix().norm(),
+		transform.m.block(0, 1, 3, 1).matrix().norm(),
+		transform.m.block(0, 2, 3, 1).matrix().norm() );
+	const Quaternionf rotation(transform.m.block<3,3>(0,0).matrix() * DiagonalMatrix<float,3,3>(1/scale.x(), 1/scale.y(), 1/scale.z()));
+	
+	r *= transform.m.block<3,3>(0,0).matrix().determinant();
+	transform = make_transform(transform.m.col(3).head<3>(), make_quatf(rotation.x(), rotation.y(), rotation.z(), rotation.w()), float3::Ones());
+	#endif
+	return transform;
+}
+
+// Vose's alias method. Writes weights.size() entries, stride floats apart: the probability of keeping the entry, and asfloat(its alias)
+inline void build_alias_table(const vector<double>& weights, float* table, const uint32_t stride) {
+	const double sum = accumulate(weights.begin(), weights.end(), 0.0);
+	vector<double> scaled(weights.size());
+	vector<uint32_t> small, large;
+	for (uint32_t i = 0; i < weights.size(); i++) {
+		scaled[i] = sum > 0 ? weights[i] * weights.size() / sum : 1;
+		(scaled[i] < 1 ? small : large).emplace_back(i);
+	}
+	while (!small.empty() && !large.empty()) {
+		const uint32_t s = small.back();
+		small.pop_back();
+		const uint32_t l = large.back();
+		table[stride*s] = (float)scaled[s];
+		table[stride*s + 1] = asfloat(l);
+		scaled[l] -= 1 - scaled[s];
+		if (scaled[l] < 1) {
+			large.pop_back();
+			small.emplace_back(l);
+		}
+	}
+	// what remains is 1 up to rounding
+	for (const vector<uint32_t>& v : { small, large })
+		for (uint32_t i : v) {
+			table[stride*i] = 1;
+			table[stride*i + 1] = asfloat(i);
+		}
+}
+
+uint32_t RayTraceScene::RangeAllocator::allocate(uint32_t size) {
+	for (auto it = mFreeRanges.begin(); it != mFreeRanges.end(); it++) {
+		if (it->second < size) continue;
+		const auto[offset, rangeSize] = *it;
+		mFreeRanges.erase(it);
+		if (rangeSize > size)
+			mFreeRanges.emplace(offset + size, rangeSize - size);
+		return offset;
+	}
+	const uint32_t offset = mEnd;
+	mEnd += size;
+	return offset;
+}
+void RayTraceScene::RangeAllocator::free(uint32_t offset, uint32_t size) {
+	if (size == 0) return;
+	// merge with the adjacent free ranges
+	auto next = mFreeRanges.lower_bound(offset);
+	if (next != mFreeRanges.end() && offset + size == next->first) {
+		size += next->second;
+		next = mFreeRanges.erase(next);
+	}
+	if (next != mFreeRanges.begin()) {
+		auto p = prev(next);
+		if (p->first + p->second == offset) {
+			offset = p->first;
+			size += p->second;
+			mFreeRanges.erase(p);
+		}
+	}
+	if (offset + size == mEnd)
+		mEnd = offset;
+	else
+		mFreeRanges.emplace(offset, size);
+}
+
 void RayTraceScene::update(CommandBuffer& commandBuffer) {
 	ProfilerRegion s("RayTraceScene::update", commandBuffer);
 
-	swap(mPrevFrame, mCurFrame);
+	mInFlightFrames.emplace_back(move(mPrevFrame));
+	mPrevFrame = move(mCurFrame);
+	mCurFrame = move(mInFlightFrames.front());
+	mInFlightFrames.pop_front();
 	mCurFrame->mFrameId = mPrevFrame->mFrameId + 1;
-
-	vector<vk::BufferMemoryBarrier> blasBarriers;
+	mSceneVersion++;
 
 	if (!mUnitCubeAS) {
 		Buffer::View<vk::AabbPositionsKHR> aabb = make_shared<Buffer>(commandBuffer.mDevice, "Unit cube aabb", sizeof(vk::AabbPositionsKHR), vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR|vk::BufferUsageFlagBits::eShaderDeviceAddress, VMA_MEMORY_USAGE_CPU_TO_GPU);
@@ -205,278 +617,835 @@ void RayTraceScene::update(CommandBuffer& commandBuffer) {
 		aabb[0].maxX = 1;
 		aabb[0].maxY = 1;
 		aabb[0].maxZ = 1;
-		vk::AccelerationStructureGeometryAabbsDataKHR aabbs(commandBuffer.hold_resource(aabb).device_address(), sizeof(vk::AabbPositionsKHR));
+		vk::AccelerationStructureGeometryAabbsDataKHR aabbs(aabb.device_address(), sizeof(vk::AabbPositionsKHR));
 		vk::AccelerationStructureGeometryKHR aabbGeometry(vk::GeometryTypeKHR::eAabbs, aabbs, vk::GeometryFlagBitsKHR::eOpaque);
 		vk::AccelerationStructureBuildRangeInfoKHR range(1);
-		mUnitCubeAS = make_shared<AccelerationStructure>(commandBuffer, "Unit cube BLAS", vk::AccelerationStructureTypeKHR::eBottomLevel, aabbGeometry, range);
-		blasBarriers.emplace_back(
-			vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR,
-			VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
-			**mUnitCubeAS->buffer().buffer(), mUnitCubeAS->buffer().offset(), mUnitCubeAS->buffer().size_bytes());
+		mUnitCubeAS = mBlasBuildQueue.push(commandBuffer.mDevice, "Unit cube BLAS", aabbGeometry, range, { aabb });
 	}
 
-	ImagePool images;
-	images.distribution_data_size = 0;
+	const NodeGraph& nodeGraph = mNode.node_graph();
+	const TransformCache& transforms = transform_cache(nodeGraph);
+	bool extract = mInstanceSetVersion == 0 ||
+		nodeGraph.structure_version() != mExtractedVersions.mStructure ||
+		nodeGraph.component_version<SpherePrimitive>() != mExtractedVersions.mSpheres ||
+		nodeGraph.component_version<MeshPrimitive>() != mExtractedVersions.mMeshes;
+	bool tlasDirty = extract;
+
+	if (!extract && nodeGraph.component_version<Material>() != mExtractedVersions.mMaterials) {
+		ProfilerRegion s("Update materials", commandBuffer);
+		// re-store modified materials in place, materials that change size or type require a full extraction
+		for (MaterialRecord& r : mMaterialRecords) {
+			if (!r.mMaterial) continue;
+			const uint64_t version = r.mMaterial.node().version<Material>();
+			if (version == r.mVersion) continue;
+			const uint32_t distributionDataSize = mImages.distribution_data_size;
+			ByteAppendBuffer bytes;
+			store_material(bytes, mImages, *r.mMaterial);
+			if (r.mMaterial->index() != r.mType || bytes.data.size()*sizeof(uint32_t) != r.mSize) {
+				extract = true;
+				break;
+			}
+			ranges::copy(bytes.data, mMaterialData.data.begin() + r.mAddress/sizeof(uint32_t));
+			r.mVersion = version;
+			r.mDirtyVersion = mSceneVersion;
+			if (r.mMaterial->index() == BSDFType::eEmissive)
+				mLightDistributionDirty = true;
+			if (mImages.distribution_data_size != distributionDataSize)
+				mDistributionDataVersion = mSceneVersion;
+		}
+	}
 
-	uint32_t totalVertexCount = 0;
-	uint32_t totalIndexBufferSize = 0;
-	ByteAppendBuffer materialData;
-	materialData.data.reserve(mPrevFrame->mMaterialData ? mPrevFrame->mMaterialData.size()/sizeof(uint32_t) : 1);
-	unordered_map<Material*, uint32_t> materialMap;
-	
-	vector<tuple<MeshPrimitive*, MeshAS*, uint32_t>> instanceIndices;
-	vector<vk::AccelerationStructureInstanceKHR> instancesAS;
-	vector<InstanceData> instanceDatas;
-	instanceDatas.reserve(mPrevFrame->mInstances ? mPrevFrame->mInstances.size() : 1);
-	unordered_map<void*, pair<hlsl::TransformData, uint32_t>> transformHistory;
-	Buffer::View<uint32_t> instanceIndexMap = make_shared<Buffer>(commandBuffer.mDevice, "InstanceIndexMap", sizeof(uint32_t)*max<size_t>(1, mTransformHistory.size()), vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU);
-	ranges::fill(instanceIndexMap, -1);
-
-	vector<uint32_t> lightInstances;
-	lightInstances.reserve(1);
-
-	{ // spheres
-		ProfilerRegion s("Process spheres", commandBuffer);
-		mNode.for_each_descendant<SpherePrimitive>([&](const component_ptr<SpherePrimitive>& prim) {
-			// append unique materials to materials list
-			auto materialMap_it = materialMap.find(prim->mMaterial.get());
-			if (materialMap_it == materialMap.end()) {
-				materialMap_it = materialMap.emplace(prim->mMaterial.get(), (uint32_t)(materialData.data.size()*sizeof(uint32_t))).first;
-				store_material(materialData, images, *prim->mMaterial);
+	if (extract) {
+		ProfilerRegion s("Extract scene", commandBuffer);
+
+		// previous transforms and instance indices, for motion vectors and gInstanceIndexMap
+		unordered_map<void*, uint32_t> prevInstances;
+		prevInstances.reserve(mInstanceRecords.size());
+		for (uint32_t i = 0; i < mInstanceRecords.size(); i++)
+			prevInstances.emplace(mInstanceRecords[i].mPrimitive, i);
+		const vector<InstanceRecord> prevRecords = move(mInstanceRecords);
+
+		mInstanceRecords.clear();
+		mInstanceDatas.clear();
+		mInstancesAS.clear();
+		mMaterialRecords.clear();
+		mMaterialData.data.clear();
+		mImages.images.clear();
+		mImages.distribution_data_map.clear();
+		mImages.distribution_data_size = 0;
+		mLightInstances.clear();
+		mLightRecords.clear();
+		mUnbuiltInstances.clear();
+
+		mInstanceIndexMap.assign(max<size_t>(1, prevRecords.size()), ~0u);
+		mInstanceIndexMapIdentity = false;
+
+		unordered_map<Material*, uint32_t> materialMap;
+		auto append_material = [&](const component_ptr<Material>& material) {
+			auto it = materialMap.find(material.get());
+			if (it == materialMap.end()) {
+				const uint32_t address = (uint32_t)(mMaterialData.data.size()*sizeof(uint32_t));
+				it = materialMap.emplace(material.get(), address).first;
+				if (material)
+					store_material(mMaterialData, mImages, *material);
+				else {
+					Material error_mat = Lambertian{};
+					get<Lambertian>(error_mat).reflectance = make_image_value3({}, float3(1,0,1));
+					store_material(mMaterialData, mImages, error_mat);
+				}
+				mMaterialRecords.emplace_back(MaterialRecord{ material, address, (uint32_t)(mMaterialData.data.size()*sizeof(uint32_t)) - address, material ? material->index() : BSDFType::eLambertian, material ? material.node().version<Material>() : 0, mSceneVersion });
 			}
-			if (prim->mMaterial->index() == BSDFType::eEmissive)
-				lightInstances.emplace_back((uint32_t)instanceDatas.size());
-
-			TransformData transform = node_to_world(prim.node());
-			float r = prim->mRadius;
-			#ifdef TRANSFORM_UNIFORM_SCALING
-			r *= transform.mScale;
-			transform.mScale = 1;
-			#else
-			const float3 scale = float3(
-				transform.m.block(0, 0, 3, 1).matrix().norm(),
-				transform.m.block(0, 1, 3, 1).matrix().norm(),
-				transform.m.block(0, 2, 3, 1).matrix().norm() );
-			const Quaternionf rotation(transform.m.block<3,3>(0,0).matrix() * DiagonalMatrix<float,3,3>(1/scale.x(), 1/scale.y(), 1/scale.z()));
-			
-			r *= transform.m.block<3,3>(0,0).matrix().determinant();
-			transform = make_transform(transform.m.col(3).head<3>(), make_quatf(rotation.x(), rotation.y(), rotation.z(), rotation.w()), float3::Ones());
-			#endif
-			
+			return it->second;
+		};
+		auto append_instance = [&](void* prim, const Node& node, float radius) {
+			const uint32_t index = (uint32_t)mInstanceRecords.size();
+			const uint32_t transformIndex = transforms.index(node);
+			float r = radius;
+			TransformData transform = transforms.node_to_world(transformIndex);
+			if (radius > 0) transform = sphere_transform(transform, r);
 			TransformData prevTransform;
-			if (auto it = mTransformHistory.find(prim.get()); it != mTransformHistory.end()) {
-				prevTransform = it->second.first;
-				instanceIndexMap[it->second.second] = (uint32_t)instanceDatas.size();
+			if (auto it = prevInstances.find(prim); it != prevInstances.end()) {
+				prevTransform = prevRecords[it->second].mTransform;
+				mInstanceIndexMap[it->second] = index;
 			} else
 				prevTransform = transform;
+			mInstanceRecords.emplace_back(InstanceRecord{ prim, transformIndex, radius, transform, transforms.version(transformIndex), mSceneVersion, true });
+			return make_tuple(transform, prevTransform, r);
+		};
+
+		{ // spheres
+			ProfilerRegion s("Process spheres", commandBuffer);
+			transforms.for_each_descendant<SpherePrimitive>(mNode, [&](const component_ptr<SpherePrimitive>& prim) {
+				const uint32_t materialAddress = append_material(prim->mMaterial);
+				if (prim->mMaterial->index() == BSDFType::eEmissive) {
+					mLightInstances.emplace_back((uint32_t)mInstanceDatas.size());
+					mLightRecords.emplace_back(LightRecord{ prim->mMaterial, nullptr });
+				}
 
-			vk::AccelerationStructureInstanceKHR& instance = instancesAS.emplace_back();
-			Matrix<float,3,4,RowMajor>::Map(&instance.transform.matrix[0][0]) = to_float3x4(tmul(transform, make_transform(float3::Zero(), quatf_identity(), float3::Constant(prim->mRadius))));
-			instance.instanceCustomIndex = (uint32_t)instanceDatas.size();
-			instance.mask = BVH_FLAG_SPHERES;
-			instance.accelerationStructureReference = commandBuffer.mDevice->getAccelerationStructureAddressKHR(**mUnitCubeAS);
+				const auto[transform, prevTransform, r] = append_instance(prim.get(), prim.node(), prim->mRadius);
 
-			transformHistory.emplace(prim.get(), make_pair(transform, (uint32_t)instanceDatas.size()));
-			instanceDatas.emplace_back( make_instance_sphere(transform, prevTransform, materialMap_it->second, r) );
-		});
-	}
+				vk::AccelerationStructureInstanceKHR& instance = mInstancesAS.emplace_back();
+				Matrix<float,3,4,RowMajor>::Map(&instance.transform.matrix[0][0]) = to_float3x4(tmul(transform, make_transform(float3::Zero(), quatf_identity(), float3::Constant(prim->mRadius))));
+				instance.instanceCustomIndex = (uint32_t)mInstanceDatas.size();
+				instance.mask = BVH_FLAG_SPHERES;
+				if (mUnitCubeAS->built())
+					instance.accelerationStructureReference = commandBuffer.mDevice->getAccelerationStructureAddressKHR(**mUnitCubeAS);
+				else
+					mUnbuiltInstances.emplace_back((uint32_t)mInstancesAS.size() - 1, mUnitCubeAS);
 
-	{ // meshes
-		Material error_mat = Lambertian{};
-		get<Lambertian>(error_mat).reflectance = make_image_value3({}, float3(1,0,1));
-		materialMap.emplace(nullptr, (uint32_t)(materialData.data.size()*sizeof(uint32_t)));
-		store_material(materialData, images, error_mat);
+				mInstanceDatas.emplace_back( make_instance_sphere(transform, prevTransform, materialAddress, r) );
+			});
+		}
 
-		ProfilerRegion s("Process meshes", commandBuffer);
-		mNode.for_each_descendant<MeshPrimitive>([&](const component_ptr<MeshPrimitive>& prim) {
-			if (prim->mMesh->topology() != vk::PrimitiveTopology::eTriangleList) return;
+		{ // meshes
+			append_material({});
 
-			// build BLAS
-			auto it = mMeshAccelerationStructures.find(prim->mMesh.get());
-			if (it == mMeshAccelerationStructures.end()) {
-				const auto& [vertexPosDesc, positions] = prim->mMesh->vertices()->at(VertexArrayObject::AttributeType::ePosition)[0];
-				
+			ProfilerRegion s("Process meshes", commandBuffer);
+			mInstancedGeometryBytes = 0;
+			transforms.for_each_descendant<MeshPrimitive>(mNode, [&](const component_ptr<MeshPrimitive>& prim) {
+				if (prim->mMesh->topology() != vk::PrimitiveTopology::eTriangleList) return;
 				if (prim->mMesh->index_type() != vk::IndexType::eUint32 && prim->mMesh->index_type() != vk::IndexType::eUint16)
 					return;
 
-				vk::AccelerationStructureGeometryTrianglesDataKHR triangles;
-				triangles.vertexFormat = vertexPosDesc.mFormat;
-				triangles.vertexData = commandBuffer.hold_resource(positions).device_address();
-				triangles.vertexStride = vertexPosDesc.mStride;
-				triangles.maxVertex = (uint32_t)(positions.size_bytes()/vertexPosDesc.mStride);
-				triangles.indexType = prim->mMesh->index_type();
-				triangles.indexData = commandBuffer.hold_resource(prim->mMesh->indices()).device_address();
-				vk::GeometryFlagBitsKHR flag = vk::GeometryFlagBitsKHR::eOpaque;
-				// TODO: non-opaque geometry
-				vk::AccelerationStructureGeometryKHR triangleGeometry(vk::GeometryTypeKHR::eTriangles, triangles, flag);
-				vk::AccelerationStructureBuildRangeInfoKHR range(prim->mMesh->indices().size()/(prim->mMesh->indices().stride()*3));
-				auto as = make_shared<AccelerationStructure>(commandBuffer, prim.node().name()+"/BLAS", vk::AccelerationStructureTypeKHR::eBottomLevel, triangleGeometry, range);
-				blasBarriers.emplace_back(
-					vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR,
-					VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
-					**as->buffer().buffer(), as->buffer().offset(), as->buffer().size_bytes());
-				
-				if (mMeshVertices.find(prim->mMesh.get()) == mMeshVertices.end()) {
-					Buffer::View<PackedVertexData>& vertices = mMeshVertices.emplace(prim->mMesh.get(),
-						make_shared<Buffer>(commandBuffer.mDevice, prim.node().name()+"/PackedVertexData", triangles.maxVertex*sizeof(PackedVertexData), vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eShaderDeviceAddress)).first->second;
-					
-					// copy vertex data
-					auto positions = prim->mMesh->vertices()->at(VertexArrayObject::AttributeType::ePosition)[0];
-					auto normals   = prim->mMesh->vertices()->at(VertexArrayObject::AttributeType::eNormal)[0];
-					auto texcoords = prim->mMesh->vertices()->find(VertexArrayObject::AttributeType::eTexcoord);
-					auto tangents  = prim->mMesh->vertices()->find(VertexArrayObject::AttributeType::eTangent);
-					
-					commandBuffer.bind_pipeline(mCopyVerticesPipeline->get_pipeline());
-					mCopyVerticesPipeline->descriptor("gVertices") = vertices;
-					mCopyVerticesPipeline->descriptor("gPositions") = Buffer::View(positions.second, positions.first.mOffset);
-					mCopyVerticesPipeline->descriptor("gNormals")   = Buffer::View(normals.second, normals.first.mOffset);
-					mCopyVerticesPipeline->descriptor("gTangents")  = tangents ? Buffer::View(tangents->second, tangents->first.mOffset) : positions.second;
-					mCopyVerticesPipeline->descriptor("gTexcoords") = texcoords ? Buffer::View(texcoords->second, texcoords->first.mOffset) : positions.second;
-					mCopyVerticesPipeline->push_constant<uint32_t>("gCount") = vertices.size();
-					mCopyVerticesPipeline->push_constant<uint32_t>("gPositionStride") = positions.first.mStride;
-					mCopyVerticesPipeline->push_constant<uint32_t>("gNormalStride") = normals.first.mStride;
-					mCopyVerticesPipeline->push_constant<uint32_t>("gTangentStride") = tangents ? tangents->first.mStride : 0;
-					mCopyVerticesPipeline->push_constant<uint32_t>("gTexcoordStride") = texcoords ? texcoords->first.mStride : 0;
-					mCopyVerticesPipeline->bind_descriptor_sets(commandBuffer);
-					mCopyVerticesPipeline->push_constants(commandBuffer);
-					commandBuffer.dispatch_over(triangles.maxVertex);
-					commandBuffer.barrier(vertices, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderWrite, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead);
+				// animated primitives get their own BLAS instead of the mesh's
+				const component_ptr<AnimatedMesh> animation = prim.node().find<AnimatedMesh>();
+
+				// build BLAS
+				auto it = mMeshAccelerationStructures.find(prim->mMesh.get());
+				if (it == mMeshAccelerationStructures.end() && !animation) {
+					const auto& [vertexPosDesc, positions] = prim->mMesh->vertices()->at(VertexArrayObject::AttributeType::ePosition)[0];
+
+					vk::AccelerationStructureGeometryTrianglesDataKHR triangles;
+					triangles.vertexFormat = vertexPosDesc.mFormat;
+					triangles.vertexData = positions.device_address();
+					triangles.vertexStride = vertexPosDesc.mStride;
+					triangles.maxVertex = (uint32_t)(positions.size_bytes()/vertexPosDesc.mStride);
+					triangles.indexType = prim->mMesh->index_type();
+					triangles.indexData = prim->mMesh->indices().device_address();
+					vk::GeometryFlagBitsKHR flag = vk::GeometryFlagBitsKHR::eOpaque;
+					// TODO: non-opaque geometry
+					vk::AccelerationStructureGeometryKHR triangleGeometry(vk::GeometryTypeKHR::eTriangles, triangles, flag);
+					vk::AccelerationStructureBuildRangeInfoKHR range(prim->mMesh->indices().size()/(prim->mMesh->indices().stride()*3));
+					const vk::BuildAccelerationStructureFlagsKHR flags = mCompactBlas ?
+						vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace|vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction :
+						vk::BuildAccelerationStructureFlagsKHR(vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
+					auto as = mBlasBuildQueue.push(commandBuffer.mDevice, prim.node().name()+"/BLAS", triangleGeometry, range, { positions, prim->mMesh->indices() }, flags);
+
+					it = mMeshAccelerationStructures.emplace(prim->mMesh.get(), MeshAS { as, prim->mMesh->indices() }).first;
 				}
 
-				it = mMeshAccelerationStructures.emplace(prim->mMesh.get(), MeshAS { as, prim->mMesh->indices() }).first;
+				// allocate the mesh's ranges in the geometry arenas, its data is written after extraction
+				auto[geometryIt, added] = mMeshGeometry.try_emplace(prim->mMesh.get());
+				MeshGeometry& geometry = geometryIt->second;
+				if (added) {
+					const auto& [vertexPosDesc, positions] = prim->mMesh->vertices()->at(VertexArrayObject::AttributeType::ePosition)[0];
+					geometry.mVertexCount = (uint32_t)(positions.size_bytes()/vertexPosDesc.mStride);
+					geometry.mFirstVertex = mVertexRanges.allocate(geometry.mVertexCount);
+					geometry.mIndexBytes = (uint32_t)align_up(prim->mMesh->indices().size_bytes(), 4);
+					geometry.mIndexByteOffset = mIndexRanges.allocate(geometry.mIndexBytes);
+					mPendingGeometry.emplace_back(prim->mMesh.get());
+				}
+				geometry.mUsedVersion = mSceneVersion;
+
+				// animated instances start inactive, their BLAS is built when they are first deformed
+				uint32_t firstVertex = geometry.mFirstVertex;
+				shared_ptr<AccelerationStructure> blas = animation ? nullptr : it->second.mAccelerationStructure;
+				if (animation) {
+					auto[animatedIt, added] = mAnimatedInstances.try_emplace(prim.get());
+					AnimatedInstance& a = animatedIt->second;
+					if (!added && a.mMesh != prim->mMesh.get())
+						mVertexRanges.free(a.mFirstVertex, a.mVertexCount);
+					if (added || a.mMesh != prim->mMesh.get()) {
+						a.mMesh = prim->mMesh.get();
+						a.mVertexCount = geometry.mVertexCount;
+						a.mFirstVertex = mVertexRanges.allocate(a.mVertexCount);
+						a.mAccelerationStructure.reset();
+					}
+					a.mAnimation = animation;
+					a.mInstanceIndex = (uint32_t)mInstancesAS.size();
+					a.mUsedVersion = mSceneVersion;
+					firstVertex = a.mFirstVertex;
+					blas = a.mAccelerationStructure;
+				}
+				
+				const uint32_t materialAddress = append_material(prim->mMaterial);
+				if (prim->mMaterial->index() == BSDFType::eEmissive) {
+					mLightInstances.emplace_back((uint32_t)mInstanceDatas.size());
+					mLightRecords.emplace_back(LightRecord{ prim->mMaterial, prim->mMesh.get() });
+					// read back new emissive meshes, for their triangle alias tables
+					const auto& [vertexPosDesc, positions] = prim->mMesh->vertices()->at(VertexArrayObject::AttributeType::ePosition)[0];
+					if (mEmissiveMeshes.try_emplace(prim->mMesh.get()).second && vertexPosDesc.mFormat == vk::Format::eR32G32B32Sfloat) {
+						const Buffer::View<byte> src = Buffer::View<byte>(positions, vertexPosDesc.mOffset, (geometry.mVertexCount-1)*vertexPosDesc.mStride + sizeof(float3));
+						TriangleReadback& r = mTriangleReadbacks.emplace_back();
+						r.mMesh = prim->mMesh.get();
+						r.mPositions = make_shared<Buffer>(commandBuffer.mDevice, "Emissive positions readback", src.size_bytes(), vk::BufferUsageFlagBits::eTransferDst, VMA_MEMORY_USAGE_GPU_TO_CPU);
+						r.mPositionStride = vertexPosDesc.mStride;
+						r.mIndices = make_shared<Buffer>(commandBuffer.mDevice, "Emissive indices readback", prim->mMesh->indices().size_bytes(), vk::BufferUsageFlagBits::eTransferDst, VMA_MEMORY_USAGE_GPU_TO_CPU);
+						r.mIndexStride = (uint32_t)prim->mMesh->indices().stride();
+						commandBuffer.copy_buffer(src, r.mPositions);
+						commandBuffer.copy_buffer(prim->mMesh->indices(), r.mIndices);
+						commandBuffer.barrier(r.mPositions, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostRead);
+						commandBuffer.barrier(r.mIndices, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostRead);
+					}
+				}
+				
+				const auto[transform, prevTransform, r] = append_instance(prim.get(), prim.node(), 0);
+
+				vk::AccelerationStructureInstanceKHR& instance = mInstancesAS.emplace_back();
+				Matrix<float,3,4,RowMajor>::Map(&instance.transform.matrix[0][0]) = to_float3x4(transform);
+				instance.instanceCustomIndex = (uint32_t)mInstanceDatas.size();
+				instance.mask = BVH_FLAG_TRIANGLES;
+				if (blas && blas->built())
+					instance.accelerationStructureReference = commandBuffer.mDevice->getAccelerationStructureAddressKHR(*commandBuffer.hold_resource(blas));
+				else if (!animation)
+					mUnbuiltInstances.emplace_back((uint32_t)mInstancesAS.size() - 1, blas);
+
+				const uint32_t triCount = prim->mMesh->indices().size_bytes() / (prim->mMesh->indices().stride()*3);
+				
+				mInstanceDatas.emplace_back(make_instance_triangles(transform, prevTransform, materialAddress, triCount, firstVertex, geometry.mIndexByteOffset, (uint32_t)prim->mMesh->indices().stride()));
+				mInstancedGeometryBytes += geometry.mVertexCount*sizeof(PackedVertexData) + geometry.mIndexBytes;
+			});
+
+			// free the vertices of animated primitives that are no longer instanced
+			for (auto it = mAnimatedInstances.begin(); it != mAnimatedInstances.end();) {
+				if (it->second.mUsedVersion == mSceneVersion) {
+					it++;
+					continue;
+				}
+				mVertexRanges.free(it->second.mFirstVertex, it->second.mVertexCount);
+				it = mAnimatedInstances.erase(it);
 			}
-			
-			// append unique materials to materials list
-			auto materialMap_it = materialMap.find(prim->mMaterial.get());
-			if (materialMap_it == materialMap.end()) {
-				materialMap_it = materialMap.emplace(prim->mMaterial.get(), (uint32_t)(materialData.data.size()*sizeof(uint32_t))).first;
-				store_material(materialData, images, *prim->mMaterial);
+
+			// evict meshes that are no longer instanced
+			for (auto it = mMeshGeometry.begin(); it != mMeshGeometry.end();) {
+				if (it->second.mUsedVersion == mSceneVersion) {
+					it++;
+					continue;
+				}
+				mVertexRanges.free(it->second.mFirstVertex, it->second.mVertexCount);
+				mIndexRanges.free(it->second.mIndexByteOffset, it->second.mIndexBytes);
+				mMeshAccelerationStructures.erase(it->first);
+				mEmissiveMeshes.erase(it->first);
+				it = mMeshGeometry.erase(it);
 			}
-			if (prim->mMaterial->index() == BSDFType::eEmissive)
-				lightInstances.emplace_back((uint32_t)instanceDatas.size());
-			
-			const TransformData transform = node_to_world(prim.node());
-			TransformData prevTransform;
-			if (auto transform_it = mTransformHistory.find(prim.get()); transform_it != mTransformHistory.end()) {
-				prevTransform = transform_it->second.first;
-				instanceIndexMap[transform_it->second.second] = (uint32_t)instanceDatas.size();
+		}
+
+		{ // environment map
+			ProfilerRegion s("Process env map", commandBuffer);
+			component_ptr<Material> envMap;
+			transforms.for_each_descendant<Material>(mNode, [&](component_ptr<Material> m) {
+				if (m->index() == BSDFType::eEnvironment)
+					envMap = m;
+			});
+			mEnvironmentMaterialAddress = envMap ? append_material(envMap) : ~0u;
+		}
+
+		mInstanceSetVersion = mSceneVersion;
+		mDistributionDataVersion = mSceneVersion;
+		mLightDistributionDirty = true;
+		mInstancesMoved = true;
+		mExtractedVersions.mStructure = nodeGraph.structure_version();
+		mExtractedVersions.mSpheres = nodeGraph.component_version<SpherePrimitive>();
+		mExtractedVersions.mMeshes = nodeGraph.component_version<MeshPrimitive>();
+		mExtractedVersions.mTransforms = nodeGraph.component_version<TransformData>();
+	} else if (mInstancesMoved || nodeGraph.component_version<TransformData>() != mExtractedVersions.mTransforms) {
+		ProfilerRegion s("Update transforms", commandBuffer);
+		// only instances whose transform (or an ancestor's) changed are written, and instances that moved last update get their prev_transform reset
+		mInstancesMoved = false;
+		for (uint32_t i = 0; i < mInstanceRecords.size(); i++) {
+			InstanceRecord& r = mInstanceRecords[i];
+			InstanceData& d = mInstanceDatas[i];
+			const uint64_t version = transforms.version(r.mTransformIndex);
+			if (version != r.mTransformVersion) {
+				const TransformData prevTransform = r.mTransform;
+				float radius = r.mRadius;
+				r.mTransform = transforms.node_to_world(r.mTransformIndex);
+				if (r.mRadius > 0) {
+					r.mTransform = sphere_transform(r.mTransform, radius);
+					d.v[1] = asuint(radius);
+				}
+				r.mTransformVersion = version;
+				r.mMoved = true;
+				mInstancesMoved = true;
+				d.transform = r.mTransform;
+				d.prev_transform = tmul(prevTransform, r.mTransform.inverse());
+
+				vk::AccelerationStructureInstanceKHR& instance = mInstancesAS[i];
+				if (r.mRadius > 0)
+					Matrix<float,3,4,RowMajor>::Map(&instance.transform.matrix[0][0]) = to_float3x4(tmul(r.mTransform, make_transform(float3::Zero(), quatf_identity(), float3::Constant(r.mRadius))));
+				else
+					Matrix<float,3,4,RowMajor>::Map(&instance.transform.matrix[0][0]) = to_float3x4(r.mTransform);
+				tlasDirty = true;
+			} else if (r.mMoved) {
+				d.prev_transform = tmul(r.mTransform, r.mTransform.inverse());
+				r.mMoved = false;
 			} else
-				prevTransform = transform;
+				continue;
+			r.mDirtyVersion = mSceneVersion;
+		}
+		// light power depends on the instance's scale, so lights that moved this update need a new light distribution
+		for (uint32_t i : mLightInstances)
+			if (mInstanceRecords[i].mMoved && mInstanceRecords[i].mDirtyVersion == mSceneVersion) {
+				mLightDistributionDirty = true;
+				break;
+			}
+		mExtractedVersions.mTransforms = nodeGraph.component_version<TransformData>();
+	}
+	mExtractedVersions.mMaterials = nodeGraph.component_version<Material>();
 
-			vk::AccelerationStructureInstanceKHR& instance = instancesAS.emplace_back();
-			Matrix<float,3,4,RowMajor>::Map(&instance.transform.matrix[0][0]) = to_float3x4(transform);
-			instance.instanceCustomIndex = (uint32_t)instanceDatas.size();
-			instance.mask = BVH_FLAG_TRIANGLES;
-			instance.accelerationStructureReference = commandBuffer.mDevice->getAccelerationStructureAddressKHR(*commandBuffer.hold_resource(it->second.mAccelerationStructure));
+	if (!extract && !mInstanceIndexMapIdentity) {
+		// instance indices only change during extraction
+		mInstanceIndexMap.resize(max<size_t>(1, mInstanceRecords.size()));
+		iota(mInstanceIndexMap.begin(), mInstanceIndexMap.end(), 0u);
+		mInstanceIndexMapIdentity = true;
+	}
+	
+	if (!mVertices || !mIndices || !mPendingGeometry.empty() || mVertices.size() < mVertexRanges.end()) {
+		ProfilerRegion s("Upload geometry", commandBuffer);
+
+		// previous frames may still be reading the arenas, and new meshes can reuse ranges freed by meshes they trace
+		if (mVertices)
+			commandBuffer.barrier(mVertices,
+				vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eTransferWrite,
+				vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eTransferRead);
+		if (mIndices)
+			commandBuffer.barrier(mIndices,
+				vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite,
+				vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead|vk::AccessFlagBits::eTransferWrite);
+
+		// grow the arenas, keeping the resident geometry where it is
+		if (!mVertices || mVertices.size() < mVertexRanges.end()) {
+			Buffer::View<PackedVertexData> vertices = make_shared<Buffer>(commandBuffer.mDevice, "gVertices", max<size_t>({ 1, mVertexRanges.end(), 2*mVertices.size() })*sizeof(PackedVertexData), vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eShaderDeviceAddress|vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR, VMA_MEMORY_USAGE_GPU_ONLY, 16);
+			if (mVertices) {
+				commandBuffer.copy_buffer(mVertices, vertices);
+				// the copy includes freed ranges that new meshes are about to overwrite
+				commandBuffer.barrier(vertices, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderWrite);
+			}
+			mVertices = vertices;
+		}
+		if (!mIndices || mIndices.size() < mIndexRanges.end()) {
+			Buffer::View<byte> indices = make_shared<Buffer>(commandBuffer.mDevice, "gIndices", max<size_t>({ sizeof(uint32_t), mIndexRanges.end(), 2*mIndices.size() }), vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY, 4);
+			if (mIndices) {
+				commandBuffer.copy_buffer(mIndices, indices);
+				commandBuffer.barrier(indices, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite);
+			}
+			mIndices = indices;
+		}
+
+		if (!mPendingGeometry.empty())
+			commandBuffer.bind_pipeline(mCopyVerticesPipeline->get_pipeline());
+		for (Mesh* mesh : mPendingGeometry) {
+			const MeshGeometry& geometry = mMeshGeometry.at(mesh);
 
-			const uint32_t triCount = prim->mMesh->indices().size_bytes() / (prim->mMesh->indices().stride()*3);
+			auto positions = mesh->vertices()->at(VertexArrayObject::AttributeType::ePosition)[0];
+			auto normals   = mesh->vertices()->at(VertexArrayObject::AttributeType::eNormal)[0];
+			auto texcoords = mesh->vertices()->find(VertexArrayObject::AttributeType::eTexcoord);
+			auto tangents  = mesh->vertices()->find(VertexArrayObject::AttributeType::eTangent);
 			
-			instanceIndices.emplace_back(prim.get(), &it->second, (uint32_t)instanceDatas.size());
-			transformHistory.emplace(prim.get(), make_pair(transform, (uint32_t)instanceDatas.size()));
-			instanceDatas.emplace_back(make_instance_triangles(transform, prevTransform, materialMap_it->second, triCount, totalVertexCount, totalIndexBufferSize, (uint32_t)it->second.mIndices.stride()));
-			totalVertexCount += mMeshVertices.at(prim->mMesh.get()).size();
-			totalIndexBufferSize += align_up(it->second.mIndices.size_bytes(), 4);
-		});
-		mTransformHistory = transformHistory;
+			mCopyVerticesPipeline->descriptor("gVertices") = mVertices;
+			mCopyVerticesPipeline->descriptor("gPositions") = Buffer::View(positions.second, positions.first.mOffset);
+			mCopyVerticesPipeline->descriptor("gNormals")   = Buffer::View(normals.second, normals.first.mOffset);
+			mCopyVerticesPipeline->descriptor("gTangents")  = tangents ? Buffer::View(tangents->second, tangents->first.mOffset) : positions.second;
+			mCopyVerticesPipeline->descriptor("gTexcoords") = texcoords ? Buffer::View(texcoords->second, texcoords->first.mOffset) : positions.second;
+			mCopyVerticesPipeline->push_constant<uint32_t>("gCount") = geometry.mVertexCount;
+			mCopyVerticesPipeline->push_constant<uint32_t>("gFirstVertex") = geometry.mFirstVertex;
+			mCopyVerticesPipeline->push_constant<uint32_t>("gPositionStride") = positions.first.mStride;
+			mCopyVerticesPipeline->push_constant<uint32_t>("gNormalStride") = normals.first.mStride;
+			mCopyVerticesPipeline->push_constant<uint32_t>("gTangentStride") = tangents ? tangents->first.mStride : 0;
+			mCopyVerticesPipeline->push_constant<uint32_t>("gTexcoordStride") = texcoords ? texcoords->first.mStride : 0;
+			mCopyVerticesPipeline->bind_descriptor_sets(commandBuffer);
+			mCopyVerticesPipeline->push_constants(commandBuffer);
+			commandBuffer.dispatch_over(geometry.mVertexCount);
+
+			commandBuffer.copy_buffer(mesh->indices(), Buffer::View<byte>(mIndices.buffer(), geometry.mIndexByteOffset, mesh->indices().size_bytes()));
+		}
+		mPendingGeometry.clear();
+
+		commandBuffer.barrier(mVertices, vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead);
+		commandBuffer.barrier(mIndices, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead);
 	}
-	
+
+	bool blasDeformed = false;
+	if (!mAnimatedInstances.empty()) {
+		ProfilerRegion s("Animate meshes", commandBuffer);
+
+		// deform the instances whose joints or morph weights changed since they were last deformed
+		vector<AnimatedInstance*> deformed;
+		for (auto&[prim, a] : mAnimatedInstances) {
+			uint64_t version = a.mAnimation.node().version<AnimatedMesh>();
+			if (a.mAnimation->mWeights) {
+				version = max(version, transforms.version(transforms.index(a.mAnimation.node())));
+				for (const Node* joint : a.mAnimation->mJoints)
+					version = max(version, transforms.version(transforms.index(*joint)));
+			}
+			if (a.mAccelerationStructure && version == a.mAnimatedVersion) continue;
+			a.mAnimatedVersion = version;
+			deformed.emplace_back(&a);
+		}
+		mAnimatedStats.mDeformed = deformed.size();
+
+		if (!deformed.empty()) {
+			// previous frames may still be tracing against the vertices or refitting with them, and the bind poses may have just been uploaded
+			commandBuffer.barrier(mVertices,
+				vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR|vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eTransferWrite,
+				vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead|vk::AccessFlagBits::eTransferWrite);
+
+			// start from the bind pose
+			for (AnimatedInstance* a : deformed) {
+				const MeshGeometry& geometry = mMeshGeometry.at(a->mMesh);
+				commandBuffer.copy_buffer(Buffer::View<PackedVertexData>(mVertices, geometry.mFirstVertex, a->mVertexCount), Buffer::View<PackedVertexData>(mVertices, a->mFirstVertex, a->mVertexCount));
+			}
+			commandBuffer.barrier(mVertices, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+
+			auto set_vertex_constants = [&](ComputePipelineState& pipeline, const AnimatedInstance& a) {
+				pipeline.descriptor("gVertices") = mVertices;
+				pipeline.push_constant<uint32_t>("gVertexCount") = a.mVertexCount;
+				pipeline.push_constant<uint32_t>("gVertexStride") = sizeof(PackedVertexData);
+				pipeline.push_constant<uint32_t>("gNormalOffset") = offsetof(PackedVertexData, normal);
+				pipeline.push_constant<uint32_t>("gTangentOffset") = offsetof(PackedVertexData, tangent);
+				pipeline.push_constant<uint32_t>("gBaseAddress") = a.mFirstVertex*sizeof(PackedVertexData);
+			};
+
+			// morph targets, 4 per dispatch. instances write disjoint ranges, so only consecutive passes need a barrier
+			size_t targetCount = 0;
+			for (const AnimatedInstance* a : deformed)
+				targetCount = max(targetCount, a->mAnimation->mMorphTargets.size());
+			for (size_t first = 0; first < targetCount; first += 4) {
+				bool recorded = false;
+				for (AnimatedInstance* a : deformed) {
+					const AnimatedMesh& animation = *a->mAnimation;
+					if (first >= animation.mMorphTargets.size()) continue;
+					float4 factors = float4::Zero();
+					for (size_t i = 0; i < 4 && first + i < animation.mMorphTargets.size(); i++)
+						factors[i] = first + i < animation.mMorphWeights.size() ? animation.mMorphWeights[first + i] : 0.f;
+					if ((factors == 0).all()) continue;
+					if (!recorded) {
+						commandBuffer.bind_pipeline(mBlendPipeline->get_pipeline());
+						recorded = true;
+					}
+					set_vertex_constants(*mBlendPipeline, *a);
+					for (size_t i = 0; i < 4; i++)
+						mBlendPipeline->descriptor("gBlendTarget" + to_string(i)) = animation.mMorphTargets[min(first + i, animation.mMorphTargets.size() - 1)];
+					mBlendPipeline->push_constant<float4>("gBlendFactors") = factors;
+					mBlendPipeline->bind_descriptor_sets(commandBuffer);
+					mBlendPipeline->push_constants(commandBuffer);
+					commandBuffer.dispatch_over(a->mVertexCount);
+				}
+				if (recorded)
+					commandBuffer.barrier(mVertices, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+			}
+
+			// skinning, with the joints relative to the primitive's node since the instance transform is applied when tracing
+			bool skinned = false;
+			for (AnimatedInstance* a : deformed) {
+				const AnimatedMesh& animation = *a->mAnimation;
+				if (!animation.mWeights || animation.mJoints.empty()) continue;
+				if (!skinned) {
+					commandBuffer.bind_pipeline(mSkinPipeline->get_pipeline());
+					skinned = true;
+				}
+				const TransformData worldToMesh = transforms.node_to_world(transforms.index(a->mAnimation.node())).inverse();
+				vector<Matrix<float,3,4,RowMajor>> pose(animation.mJoints.size());
+				for (size_t j = 0; j < pose.size(); j++) {
+					Matrix4f jointToMesh = Matrix4f::Identity();
+					jointToMesh.topRows<3>() = to_float3x4(tmul(worldToMesh, transforms.node_to_world(transforms.index(*animation.mJoints[j])))).matrix();
+					pose[j] = (jointToMesh * animation.mInverseBindMatrices[j]).topRows<3>();
+				}
+				set_vertex_constants(*mSkinPipeline, *a);
+				mSkinPipeline->descriptor("gWeights") = animation.mWeights;
+				mSkinPipeline->descriptor("gPose") = commandBuffer.mDevice.upload_ring().upload(commandBuffer, pose);
+				mSkinPipeline->bind_descriptor_sets(commandBuffer);
+				mSkinPipeline->push_constants(commandBuffer);
+				commandBuffer.dispatch_over(a->mVertexCount);
+			}
+
+			commandBuffer.barrier(mVertices,
+				vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eTransferWrite,
+				vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::AccessFlagBits::eShaderRead);
+			// the structures being refit may still be read or written (by the previous refit) in previous frames
+			commandBuffer.barrier(vk::MemoryBarrier(vk::AccessFlagBits::eAccelerationStructureReadKHR|vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR|vk::AccessFlagBits::eAccelerationStructureWriteKHR),
+				vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+				vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR);
+
+			// refit the BLASes, the topology never changes so a refit is valid as long as the structure exists.
+			// each structure keeps its own scratch memory (see AccelerationStructure::build)
+			for (AnimatedInstance* a : deformed) {
+				vk::AccelerationStructureGeometryTrianglesDataKHR triangles;
+				triangles.vertexFormat = vk::Format::eR32G32B32Sfloat;
+				triangles.vertexData = mVertices.device_address() + a->mFirstVertex*sizeof(PackedVertexData);
+				triangles.vertexStride = sizeof(PackedVertexData);
+				triangles.maxVertex = a->mVertexCount;
+				triangles.indexType = a->mMesh->index_type();
+				triangles.indexData = a->mMesh->indices().device_address();
+				vk::AccelerationStructureGeometryKHR triangleGeometry(vk::GeometryTypeKHR::eTriangles, triangles, vk::GeometryFlagBitsKHR::eOpaque);
+				vk::AccelerationStructureBuildRangeInfoKHR range(a->mMesh->indices().size()/(a->mMesh->indices().stride()*3));
+				commandBuffer.hold_resource(a->mMesh->indices());
+
+				if (a->mAccelerationStructure && a->mAccelerationStructure->build(commandBuffer, triangleGeometry, range, mRefitAnimatedBlas ? vk::BuildAccelerationStructureModeKHR::eUpdate : vk::BuildAccelerationStructureModeKHR::eBuild)) {
+					if (mRefitAnimatedBlas)
+						mAnimatedStats.mRefits++;
+					else
+						mAnimatedStats.mBuilds++;
+				} else {
+					a->mAccelerationStructure = make_shared<AccelerationStructure>(commandBuffer, a->mAnimation.node().name()+"/BLAS", vk::AccelerationStructureTypeKHR::eBottomLevel, triangleGeometry, range,
+						vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate|vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild);
+					mAnimatedStats.mBuilds++;
+				}
+				mInstancesAS[a->mInstanceIndex].accelerationStructureReference = commandBuffer.mDevice->getAccelerationStructureAddressKHR(*commandBuffer.hold_resource(a->mAccelerationStructure));
+			}
+			commandBuffer.barrier(vk::MemoryBarrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR),
+				vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+				vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR|vk::PipelineStageFlagBits::eComputeShader);
+
+			// the TLAS bounds have to be updated even though its instances are unchanged
+			tlasDirty = true;
+			blasDeformed = true;
+		}
+	}
+
 	{ // Build TLAS
 		ProfilerRegion s("Build TLAS", commandBuffer);
-		commandBuffer.barrier(blasBarriers, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR);
-		vk::AccelerationStructureGeometryKHR geom { vk::GeometryTypeKHR::eInstances, vk::AccelerationStructureGeometryInstancesDataKHR() };
-		vk::AccelerationStructureBuildRangeInfoKHR range { (uint32_t)instancesAS.size() };
-		if (!instancesAS.empty()) {
-			auto buf = make_shared<Buffer>(commandBuffer.mDevice, "TLAS instance buffer", sizeof(vk::AccelerationStructureInstanceKHR)*instancesAS.size(), vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR|vk::BufferUsageFlagBits::eShaderDeviceAddress, VMA_MEMORY_USAGE_CPU_TO_GPU, 16);
-			memcpy(buf->data(), instancesAS.data(), buf->size());
-			commandBuffer.hold_resource(buf);
-			geom.geometry.instances.data = buf->device_address();
-		}
-		mTopLevel = make_shared<AccelerationStructure>(commandBuffer, mNode.name()+"/TLAS", vk::AccelerationStructureTypeKHR::eTopLevel, geom, range);
+
+		// instances stay inactive (with a null reference) until their BLAS is built, which may take several frames for large batches
+		if (mBlasBuildQueue.flush(commandBuffer))
+			erase_if(mUnbuiltInstances, [&](const auto& p) {
+				if (!p.second->built()) return false;
+				mInstancesAS[p.first].accelerationStructureReference = commandBuffer.mDevice->getAccelerationStructureAddressKHR(*commandBuffer.hold_resource(p.second));
+				tlasDirty = true;
+				return true;
+			});
+
+		// swap in compacted BLASes, the originals are released once the frames using them are done
+		if (const auto compacted = mBlasBuildQueue.compact(commandBuffer); !compacted.empty()) {
+			unordered_map<const AccelerationStructure*, const shared_ptr<AccelerationStructure>*> replacements;
+			for (const auto&[src, dst] : compacted)
+				replacements.emplace(src.get(), &dst);
+			unordered_map<vk::DeviceAddress, vk::DeviceAddress> addresses;
+			for (auto&[_, blas] : mMeshAccelerationStructures)
+				if (auto it = replacements.find(blas.mAccelerationStructure.get()); it != replacements.end()) {
+					// BLASes evicted while they were being compacted aren't found here, and are dropped
+					addresses.emplace(
+						commandBuffer.mDevice->getAccelerationStructureAddressKHR(**blas.mAccelerationStructure),
+						commandBuffer.mDevice->getAccelerationStructureAddressKHR(***it->second));
+					blas.mAccelerationStructure = *it->second;
+				}
+			if (!addresses.empty())
+				for (vk::AccelerationStructureInstanceKHR& instance : mInstancesAS)
+					if (auto it = addresses.find(instance.accelerationStructureReference); it != addresses.end()) {
+						instance.accelerationStructureReference = it->second;
+						tlasDirty = true;
+					}
+		}
+
+		if (mTopLevel && (bool)(mTopLevel->flags() & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate) != mTopLevelRefit) {
+			mTopLevel.reset(); // refitting was toggled, recreate with the new flags
+			tlasDirty = true;
+		}
+		if (!mTopLevel) tlasDirty = true;
+
+		// rebuild when the instance set changes (count or referenced BLASes), refit when only transforms/masks changed, and skip entirely when nothing changed
+		vk::BuildAccelerationStructureModeKHR mode = vk::BuildAccelerationStructureModeKHR::eBuild;
+		bool skip = !tlasDirty;
+		if (tlasDirty && mTopLevel && mTopLevelInstances.size() == mInstancesAS.size()) {
+			bool sameReferences = true;
+			for (uint32_t i = 0; i < mInstancesAS.size(); i++)
+				if (mInstancesAS[i].accelerationStructureReference != mTopLevelInstances[i].accelerationStructureReference) {
+					sameReferences = false;
+					break;
+				}
+			if (sameReferences) {
+				if (!blasDeformed && memcmp(mInstancesAS.data(), mTopLevelInstances.data(), mInstancesAS.size()*sizeof(vk::AccelerationStructureInstanceKHR)) == 0)
+					skip = true;
+				else if (mTopLevelRefit && mTopLevelRefitCount < mTopLevelMaxRefits)
+					mode = vk::BuildAccelerationStructureModeKHR::eUpdate;
+			}
+		}
+
+		if (skip)
+			mTopLevelStats.mSkipped++;
+		else {
+			vk::AccelerationStructureGeometryKHR geom { vk::GeometryTypeKHR::eInstances, vk::AccelerationStructureGeometryInstancesDataKHR() };
+			vk::AccelerationStructureBuildRangeInfoKHR range { (uint32_t)mInstancesAS.size() };
+			if (!mInstancesAS.empty())
+				geom.geometry.instances.data = commandBuffer.mDevice.upload_ring().upload(commandBuffer, mInstancesAS, 16).device_address();
+
+			// previous frames may still be tracing against the TLAS or using its scratch memory.
+			// a global barrier covers both the TLAS buffer and the scratch buffer the build reuses
+			if (mTopLevel)
+				commandBuffer.barrier(vk::MemoryBarrier(vk::AccessFlagBits::eAccelerationStructureReadKHR|vk::AccessFlagBits::eAccelerationStructureWriteKHR, vk::AccessFlagBits::eAccelerationStructureReadKHR|vk::AccessFlagBits::eAccelerationStructureWriteKHR),
+					vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+					vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR);
+
+			if (!mTopLevel || !mTopLevel->build(commandBuffer, geom, range, mode)) {
+				const vk::BuildAccelerationStructureFlagsKHR flags = mTopLevelRefit ?
+					vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace|vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate :
+					vk::BuildAccelerationStructureFlagsKHR(vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
+				mTopLevel = make_shared<AccelerationStructure>(commandBuffer, mNode.name()+"/TLAS", vk::AccelerationStructureTypeKHR::eTopLevel, geom, range, flags);
+				mode = vk::BuildAccelerationStructureModeKHR::eBuild;
+			}
+
+			if (mode == vk::BuildAccelerationStructureModeKHR::eUpdate) {
+				mTopLevelRefitCount++;
+				mTopLevelStats.mRefits++;
+			} else {
+				mTopLevelRefitCount = 0;
+				mTopLevelStats.mBuilds++;
+			}
+			mTopLevelInstances = mInstancesAS;
+		}
+
 		commandBuffer.barrier(commandBuffer.hold_resource(mTopLevel).buffer(),
 			vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, vk::AccessFlagBits::eAccelerationStructureWriteKHR,
 			vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eAccelerationStructureReadKHR);
 	}
 
-	{ // environment map
-		ProfilerRegion s("Process env map", commandBuffer);
-		component_ptr<Material> envMap;
-		mNode.for_each_descendant<Material>([&](component_ptr<Material> m) {
-			if (m->index() == BSDFType::eEnvironment)
-				envMap = m;
-		});
-		if (envMap) {
-			uint32_t address = (uint32_t)(materialData.data.size()*sizeof(uint32_t));
-			store_material(materialData, images, *envMap);
-			mTraceBouncePipeline->push_constant<uint32_t>("gEnvironmentMaterialAddress") = address;
-			mTraceBouncePipeline->push_constant<float>("gEnvironmentSampleProbability") = 0.5f;
+	// triangle alias tables for the emissive meshes whose readback has finished, which is once the CommandBuffer that copied them stops holding the buffers
+	while (!mTriangleReadbacks.empty() && !mTriangleReadbacks.front().mPositions.buffer()->in_use() && !mTriangleReadbacks.front().mIndices.buffer()->in_use()) {
+		const TriangleReadback r = move(mTriangleReadbacks.front());
+		mTriangleReadbacks.pop_front();
+		auto it = mEmissiveMeshes.find(r.mMesh);
+		if (it == mEmissiveMeshes.end()) continue;
+		ProfilerRegion s("Build triangle distribution", commandBuffer);
+		const uint32_t vertexCount = (uint32_t)((r.mPositions.size_bytes() - sizeof(float3)) / r.mPositionStride) + 1; // the last vertex only spans a float3
+		const uint32_t triCount = (uint32_t)(r.mIndices.size_bytes() / (r.mIndexStride*3));
+		auto position = [&](uint32_t i) {
+			const uint32_t v = r.mIndexStride == sizeof(uint16_t) ? ((const uint16_t*)r.mIndices.data())[i] : ((const uint32_t*)r.mIndices.data())[i];
+			return v < vertexCount ? Vector3f::Map((const float*)(r.mPositions.data() + v*r.mPositionStride)) : Vector3f::Zero();
+		};
+		vector<double> areas(triCount);
+		for (uint32_t i = 0; i < triCount; i++) {
+			const Vector3f p0 = position(3*i);
+			areas[i] = 0.5*(position(3*i + 1) - p0).cross(position(3*i + 2) - p0).norm();
+		}
+		const double area = accumulate(areas.begin(), areas.end(), 0.0);
+		Buffer::View<float> table = make_shared<Buffer>(commandBuffer.mDevice, "Triangle alias table", max<size_t>(1, triCount)*3*sizeof(float), vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_CPU_TO_GPU);
+		build_alias_table(areas, table.data(), 3);
+		for (uint32_t i = 0; i < triCount; i++)
+			table[3*i + 2] = (float)(area > 0 ? areas[i] / area : 1.0 / triCount);
+		it->second.mTriangleDistribution = table;
+		it->second.mArea = (float)area;
+		mLightDistributionDirty = true;
+	}
+
+	if (mLightDistributionDirty) {
+		ProfilerRegion s("Build light distribution", commandBuffer);
+		mLightDistributionDirty = false;
+		const uint32_t distributionDataSize = mImages.distribution_data_size;
+		// the previous table's range, if it wasn't cleared by an extraction
+		auto prevTable = mLightDistribution ? mImages.distribution_data_map.find(mLightDistribution) : mImages.distribution_data_map.end();
+
+		// select lights in proportion to their power. meshes whose area isn't known yet get the mean power of the others
+		vector<double> power(mLightInstances.size());
+		double knownPower = 0;
+		uint32_t knownCount = 0;
+		for (uint32_t i = 0; i < mLightInstances.size(); i++) {
+			const LightRecord& l = mLightRecords[i];
+			const float emission = luminance(get<Emissive>(*l.mMaterial).emission.value);
+			float area = 0;
+			if (!l.mMesh)
+				area = (float)(4*M_PI*pow2(mInstanceDatas[mLightInstances[i]].radius()));
+			else if (const EmissiveMesh& m = mEmissiveMeshes.at(l.mMesh); m.mTriangleDistribution) {
+				const TransformData& t = mInstanceRecords[mLightInstances[i]].mTransform;
+				#ifdef TRANSFORM_UNIFORM_SCALING
+				area = m.mArea * pow2(t.mScale);
+				#else
+				area = m.mArea * pow(abs(t.m.block<3,3>(0,0).matrix().determinant()), 2.f/3.f);
+				#endif
+			} else {
+				power[i] = -1;
+				continue;
+			}
+			power[i] = max(0.f, emission) * area;
+			knownPower += power[i];
+			knownCount++;
+		}
+		for (double& p : power)
+			if (p < 0) p = knownCount > 0 ? knownPower / knownCount : 1;
+		const double sum = accumulate(power.begin(), power.end(), 0.0);
+
+		const size_t tableSize = LIGHT_ALIAS_STRIDE*mLightInstances.size();
+		Buffer::View<float> dist = make_shared<Buffer>(commandBuffer.mDevice, "Light alias table", max<size_t>(1, tableSize + LIGHT_INSTANCE_STRIDE*mInstanceDatas.size())*sizeof(float), vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_CPU_TO_GPU);
+		build_alias_table(power, dist.data(), LIGHT_ALIAS_STRIDE);
+		for (uint32_t i = 0; i < mInstanceDatas.size(); i++) {
+			dist[tableSize + LIGHT_INSTANCE_STRIDE*i] = 0;
+			dist[tableSize + LIGHT_INSTANCE_STRIDE*i + 1] = asfloat(~0u);
+		}
+		for (uint32_t i = 0; i < mLightInstances.size(); i++) {
+			const size_t address = tableSize + LIGHT_INSTANCE_STRIDE*mLightInstances[i];
+			dist[address] = (float)(sum > 0 ? power[i] / sum : 1.0 / mLightInstances.size());
+			if (mLightRecords[i].mMesh)
+				if (const Buffer::View<float>& table = mEmissiveMeshes.at(mLightRecords[i].mMesh).mTriangleDistribution)
+					dist[address + 1] = asfloat(mImages.get_index(table));
+		}
+		// the table's size only depends on the light and instance counts, so without an extraction it overwrites its previous range
+		if (prevTable != mImages.distribution_data_map.end() && prevTable->first.size() == dist.size()) {
+			mImages.distribution_data_map.erase(prevTable);
+			mImages.distribution_data_map.emplace(dist, mLightDistributionAddress);
+			mLightDistributionVersion = mSceneVersion;
 		} else {
-			mTraceBouncePipeline->push_constant<uint32_t>("gEnvironmentMaterialAddress") = -1;
-			mTraceBouncePipeline->push_constant<float>("gEnvironmentSampleProbability") = 0;
-		}
-	}
-
-	if (!mCurFrame->mVertices || mCurFrame->mVertices.size() < totalVertexCount)
-		mCurFrame->mVertices = make_shared<Buffer>(commandBuffer.mDevice, "gVertices", max(totalVertexCount,1u)*sizeof(PackedVertexData), vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY, 16);
-	if (!mCurFrame->mIndices || mCurFrame->mIndices.size() < totalIndexBufferSize)
-		mCurFrame->mIndices = make_shared<Buffer>(commandBuffer.mDevice, "gIndices", align_up(max(totalIndexBufferSize,1u), sizeof(uint32_t)), vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY, 4);
-	if (!mCurFrame->mInstances || mCurFrame->mInstances.size() < instanceDatas.size())
-		mCurFrame->mInstances = make_shared<Buffer>(commandBuffer.mDevice, "gInstances", max<size_t>(1, instanceDatas.size())*sizeof(InstanceData), vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU, 16);
-	if (!mCurFrame->mMaterialData || mCurFrame->mMaterialData.size_bytes() < materialData.data.size()*sizeof(uint32_t))
-		mCurFrame->mMaterialData = make_shared<Buffer>(commandBuffer.mDevice, "gMaterialData", max<size_t>(1, materialData.data.size())*sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU, 16);
-	if (!mCurFrame->mLightInstances || mCurFrame->mLightInstances.size() < lightInstances.size())
-		mCurFrame->mLightInstances = make_shared<Buffer>(commandBuffer.mDevice, "gLightInstances", max<size_t>(1, lightInstances.size())*sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU, 16);
-	if (!mCurFrame->mDistributionData || mCurFrame->mDistributionData.size() < images.distribution_data_size)
-		mCurFrame->mDistributionData = make_shared<Buffer>(commandBuffer.mDevice, "gDistributionData", max<size_t>(1, images.distribution_data_size)*sizeof(float), vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY, 16);
-
-	{ // copy vertices and indices
-		ProfilerRegion s("Copy vertex data", commandBuffer);
-		for (uint32_t i = 0; i < instanceIndices.size(); i++) {
-			const auto&[prim, blas, instanceIndex] = instanceIndices[i];
-			const InstanceData& d = instanceDatas[instanceIndex];
-			Buffer::View<PackedVertexData>& meshVertices = mMeshVertices.at(prim->mMesh.get());
-			commandBuffer.copy_buffer(meshVertices, Buffer::View<PackedVertexData>(mCurFrame->mVertices.buffer(), d.first_vertex()*sizeof(PackedVertexData), meshVertices.size()));
-			commandBuffer.copy_buffer(blas->mIndices, Buffer::View<byte>(mCurFrame->mIndices.buffer(), d.indices_byte_offset(), blas->mIndices.size_bytes()));
-		}
-		commandBuffer.barrier(mCurFrame->mIndices, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead);
-		commandBuffer.barrier(mCurFrame->mVertices, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead);
-	}
-
-	memcpy(mCurFrame->mInstances.data(), instanceDatas.data(), instanceDatas.size()*sizeof(InstanceData));
-	memcpy(mCurFrame->mMaterialData.data(), materialData.data.data(), materialData.data.size()*sizeof(uint32_t));
-	memcpy(mCurFrame->mLightInstances.data(), lightInstances.data(), lightInstances.size()*sizeof(uint32_t));
-	for (const auto&[buf, address] : images.distribution_data_map)
-		commandBuffer.copy_buffer(buf, Buffer::View<float>(mCurFrame->mDistributionData, address, buf.size()));
-
-	commandBuffer.barrier(mCurFrame->mDistributionData,
-		vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite,
-		vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead );
-
-	mTraceVisibilityPipeline->descriptor("gScene") = **mTopLevel;
-	mTraceVisibilityPipeline->descriptor("gVertices") = mCurFrame->mVertices;
-	mTraceVisibilityPipeline->descriptor("gIndices") = mCurFrame->mIndices;
-	mTraceVisibilityPipeline->descriptor("gInstances") = mCurFrame->mInstances;
-	mTraceVisibilityPipeline->descriptor("gMaterialData") = mCurFrame->mMaterialData;
-
-	mTraceBouncePipeline->descriptor("gScene") = **mTopLevel;
-	mTraceBouncePipeline->descriptor("gVertices") = mCurFrame->mVertices;
-	mTraceBouncePipeline->descriptor("gIndices") = mCurFrame->mIndices;
-	mTraceBouncePipeline->descriptor("gInstances") = mCurFrame->mInstances;
-	mTraceBouncePipeline->descriptor("gMaterialData") = mCurFrame->mMaterialData;
-	mTraceBouncePipeline->descriptor("gDistributions") = mCurFrame->mDistributionData;
-	mTraceBouncePipeline->descriptor("gLightInstances") = mCurFrame->mLightInstances;
-	mTraceBouncePipeline->push_constant<uint32_t>("gLightCount") = (uint32_t)lightInstances.size();
-
-	for (const auto&[image, index] : images.images) {
+			if (prevTable != mImages.distribution_data_map.end())
+				mImages.distribution_data_map.erase(prevTable);
+			mLightDistributionAddress = mImages.get_index(dist);
+			mDistributionDataVersion = mSceneVersion;
+		}
+		mLightDistribution = dist;
+		// newly read back triangle tables are appended too
+		if (mImages.distribution_data_size != distributionDataSize)
+			mDistributionDataVersion = mSceneVersion;
+	}
+
+	if (!mCurFrame->mInstances || mCurFrame->mInstances.size() < mInstanceDatas.size()) {
+		mCurFrame->mInstances = make_shared<Buffer>(commandBuffer.mDevice, "gInstances", max<size_t>(1, mInstanceDatas.size())*sizeof(InstanceData), vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU, 16);
+		mCurFrame->mInstancesVersion = 0;
+	}
+	if (!mCurFrame->mMaterialData || mCurFrame->mMaterialData.size_bytes() < mMaterialData.data.size()*sizeof(uint32_t)) {
+		mCurFrame->mMaterialData = make_shared<Buffer>(commandBuffer.mDevice, "gMaterialData", max<size_t>(1, mMaterialData.data.size())*sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU, 16);
+		mCurFrame->mMaterialDataVersion = 0;
+	}
+	if (!mCurFrame->mLightInstances || mCurFrame->mLightInstances.size() < mLightInstances.size()) {
+		mCurFrame->mLightInstances = make_shared<Buffer>(commandBuffer.mDevice, "gLightInstances", max<size_t>(1, mLightInstances.size())*sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU, 16);
+		mCurFrame->mInstanceSetVersion = 0;
+	}
+	if (!mCurFrame->mDistributionData || mCurFrame->mDistributionData.size() < mImages.distribution_data_size) {
+		mCurFrame->mDistributionData = make_shared<Buffer>(commandBuffer.mDevice, "gDistributionData", max<size_t>(1, mImages.distribution_data_size)*sizeof(float), vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY, 16);
+		mCurFrame->mDistributionDataVersion = 0;
+	}
+
+	// each frame's buffers only receive the data that changed since they were last written
+
+	if (mCurFrame->mInstanceSetVersion < mInstanceSetVersion) {
+		memcpy(mCurFrame->mLightInstances.data(), mLightInstances.data(), mLightInstances.size()*sizeof(uint32_t));
+		mCurFrame->mInstanceSetVersion = mInstanceSetVersion;
+	}
+
+	if (mCurFrame->mInstancesVersion < mInstanceSetVersion)
+		memcpy(mCurFrame->mInstances.data(), mInstanceDatas.data(), mInstanceDatas.size()*sizeof(InstanceData));
+	else {
+		// copy contiguous runs of dirty instances
+		for (uint32_t i = 0; i < mInstanceRecords.size();) {
+			if (mInstanceRecords[i].mDirtyVersion <= mCurFrame->mInstancesVersion) {
+				i++;
+				continue;
+			}
+			uint32_t end = i + 1;
+			while (end < mInstanceRecords.size() && mInstanceRecords[end].mDirtyVersion > mCurFrame->mInstancesVersion) end++;
+			memcpy(mCurFrame->mInstances.data() + i, mInstanceDatas.data() + i, (end - i)*sizeof(InstanceData));
+			i = end;
+		}
+	}
+	mCurFrame->mInstancesVersion = mSceneVersion;
+
+	if (mCurFrame->mMaterialDataVersion < mInstanceSetVersion)
+		memcpy(mCurFrame->mMaterialData.data(), mMaterialData.data.data(), mMaterialData.data.size()*sizeof(uint32_t));
+	else {
+		for (const MaterialRecord& r : mMaterialRecords)
+			if (r.mDirtyVersion > mCurFrame->mMaterialDataVersion)
+				memcpy(mCurFrame->mMaterialData.data() + r.mAddress, mMaterialData.data.data() + r.mAddress/sizeof(uint32_t), r.mSize);
+	}
+	mCurFrame->mMaterialDataVersion = mSceneVersion;
+
+	if (mCurFrame->mDistributionDataVersion < mDistributionDataVersion) {
+		for (const auto&[buf, address] : mImages.distribution_data_map)
+			commandBuffer.copy_buffer(buf, Buffer::View<float>(mCurFrame->mDistributionData, address, buf.size()));
+		commandBuffer.barrier(mCurFrame->mDistributionData,
+			vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite,
+			vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead );
+		mCurFrame->mDistributionDataVersion = mDistributionDataVersion;
+		mCurFrame->mLightDistributionVersion = mLightDistributionVersion;
+	} else if (mCurFrame->mLightDistributionVersion < mLightDistributionVersion) {
+		// only the light table was rewritten in place
+		const Buffer::View<float> dst(mCurFrame->mDistributionData, mLightDistributionAddress, mLightDistribution.size());
+		commandBuffer.copy_buffer(mLightDistribution, dst);
+		commandBuffer.barrier(dst,
+			vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite,
+			vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead );
+		mCurFrame->mLightDistributionVersion = mLightDistributionVersion;
+	}
+
+	mTraceAdaptivePipeline->descriptor("gScene") = **mTopLevel;
+	mTraceAdaptivePipeline->descriptor("gVertices") = mVertices;
+	mTraceAdaptivePipeline->descriptor("gIndices") = mIndices;
+	mTraceAdaptivePipeline->descriptor("gInstances") = mCurFrame->mInstances;
+	mTraceAdaptivePipeline->descriptor("gMaterialData") = mCurFrame->mMaterialData;
+
+	// the visibility pass samples lights for ReSTIR's initial candidates
+	for (const auto& pipeline : { mTraceVisibilityPipeline, mTraceBouncePipeline, mTraceBounceQueuedPipeline }) {
+		pipeline->descriptor("gScene") = **mTopLevel;
+		pipeline->descriptor("gVertices") = mVertices;
+		pipeline->descriptor("gIndices") = mIndices;
+		pipeline->descriptor("gInstances") = mCurFrame->mInstances;
+		pipeline->descriptor("gMaterialData") = mCurFrame->mMaterialData;
+		pipeline->descriptor("gDistributions") = mCurFrame->mDistributionData;
+		pipeline->descriptor("gLightInstances") = mCurFrame->mLightInstances;
+	}
+	// spatial reuse evaluates light samples, but traces no rays
+	mSpatialReusePipeline->descriptor("gVertices") = mVertices;
+	mSpatialReusePipeline->descriptor("gIndices") = mIndices;
+	mSpatialReusePipeline->descriptor("gInstances") = mCurFrame->mInstances;
+	mSpatialReusePipeline->descriptor("gMaterialData") = mCurFrame->mMaterialData;
+	mSpatialReusePipeline->descriptor("gDistributions") = mCurFrame->mDistributionData;
+	mSpatialReusePipeline->descriptor("gLightInstances") = mCurFrame->mLightInstances;
+	mTraceBouncePipeline->push_constant<uint32_t>("gLightCount") = (uint32_t)mLightInstances.size();
+	mTraceBouncePipeline->push_constant<uint32_t>("gLightDistribution") = mLightDistributionAddress;
+	mTraceBouncePipeline->push_constant<uint32_t>("gEnvironmentMaterialAddress") = mEnvironmentMaterialAddress;
+	mTraceBouncePipeline->push_constant<float>("gEnvironmentSampleProbability") = mEnvironmentMaterialAddress == ~0u ? 0 : 0.5f;
+
+	for (const auto&[image, index] : mImages.images) {
 		mTraceVisibilityPipeline->descriptor("gImages", index) = image_descriptor(image, vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits::eShaderRead);
 		mTraceBouncePipeline->descriptor("gImages", index) = image_descriptor(image, vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits::eShaderRead);
+		mTraceBounceQueuedPipeline->descriptor("gImages", index) = image_descriptor(image, vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits::eShaderRead);
+		mTraceAdaptivePipeline->descriptor("gImages", index) = image_descriptor(image, vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits::eShaderRead);
+		mSpatialReusePipeline->descriptor("gImages", index) = image_descriptor(image, vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits::eShaderRead);
 	}
 
-	mGradientForwardProjectPipeline->descriptor("gVertices") = mCurFrame->mVertices;
-	mGradientForwardProjectPipeline->descriptor("gIndices") = mCurFrame->mIndices;
+	mGradientForwardProjectPipeline->descriptor("gVertices") = mVertices;
+	mGradientForwardProjectPipeline->descriptor("gIndices") = mIndices;
 	mGradientForwardProjectPipeline->descriptor("gInstances") = mCurFrame->mInstances;
+	const Buffer::View<uint32_t> instanceIndexMap = commandBuffer.mDevice.upload_ring().upload(commandBuffer, mInstanceIndexMap);
 	mGradientForwardProjectPipeline->descriptor("gInstanceIndexMap") = instanceIndexMap;
 	
 	mTemporalAccumulationPipeline->descriptor("gInstanceIndexMap") = instanceIndexMap;
+	mTraceVisibilityPipeline->descriptor("gInstanceIndexMap") = instanceIndexMap;
 
 	mTonemapPipeline->specialization_constant("gModulateAlbedo") = mDemodulateAlbedo;
 }
@@ -484,173 +1453,513 @@ void RayTraceScene::update(CommandBuffer& commandBuffer) {
 void RayTraceScene::render(CommandBuffer& commandBuffer, const Image::View& renderTarget, const vector<hlsl::ViewData>& views) {
 	ProfilerRegion ps("RayTraceScene::render", commandBuffer);
 
+	// the timestamps and path counts become available once the command buffer that rendered the frame has executed.
+	// the query pools are reset by that command buffer too, so they can't be polled before it finishes
+	while (!mBounceTimings.empty()) {
+		BounceTiming& t = mBounceTimings.front();
+		if (t.mRenderCompletion->in_use()) break;
+		auto[result, timestamps] = commandBuffer.mDevice->getQueryPoolResults<uint64_t>(t.mQueryPool, 0, 2, 2*sizeof(uint64_t), sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+		if (result == vk::Result::eNotReady) break;
+		mBounceStats.mDepth = t.mDepth;
+		mBounceStats.mWavefront = t.mWavefront;
+		mBounceStats.mSortPaths = t.mSortPaths;
+		mBounceStats.mAdaptiveBudget = t.mAdaptiveBudget;
+		mBounceStats.mTime = (timestamps[1] - timestamps[0]) * commandBuffer.mDevice.limits().timestampPeriod / 1e6f;
+		mBounceStats.mTracedPaths.resize(t.mDepth);
+		mBounceStats.mRays = 0;
+		const uint32_t* headers = reinterpret_cast<const uint32_t*>(t.mPathQueueArgs.data());
+		for (uint32_t i = 0; i < t.mDepth; i++) {
+			mBounceStats.mTracedPaths[i] = headers[i*8 + 4];
+			mBounceStats.mRays += 2*headers[i*8 + 4];
+		}
+		// the adaptive sampling args follow the headers
+		mBounceStats.mAdaptiveSamples = min(headers[t.mDepth*8 + 3], t.mAdaptiveBudget);
+		mFreeBounceQueryPools.emplace_back(t.mQueryPool);
+		mBounceTimings.pop_front();
+	}
+
+	mRenderGraph.clear();
+
 	const vk::Extent3D extent = renderTarget.extent();
 	const vk::Extent3D gradExtent((extent.width + gGradientDownsample-1) / gGradientDownsample, (extent.height + gGradientDownsample-1) / gGradientDownsample, 1);
-	if (!mCurFrame->mRadiance || mCurFrame->mRadiance.extent() != extent) {
-		mCurFrame = make_unique<FrameData>();
+	// mDiffTemp is dead once temporal accumulation has read it, and mTemp is first written after that, so the two can share memory.
+	// The antilag debug view reads mDiffTemp while tonemapping into mTemp, so they get separate memory while it is active
+	const bool aliasTemp = mAliasTemporaries && mTonemapPipeline->specialization_constant("gDebugMode") != DebugMode::eAntilag;
+	if (!mCurFrame->mRadiance || mCurFrame->mRadiance.extent() != extent || mCurFrame->mAliasedTemp != aliasTemp) {
+		// frame images come from the device's ResourcePool, so resizing back and forth or rendering several view sizes doesn't reallocate
+		// only the per-pixel resources depend on the extent, the scene buffers and versions that update() wrote for this frame are kept
+		ResourcePool& pool = commandBuffer.mDevice.resource_pool();
+		mCurFrame->mSampleCounts = {};
+		mCurFrame->mSamplePriority = {};
+		mCurFrame->mHasSamplePriority = false;
+		mCurFrame->mHasReservoirs = false;
 		for (Image::View& v : mCurFrame->mVisibility)
-			v = make_shared<Image>(commandBuffer.mDevice, "gVisibility", extent, vk::Format::eR32G32B32A32Uint, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled);
-		
-		mCurFrame->mRadiance = make_shared<Image>(commandBuffer.mDevice, "gRadiance", extent, vk::Format::eR16G16B16A16Sfloat, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferSrc);
-		mCurFrame->mAlbedo   = make_shared<Image>(commandBuffer.mDevice, "gAlbedo"  , extent, vk::Format::eR16G16B16A16Sfloat, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled);
+			v = pool.get_image({ "gVisibility", extent, vk::Format::eR32G32B32A32Uint, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled });
 		
-		mCurFrame->mReservoirs = make_shared<Image>(commandBuffer.mDevice, "gReservoirs", extent, vk::Format::eR32G32B32A32Sfloat, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled);
-		mCurFrame->mReservoirRNG = make_shared<Image>(commandBuffer.mDevice, "gReservoirRNG", extent, vk::Format::eR32G32B32A32Uint, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled);
-
-		mCurFrame->mAccumColor   = make_shared<Image>(commandBuffer.mDevice, "gAccumColor", extent, vk::Format::eR16G16B16A16Sfloat, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferSrc|vk::ImageUsageFlagBits::eTransferDst);
-		mCurFrame->mAccumMoments = make_shared<Image>(commandBuffer.mDevice, "gAccumMoments", extent, vk::Format::eR16G16Sfloat, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled);
+		mCurFrame->mRadiance = pool.get_image({ "gRadiance", extent, vk::Format::eR16G16B16A16Sfloat, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferSrc });
+		mCurFrame->mAlbedo   = pool.get_image({ "gAlbedo"  , extent, vk::Format::eR16G16B16A16Sfloat, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled });
 		
-		mCurFrame->mPathBounceData = make_shared<Buffer>(commandBuffer.mDevice, "gPathStates", extent.width*extent.height*(sizeof(uint32_t)*20), vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_GPU_ONLY, 16);
-
-		mCurFrame->mGradientPositions = make_shared<Image>(commandBuffer.mDevice, "gGradientPositions", gradExtent, vk::Format::eR32Uint, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferDst);
-		for (Image::View& v : mCurFrame->mTemp)
-			v = make_shared<Image>(commandBuffer.mDevice, "pingpong", extent, vk::Format::eR16G16B16A16Sfloat, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferSrc|vk::ImageUsageFlagBits::eTransferDst);
-		for (array<Image::View, 2>& v : mCurFrame->mDiffTemp) {
-			v[0] = make_shared<Image>(commandBuffer.mDevice, "diff1 pingpong", gradExtent, vk::Format::eR16G16Sfloat, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferSrc|vk::ImageUsageFlagBits::eTransferDst);
-			v[1] = make_shared<Image>(commandBuffer.mDevice, "diff2 pingpong", gradExtent, vk::Format::eR16G16B16A16Sfloat, 1, 1, vk::SampleCountFlagBits::e1, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferSrc|vk::ImageUsageFlagBits::eTransferDst);
+		for (Image::View& v : mCurFrame->mReservoirs)
+			v = pool.get_image({ "gReservoirs", extent, vk::Format::eR32G32B32A32Sfloat, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled });
+		for (Image::View& v : mCurFrame->mReservoirRNG)
+			v = pool.get_image({ "gReservoirRNG", extent, vk::Format::eR32G32B32A32Uint, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled });
+
+		mCurFrame->mAccumColor   = pool.get_image({ "gAccumColor", extent, vk::Format::eR16G16B16A16Sfloat, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferSrc|vk::ImageUsageFlagBits::eTransferDst });
+		mCurFrame->mAccumMoments = pool.get_image({ "gAccumMoments", extent, vk::Format::eR16G16Sfloat, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled });
+
+		mCurFrame->mGradientPositions = pool.get_image({ "gGradientPositions", gradExtent, vk::Format::eR32Uint, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferDst });
+
+		const vk::ImageUsageFlags tempUsage = vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled|vk::ImageUsageFlagBits::eTransferSrc|vk::ImageUsageFlagBits::eTransferDst;
+		const vector<ResourcePool::ImageDescription> temp {
+			{ "pingpong", extent, vk::Format::eR16G16B16A16Sfloat, tempUsage },
+			{ "pingpong", extent, vk::Format::eR16G16B16A16Sfloat, tempUsage } };
+		const vector<ResourcePool::ImageDescription> diffTemp {
+			{ "diff1 pingpong", gradExtent, vk::Format::eR16G16Sfloat, tempUsage },
+			{ "diff2 pingpong", gradExtent, vk::Format::eR16G16B16A16Sfloat, tempUsage },
+			{ "diff1 pingpong", gradExtent, vk::Format::eR16G16Sfloat, tempUsage },
+			{ "diff2 pingpong", gradExtent, vk::Format::eR16G16B16A16Sfloat, tempUsage } };
+		if (aliasTemp) {
+			const vector<vector<Image::View>> images = pool.get_aliased_images({ temp, diffTemp });
+			ranges::copy(images[0], mCurFrame->mTemp.begin());
+			for (uint32_t i = 0; i < 4; i++)
+				mCurFrame->mDiffTemp[i/2][i%2] = images[1][i];
+		} else {
+			for (uint32_t i = 0; i < 2; i++)
+				mCurFrame->mTemp[i] = pool.get_image(temp[i]);
+			for (uint32_t i = 0; i < 4; i++)
+				mCurFrame->mDiffTemp[i/2][i%2] = pool.get_image(diffTemp[i]);
 		}
+		mCurFrame->mAliasedTemp = aliasTemp;
 		
 		mCurFrame->mFrameId = 0;
 		commandBuffer.clear_color_image(mCurFrame->mAccumColor, vk::ClearColorValue{ array<float,4>{ 0.f, 0.f, 0.f, 0.f } });
 	}
 	
-	const bool hasHistory = mPrevFrame->mRadiance && mPrevFrame->mRadiance.extent() == mCurFrame->mRadiance.extent();
-
-	mCurFrame->mViews = make_shared<Buffer>(commandBuffer.mDevice, "gViews", views.size()*sizeof(hlsl::ViewData), vk::BufferUsageFlagBits::eStorageBuffer, VMA_MEMORY_USAGE_CPU_TO_GPU);	
-	memcpy(mCurFrame->mViews.data(), views.data(), mCurFrame->mViews.size_bytes());
+	// Adaptive samples are traced as extra wavefront paths, whose states follow the pixels' states in mPathBounceData.
+	// The slot buffers are bound to the bounce pipelines either way, so they are never empty
+	// Queue entries pack the path state index below the sort key, so wavefront bounces hold at most PATH_QUEUE_MAX_PATHS paths.
+	// The budget is clamped to the paths left after the pixels, and views with more pixels than that trace per pixel
+	const uint32_t pixelCount = extent.width*extent.height;
+	const bool wavefront = mWavefront && pixelCount <= PATH_QUEUE_MAX_PATHS;
+	const uint32_t adaptiveBudget = (wavefront && mAdaptiveSampling) ? min((uint32_t)(mAdaptiveBudget*pixelCount), PATH_QUEUE_MAX_PATHS - pixelCount) : 0;
+	const bool adaptive = adaptiveBudget > 0;
+	const uint32_t pathCount = pixelCount + adaptiveBudget;
+	{
+		ResourcePool& pool = commandBuffer.mDevice.resource_pool();
+		if (!mCurFrame->mPathBounceData || mCurFrame->mPathBounceData.size_bytes() != (vk::DeviceSize)pathCount*PATH_BOUNCE_STATE_SIZE)
+			mCurFrame->mPathBounceData = pool.get_buffer("gPathStates", (vk::DeviceSize)pathCount*PATH_BOUNCE_STATE_SIZE, vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst|vk::BufferUsageFlagBits::eStorageBuffer);
+		const uint32_t slots = max(adaptiveBudget, 1u);
+		if (!mCurFrame->mAdaptiveSamples || mCurFrame->mAdaptiveSamples.size_bytes() != slots*sizeof(uint32_t)) {
+			mCurFrame->mAdaptiveSamples = pool.get_buffer("gAdaptiveSamples", slots*sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer);
+			mCurFrame->mSampleRadiance  = pool.get_buffer("gSampleRadiance", slots*sizeof(float4), vk::BufferUsageFlagBits::eStorageBuffer);
+		}
+		if (!mCurFrame->mAdaptiveArgs)
+			mCurFrame->mAdaptiveArgs = pool.get_buffer("gAdaptiveArgs", 8*sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eIndirectBuffer|vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst);
+		if (adaptive && !mCurFrame->mSampleCounts) {
+			mCurFrame->mSampleCounts   = pool.get_buffer("gSampleCounts", extent.width*extent.height*sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer);
+			mCurFrame->mSamplePriority = pool.get_image({ "gSamplePriority", extent, vk::Format::eR16Sfloat, vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled });
+		}
+		mCurFrame->mHasSamplePriority = false;
+	}
 
-	{ // Visibility
-		ProfilerRegion ps("Visibility", commandBuffer);
+	const bool hasHistory = mPrevFrame->mRadiance && mPrevFrame->mRadiance.extent() == mCurFrame->mRadiance.extent();
+	const bool antilag = mTemporalAccumulationPipeline->specialization_constant("gAntilag");
+
+	// ReSTIR DI. The visibility pass writes mReservoirs[0] from the initial candidates and the previous frame's final reservoirs,
+	// then each spatial reuse iteration reads one image and writes the other
+	const bool temporalReservoirs = mReservoirSamples > 0 && mTemporalReservoirReuse && hasHistory && mPrevFrame->mHasReservoirs;
+	const uint32_t spatialIterations = mReservoirSamples > 0 ? mSpatialReservoirIterations : 0;
+	mCurFrame->mReservoirIndex = spatialIterations % 2;
+	mCurFrame->mHasReservoirs = mReservoirSamples > 0;
+	mTraceBouncePipeline->push_constant<uint32_t>("gReservoirSamples") = mReservoirSamples;
+	mTraceBouncePipeline->push_constant<uint32_t>("gTemporalReuse") = temporalReservoirs;
+	const Image::View& prevReservoirs   = temporalReservoirs ? mPrevFrame->mReservoirs[mPrevFrame->mReservoirIndex]   : mCurFrame->mReservoirs[1];
+	const Image::View& prevReservoirRNG = temporalReservoirs ? mPrevFrame->mReservoirRNG[mPrevFrame->mReservoirIndex] : mCurFrame->mReservoirRNG[1];
+	const uint32_t debugMode = mTonemapPipeline->specialization_constant("gDebugMode");
+
+	mCurFrame->mViewData = views;
+	mCurFrame->mViews = commandBuffer.mDevice.upload_ring().upload(commandBuffer, views);
+
+	// The passes below only declare what they access. The graph culls the ones whose results are unused
+	// (the gradient passes when antilag is off) and records one barrier in front of each remaining pass.
+	// The images and buffers that the next frame reads as history are exported so that their passes are kept
+	for (const Image::View& v : mCurFrame->mVisibility)
+		mRenderGraph.export_resource(v);
+	mRenderGraph.export_resource(mCurFrame->mRadiance);
+	mRenderGraph.export_resource(mCurFrame->mAccumColor);
+	mRenderGraph.export_resource(mCurFrame->mAccumMoments);
+
+	RenderGraph::Pass& visibilityPass = mRenderGraph.add_pass("Visibility", [&](CommandBuffer& commandBuffer) {
 		mTraceVisibilityPipeline->descriptor("gViews") = mCurFrame->mViews;
-		mTraceVisibilityPipeline->descriptor("gPrevViews") = hasHistory ? mPrevFrame->mViews : mCurFrame->mViews;
-		for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++)
+		mTraceVisibilityPipeline->descriptor("gPrevViews") = hasHistory ? commandBuffer.mDevice.upload_ring().upload(commandBuffer, mPrevFrame->mViewData) : mCurFrame->mViews;
+		for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++) {
 			mTraceVisibilityPipeline->descriptor("gVisibility", i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
+			mTraceVisibilityPipeline->descriptor("gPrevVisibility", i) = image_descriptor(hasHistory ? mPrevFrame->mVisibility[i] : mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+		}
 		mTraceVisibilityPipeline->descriptor("gRadiance") = image_descriptor(mCurFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
 		mTraceVisibilityPipeline->descriptor("gAlbedo")   = image_descriptor(mCurFrame->mAlbedo, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
 		mTraceVisibilityPipeline->descriptor("gPathStates") = mCurFrame->mPathBounceData;
+		mTraceVisibilityPipeline->descriptor("gReservoirs")   = image_descriptor(mCurFrame->mReservoirs[0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
+		mTraceVisibilityPipeline->descriptor("gReservoirRNG") = image_descriptor(mCurFrame->mReservoirRNG[0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
+		mTraceVisibilityPipeline->descriptor("gInputReservoirs")   = image_descriptor(prevReservoirs, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+		mTraceVisibilityPipeline->descriptor("gInputReservoirRNG") = image_descriptor(prevReservoirRNG, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
 		mTraceVisibilityPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
+		mTraceBouncePipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
 		commandBuffer.bind_pipeline(mTraceVisibilityPipeline->get_pipeline());
 		mTraceVisibilityPipeline->bind_descriptor_sets(commandBuffer);
 		mTraceBouncePipeline->push_constants(commandBuffer);
 		if (mRandomPerFrame) commandBuffer.push_constant<uint32_t>("gRandomSeed", rand());
 		commandBuffer.dispatch_over(extent);
-	}
-
-	/*
-	// Spatial reservoir re-use
-	if (mSpatialReservoirIterations > 0) {
-		ProfilerRegion ps("Spatial reservoir re-use", commandBuffer);
-		mSpatialReusePipeline->specialization_constant("gSamplingFlags") = mTraceIndirectPipeline->specialization_constant("gSamplingFlags");
-		mSpatialReusePipeline->descriptor("gViews") = mCurFrame->mViews;
-		mSpatialReusePipeline->descriptor("gVisibility") = image_descriptor(mCurFrame->mVisibility, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-		mSpatialReusePipeline->descriptor("gNormal") = image_descriptor(mCurFrame->mNormal, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-		mSpatialReusePipeline->descriptor("gZ") = image_descriptor(mCurFrame->mZ, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-		mSpatialReusePipeline->descriptor("gReservoirs")   = image_descriptor(mCurFrame->mReservoirs, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-		mSpatialReusePipeline->descriptor("gReservoirRNG") = image_descriptor(mCurFrame->mReservoirRNG, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-		mSpatialReusePipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
-		commandBuffer.bind_pipeline(mSpatialReusePipeline->get_pipeline());
-		mSpatialReusePipeline->bind_descriptor_sets(commandBuffer);
-		for (uint32_t i = 0; i < mSpatialReservoirIterations; i++) {
-			if (mRandomPerFrame) mSpatialReusePipeline->push_constant<uint32_t>("gRandomSeed") = rand();
-			mSpatialReusePipeline->push_constants(commandBuffer);
-			mSpatialReusePipeline->transition_images(commandBuffer);
+	});
+	for (const Image::View& v : mCurFrame->mVisibility)
+		visibilityPass.write(v);
+	visibilityPass.write(mCurFrame->mRadiance).write(mCurFrame->mAlbedo).write(mCurFrame->mPathBounceData);
+	visibilityPass.write(mCurFrame->mReservoirs[0]).write(mCurFrame->mReservoirRNG[0]).read(prevReservoirs).read(prevReservoirRNG);
+	if (hasHistory)
+		for (const Image::View& v : mPrevFrame->mVisibility)
+			visibilityPass.read(v);
+
+	for (uint32_t i = 0; i < spatialIterations; i++) {
+		RenderGraph::Pass& spatialPass = mRenderGraph.add_pass("Spatial reservoir reuse " + to_string(i), [&,i](CommandBuffer& commandBuffer) {
+			mSpatialReusePipeline->descriptor("gViews") = mCurFrame->mViews;
+			for (uint32_t j = 0; j < mCurFrame->mVisibility.size(); j++)
+				mSpatialReusePipeline->descriptor("gVisibility", j) = image_descriptor(mCurFrame->mVisibility[j], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mSpatialReusePipeline->descriptor("gPathStates") = mCurFrame->mPathBounceData;
+			mSpatialReusePipeline->descriptor("gInputReservoirs")   = image_descriptor(mCurFrame->mReservoirs[i%2], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mSpatialReusePipeline->descriptor("gInputReservoirRNG") = image_descriptor(mCurFrame->mReservoirRNG[i%2], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mSpatialReusePipeline->descriptor("gReservoirs")   = image_descriptor(mCurFrame->mReservoirs[(i+1)%2], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
+			mSpatialReusePipeline->descriptor("gReservoirRNG") = image_descriptor(mCurFrame->mReservoirRNG[(i+1)%2], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
+			commandBuffer.bind_pipeline(mSpatialReusePipeline->get_pipeline());
+			mSpatialReusePipeline->bind_descriptor_sets(commandBuffer);
+			mTraceBouncePipeline->push_constants(commandBuffer);
+			if (mRandomPerFrame) commandBuffer.push_constant<uint32_t>("gRandomSeed", rand());
+			commandBuffer.push_constant("gSpatialIteration", i);
 			commandBuffer.dispatch_over(extent);
-		}
+		})
+		.read(mCurFrame->mPathBounceData)
+		.read(mCurFrame->mReservoirs[i%2])
+		.read(mCurFrame->mReservoirRNG[i%2])
+		.write(mCurFrame->mReservoirs[(i+1)%2])
+		.write(mCurFrame->mReservoirRNG[(i+1)%2]);
+		for (const Image::View& v : mCurFrame->mVisibility)
+			spatialPass.read(v);
 	}
-	*/
 
-	commandBuffer.clear_color_image(mCurFrame->mGradientPositions, vk::ClearColorValue(array<uint32_t,4>{ 0, 0, 0, 0 }));
+	mRenderGraph.add_pass("Clear gradient positions", [&](CommandBuffer& commandBuffer) {
+		commandBuffer.clear_color_image(mCurFrame->mGradientPositions, vk::ClearColorValue(array<uint32_t,4>{ 0, 0, 0, 0 }));
+	}).write(mCurFrame->mGradientPositions, vk::PipelineStageFlagBits::eTransfer, vk::ImageLayout::eTransferDstOptimal, vk::AccessFlagBits::eTransferWrite);
 
-	if (mTemporalAccumulationPipeline->specialization_constant("gAntilag") && hasHistory) {
-		// forward project
-		ProfilerRegion ps("Forward projection", commandBuffer);
-		mGradientForwardProjectPipeline->descriptor("gViews") = mCurFrame->mViews;
+	// forward projection also writes the reprojected samples into the visibility buffers, so it can't be left to culling
+	if (antilag && hasHistory) {
+		RenderGraph::Pass& forwardProjectPass = mRenderGraph.add_pass("Forward projection", [&](CommandBuffer& commandBuffer) {
+			mGradientForwardProjectPipeline->descriptor("gViews") = mCurFrame->mViews;
+			for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++) {
+				mGradientForwardProjectPipeline->descriptor("gVisibility", i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
+				mGradientForwardProjectPipeline->descriptor("gPrevVisibility", i) = image_descriptor(mPrevFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			}
+			mGradientForwardProjectPipeline->descriptor("gGradientSamples") = image_descriptor(mCurFrame->mGradientPositions, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eShaderRead);
+			mGradientForwardProjectPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
+			if (mRandomPerFrame) mGradientForwardProjectPipeline->push_constant<uint32_t>("gFrameNumber") = mCurFrame->mFrameId;
+			commandBuffer.bind_pipeline(mGradientForwardProjectPipeline->get_pipeline());
+			mGradientForwardProjectPipeline->bind_descriptor_sets(commandBuffer);
+			mGradientForwardProjectPipeline->push_constants(commandBuffer);
+			commandBuffer.dispatch_over(gradExtent);
+		});
 		for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++) {
-			mGradientForwardProjectPipeline->descriptor("gVisibility", i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
-			mGradientForwardProjectPipeline->descriptor("gPrevVisibility", i) = image_descriptor(mPrevFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			forwardProjectPass.write(mCurFrame->mVisibility[i]);
+			forwardProjectPass.read(mPrevFrame->mVisibility[i]);
 		}
-		mGradientForwardProjectPipeline->descriptor("gGradientSamples") = image_descriptor(mCurFrame->mGradientPositions, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eShaderRead);
-		mGradientForwardProjectPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
-		if (mRandomPerFrame) mGradientForwardProjectPipeline->push_constant<uint32_t>("gFrameNumber") = mCurFrame->mFrameId;
-		commandBuffer.bind_pipeline(mGradientForwardProjectPipeline->get_pipeline());
-		mGradientForwardProjectPipeline->bind_descriptor_sets(commandBuffer);
-		mGradientForwardProjectPipeline->push_constants(commandBuffer);
-		commandBuffer.dispatch_over(gradExtent);
+		forwardProjectPass.write(mCurFrame->mGradientPositions, vk::PipelineStageFlagBits::eComputeShader, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eShaderRead);
 	}
 	
-	{ // Indirect
-		ProfilerRegion ps("Indirect", commandBuffer);
-		mTraceBouncePipeline->descriptor("gViews") = mCurFrame->mViews;
-		mTraceBouncePipeline->descriptor("gRadiance") = image_descriptor(mCurFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-		mTraceBouncePipeline->descriptor("gPathStates") = mCurFrame->mPathBounceData;
-		mTraceBouncePipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
-		commandBuffer.bind_pipeline(mTraceBouncePipeline->get_pipeline());
-		mTraceBouncePipeline->bind_descriptor_sets(commandBuffer);
-		mTraceBouncePipeline->push_constants(commandBuffer);
-		uint32_t flag = mTraceBouncePipeline->push_constant<uint32_t>("gSamplingFlags");
- 		for (uint32_t i = 0; i < mMaxDepth; i++) {
-			commandBuffer.barrier(mCurFrame->mPathBounceData, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-			mCurFrame->mRadiance.transition_barrier(commandBuffer, vk::PipelineStageFlagBits::eComputeShader, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-			if (i+1 > mMinDepth) flag |= SAMPLE_FLAG_RR;
-			commandBuffer.push_constant("gSamplingFlags", flag);
+	// Each bounce writes a 32 byte header to mPathQueueArgs (PATH_QUEUE_HEADER_SIZE in pt.hlsl): indirect dispatch args for the paths it queued,
+	// the number of queued paths, and the number of paths it traced
+	// With sorting, each bounce also counts its queued paths per sort key in mPathBins (PATH_SORT_BINS_SIZE in pt.hlsl), and sort_paths
+	// places them into a third queue, which the next bounce reads
+	const vk::DeviceSize pathQueueHeaderSize = 32;
+	const vk::DeviceSize pathBinsSize = (1 << PATH_SORT_KEY_BITS)*2*sizeof(uint32_t);
+	const bool sortPaths = wavefront && mSortPaths;
+	if (!mCurFrame->mPathQueueArgs || mCurFrame->mPathQueueArgs.size_bytes() < mMaxDepth*pathQueueHeaderSize)
+		mCurFrame->mPathQueueArgs = commandBuffer.mDevice.resource_pool().get_buffer("gPathQueueArgs", mMaxDepth*pathQueueHeaderSize, vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eIndirectBuffer|vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eTransferDst);
+	if (!mCurFrame->mPathBins || mCurFrame->mPathBins.size_bytes() < mMaxDepth*pathBinsSize)
+		mCurFrame->mPathBins = commandBuffer.mDevice.resource_pool().get_buffer("gPathBins", mMaxDepth*pathBinsSize, vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eTransferDst);
+	const vk::DeviceSize pathQueueSize = (sortPaths ? 3 : 2)*pathCount*sizeof(uint32_t);
+	if (wavefront && (!mCurFrame->mPathQueue || mCurFrame->mPathQueue.size_bytes() < pathQueueSize))
+		mCurFrame->mPathQueue = commandBuffer.mDevice.resource_pool().get_buffer("gPathQueue", pathQueueSize, vk::BufferUsageFlagBits::eStorageBuffer);
+
+	BounceTiming& timing = mBounceTimings.emplace_back();
+	if (mFreeBounceQueryPools.empty())
+		timing.mQueryPool = commandBuffer.mDevice->createQueryPool(vk::QueryPoolCreateInfo({}, vk::QueryType::eTimestamp, 2));
+	else {
+		timing.mQueryPool = mFreeBounceQueryPools.back();
+		mFreeBounceQueryPools.pop_back();
+	}
+	timing.mPathQueueArgs = commandBuffer.mDevice.resource_pool().get_buffer("gPathQueueArgs readback", mMaxDepth*pathQueueHeaderSize + mCurFrame->mAdaptiveArgs.size_bytes(), vk::BufferUsageFlagBits::eTransferDst, VMA_MEMORY_USAGE_GPU_TO_CPU);
+	timing.mDepth = mMaxDepth;
+	timing.mWavefront = wavefront;
+	timing.mSortPaths = sortPaths;
+	timing.mAdaptiveBudget = adaptiveBudget;
+	timing.mRenderCompletion = make_shared<DeviceResource>(commandBuffer.mDevice, "Bounce timing queries");
+	commandBuffer.hold_resource(timing.mRenderCompletion);
+
+	mRenderGraph.add_pass("Reset path queues", [&](CommandBuffer& commandBuffer) {
+		commandBuffer->resetQueryPool(timing.mQueryPool, 0, 2);
+		vector<uint32_t> headers(mMaxDepth*pathQueueHeaderSize/sizeof(uint32_t), 0);
+		for (uint32_t i = 0; i < mMaxDepth; i++)
+			headers[i*8 + 1] = headers[i*8 + 2] = 1;
+		commandBuffer->updateBuffer<uint32_t>(**mCurFrame->mPathQueueArgs.buffer(), mCurFrame->mPathQueueArgs.offset(), headers);
+		if (sortPaths)
+			commandBuffer->fillBuffer(**mCurFrame->mPathBins.buffer(), mCurFrame->mPathBins.offset(), mMaxDepth*pathBinsSize, 0);
+		// no adaptive samples unless allocate_samples writes them
+		commandBuffer->updateBuffer<uint32_t>(**mCurFrame->mAdaptiveArgs.buffer(), mCurFrame->mAdaptiveArgs.offset(), { 0, 1, 1, 0, 0, 0, 0, 0 });
+	})
+	.write(mCurFrame->mPathQueueArgs, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite)
+	.write(mCurFrame->mAdaptiveArgs, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite)
+	.write(mCurFrame->mPathBins, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite);
+
+	const vk::PipelineStageFlags queueStages = vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eDrawIndirect;
+	const vk::AccessFlags queueAccess = vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite|vk::AccessFlagBits::eIndirectCommandRead;
+
+	// Adaptive sampling: the previous frame's sample priority (see "Estimate sample priority") is reprojected and summed, then adaptiveBudget
+	// extra paths are split between the pixels in proportion to it, and their primary hits are traced into the path states after the pixels' states.
+	// The bounces continue them along with the pixels' paths, and "Resolve adaptive samples" averages them into their pixels
+	const Image::View& prevSamplePriority = (hasHistory && mPrevFrame->mHasSamplePriority) ? mPrevFrame->mSamplePriority : mCurFrame->mSamplePriority;
+	if (adaptive) {
+		// adaptive_sampling.hlsl's push constants live in mAllocateSamplesPipeline, like pt.hlsl's live in mTraceBouncePipeline
+		mAllocateSamplesPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
+		mAllocateSamplesPipeline->push_constant<uint32_t>("gHasPriority") = hasHistory && mPrevFrame->mHasSamplePriority;
+		mAllocateSamplesPipeline->push_constant<uint32_t>("gSampleBudget") = adaptiveBudget;
+		mAllocateSamplesPipeline->push_constant<uint32_t>("gMaxSamples") = min(mAdaptiveMaxSamples, 31u);
+		mAllocateSamplesPipeline->push_constant<float>("gErrorThreshold") = mAdaptiveThreshold;
+		if (mRandomPerFrame) mAllocateSamplesPipeline->push_constant<uint32_t>("gRandomSeed") = rand();
+
+		RenderGraph::Pass& sumPass = mRenderGraph.add_pass("Sum sample priority", [&](CommandBuffer& commandBuffer) {
+			mSumPriorityPipeline->descriptor("gViews") = mCurFrame->mViews;
+			for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++)
+				mSumPriorityPipeline->descriptor("gVisibility", i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mSumPriorityPipeline->descriptor("gPrevSamplePriority") = image_descriptor(prevSamplePriority, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mSumPriorityPipeline->descriptor("gAdaptiveArgs") = mCurFrame->mAdaptiveArgs;
+			commandBuffer.bind_pipeline(mSumPriorityPipeline->get_pipeline());
+			mSumPriorityPipeline->bind_descriptor_sets(commandBuffer);
+			mAllocateSamplesPipeline->push_constants(commandBuffer);
 			commandBuffer.dispatch_over(extent);
-		}
+		})
+		.read(prevSamplePriority)
+		.write(mCurFrame->mAdaptiveArgs, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+		for (const Image::View& v : mCurFrame->mVisibility)
+			sumPass.read(v);
+
+		RenderGraph::Pass& allocatePass = mRenderGraph.add_pass("Allocate adaptive samples", [&](CommandBuffer& commandBuffer) {
+			mAllocateSamplesPipeline->descriptor("gViews") = mCurFrame->mViews;
+			for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++)
+				mAllocateSamplesPipeline->descriptor("gVisibility", i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mAllocateSamplesPipeline->descriptor("gPrevSamplePriority") = image_descriptor(prevSamplePriority, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mAllocateSamplesPipeline->descriptor("gAdaptiveArgs") = mCurFrame->mAdaptiveArgs;
+			mAllocateSamplesPipeline->descriptor("gAdaptiveSamples") = mCurFrame->mAdaptiveSamples;
+			mAllocateSamplesPipeline->descriptor("gSampleCounts") = mCurFrame->mSampleCounts;
+			commandBuffer.bind_pipeline(mAllocateSamplesPipeline->get_pipeline());
+			mAllocateSamplesPipeline->bind_descriptor_sets(commandBuffer);
+			mAllocateSamplesPipeline->push_constants(commandBuffer);
+			commandBuffer.dispatch_over(extent);
+		})
+		.read(prevSamplePriority)
+		.write(mCurFrame->mAdaptiveArgs, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite)
+		.write(mCurFrame->mAdaptiveSamples)
+		.write(mCurFrame->mSampleCounts);
+		for (const Image::View& v : mCurFrame->mVisibility)
+			allocatePass.read(v);
+
+		mRenderGraph.add_pass("Adaptive samples", [&](CommandBuffer& commandBuffer) {
+			mTraceAdaptivePipeline->descriptor("gViews") = mCurFrame->mViews;
+			mTraceAdaptivePipeline->descriptor("gRadiance") = image_descriptor(mCurFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mTraceAdaptivePipeline->descriptor("gPathStates") = mCurFrame->mPathBounceData;
+			mTraceAdaptivePipeline->descriptor("gAdaptiveArgs") = mCurFrame->mAdaptiveArgs;
+			mTraceAdaptivePipeline->descriptor("gAdaptiveSamples") = mCurFrame->mAdaptiveSamples;
+			mTraceAdaptivePipeline->descriptor("gSampleRadiance") = mCurFrame->mSampleRadiance;
+			// extra paths light their first vertex without reservoirs, but share path_bounce with the pixel's own path
+			mTraceAdaptivePipeline->descriptor("gReservoirs")   = image_descriptor(mCurFrame->mReservoirs[mCurFrame->mReservoirIndex], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mTraceAdaptivePipeline->descriptor("gReservoirRNG") = image_descriptor(mCurFrame->mReservoirRNG[mCurFrame->mReservoirIndex], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mTraceBouncePipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
+			commandBuffer.bind_pipeline(mTraceAdaptivePipeline->get_pipeline());
+			mTraceAdaptivePipeline->bind_descriptor_sets(commandBuffer);
+			mTraceBouncePipeline->push_constants(commandBuffer);
+			if (mRandomPerFrame) commandBuffer.push_constant<uint32_t>("gRandomSeed", rand());
+			commandBuffer->dispatchIndirect(**mCurFrame->mAdaptiveArgs.buffer(), mCurFrame->mAdaptiveArgs.offset());
+		})
+		.read(mCurFrame->mRadiance)
+		.read(mCurFrame->mAdaptiveArgs, queueStages, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eIndirectCommandRead)
+		.read(mCurFrame->mAdaptiveSamples)
+		.read(mCurFrame->mReservoirs[mCurFrame->mReservoirIndex])
+		.read(mCurFrame->mReservoirRNG[mCurFrame->mReservoirIndex])
+		.write(mCurFrame->mSampleRadiance)
+		.write(mCurFrame->mPathBounceData, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
 	}
 
-	if (mDemodulateAlbedo) {
-		ProfilerRegion ps("Demodulate Albedo", commandBuffer);
-		mDemodulateAlbedoPipeline->descriptor("gOutput") = image_descriptor(mCurFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-		mDemodulateAlbedoPipeline->descriptor("gAlbedo") = image_descriptor(mCurFrame->mAlbedo, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-		commandBuffer.bind_pipeline(mDemodulateAlbedoPipeline->get_pipeline());
-		mDemodulateAlbedoPipeline->bind_descriptor_sets(commandBuffer);
-		mDemodulateAlbedoPipeline->push_constants(commandBuffer);
-		commandBuffer.dispatch_over(extent);
+	// Indirect. Each bounce is its own pass, so that the radiance and path state barriers between bounces are recorded together.
+	// In wavefront mode, bounces after the first only run over the paths that survived the previous bounce, which are packed into mPathQueue
+	// and dispatched with the args in the previous bounce's header. Otherwise every bounce runs over every pixel, and threads of terminated paths idle.
+	// Sorting binds another pipeline between bounces, so each bounce rebinds its own
+	for (uint32_t i = 0; i < mMaxDepth; i++) {
+		RenderGraph::Pass& bouncePass = mRenderGraph.add_pass("Indirect bounce " + to_string(i), [&,i](CommandBuffer& commandBuffer) {
+			const component_ptr<ComputePipelineState>& pipeline = wavefront ? mTraceBounceQueuedPipeline : mTraceBouncePipeline;
+			if (i == 0) {
+				pipeline->descriptor("gViews") = mCurFrame->mViews;
+				pipeline->descriptor("gRadiance") = image_descriptor(mCurFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+				pipeline->descriptor("gPathStates") = mCurFrame->mPathBounceData;
+				pipeline->descriptor("gPathQueueArgs") = mCurFrame->mPathQueueArgs;
+				pipeline->descriptor("gSampleRadiance") = mCurFrame->mSampleRadiance;
+				pipeline->descriptor("gReservoirs")   = image_descriptor(mCurFrame->mReservoirs[mCurFrame->mReservoirIndex], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+				pipeline->descriptor("gReservoirRNG") = image_descriptor(mCurFrame->mReservoirRNG[mCurFrame->mReservoirIndex], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+				if (wavefront) {
+					pipeline->descriptor("gPathQueue") = mCurFrame->mPathQueue;
+					pipeline->descriptor("gPathBins") = mCurFrame->mPathBins;
+					pipeline->descriptor("gAdaptiveSamples") = mCurFrame->mAdaptiveSamples;
+					pipeline->descriptor("gAdaptiveArgs") = mCurFrame->mAdaptiveArgs;
+				}
+				mTraceBouncePipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
+				mTraceBouncePipeline->push_constant<uint32_t>("gSortPaths") = sortPaths;
+			}
+			if (i == 0 || sortPaths) {
+				commandBuffer.bind_pipeline(pipeline->get_pipeline());
+				pipeline->bind_descriptor_sets(commandBuffer);
+				mTraceBouncePipeline->push_constants(commandBuffer);
+			}
+			if (i == 0)
+				commandBuffer->writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, timing.mQueryPool, 0);
+			uint32_t flag = mTraceBouncePipeline->push_constant<uint32_t>("gSamplingFlags");
+			if (i+1 > mMinDepth) flag |= SAMPLE_FLAG_RR;
+			commandBuffer.push_constant("gSamplingFlags", flag);
+			commandBuffer.push_constant("gBounce", i);
+			if (!wavefront)
+				commandBuffer.dispatch_over(extent);
+			else if (i == 0)
+				commandBuffer.dispatch_over(pathCount);
+			else
+				commandBuffer->dispatchIndirect(**mCurFrame->mPathQueueArgs.buffer(), mCurFrame->mPathQueueArgs.offset() + (i-1)*pathQueueHeaderSize);
+		})
+		.write(mCurFrame->mRadiance, vk::PipelineStageFlagBits::eComputeShader, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite)
+		.write(mCurFrame->mPathBounceData, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite)
+		.write(mCurFrame->mPathQueueArgs, queueStages, queueAccess)
+		.write(mCurFrame->mPathBins, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite)
+		.write(mCurFrame->mSampleRadiance, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite)
+		.read(mCurFrame->mReservoirs[mCurFrame->mReservoirIndex])
+		.read(mCurFrame->mReservoirRNG[mCurFrame->mReservoirIndex]);
+		if (wavefront)
+			bouncePass
+				.write(mCurFrame->mPathQueue, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite)
+				.read(mCurFrame->mAdaptiveSamples)
+				.read(mCurFrame->mAdaptiveArgs);
+
+		if (sortPaths && i+1 < mMaxDepth)
+			mRenderGraph.add_pass("Sort paths " + to_string(i), [&,i](CommandBuffer& commandBuffer) {
+				mSortPathsPipeline->descriptor("gPathStates") = mCurFrame->mPathBounceData;
+				mSortPathsPipeline->descriptor("gPathQueue") = mCurFrame->mPathQueue;
+				mSortPathsPipeline->descriptor("gPathQueueArgs") = mCurFrame->mPathQueueArgs;
+				mSortPathsPipeline->descriptor("gPathBins") = mCurFrame->mPathBins;
+				commandBuffer.bind_pipeline(mSortPathsPipeline->get_pipeline());
+				mSortPathsPipeline->bind_descriptor_sets(commandBuffer);
+				commandBuffer.push_constant("gBounce", i);
+				commandBuffer->dispatchIndirect(**mCurFrame->mPathQueueArgs.buffer(), mCurFrame->mPathQueueArgs.offset() + i*pathQueueHeaderSize);
+			})
+			.read(mCurFrame->mPathBounceData)
+			.read(mCurFrame->mPathQueueArgs, queueStages, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eIndirectCommandRead)
+			.write(mCurFrame->mPathQueue, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite)
+			.write(mCurFrame->mPathBins, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
 	}
 
+	if (adaptive)
+		mRenderGraph.add_pass("Resolve adaptive samples", [&](CommandBuffer& commandBuffer) {
+			mResolveSamplesPipeline->descriptor("gRadiance") = image_descriptor(mCurFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+			mResolveSamplesPipeline->descriptor("gSampleCounts") = mCurFrame->mSampleCounts;
+			mResolveSamplesPipeline->descriptor("gSampleRadiance") = mCurFrame->mSampleRadiance;
+			commandBuffer.bind_pipeline(mResolveSamplesPipeline->get_pipeline());
+			mResolveSamplesPipeline->bind_descriptor_sets(commandBuffer);
+			commandBuffer.dispatch_over(extent);
+		})
+		.write(mCurFrame->mRadiance, vk::PipelineStageFlagBits::eComputeShader, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite)
+		.read(mCurFrame->mSampleCounts)
+		.read(mCurFrame->mSampleRadiance);
+
+	// the adaptive sampling args are copied after the headers
+	mRenderGraph.add_pass("Read back path counts", [&](CommandBuffer& commandBuffer) {
+		commandBuffer->writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, timing.mQueryPool, 1);
+		const vk::DeviceSize headersSize = mMaxDepth*pathQueueHeaderSize;
+		commandBuffer.copy_buffer(Buffer::View<byte>(mCurFrame->mPathQueueArgs, 0, headersSize), Buffer::View<byte>(timing.mPathQueueArgs, 0, headersSize));
+		commandBuffer.copy_buffer(mCurFrame->mAdaptiveArgs, Buffer::View<byte>(timing.mPathQueueArgs, headersSize, mCurFrame->mAdaptiveArgs.size_bytes()));
+		commandBuffer.barrier(timing.mPathQueueArgs, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostRead);
+	})
+	.read(mCurFrame->mPathQueueArgs, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead)
+	.read(mCurFrame->mAdaptiveArgs, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferRead)
+	.side_effect();
+
+	if (mDemodulateAlbedo)
+		mRenderGraph.add_pass("Demodulate Albedo", [&](CommandBuffer& commandBuffer) {
+			mDemodulateAlbedoPipeline->descriptor("gOutput") = image_descriptor(mCurFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+			mDemodulateAlbedoPipeline->descriptor("gAlbedo") = image_descriptor(mCurFrame->mAlbedo, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			commandBuffer.bind_pipeline(mDemodulateAlbedoPipeline->get_pipeline());
+			mDemodulateAlbedoPipeline->bind_descriptor_sets(commandBuffer);
+			mDemodulateAlbedoPipeline->push_constants(commandBuffer);
+			commandBuffer.dispatch_over(extent);
+		})
+		.write(mCurFrame->mRadiance, vk::PipelineStageFlagBits::eComputeShader, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite)
+		.read(mCurFrame->mAlbedo);
+
 	Image::View tonemap_in = mCurFrame->mRadiance;
 	Image::View tonemap_out = mCurFrame->mTemp[0];
+	const Image::View& diff = mCurFrame->mDiffTemp[mDiffAtrousIterations%2][0];
 
 	if (hasHistory && mReprojection) {
-		if (mTemporalAccumulationPipeline->specialization_constant("gAntilag")) {
-			{ // create diff image
-				ProfilerRegion ps("Create diff image", commandBuffer);
-				mCreateGradientSamplesPipeline->descriptor("gViews")   = mCurFrame->mViews;
-				mCreateGradientSamplesPipeline->descriptor("gOutput1") = image_descriptor(mCurFrame->mDiffTemp[0][0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
-				mCreateGradientSamplesPipeline->descriptor("gOutput2") = image_descriptor(mCurFrame->mDiffTemp[0][1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
-				mCreateGradientSamplesPipeline->descriptor("gRadiance") = image_descriptor(mCurFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-				mCreateGradientSamplesPipeline->descriptor("gPrevRadiance") = image_descriptor(mPrevFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-				mCreateGradientSamplesPipeline->descriptor("gGradientPositions") = image_descriptor(mCurFrame->mGradientPositions, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-				for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++)
-						mCreateGradientSamplesPipeline->descriptor("gVisibility",i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-				mCreateGradientSamplesPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
-
-				commandBuffer.bind_pipeline(mCreateGradientSamplesPipeline->get_pipeline());
-				mCreateGradientSamplesPipeline->bind_descriptor_sets(commandBuffer);
-				mCreateGradientSamplesPipeline->push_constants(commandBuffer);
-				commandBuffer.dispatch_over(gradExtent);
-			}
-			{ // filter diff image
-				ProfilerRegion ps("Filter diff image", commandBuffer);
-				mAtrousGradientPipeline->descriptor("gViews")   = mCurFrame->mViews;
-				mAtrousGradientPipeline->descriptor("gImage1",0) = image_descriptor(mCurFrame->mDiffTemp[0][0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-				mAtrousGradientPipeline->descriptor("gImage2",0) = image_descriptor(mCurFrame->mDiffTemp[0][1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-				mAtrousGradientPipeline->descriptor("gImage1",1) = image_descriptor(mCurFrame->mDiffTemp[1][0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-				mAtrousGradientPipeline->descriptor("gImage2",1) = image_descriptor(mCurFrame->mDiffTemp[1][1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-				commandBuffer.bind_pipeline(mAtrousGradientPipeline->get_pipeline());
-				mAtrousGradientPipeline->bind_descriptor_sets(commandBuffer);
-				for (int i = 0; i < mDiffAtrousIterations; i++) {
-					mAtrousGradientPipeline->push_constant<uint32_t>("gIteration") = i;
-					mAtrousGradientPipeline->push_constant<uint32_t>("gStepSize") = (1 << i);
-					mAtrousGradientPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
-					mAtrousGradientPipeline->push_constants(commandBuffer);
-					commandBuffer.dispatch_over(gradExtent);
-					mAtrousGradientPipeline->transition_images(commandBuffer);
+		// the gradient passes are always declared, and culled unless temporal accumulation or the antilag debug view reads the result
+		RenderGraph::Pass& createDiffPass = mRenderGraph.add_pass("Create diff image", [&](CommandBuffer& commandBuffer) {
+			mCreateGradientSamplesPipeline->descriptor("gViews")   = mCurFrame->mViews;
+			mCreateGradientSamplesPipeline->descriptor("gOutput1") = image_descriptor(mCurFrame->mDiffTemp[0][0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
+			mCreateGradientSamplesPipeline->descriptor("gOutput2") = image_descriptor(mCurFrame->mDiffTemp[0][1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
+			mCreateGradientSamplesPipeline->descriptor("gRadiance") = image_descriptor(mCurFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mCreateGradientSamplesPipeline->descriptor("gPrevRadiance") = image_descriptor(mPrevFrame->mRadiance, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mCreateGradientSamplesPipeline->descriptor("gGradientPositions") = image_descriptor(mCurFrame->mGradientPositions, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++)
+					mCreateGradientSamplesPipeline->descriptor("gVisibility",i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mCreateGradientSamplesPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
+
+			commandBuffer.bind_pipeline(mCreateGradientSamplesPipeline->get_pipeline());
+			mCreateGradientSamplesPipeline->bind_descriptor_sets(commandBuffer);
+			mCreateGradientSamplesPipeline->push_constants(commandBuffer);
+			commandBuffer.dispatch_over(gradExtent);
+		})
+		.write(mCurFrame->mDiffTemp[0][0])
+		.write(mCurFrame->mDiffTemp[0][1])
+		.read(mCurFrame->mRadiance)
+		.read(mPrevFrame->mRadiance)
+		.read(mCurFrame->mGradientPositions);
+		for (const Image::View& v : mCurFrame->mVisibility)
+			createDiffPass.read(v);
+		if (mCurFrame->mAliasedTemp)
+			for (const auto& d : mCurFrame->mDiffTemp)
+				createDiffPass.begin_alias(d[0]).begin_alias(d[1]);
+
+		for (uint32_t i = 0; i < mDiffAtrousIterations; i++) {
+			RenderGraph::Pass& filterDiffPass = mRenderGraph.add_pass("Filter diff image " + to_string(i), [&,i](CommandBuffer& commandBuffer) {
+				if (i == 0) {
+					mAtrousGradientPipeline->descriptor("gViews")   = mCurFrame->mViews;
+					mAtrousGradientPipeline->descriptor("gImage1",0) = image_descriptor(mCurFrame->mDiffTemp[0][0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+					mAtrousGradientPipeline->descriptor("gImage2",0) = image_descriptor(mCurFrame->mDiffTemp[0][1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+					mAtrousGradientPipeline->descriptor("gImage1",1) = image_descriptor(mCurFrame->mDiffTemp[1][0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+					mAtrousGradientPipeline->descriptor("gImage2",1) = image_descriptor(mCurFrame->mDiffTemp[1][1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+					commandBuffer.bind_pipeline(mAtrousGradientPipeline->get_pipeline());
+					mAtrousGradientPipeline->bind_descriptor_sets(commandBuffer);
 				}
-			}
+				mAtrousGradientPipeline->push_constant<uint32_t>("gIteration") = i;
+				mAtrousGradientPipeline->push_constant<uint32_t>("gStepSize") = (1 << i);
+				mAtrousGradientPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
+				mAtrousGradientPipeline->push_constants(commandBuffer);
+				commandBuffer.dispatch_over(gradExtent);
+			});
+			for (const auto& d : mCurFrame->mDiffTemp)
+				for (const Image::View& v : d)
+					filterDiffPass.write(v, vk::PipelineStageFlagBits::eComputeShader, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
 		}
 
-		{ // temporal accumulation
-			ProfilerRegion ps("Temporal accumulation", commandBuffer);
+		RenderGraph::Pass& accumulationPass = mRenderGraph.add_pass("Temporal accumulation", [&](CommandBuffer& commandBuffer) {
 			mTemporalAccumulationPipeline->descriptor("gViews")   = mCurFrame->mViews;
 			mTemporalAccumulationPipeline->descriptor("gAccumColor") = image_descriptor(mCurFrame->mAccumColor, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
 			mTemporalAccumulationPipeline->descriptor("gAccumMoments") = image_descriptor(mCurFrame->mAccumMoments, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
@@ -662,7 +1971,7 @@ void RayTraceScene::render(CommandBuffer& commandBuffer, const Image::View& rend
 				mTemporalAccumulationPipeline->descriptor("gPrevVisibility", i) = image_descriptor(mPrevFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
 			}
 			mTemporalAccumulationPipeline->descriptor("gPrevMoments") = image_descriptor(mPrevFrame->mAccumMoments, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-			mTemporalAccumulationPipeline->descriptor("gDiff") = image_descriptor(mCurFrame->mDiffTemp[mDiffAtrousIterations%2][0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+			mTemporalAccumulationPipeline->descriptor("gDiff") = image_descriptor(diff, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
 
 			mTemporalAccumulationPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
 				
@@ -670,12 +1979,21 @@ void RayTraceScene::render(CommandBuffer& commandBuffer, const Image::View& rend
 			mTemporalAccumulationPipeline->bind_descriptor_sets(commandBuffer);
 			mTemporalAccumulationPipeline->push_constants(commandBuffer);
 			commandBuffer.dispatch_over(extent);
-			
-			tonemap_in = mCurFrame->mAccumColor;
+		})
+		.write(mCurFrame->mAccumColor)
+		.write(mCurFrame->mAccumMoments)
+		.read(mCurFrame->mRadiance)
+		.read(mPrevFrame->mAccumColor)
+		.read(mPrevFrame->mAccumMoments);
+		for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++) {
+			accumulationPass.read(mCurFrame->mVisibility[i]);
+			accumulationPass.read(mPrevFrame->mVisibility[i]);
 		}
+		// gDiff is always bound, but only read with antilag enabled
+		if (antilag) accumulationPass.read(diff);
+		tonemap_in = mCurFrame->mAccumColor;
 
-		{ // estimate variance
-			ProfilerRegion ps("Estimate Variance", commandBuffer);
+		RenderGraph::Pass& variancePass = mRenderGraph.add_pass("Estimate Variance", [&](CommandBuffer& commandBuffer) {
 			mEstimateVariancePipeline->descriptor("gViews") = mCurFrame->mViews;
 			mEstimateVariancePipeline->descriptor("gInput") = image_descriptor(mCurFrame->mAccumColor, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
 			mEstimateVariancePipeline->descriptor("gOutput") = image_descriptor(mCurFrame->mTemp[0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
@@ -688,76 +2006,122 @@ void RayTraceScene::render(CommandBuffer& commandBuffer, const Image::View& rend
 			mEstimateVariancePipeline->bind_descriptor_sets(commandBuffer);
 			mEstimateVariancePipeline->push_constants(commandBuffer);
 			commandBuffer.dispatch_over(extent);
-			
-			tonemap_in = mCurFrame->mTemp[0];
+		})
+		.read(mCurFrame->mAccumColor)
+		.write(mCurFrame->mTemp[0])
+		.read(mCurFrame->mAccumMoments);
+		for (const Image::View& v : mCurFrame->mVisibility)
+			variancePass.read(v);
+		if (mCurFrame->mAliasedTemp)
+			variancePass.begin_alias(mCurFrame->mTemp[0]).begin_alias(mCurFrame->mTemp[1]);
+		tonemap_in = mCurFrame->mTemp[0];
+
+		// before the history tap overwrites mAccumColor's history length
+		if (adaptive) {
+			RenderGraph::Pass& priorityPass = mRenderGraph.add_pass("Estimate sample priority", [&](CommandBuffer& commandBuffer) {
+				mEstimatePriorityPipeline->descriptor("gViews") = mCurFrame->mViews;
+				for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++)
+					mEstimatePriorityPipeline->descriptor("gVisibility", i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+				mEstimatePriorityPipeline->descriptor("gAccumColor") = image_descriptor(mCurFrame->mAccumColor, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+				mEstimatePriorityPipeline->descriptor("gVariance") = image_descriptor(mCurFrame->mTemp[0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+				mEstimatePriorityPipeline->descriptor("gSamplePriority") = image_descriptor(mCurFrame->mSamplePriority, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
+				commandBuffer.bind_pipeline(mEstimatePriorityPipeline->get_pipeline());
+				mEstimatePriorityPipeline->bind_descriptor_sets(commandBuffer);
+				mAllocateSamplesPipeline->push_constants(commandBuffer);
+				commandBuffer.dispatch_over(extent);
+			})
+			.read(mCurFrame->mAccumColor)
+			.read(mCurFrame->mTemp[0])
+			.write(mCurFrame->mSamplePriority);
+			for (const Image::View& v : mCurFrame->mVisibility)
+				priorityPass.read(v);
+			mRenderGraph.export_resource(mCurFrame->mSamplePriority);
+			mCurFrame->mHasSamplePriority = true;
 		}
 
-		if (mAtrousIterations > 0) {
-			ProfilerRegion ps("Filter image", commandBuffer);
-			mAtrousPipeline->descriptor("gViews")  = mCurFrame->mViews;
-			for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++)
-				mAtrousPipeline->descriptor("gVisibility", i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-			mAtrousPipeline->descriptor("gImage", 0) = image_descriptor(mCurFrame->mTemp[0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-			mAtrousPipeline->descriptor("gImage", 1) = image_descriptor(mCurFrame->mTemp[1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
-			mAtrousPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
-			commandBuffer.bind_pipeline(mAtrousPipeline->get_pipeline());
-			mAtrousPipeline->bind_descriptor_sets(commandBuffer);
-			for (uint32_t i = 0; i < mAtrousIterations; i++) {
+		for (uint32_t i = 0; i < mAtrousIterations; i++) {
+			RenderGraph::Pass& atrousPass = mRenderGraph.add_pass("Filter image " + to_string(i), [&,i](CommandBuffer& commandBuffer) {
+				if (i == 0) {
+					mAtrousPipeline->descriptor("gViews")  = mCurFrame->mViews;
+					for (uint32_t j = 0; j < mCurFrame->mVisibility.size(); j++)
+						mAtrousPipeline->descriptor("gVisibility", j) = image_descriptor(mCurFrame->mVisibility[j], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+					mAtrousPipeline->descriptor("gImage", 0) = image_descriptor(mCurFrame->mTemp[0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+					mAtrousPipeline->descriptor("gImage", 1) = image_descriptor(mCurFrame->mTemp[1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+					mAtrousPipeline->push_constant<uint32_t>("gViewCount") = (uint32_t)views.size();
+					commandBuffer.bind_pipeline(mAtrousPipeline->get_pipeline());
+					mAtrousPipeline->bind_descriptor_sets(commandBuffer);
+				}
 				mAtrousPipeline->push_constant<uint32_t>("gIteration") = i;
 				mAtrousPipeline->push_constant<uint32_t>("gStepSize") = 1 << i;
 				mAtrousPipeline->push_constants(commandBuffer);
-				mAtrousPipeline->transition_images(commandBuffer);
 				commandBuffer.dispatch_over(extent);
-
-				if (i+1 == mHistoryTap)
+			});
+			for (const Image::View& v : mCurFrame->mVisibility)
+				atrousPass.read(v);
+			for (const Image::View& v : mCurFrame->mTemp)
+				atrousPass.write(v, vk::PipelineStageFlagBits::eComputeShader, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite);
+
+			if (i+1 == mHistoryTap)
+				mRenderGraph.add_pass("History tap", [&,i](CommandBuffer& commandBuffer) {
 					commandBuffer.copy_image(mCurFrame->mTemp[(i+1)%2], mCurFrame->mAccumColor);
-			}
+				})
+				.read(mCurFrame->mTemp[(i+1)%2], vk::PipelineStageFlagBits::eTransfer, vk::ImageLayout::eTransferSrcOptimal, vk::AccessFlagBits::eTransferRead)
+				.write(mCurFrame->mAccumColor, vk::PipelineStageFlagBits::eTransfer, vk::ImageLayout::eTransferDstOptimal, vk::AccessFlagBits::eTransferWrite);
+		}
+		if (mAtrousIterations > 0) {
 			tonemap_in = mCurFrame->mTemp[mAtrousIterations%2];
 			tonemap_out = mCurFrame->mTemp[(mAtrousIterations+1)%2];
 		}
-	} else
-		commandBuffer.clear_color_image(mCurFrame->mAccumColor, vk::ClearColorValue{ array<float,4>{ 0.f, 0.f, 0.f, 0.f } });
+	} else {
+		mRenderGraph.add_pass("Clear history", [&](CommandBuffer& commandBuffer) {
+			commandBuffer.clear_color_image(mCurFrame->mAccumColor, vk::ClearColorValue{ array<float,4>{ 0.f, 0.f, 0.f, 0.f } });
+		}).write(mCurFrame->mAccumColor, vk::PipelineStageFlagBits::eTransfer, vk::ImageLayout::eTransferDstOptimal, vk::AccessFlagBits::eTransferWrite);
+	}
 
-	{ // Tonemap
-		ProfilerRegion ps("Tonemap", commandBuffer);
+	// images for the debug views. The ones the current mode doesn't use are bound to images that are valid every frame
+	Image::View debug1 = mCurFrame->mAccumColor;
+	Image::View debug2 = mCurFrame->mAccumMoments;
+	if (debugMode == DebugMode::eAntilag)
+		debug2 = diff;
+
+	RenderGraph::Pass& tonemapPass = mRenderGraph.add_pass("Tonemap", [&](CommandBuffer& commandBuffer) {
 		mTonemapPipeline->descriptor("gInput") = image_descriptor(tonemap_in, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
 		mTonemapPipeline->descriptor("gOutput") = image_descriptor(tonemap_out, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderWrite);
 		mTonemapPipeline->descriptor("gAlbedo") = image_descriptor(mCurFrame->mAlbedo, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-		switch (mTonemapPipeline->specialization_constant("gDebugMode")) {
-		default:
-		case DebugMode::eZ:
-		case DebugMode::eDz:
-		case DebugMode::eNormals:
-			mTonemapPipeline->descriptor("gDebug3") = image_descriptor(mCurFrame->mVisibility[1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-			break;
-		case DebugMode::ePrevUV:
-			mTonemapPipeline->descriptor("gDebug2") = image_descriptor(mCurFrame->mVisibility[2], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-			break;
-		case DebugMode::eAccumLength:
-			mTonemapPipeline->descriptor("gDebug1") = image_descriptor(mCurFrame->mAccumColor, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-			break;
-		case DebugMode::eAntilag:
-			mTonemapPipeline->descriptor("gDebug2") = image_descriptor(mCurFrame->mDiffTemp[mDiffAtrousIterations%2][0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-			break;
-		}
-
-		if (!get<Image::View>(mTonemapPipeline->descriptor("gDebug1"))) mTonemapPipeline->descriptor("gDebug1") = image_descriptor(mCurFrame->mAccumColor, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-		if (!get<Image::View>(mTonemapPipeline->descriptor("gDebug2"))) mTonemapPipeline->descriptor("gDebug2") = image_descriptor(mCurFrame->mDiffTemp[mDiffAtrousIterations%2][0], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
-		if (!get<Image::View>(mTonemapPipeline->descriptor("gDebug3"))) mTonemapPipeline->descriptor("gDebug3") = image_descriptor(mCurFrame->mVisibility[1], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+		mTonemapPipeline->descriptor("gDebug1") = image_descriptor(debug1, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+		mTonemapPipeline->descriptor("gDebug2") = image_descriptor(debug2, vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
+		for (uint32_t i = 0; i < mCurFrame->mVisibility.size(); i++)
+			mTonemapPipeline->descriptor("gVisibility", i) = image_descriptor(mCurFrame->mVisibility[i], vk::ImageLayout::eGeneral, vk::AccessFlagBits::eShaderRead);
 
 		commandBuffer.bind_pipeline(mTonemapPipeline->get_pipeline());
 		mTonemapPipeline->bind_descriptor_sets(commandBuffer);
-		if (mTonemapPipeline->specialization_constant("gDebugMode") == DebugMode::eAccumLength)
+		if (debugMode == DebugMode::eAccumLength)
 			commandBuffer.push_constant("gExposure", 1/mTemporalAccumulationPipeline->push_constant<float>("gHistoryLimit"));
 		else
 			mTonemapPipeline->push_constants(commandBuffer);
 		commandBuffer.dispatch_over(extent);
-	}
+	})
+	.read(tonemap_in)
+	.write(tonemap_out)
+	.read(mCurFrame->mAlbedo)
+	.read(debug1)
+	.read(debug2);
+	for (const Image::View& v : mCurFrame->mVisibility)
+		tonemapPass.read(v);
+	if (!(hasHistory && mReprojection) && mCurFrame->mAliasedTemp)
+		tonemapPass.begin_alias(tonemap_out);
+
+	mRenderGraph.add_pass("Copy to render target", [&](CommandBuffer& commandBuffer) {
+		if (tonemap_out.image()->format() == renderTarget.image()->format())
+			commandBuffer.copy_image(tonemap_out, renderTarget);
+		else
+			commandBuffer.blit_image(tonemap_out, renderTarget);
+	})
+	.read(tonemap_out, vk::PipelineStageFlagBits::eTransfer, vk::ImageLayout::eTransferSrcOptimal, vk::AccessFlagBits::eTransferRead)
+	.write(renderTarget, vk::PipelineStageFlagBits::eTransfer, vk::ImageLayout::eTransferDstOptimal, vk::AccessFlagBits::eTransferWrite)
+	.side_effect();
 
-	if (tonemap_out.image()->format() == renderTarget.image()->format())
-		commandBuffer.copy_image(tonemap_out, renderTarget);
-	else
-		commandBuffer.blit_image(tonemap_out, renderTarget);
+	mRenderGraph.execute(commandBuffer);
 }
 
 }
\ No newline at end of file
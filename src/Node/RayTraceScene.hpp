@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Core/PipelineState.hpp>
+#include <Core/RenderGraph.hpp>
 
 #include "Scene.hpp"
 
@@ -18,19 +19,91 @@ public:
 	AccelerationStructure() = delete;
 	AccelerationStructure(const AccelerationStructure&) = delete;
 	AccelerationStructure(AccelerationStructure&&) = delete;
-	STRATUM_API AccelerationStructure(CommandBuffer& commandBuffer, const string& name, vk::AccelerationStructureTypeKHR type, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureGeometryKHR>& geometries, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureBuildRangeInfoKHR>& buildRanges);
+	STRATUM_API AccelerationStructure(CommandBuffer& commandBuffer, const string& name, vk::AccelerationStructureTypeKHR type, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureGeometryKHR>& geometries, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureBuildRangeInfoKHR>& buildRanges, vk::BuildAccelerationStructureFlagsKHR flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
+	// Creates the acceleration structure without building it (see BlasBuildQueue)
+	STRATUM_API AccelerationStructure(Device& device, const string& name, vk::AccelerationStructureTypeKHR type, vk::DeviceSize size, vk::BuildAccelerationStructureFlagsKHR flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
 	STRATUM_API ~AccelerationStructure();
 	inline const Buffer::View<byte>& buffer() const { return mBuffer; }
 	inline const vk::AccelerationStructureKHR* operator->() const { return &mAccelerationStructure; }
 	inline const vk::AccelerationStructureKHR& operator*() const { return mAccelerationStructure; }
+	inline vk::AccelerationStructureTypeKHR type() const { return mType; }
+	inline vk::BuildAccelerationStructureFlagsKHR flags() const { return mFlags; }
+	// false until a build has been recorded. Unbuilt structures can't be referenced by a TLAS
+	inline bool built() const { return mBuilt; }
+
+	// Rebuilds (eBuild) or refits (eUpdate) the acceleration structure in place, reusing the storage and scratch buffers.
+	// eUpdate requires the structure to have been created with eAllowUpdate and the same primitive counts.
+	// Returns false if the existing storage is too small for the new geometry, in which case a new AccelerationStructure must be created
+	STRATUM_API bool build(CommandBuffer& commandBuffer, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureGeometryKHR>& geometries, const vk::ArrayProxyNoTemporaries<const vk::AccelerationStructureBuildRangeInfoKHR>& buildRanges, vk::BuildAccelerationStructureModeKHR mode);
+
 private:
+	friend class BlasBuildQueue;
+
+	void create(vk::DeviceSize size);
+
 	vk::AccelerationStructureKHR mAccelerationStructure;
+	vk::AccelerationStructureTypeKHR mType;
+	vk::BuildAccelerationStructureFlagsKHR mFlags;
 	Buffer::View<byte> mBuffer;
+	Buffer::View<byte> mScratchBuffer; // kept alive between builds when eAllowUpdate is set
+	bool mBuilt = false;
+};
+
+// Gathers bottom level builds and records them with a single buildAccelerationStructuresKHR per flush(), with scratch memory
+// sub-allocated from one buffer that is reused between flushes. Builds past the primitive budget are left for the next flush()
+class BlasBuildQueue {
+public:
+	STRATUM_API ~BlasBuildQueue();
+
+	// Creates an unbuilt acceleration structure for the geometry. inputs are the buffers the geometry's device addresses point into,
+	// they are kept alive until the build is recorded
+	STRATUM_API shared_ptr<AccelerationStructure> push(Device& device, const string& name, const vk::AccelerationStructureGeometryKHR& geometry, const vk::AccelerationStructureBuildRangeInfoKHR& range, vector<Buffer::View<byte>>&& inputs, vk::BuildAccelerationStructureFlagsKHR flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
+	// Records the pending builds, oldest first, until the primitive budget is used up (at least one build is always recorded),
+	// followed by a barrier that makes the built structures visible to TLAS builds and shaders. Returns the number of builds recorded.
+	// The compacted sizes of structures created with eAllowCompaction are queried after their build
+	STRATUM_API size_t flush(CommandBuffer& commandBuffer);
+	// Copies structures whose compacted size query has completed into new, right-sized structures.
+	// Returns the (original, compacted) pairs; the originals should be replaced and released
+	STRATUM_API vector<pair<shared_ptr<AccelerationStructure>, shared_ptr<AccelerationStructure>>> compact(CommandBuffer& commandBuffer);
+
+	inline uint32_t& primitive_budget() { return mPrimitiveBudget; }
+	inline size_t pending_count() const { return mPending.size(); }
+	inline size_t build_count() const { return mBuildCount; }
+	inline size_t batch_count() const { return mBatchCount; }
+	inline vk::DeviceSize scratch_size() const { return mScratch ? mScratch.size_bytes() : 0; }
+	// total size of the structures compacted so far, before and after compaction
+	inline vk::DeviceSize uncompacted_bytes() const { return mUncompactedBytes; }
+	inline vk::DeviceSize compacted_bytes() const { return mCompactedBytes; }
+
+private:
+	struct PendingBuild {
+		shared_ptr<AccelerationStructure> mAccelerationStructure;
+		vk::AccelerationStructureGeometryKHR mGeometry;
+		vk::AccelerationStructureBuildRangeInfoKHR mRange;
+		vk::DeviceSize mScratchSize;
+		vector<Buffer::View<byte>> mInputs;
+	};
+	struct PendingCompaction {
+		vk::QueryPool mQueryPool; // one eAccelerationStructureCompactedSizeKHR query per structure
+		shared_ptr<DeviceResource> mBuildCompletion; // held only by the command buffer that reset and wrote the queries
+		vector<shared_ptr<AccelerationStructure>> mAccelerationStructures;
+	};
+	Device* mDevice = nullptr;
+	deque<PendingBuild> mPending;
+	deque<PendingCompaction> mCompactions;
+	Buffer::View<byte> mScratch;
+	vk::DeviceSize mScratchAlignment = 0;
+	uint32_t mPrimitiveBudget = 1 << 22;
+	size_t mBuildCount = 0;
+	size_t mBatchCount = 0;
+	vk::DeviceSize mUncompactedBytes = 0;
+	vk::DeviceSize mCompactedBytes = 0;
 };
 
 class RayTraceScene {
 public:
 	STRATUM_API RayTraceScene(Node& node);
+	STRATUM_API ~RayTraceScene();
 
 	inline Node& node() const { return mNode; }
 		
@@ -45,18 +118,78 @@ private:
 		shared_ptr<AccelerationStructure> mAccelerationStructure;
 		Buffer::StrideView mIndices;
 	};
+	// Sub-allocates ranges of a shared buffer, first-fit from the freed ranges and otherwise from the end
+	class RangeAllocator {
+	public:
+		uint32_t allocate(uint32_t size);
+		void free(uint32_t offset, uint32_t size);
+		inline uint32_t end() const { return mEnd; }
+	private:
+		map<uint32_t, uint32_t> mFreeRanges; // offset -> size
+		uint32_t mEnd = 0; // everything past mEnd is free
+	};
+	struct MeshGeometry {
+		uint32_t mFirstVertex;
+		uint32_t mVertexCount;
+		uint32_t mIndexByteOffset;
+		uint32_t mIndexBytes; // aligned to 4
+		uint64_t mUsedVersion; // mSceneVersion of the last extraction that instanced the mesh
+	};
+	// A MeshPrimitive with an AnimatedMesh. It has its own range of mVertices, which is reset to the mesh's bind pose and deformed
+	// whenever its joints or morph weights change, and its own BLAS, which is refit (or rebuilt) after each deformation
+	struct AnimatedInstance {
+		Mesh* mMesh;
+		component_ptr<AnimatedMesh> mAnimation;
+		uint32_t mFirstVertex;
+		uint32_t mVertexCount;
+		uint32_t mInstanceIndex; // index in mInstancesAS
+		shared_ptr<AccelerationStructure> mAccelerationStructure; // null until the first deformation
+		uint64_t mAnimatedVersion; // latest version of the joints' transforms and the AnimatedMesh when the vertices were deformed
+		uint64_t mUsedVersion; // mSceneVersion of the last extraction that instanced the primitive
+	};
 
 	Node& mNode;
 	shared_ptr<AccelerationStructure> mTopLevel;
 	shared_ptr<AccelerationStructure> mUnitCubeAS;
-	unordered_map<Mesh*, Buffer::View<hlsl::PackedVertexData>> mMeshVertices;
 	unordered_map<Mesh*, MeshAS> mMeshAccelerationStructures;
-	unordered_map<void*, pair<hlsl::TransformData, uint32_t>> mTransformHistory;
+	BlasBuildQueue mBlasBuildQueue;
+	vector<pair<uint32_t, shared_ptr<AccelerationStructure>>> mUnbuiltInstances; // mInstancesAS entries left inactive until their BLAS is built
+
+	// Mesh vertices and indices live in arenas shared by all instances of the mesh and all frames. A mesh is written once,
+	// when an extraction first instances it, and its ranges are freed by the first extraction that doesn't
+	Buffer::View<hlsl::PackedVertexData> mVertices;
+	Buffer::View<byte> mIndices;
+	RangeAllocator mVertexRanges; // in vertices
+	RangeAllocator mIndexRanges; // in bytes
+	unordered_map<Mesh*, MeshGeometry> mMeshGeometry;
+	vector<Mesh*> mPendingGeometry; // allocated in mMeshGeometry, but not written to the arenas yet
+	unordered_map<MeshPrimitive*, AnimatedInstance> mAnimatedInstances;
+	// Emissive meshes, with an alias table that samples their triangles in proportion to area. Mesh data only lives on the GPU,
+	// so the table is built from a readback, and the mesh's triangles are sampled uniformly until it arrives
+	struct EmissiveMesh {
+		Buffer::View<float> mTriangleDistribution;
+		float mArea = 0; // in object space
+	};
+	unordered_map<Mesh*, EmissiveMesh> mEmissiveMeshes;
+	// emissive mesh data being copied to the host. Kept outside of FrameData, which render() replaces on resize
+	struct TriangleReadback {
+		Mesh* mMesh;
+		Buffer::View<byte> mPositions;
+		uint32_t mPositionStride;
+		Buffer::View<byte> mIndices;
+		uint32_t mIndexStride;
+	};
+	deque<TriangleReadback> mTriangleReadbacks;
 	
 	component_ptr<ComputePipelineState> mCopyVerticesPipeline;
+	component_ptr<ComputePipelineState> mSkinPipeline;
+	component_ptr<ComputePipelineState> mBlendPipeline;
 	
 	component_ptr<ComputePipelineState> mTraceVisibilityPipeline;
 	component_ptr<ComputePipelineState> mTraceBouncePipeline;
+	component_ptr<ComputePipelineState> mTraceBounceQueuedPipeline;
+	component_ptr<ComputePipelineState> mSortPathsPipeline;
+	component_ptr<ComputePipelineState> mTraceAdaptivePipeline;
 	component_ptr<ComputePipelineState> mDemodulateAlbedoPipeline;
 	component_ptr<ComputePipelineState> mTonemapPipeline;
 	
@@ -70,45 +203,176 @@ private:
 	component_ptr<ComputePipelineState> mCreateGradientSamplesPipeline;
 	component_ptr<ComputePipelineState> mAtrousGradientPipeline;
 
+	// adaptive sampling pipelines
+	component_ptr<ComputePipelineState> mEstimatePriorityPipeline;
+	component_ptr<ComputePipelineState> mSumPriorityPipeline;
+	component_ptr<ComputePipelineState> mAllocateSamplesPipeline;
+	component_ptr<ComputePipelineState> mResolveSamplesPipeline;
+
+	RenderGraph mRenderGraph; // rebuilt every frame
+
 	bool mRandomPerFrame = true;
 	bool mReprojection = true;
 	bool mDemodulateAlbedo = true;
 	uint32_t mDiffAtrousIterations = 0;
 	uint32_t mAtrousIterations = 0;
-	uint32_t mSpatialReservoirIterations = 0;
+	uint32_t mReservoirSamples = 0; // ReSTIR DI light candidates per pixel, 0 disables ReSTIR
+	bool mTemporalReservoirReuse = true;
+	uint32_t mSpatialReservoirIterations = 1;
 	uint32_t mHistoryTap = 0;
 	uint32_t mMinDepth = 2;
 	uint32_t mMaxDepth = 5;
+	bool mWavefront = true; // bounces after the first only run over the paths that are still alive, with indirect dispatches
+	bool mSortPaths = false; // sort the queued paths by BSDF type and material between wavefront bounces
+	bool mAdaptiveSampling = false; // trace extra wavefront paths for the pixels with the highest relative error in the previous frame
+	float mAdaptiveBudget = 0.25f; // extra paths per frame, as a fraction of the pixel count
+	uint32_t mAdaptiveMaxSamples = 4; // extra paths per pixel, at most 31
+	float mAdaptiveThreshold = 0.02f; // pixels with a lower relative standard error are converged and get no extra paths
+	bool mAliasTemporaries = true; // let mTemp and mDiffTemp share memory
+	bool mCompactBlas = true; // build mesh BLASes with eAllowCompaction and replace them with compacted copies
+	bool mRefitAnimatedBlas = true; // refit the BLASes of deformed meshes, otherwise they are rebuilt
+	struct {
+		size_t mDeformed = 0; // in the last update
+		size_t mRefits = 0;
+		size_t mBuilds = 0;
+	} mAnimatedStats;
+
+	// GPU time and path counts of the bounce passes, read back once the frame has executed
+	struct BounceTiming {
+		vk::QueryPool mQueryPool; // timestamps before the first and after the last bounce
+		shared_ptr<DeviceResource> mRenderCompletion; // held only by the command buffer that reset and wrote the queries
+		Buffer::View<byte> mPathQueueArgs; // host copy of FrameData::mPathQueueArgs
+		uint32_t mDepth;
+		bool mWavefront;
+		bool mSortPaths;
+		uint32_t mAdaptiveBudget; // 0 without adaptive sampling
+	};
+	deque<BounceTiming> mBounceTimings;
+	vector<vk::QueryPool> mFreeBounceQueryPools;
+	struct {
+		uint32_t mDepth = 0;
+		bool mWavefront = false;
+		bool mSortPaths = false;
+		uint32_t mAdaptiveBudget = 0;
+		uint32_t mAdaptiveSamples = 0;
+		float mTime = 0; // ms
+		uint64_t mRays = 0;
+		vector<uint32_t> mTracedPaths; // per bounce
+	} mBounceStats;
+
+	// TLAS refit heuristic: the TLAS is refit while the instance set is unchanged, and rebuilt after mTopLevelMaxRefits consecutive refits to restore trace quality
+	bool mTopLevelRefit = true;
+	uint32_t mTopLevelMaxRefits = 64;
+	uint32_t mTopLevelRefitCount = 0;
+	vector<vk::AccelerationStructureInstanceKHR> mTopLevelInstances;
+	struct {
+		size_t mBuilds = 0;
+		size_t mRefits = 0;
+		size_t mSkipped = 0;
+	} mTopLevelStats;
+
+	// Scene extraction is cached between frames. It is only redone from scratch when the node graph's structure or the primitives change,
+	// otherwise only instances whose transform version changed and materials whose version changed are updated
+	struct InstanceRecord {
+		void* mPrimitive;
+		uint32_t mTransformIndex; // index of the primitive's node in the TransformCache
+		float mRadius; // SpherePrimitive::mRadius, 0 for meshes
+		hlsl::TransformData mTransform;
+		uint64_t mTransformVersion; // TransformCache::version() when mTransform was computed
+		uint64_t mDirtyVersion; // mSceneVersion when the InstanceData was last written
+		bool mMoved; // mTransform changed in the last update, prev_transform needs to catch up
+	};
+	struct MaterialRecord {
+		component_ptr<hlsl::Material> mMaterial; // null for the error material
+		uint32_t mAddress;
+		uint32_t mSize;
+		size_t mType;
+		uint64_t mVersion;
+		uint64_t mDirtyVersion;
+	};
+	uint64_t mSceneVersion = 0;
+	uint64_t mInstanceSetVersion = 0; // mSceneVersion of the last full extraction
+	uint64_t mDistributionDataVersion = 0;
+	struct {
+		uint64_t mStructure = 0;
+		uint64_t mSpheres = 0;
+		uint64_t mMeshes = 0;
+		uint64_t mMaterials = 0;
+		uint64_t mTransforms = 0;
+	} mExtractedVersions; // NodeGraph versions seen by the last update
+	vector<InstanceRecord> mInstanceRecords;
+	vector<hlsl::InstanceData> mInstanceDatas;
+	vector<vk::AccelerationStructureInstanceKHR> mInstancesAS;
+	vector<MaterialRecord> mMaterialRecords;
+	hlsl::ByteAppendBuffer mMaterialData;
+	hlsl::ImagePool mImages;
+	vector<uint32_t> mLightInstances;
+	struct LightRecord {
+		component_ptr<hlsl::Material> mMaterial;
+		Mesh* mMesh; // null for spheres
+	};
+	vector<LightRecord> mLightRecords; // parallel to mLightInstances
+	Buffer::View<float> mLightDistribution; // the power-proportional light alias table, see light.hlsli
+	uint32_t mLightDistributionAddress = 0;
+	uint64_t mLightDistributionVersion = 0; // mSceneVersion of the last in-place rewrite of mLightDistribution's range
+	bool mLightDistributionDirty = false;
+	size_t mInstancedGeometryBytes = 0; // size of the arenas if every instance had its own copy of its mesh
+	uint32_t mEnvironmentMaterialAddress = -1;
+	vector<uint32_t> mInstanceIndexMap; // uploaded to the UploadRing every frame
+	bool mInstanceIndexMapIdentity = false;
+	bool mInstancesMoved = false;
 
 	struct FrameData {
-		Buffer::View<hlsl::PackedVertexData> mVertices;
-		Buffer::View<byte> mIndices;
 		Buffer::View<byte> mMaterialData;
 		Buffer::View<hlsl::InstanceData> mInstances;
 		Buffer::View<uint32_t> mLightInstances;
 		Buffer::View<float> mDistributionData;
 		Buffer::View<byte> mPathBounceData;
+		Buffer::View<byte> mPathQueue; // two queues of path state indices, alternating between bounces
+		Buffer::View<byte> mPathQueueArgs; // per bounce: the dispatch args for the paths it queued, and its path counts
+		Buffer::View<byte> mPathBins; // per bounce: the sort key histogram of the paths it queued
+		Buffer::View<byte> mAdaptiveArgs; // dispatch args for the adaptive samples, the number of samples, and the sum of the pixels' priorities
+		Buffer::View<byte> mAdaptiveSamples; // the pixel index of each adaptive sample
+		Buffer::View<byte> mSampleCounts; // per pixel: its first adaptive sample and the number of them
+		Buffer::View<byte> mSampleRadiance; // per adaptive sample
 
-		Buffer::View<hlsl::ViewData> mViews;
+		vector<hlsl::ViewData> mViewData;
+		Buffer::View<hlsl::ViewData> mViews; // UploadRing memory, only valid in the frame's CommandBuffer
 		
 		array<Image::View, VISIBILITY_BUFFER_COUNT> mVisibility;
 		Image::View mRadiance;
 		Image::View mAlbedo;
 
-		Image::View mReservoirs;
-		Image::View mReservoirRNG;
+		// ReSTIR DI reservoirs, ping-ponged between the spatial reuse iterations. mReservoirIndex holds the final ones, which the next frame reuses
+		array<Image::View, 2> mReservoirs;
+		array<Image::View, 2> mReservoirRNG;
+		uint32_t mReservoirIndex = 0;
+		bool mHasReservoirs = false;
 		
 		Image::View mAccumColor;
 		Image::View mAccumMoments;
+		Image::View mSamplePriority; // written from the variance estimate, for the next frame's adaptive sampling
+		bool mHasSamplePriority = false;
 		
 		Image::View mGradientPositions;
 		array<Image::View, 2> mTemp;
 		array<array<Image::View, 2>, 2> mDiffTemp;
 
 		uint32_t mFrameId;
+		bool mAliasedTemp = false; // mTemp and mDiffTemp were allocated with ResourcePool::get_aliased_images
+
+		// mSceneVersion of the data last uploaded to the buffers above, 0 after they are (re)allocated
+		uint64_t mInstanceSetVersion = 0; // light instances
+		uint64_t mInstancesVersion = 0;
+		uint64_t mMaterialDataVersion = 0;
+		uint64_t mDistributionDataVersion = 0;
+		uint64_t mLightDistributionVersion = 0;
 	};
 
 	unique_ptr<FrameData> mCurFrame, mPrevFrame;
+	// older frames that may still be in flight on the GPU. The CPU-written buffers of a FrameData are only reused once
+	// Application::max_frames_in_flight() newer frames have started, so there is one FrameData per frame in flight
+	deque<unique_ptr<FrameData>> mInFlightFrames;
 };
 
 }
\ No newline at end of file
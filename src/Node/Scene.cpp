@@ -8,12 +8,110 @@ namespace stm {
 static float3 gAnimateTranslate = float3::Zero();
 static float3 gAnimateRotate = float3::Zero();
 static TransformData* gAnimatedTransform = nullptr;
-STRATUM_API void animate(CommandBuffer& commandBuffer, float deltaTime) {
+static Node* gAnimatedNode = nullptr;
+
+// finds the keyframes around time, and how far time is between them
+inline tuple<size_t, size_t, float> find_keyframes(const vector<float>& times, float time, bool step) {
+	auto it = ranges::upper_bound(times, time);
+	if (it == times.begin()) return { 0, 0, 0.f };
+	if (it == times.end()) return { times.size() - 1, times.size() - 1, 0.f };
+	const size_t i1 = it - times.begin();
+	const size_t i0 = i1 - 1;
+	if (step) return { i0, i0, 0.f };
+	return { i0, i1, (time - times[i0]) / max(times[i1] - times[i0], 1e-6f) };
+}
+
+static void sample_animation(Animation& animation, float deltaTime) {
+	if (animation.mPlaying) {
+		animation.mTime += deltaTime*animation.mSpeed;
+		if (animation.mLoop && animation.mDuration > 0)
+			animation.mTime = fmodf(animation.mTime, animation.mDuration);
+		else
+			animation.mTime = min(animation.mTime, animation.mDuration);
+	}
+
+	struct Pose {
+		float3 mTranslation;
+		quatf mRotation;
+		float3 mScale;
+	};
+	vector<Pose> poses(animation.mTargets.size());
+	for (size_t i = 0; i < poses.size(); i++) {
+		const Animation::Target& target = animation.mTargets[i];
+		poses[i] = Pose{ target.mTranslation, target.mRotation, target.mScale };
+	}
+
+	for (const Animation::Channel& channel : animation.mChannels) {
+		if (channel.mTimes.empty()) continue;
+		const auto[i0, i1, t] = find_keyframes(channel.mTimes, animation.mTime, channel.mStep);
+		Pose& pose = poses[channel.mTarget];
+		switch (channel.mPath) {
+		case Animation::Path::eTranslation:
+			pose.mTranslation = float3::Map(&channel.mValues[3*i0])*(1 - t) + float3::Map(&channel.mValues[3*i1])*t;
+			break;
+		case Animation::Path::eScale:
+			pose.mScale = float3::Map(&channel.mValues[3*i0])*(1 - t) + float3::Map(&channel.mValues[3*i1])*t;
+			break;
+		case Animation::Path::eRotation: {
+			const float* q0 = &channel.mValues[4*i0];
+			const float* q1 = &channel.mValues[4*i1];
+			pose.mRotation = slerp(make_quatf(q0[0], q0[1], q0[2], q0[3]), make_quatf(q1[0], q1[1], q1[2], q1[3]), t);
+			break;
+		}
+		case Animation::Path::eWeights: {
+			const size_t n = channel.mValues.size() / channel.mTimes.size();
+			for (const component_ptr<AnimatedMesh>& mesh : animation.mTargets[channel.mTarget].mMeshes) {
+				bool changed = mesh->mMorphWeights.size() != n;
+				mesh->mMorphWeights.resize(n);
+				for (size_t j = 0; j < n; j++) {
+					const float w = channel.mValues[n*i0 + j]*(1 - t) + channel.mValues[n*i1 + j]*t;
+					changed |= mesh->mMorphWeights[j] != w;
+					mesh->mMorphWeights[j] = w;
+				}
+				if (changed) mesh.mark_dirty();
+			}
+			break;
+		}
+		}
+	}
+
+	for (size_t i = 0; i < poses.size(); i++) {
+		const Animation::Target& target = animation.mTargets[i];
+		if (component_ptr<TransformData> transform = target.mNode->find<TransformData>()) {
+			// a paused or clamped animation samples the same pose every frame, which shouldn't deform, refit and update the TLAS again.
+			// TransformData is all floats, so comparing bytes only errs towards marking it dirty (e.g. -0 and 0)
+			const TransformData t = make_transform(poses[i].mTranslation, poses[i].mRotation, poses[i].mScale);
+			if (memcmp(&t, transform.get(), sizeof(TransformData)) != 0) {
+				*transform = t;
+				transform.mark_dirty();
+			}
+		}
+	}
+}
+
+STRATUM_API void animate(NodeGraph& nodeGraph, float deltaTime) {
+	for (const component_ptr<Animation>& animation : nodeGraph.find_components<Animation>())
+		if (animation->mPlaying)
+			sample_animation(*animation, deltaTime);
+
 	if (gAnimatedTransform) {
+		if (!gAnimatedNode) {
+			// the inspector only knows the component, find the node that owns it
+			for (const component_ptr<TransformData>& c : nodeGraph.find_components<TransformData>())
+				if (c.get() == gAnimatedTransform) {
+					gAnimatedNode = &c.node();
+					break;
+				}
+			if (!gAnimatedNode) {
+				gAnimatedTransform = nullptr;
+				return;
+			}
+		}
 		*gAnimatedTransform = tmul(*gAnimatedTransform, make_transform(gAnimateTranslate*deltaTime, quatf_identity(), float3::Ones()));
 		float r = length(gAnimateRotate);
 		if (r > 0)
 			*gAnimatedTransform = tmul(*gAnimatedTransform, make_transform(float3::Zero(), angle_axis(r*deltaTime, gAnimateRotate/r), float3::Ones()));
+		gAnimatedNode->mark_dirty<TransformData>();
 	}
 }
 
@@ -75,8 +173,10 @@ inline void inspector_gui_fn(TransformData* t) {
 			if (ImGui::Button("Stop Animating")) gAnimatedTransform = nullptr;
 			ImGui::DragFloat3("Translate", gAnimateTranslate.data(), .01f);
 			ImGui::DragFloat3("Rotate", gAnimateRotate.data(), .01f);
-	} else if (ImGui::Button("Animate"))
+	} else if (ImGui::Button("Animate")) {
 		gAnimatedTransform = t;
+		gAnimatedNode = nullptr;
+	}
 }
 inline void inspector_gui_fn(Material* material) {
 	material_inspector_gui_fn(*material);
@@ -88,6 +188,21 @@ inline void inspector_gui_fn(MeshPrimitive* mesh) {
 inline void inspector_gui_fn(SpherePrimitive* sphere) {
 	ImGui::DragFloat("Radius", &sphere->mRadius, .01f);
 }
+inline void inspector_gui_fn(AnimatedMesh* mesh) {
+	ImGui::LabelText("Joints", "%zu", mesh->mJoints.size());
+	ImGui::LabelText("Morph targets", "%zu", mesh->mMorphTargets.size());
+	for (size_t i = 0; i < mesh->mMorphWeights.size(); i++)
+		ImGui::DragFloat(("Weight " + to_string(i)).c_str(), &mesh->mMorphWeights[i], .01f);
+}
+inline void inspector_gui_fn(Animation* animation) {
+	ImGui::Checkbox("Playing", &animation->mPlaying);
+	ImGui::Checkbox("Loop", &animation->mLoop);
+	ImGui::DragFloat("Speed", &animation->mSpeed, .01f);
+	// scrubbing while paused re-samples the animation at the new time
+	if (ImGui::SliderFloat("Time", &animation->mTime, 0, animation->mDuration) && !animation->mPlaying)
+		sample_animation(*animation, 0);
+	ImGui::LabelText("Channels", "%zu", animation->mChannels.size());
+}
 
 TransformData node_to_world(const Node& node) {
 	static bool registered = false;
@@ -100,19 +215,106 @@ TransformData node_to_world(const Node& node) {
 		gui->register_inspector_gui_fn<Material>(&inspector_gui_fn);
 		gui->register_inspector_gui_fn<MeshPrimitive>(&inspector_gui_fn);
 		gui->register_inspector_gui_fn<SpherePrimitive>(&inspector_gui_fn);
+		gui->register_inspector_gui_fn<AnimatedMesh>(&inspector_gui_fn);
+		gui->register_inspector_gui_fn<Animation>(&inspector_gui_fn);
 		
 		gAnimatedTransform = nullptr;
-		node.node_graph().find_components<Application>().front()->OnUpdate.listen(gui.node(), &animate);
+		gAnimatedNode = nullptr;
+		node.node_graph().find_components<Application>().front()->OnUpdate.listen(gui.node(), [&nodeGraph = node.node_graph()](CommandBuffer& commandBuffer, float deltaTime) {
+			animate(nodeGraph, deltaTime);
+		});
 	}
 
-	TransformData transform = make_transform(float3::Zero(), quatf_identity(), float3::Ones());
-	const Node* p = &node;
-	while (p != nullptr) {
-		auto c = p->find<TransformData>();
-		if (c) transform = tmul(*c, transform);
-		p = p->parent();
+	// exact as long as TransformData changes are stamped with mark_dirty, which debug builds assert (see component_ptr::mark_dirty)
+	const TransformCache& cache = transform_cache(node.node_graph());
+	return cache.node_to_world(cache.index(node));
+}
+
+void TransformCache::update_range(uint32_t begin, uint32_t end) {
+	// parents precede their children, so mNodeToWorld[p] is always up to date here
+	for (uint32_t i = begin; i < end; i++) {
+		const uint32_t p = mParents[i];
+		if (p == ~0u) {
+			mNodeToWorld[i] = mLocalTransforms[i] ? *mLocalTransforms[i] : make_transform(float3::Zero(), quatf_identity(), float3::Ones());
+			mVersions[i] = mLocalVersions[i];
+		} else {
+			mNodeToWorld[i] = mLocalTransforms[i] ? tmul(mNodeToWorld[p], *mLocalTransforms[i]) : mNodeToWorld[p];
+			mVersions[i] = max(mVersions[p], mLocalVersions[i]);
+		}
+	}
+}
+
+void TransformCache::update(const NodeGraph& nodeGraph) {
+	if (mNodeGraph != &nodeGraph || mStructureVersion != nodeGraph.structure_version()) {
+		ProfilerRegion ps("TransformCache::update");
+		mNodeGraph = &nodeGraph;
+		mNodeIndices.resize(nodeGraph.size());
+		mParents.clear();
+		mLocalTransforms.clear();
+		mLocalVersions.clear();
+		mParents.reserve(nodeGraph.size());
+		mLocalTransforms.reserve(nodeGraph.size());
+		mLocalVersions.reserve(nodeGraph.size());
+
+		// depth-first so that every subtree occupies a contiguous range
+		vector<pair<const Node*, uint32_t>> todo;
+		for (const Node& root : nodeGraph.nodes()) {
+			if (root.parent()) continue;
+			todo.emplace_back(&root, ~0u);
+			while (!todo.empty()) {
+				const auto[n, parent] = todo.back();
+				todo.pop_back();
+				const uint32_t index = (uint32_t)mParents.size();
+				if (n->id() >= mNodeIndices.size())
+					mNodeIndices.resize(n->id() + 1);
+				mNodeIndices[n->id()] = index;
+				mParents.emplace_back(parent);
+				mLocalTransforms.emplace_back(n->find<TransformData>().get());
+				mLocalVersions.emplace_back(n->version<TransformData>());
+				for (const Node& c : n->children())
+					todo.emplace_back(&c, index);
+			}
+		}
+
+		mSubtreeEnds.resize(mParents.size());
+		for (uint32_t i = 0; i < mSubtreeEnds.size(); i++)
+			mSubtreeEnds[i] = i + 1;
+		for (uint32_t i = (uint32_t)mParents.size(); i-- > 0;)
+			if (mParents[i] != ~0u)
+				mSubtreeEnds[mParents[i]] = max(mSubtreeEnds[mParents[i]], mSubtreeEnds[i]);
+
+		mNodeToWorld.resize(mParents.size());
+		mVersions.resize(mParents.size());
+		update_range(0, (uint32_t)mParents.size());
+
+		mStructureVersion = nodeGraph.structure_version();
+		mTransformVersion = nodeGraph.component_version<TransformData>();
+	} else if (mTransformVersion != nodeGraph.component_version<TransformData>()) {
+		mDirty.clear();
+		nodeGraph.for_each_changed_component<TransformData>(mTransformVersion, [&](const component_ptr<TransformData>& transform, uint64_t version) {
+			const uint32_t i = index(transform.node());
+			mLocalVersions[i] = version;
+			mDirty.emplace_back(i);
+		});
+		ranges::sort(mDirty);
+
+		// recompute each changed subtree once, dirty nodes inside an already recomputed subtree are skipped
+		uint32_t end = 0;
+		for (uint32_t i : mDirty)
+			if (i >= end) {
+				end = mSubtreeEnds[i];
+				update_range(i, end);
+			}
+
+		mTransformVersion = nodeGraph.component_version<TransformData>();
 	}
-	return transform;
+}
+
+const TransformCache& transform_cache(const NodeGraph& nodeGraph) {
+	if (!nodeGraph.mTransformCache)
+		nodeGraph.mTransformCache = make_shared<TransformCache>();
+	nodeGraph.mTransformCache->update(nodeGraph);
+	return *nodeGraph.mTransformCache;
 }
 
 }
\ No newline at end of file
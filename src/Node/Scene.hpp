@@ -29,6 +29,90 @@ struct SpherePrimitive {
 	float mRadius;
 };
 
+// Skinning and morph targets of the MeshPrimitive on the same node. RayTraceScene gives each animated primitive its own copy of the mesh's vertices,
+// deforms it with kernel/anim.hlsl whenever a joint or mMorphWeights changes, and refits the primitive's BLAS instead of rebuilding it
+struct AnimatedMesh {
+	Buffer::View<hlsl::VertexWeight> mWeights; // one per vertex, empty if the mesh isn't skinned
+	vector<Node*> mJoints; // mWeights' joint indices index this
+	vector<Matrix4f> mInverseBindMatrices;
+	vector<Buffer::View<hlsl::PackedVertexData>> mMorphTargets; // per-vertex displacements of the position, normal and tangent
+	vector<float> mMorphWeights; // one per morph target, mark_dirty() after changing them
+};
+
+// Keyframed transforms and morph weights, sampled by animate() every update while playing
+struct Animation {
+	enum class Path { eTranslation, eRotation, eScale, eWeights };
+	struct Channel {
+		uint32_t mTarget; // index into mTargets
+		Path mPath;
+		bool mStep; // step interpolation, otherwise linear (cubic splines are sampled at their keyframes and interpolated linearly)
+		vector<float> mTimes;
+		vector<float> mValues; // 3 (translation, scale), 4 (rotation, xyzw) or one per morph target values per keyframe
+	};
+	struct Target {
+		Node* mNode;
+		// rest pose, for the paths that aren't animated
+		float3 mTranslation;
+		hlsl::quatf mRotation;
+		float3 mScale;
+		vector<component_ptr<AnimatedMesh>> mMeshes; // receive the eWeights channels
+	};
+	vector<Target> mTargets;
+	vector<Channel> mChannels;
+	float mDuration = 0;
+	float mTime = 0;
+	float mSpeed = 1;
+	bool mPlaying = true;
+	bool mLoop = true;
+};
+
+// Flattened node-to-world transforms of every node in a NodeGraph, stored in depth-first order so that each subtree is a contiguous range.
+// update() re-flattens the hierarchy when the graph's structure changes, otherwise it only recomputes the subtrees below TransformData components that changed
+class TransformCache {
+public:
+	STRATUM_API void update(const NodeGraph& nodeGraph);
+
+	inline size_t size() const { return mNodeToWorld.size(); }
+	inline uint32_t index(const Node& node) const { return mNodeIndices[node.id()]; }
+	inline const hlsl::TransformData& node_to_world(uint32_t index) const { return mNodeToWorld[index]; }
+	// Latest version of any TransformData between the node and the root. Changes whenever node_to_world(index) changes, except for reparenting (see NodeGraph::structure_version)
+	inline uint64_t version(uint32_t index) const { return mVersions[index]; }
+
+	// Linear scan over the dense storage of components of type T, filtered to the subtree of root.
+	// Unlike Node::for_each_descendant, this does not traverse the hierarchy
+	template<typename T, invocable<component_ptr<T>> F>
+	inline void for_each_descendant(const Node& root, F&& fn) const {
+		if (!mNodeGraph->count<T>()) return;
+		const uint32_t begin = index(root);
+		const uint32_t end = mSubtreeEnds[begin];
+		for (const component_ptr<T>& c : mNodeGraph->find_components<T>()) {
+			const uint32_t i = index(c.node());
+			if (i >= begin && i < end)
+				fn(c);
+		}
+	}
+
+private:
+	const NodeGraph* mNodeGraph = nullptr;
+	uint64_t mStructureVersion = 0;
+	uint64_t mTransformVersion = 0;
+	vector<uint32_t> mNodeIndices; // indexed by Node::id()
+	vector<uint32_t> mParents; // ~0u for root nodes
+	vector<uint32_t> mSubtreeEnds; // one past the last descendant
+	vector<const hlsl::TransformData*> mLocalTransforms; // nullptr for nodes without a TransformData
+	vector<uint64_t> mLocalVersions;
+	vector<hlsl::TransformData> mNodeToWorld;
+	vector<uint64_t> mVersions;
+	vector<uint32_t> mDirty;
+
+	void update_range(uint32_t begin, uint32_t end);
+};
+
+// Returns the transform cache owned by the node graph, updated to the latest TransformData versions.
+// Only TransformData changes stamped with mark_dirty are picked up
+STRATUM_API const TransformCache& transform_cache(const NodeGraph& nodeGraph);
+
+// Reads the node's transform from the TransformCache
 STRATUM_API hlsl::TransformData node_to_world(const Node& node);
 
 STRATUM_API Mesh load_serialized(CommandBuffer& commandBuffer, const fs::path& filename, int shape_idx = -1);
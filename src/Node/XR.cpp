@@ -323,6 +323,7 @@ void XR::render(CommandBuffer& commandBuffer) {
 				float3(mXRViews[i].pose.position.x, mXRViews[i].pose.position.y, mXRViews[i].pose.position.z),
 				make_quatf(mXRViews[i].pose.orientation.x, mXRViews[i].pose.orientation.y, mXRViews[i].pose.orientation.z, mXRViews[i].pose.orientation.w),
 				float3::Ones());
+			mViews[i].mTransform.mark_dirty();
 			const float tanAngleLeft  = tanf(mXRViews[i].fov.angleLeft);
 			const float tanAngleRight = tanf(mXRViews[i].fov.angleRight);
 			const float tanAngleDown  = tanf(mXRViews[i].fov.angleDown);
@@ -9,6 +9,35 @@ using namespace stm::hlsl;
 
 namespace stm {
 
+// Reads an accessor's elements as consecutive components, converting normalized integers to floats. Sparse accessors are read without their sparse values
+template<typename T>
+static vector<T> read_accessor(const tinygltf::Model& model, const tinygltf::Accessor& accessor) {
+	const size_t components = tinygltf::GetNumComponentsInType(accessor.type);
+	vector<T> result(accessor.count*components, T(0));
+	if (accessor.bufferView < 0) return result;
+
+	const tinygltf::BufferView& bv = model.bufferViews[accessor.bufferView];
+	const size_t componentSize = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+	const size_t stride = accessor.ByteStride(bv);
+	const unsigned char* data = model.buffers[bv.buffer].data.data() + bv.byteOffset + accessor.byteOffset;
+	for (size_t i = 0; i < accessor.count; i++)
+		for (size_t c = 0; c < components; c++) {
+			const unsigned char* src = data + i*stride + c*componentSize;
+			T& dst = result[i*components + c];
+			switch (accessor.componentType) {
+				case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: 	dst = accessor.normalized ? (T)(*src/255.f) : (T)*src; break;
+				case TINYGLTF_COMPONENT_TYPE_BYTE: 						dst = accessor.normalized ? (T)max(*reinterpret_cast<const int8_t*>(src)/127.f, -1.f) : (T)*reinterpret_cast<const int8_t*>(src); break;
+				case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: 	dst = accessor.normalized ? (T)(*reinterpret_cast<const uint16_t*>(src)/65535.f) : (T)*reinterpret_cast<const uint16_t*>(src); break;
+				case TINYGLTF_COMPONENT_TYPE_SHORT: 					dst = accessor.normalized ? (T)max(*reinterpret_cast<const int16_t*>(src)/32767.f, -1.f) : (T)*reinterpret_cast<const int16_t*>(src); break;
+				case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT: 		dst = (T)*reinterpret_cast<const uint32_t*>(src); break;
+				case TINYGLTF_COMPONENT_TYPE_INT: 						dst = (T)*reinterpret_cast<const int32_t*>(src); break;
+				case TINYGLTF_COMPONENT_TYPE_FLOAT: 					dst = (T)*reinterpret_cast<const float*>(src); break;
+				case TINYGLTF_COMPONENT_TYPE_DOUBLE: 					dst = (T)*reinterpret_cast<const double*>(src); break;
+			}
+		}
+	return result;
+}
+
 void load_gltf(Node& root, CommandBuffer& commandBuffer, const fs::path& filename) {
 	ProfilerRegion ps("pbrRenderer::load_gltf", commandBuffer);
 	
@@ -27,6 +56,8 @@ void load_gltf(Node& root, CommandBuffer& commandBuffer, const fs::path& filenam
 	vector<Image::View> images(model.images.size());
 	vector<component_ptr<Material>> materials(model.materials.size());
 	vector<vector<component_ptr<Mesh>>> meshes(model.meshes.size());
+	vector<vector<Buffer::View<VertexWeight>>> meshWeights(model.meshes.size());
+	vector<vector<vector<Buffer::View<PackedVertexData>>>> meshMorphTargets(model.meshes.size());
 
 	auto get_image = [&](uint32_t index, bool srgb) -> Image::View {
 		if (index >= images.size()) return {};
@@ -67,6 +98,16 @@ void load_gltf(Node& root, CommandBuffer& commandBuffer, const fs::path& filenam
 	bufferUsage |= vk::BufferUsageFlagBits::eShaderDeviceAddress;
 	bufferUsage |= vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
 	#endif
+	// skinning weights and morph targets are converted to the layouts kernel/anim.hlsl reads
+	auto upload = [&]<typename T>(const vector<T>& data, const string& name) -> Buffer::View<T> {
+		Buffer::View<T> tmp = make_shared<Buffer>(device, name+"/Staging", data.size()*sizeof(T), vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_CPU_ONLY);
+		ranges::copy(data, tmp.begin());
+		Buffer::View<T> dst = make_shared<Buffer>(device, name, data.size()*sizeof(T), vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eTransferDst, VMA_MEMORY_USAGE_GPU_ONLY, 16);
+		commandBuffer.copy_buffer(tmp, dst);
+		commandBuffer.barrier(dst, vk::PipelineStageFlagBits::eTransfer, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead);
+		return dst;
+	};
+
 	ranges::transform(model.buffers, buffers.begin(), [&](const tinygltf::Buffer& buffer) {
 		Buffer::View<unsigned char> tmp = make_shared<Buffer>(device, buffer.name+"/Staging", buffer.data.size(), vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_CPU_ONLY);
 		ranges::copy(buffer.data, tmp.begin());
@@ -127,6 +168,8 @@ void load_gltf(Node& root, CommandBuffer& commandBuffer, const fs::path& filenam
 	Node& meshesNode = root.make_child("meshes");
 	for (uint32_t i = 0; i < model.meshes.size(); i++) {
 		meshes[i].resize(model.meshes[i].primitives.size());
+		meshWeights[i].resize(model.meshes[i].primitives.size());
+		meshMorphTargets[i].resize(model.meshes[i].primitives.size());
 		for (uint32_t j = 0; j < model.meshes[i].primitives.size(); j++) {
 			const tinygltf::Primitive& prim = model.meshes[i].primitives[j];
 			const auto& indicesAccessor = model.accessors[prim.indices];
@@ -240,10 +283,40 @@ void load_gltf(Node& root, CommandBuffer& commandBuffer, const fs::path& filenam
 			}
 
 			meshes[i][j] = meshesNode.make_child(model.meshes[i].name + "_" + to_string(j)).make_component<Mesh>(vertexData, indexBuffer, topology);
+
+			const size_t vertexCount = model.accessors[prim.attributes.at("POSITION")].count;
+			if (prim.attributes.contains("JOINTS_0") && prim.attributes.contains("WEIGHTS_0")) {
+				const vector<int32_t> joints = read_accessor<int32_t>(model, model.accessors[prim.attributes.at("JOINTS_0")]);
+				const vector<float> weights = read_accessor<float>(model, model.accessors[prim.attributes.at("WEIGHTS_0")]);
+				vector<VertexWeight> vertexWeights(vertexCount);
+				for (size_t v = 0; v < vertexCount; v++) {
+					vertexWeights[v].weights = float4::Map(&weights[4*v]);
+					vertexWeights[v].indices = uint4::Map(&joints[4*v]);
+				}
+				meshWeights[i][j] = upload(vertexWeights, model.meshes[i].name + "_" + to_string(j) + "/Weights");
+			}
+			for (uint32_t t = 0; t < prim.targets.size(); t++) {
+				vector<PackedVertexData> deltas(vertexCount);
+				memset(deltas.data(), 0, deltas.size()*sizeof(PackedVertexData));
+				for (const auto&[attribName, attribIndex] : prim.targets[t]) {
+					const vector<float> values = read_accessor<float>(model, model.accessors[attribIndex]);
+					const size_t components = values.size() / vertexCount;
+					for (size_t v = 0; v < vertexCount; v++) {
+						if (attribName == "POSITION")
+							deltas[v].position = float3::Map(&values[components*v]);
+						else if (attribName == "NORMAL")
+							deltas[v].normal = float3::Map(&values[components*v]);
+						else if (attribName == "TANGENT")
+							deltas[v].tangent.head<3>() = float3::Map(&values[components*v]);
+					}
+				}
+				meshMorphTargets[i][j].emplace_back(upload(deltas, model.meshes[i].name + "_" + to_string(j) + "/Target" + to_string(t)));
+			}
 		}
 	}
 
 	vector<Node*> nodes(model.nodes.size());
+	vector<vector<component_ptr<AnimatedMesh>>> animatedMeshes(model.nodes.size());
 	for (size_t n = 0; n < model.nodes.size(); n++) {
 		const auto& node = model.nodes[n];
 		Node& dst = root.make_child(node.name);
@@ -264,7 +337,21 @@ void load_gltf(Node& root, CommandBuffer& commandBuffer, const fs::path& filenam
 		if (node.mesh < model.meshes.size())
 			for (uint32_t i = 0; i < model.meshes[node.mesh].primitives.size(); i++) {
 				const auto& prim = model.meshes[node.mesh].primitives[i];
-				dst.make_child(model.meshes[node.mesh].name).make_component<MeshPrimitive>(materials[prim.material], meshes[node.mesh][i]);
+				Node& primNode = dst.make_child(model.meshes[node.mesh].name);
+				primNode.make_component<MeshPrimitive>(materials[prim.material], meshes[node.mesh][i]);
+
+				// joints are assigned once every node exists
+				const bool skinned = node.skin >= 0 && meshWeights[node.mesh][i];
+				if (skinned || !meshMorphTargets[node.mesh][i].empty()) {
+					component_ptr<AnimatedMesh> animated = primNode.make_component<AnimatedMesh>();
+					if (skinned) animated->mWeights = meshWeights[node.mesh][i];
+					animated->mMorphTargets = meshMorphTargets[node.mesh][i];
+					const vector<double>& weights = node.weights.empty() ? model.meshes[node.mesh].weights : node.weights;
+					animated->mMorphWeights.resize(animated->mMorphTargets.size());
+					for (size_t t = 0; t < animated->mMorphWeights.size(); t++)
+						animated->mMorphWeights[t] = t < weights.size() ? (float)weights[t] : 0.f;
+					animatedMeshes[n].emplace_back(animated);
+				}
 			}
 		
 		auto light_it = node.extensions.find("KHR_lights_punctual");
@@ -285,6 +372,64 @@ void load_gltf(Node& root, CommandBuffer& commandBuffer, const fs::path& filenam
 		for (int c : model.nodes[i].children)
 			nodes[c]->set_parent(*nodes[i]);
 
+	for (size_t n = 0; n < model.nodes.size(); n++) {
+		if (model.nodes[n].skin < 0) continue;
+		const tinygltf::Skin& skin = model.skins[model.nodes[n].skin];
+		vector<float> inverseBindMatrices;
+		if (skin.inverseBindMatrices >= 0)
+			inverseBindMatrices = read_accessor<float>(model, model.accessors[skin.inverseBindMatrices]);
+		for (const component_ptr<AnimatedMesh>& animated : animatedMeshes[n]) {
+			if (!animated->mWeights) continue;
+			animated->mJoints.resize(skin.joints.size());
+			animated->mInverseBindMatrices.resize(skin.joints.size());
+			for (size_t j = 0; j < skin.joints.size(); j++) {
+				animated->mJoints[j] = nodes[skin.joints[j]];
+				animated->mInverseBindMatrices[j] = inverseBindMatrices.empty() ? Matrix4f::Identity() : Matrix4f::Map(&inverseBindMatrices[16*j]);
+			}
+		}
+	}
+
+	for (const tinygltf::Animation& animation : model.animations) {
+		component_ptr<Animation> a = root.make_child(animation.name.empty() ? "Animation" : animation.name).make_component<Animation>();
+		unordered_map<int, uint32_t> targets;
+		for (const tinygltf::AnimationChannel& channel : animation.channels) {
+			if (channel.target_node < 0) continue;
+			auto[it, added] = targets.emplace(channel.target_node, (uint32_t)a->mTargets.size());
+			if (added) {
+				const tinygltf::Node& node = model.nodes[channel.target_node];
+				Animation::Target& target = a->mTargets.emplace_back();
+				target.mNode = nodes[channel.target_node];
+				target.mTranslation = node.translation.empty() ? float3::Zero() : float3(Array3d::Map(node.translation.data()).cast<float>());
+				target.mRotation = node.rotation.empty() ? quatf_identity() : qnormalize(make_quatf((float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2], (float)node.rotation[3]));
+				target.mScale = node.scale.empty() ? float3::Ones() : float3(Array3d::Map(node.scale.data()).cast<float>());
+				target.mMeshes = animatedMeshes[channel.target_node];
+				if (!target.mNode->find<TransformData>())
+					target.mNode->make_component<TransformData>(make_transform(target.mTranslation, target.mRotation, target.mScale));
+			}
+
+			const tinygltf::AnimationSampler& sampler = animation.samplers[channel.sampler];
+			Animation::Channel& c = a->mChannels.emplace_back();
+			c.mTarget = it->second;
+			if (channel.target_path == "translation") c.mPath = Animation::Path::eTranslation;
+			else if (channel.target_path == "rotation") c.mPath = Animation::Path::eRotation;
+			else if (channel.target_path == "scale") c.mPath = Animation::Path::eScale;
+			else c.mPath = Animation::Path::eWeights;
+			c.mStep = sampler.interpolation == "STEP";
+			c.mTimes = read_accessor<float>(model, model.accessors[sampler.input]);
+			c.mValues = read_accessor<float>(model, model.accessors[sampler.output]);
+			if (sampler.interpolation == "CUBICSPLINE" && !c.mTimes.empty()) {
+				// keep the values, dropping the in and out tangents
+				const size_t n = c.mValues.size() / (3*c.mTimes.size());
+				vector<float> values(n*c.mTimes.size());
+				for (size_t k = 0; k < c.mTimes.size(); k++)
+					ranges::copy_n(c.mValues.begin() + (3*k + 1)*n, n, values.begin() + k*n);
+				c.mValues = move(values);
+			}
+			if (!c.mTimes.empty())
+				a->mDuration = max(a->mDuration, c.mTimes.back());
+		}
+	}
+
 	cout << "Loaded " << filename << endl;
 }
 
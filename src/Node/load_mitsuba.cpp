@@ -678,7 +678,7 @@ void parse_scene(Node& root, CommandBuffer& commandBuffer, pugi::xml_node node)
 					}
 				}
 				if (filename.size() > 0) {
-					Environment e = load_environment(commandBuffer, filename);
+					Environment e = load_environment(commandBuffer, *root.node_graph().find_components<ShaderDatabase>().front(), filename);
 					e.emission.value *= scale;
 					n.make_component<Material>(e);
 				} else {
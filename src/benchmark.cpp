@@ -0,0 +1,342 @@
+#include "benchmark.hpp"
+
+#include "Node/NodeGraph.hpp"
+#include "Node/RayTraceScene.hpp"
+#include "Core/Instance.hpp"
+#include "Core/ShaderModule.hpp"
+
+namespace stm {
+
+// average time of fn() in milliseconds, after one warmup run
+template<invocable F>
+inline double time_ms(F&& fn, uint32_t iterations) {
+	fn();
+	const auto t0 = chrono::high_resolution_clock::now();
+	for (uint32_t i = 0; i < iterations; i++)
+		fn();
+	return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t0).count() / iterations;
+}
+
+inline size_t parse_count(const vector<string>& args, const string& name, size_t defaultValue) {
+	for (const string& arg : args)
+		if (arg.starts_with("--" + name + ":"))
+			return stoull(arg.substr(name.size() + 3));
+	return defaultValue;
+}
+
+// Compares iterating all components of one type through the old storage (a hash map of individually allocated components per type,
+// visited with a BFS over the hierarchy), Node::for_each_descendant, TransformCache::for_each_descendant (timed after the cache is built),
+// and the linear scan of NodeGraph::find_components
+void benchmark_node_graph(const vector<string>& args) {
+	struct Primitive {
+		float mData[8];
+	};
+	struct Transform {
+		float mData[16];
+	};
+
+	const size_t count = parse_count(args, "count", 100000);
+	const uint32_t iterations = (uint32_t)parse_count(args, "iterations", 20);
+	const size_t branching = 16;
+
+	NodeGraph nodeGraph;
+	Node& root = nodeGraph.emplace("root");
+	unordered_map<const Node*, void*> oldPrimitives;
+
+	// gltf-like hierarchy: interior nodes with transforms, primitives at the leaves
+	vector<Node*> level = { &root };
+	while (level.size()*branching*branching <= count) {
+		vector<Node*> next;
+		for (Node* n : level)
+			for (size_t i = 0; i < branching; i++) {
+				Node& c = n->make_child("node");
+				c.make_component<Transform>();
+				next.emplace_back(&c);
+			}
+		level = move(next);
+	}
+	for (size_t i = 0; i < count; i++) {
+		Node& c = level[i % level.size()]->make_child("primitive");
+		auto prim = c.make_component<Primitive>();
+		ranges::fill(prim->mData, (float)i);
+		oldPrimitives.emplace(&c, new Primitive(*prim));
+	}
+
+	float sum = 0;
+	const double oldTime = time_ms([&]() {
+		queue<const Node*> q;
+		q.push(&root);
+		while (!q.empty()) {
+			const Node* n = q.front();
+			q.pop();
+			if (auto it = oldPrimitives.find(n); it != oldPrimitives.end())
+				sum += reinterpret_cast<const Primitive*>(it->second)->mData[0];
+			for (const Node& c : n->children())
+				q.push(&c);
+		}
+	}, iterations);
+	const double descendantTime = time_ms([&]() {
+		root.for_each_descendant<Primitive>([&](const component_ptr<Primitive>& p) { sum += p->mData[0]; });
+	}, iterations);
+	const TransformCache& transforms = transform_cache(nodeGraph);
+	const double cachedDescendantTime = time_ms([&]() {
+		transforms.for_each_descendant<Primitive>(root, [&](const component_ptr<Primitive>& p) { sum += p->mData[0]; });
+	}, iterations);
+	const double linearTime = time_ms([&]() {
+		for (const component_ptr<Primitive>& p : nodeGraph.find_components<Primitive>())
+			sum += p->mData[0];
+	}, iterations);
+
+	cout << "NodeGraph: " << count << " primitives, " << nodeGraph.size() << " nodes (checksum " << sum << ")" << endl;
+	cout << "  old storage, hierarchy traversal:    " << oldTime << " ms" << endl;
+	cout << "  Node::for_each_descendant:           " << descendantTime << " ms" << endl;
+	cout << "  TransformCache::for_each_descendant: " << cachedDescendantTime << " ms" << endl;
+	cout << "  find_components (linear scan):       " << linearTime << " ms" << endl;
+
+	for (const auto&[n, p] : oldPrimitives)
+		delete reinterpret_cast<Primitive*>(p);
+	nodeGraph.erase_recurse(root);
+}
+
+// Compares refitting (eUpdate) and rebuilding (eBuild) the BLAS of a deforming grid of --triangles:<n> triangles, like RayTraceScene does for skinned meshes.
+// Times are per build, measured from recording to the completion fence, and the vertices are displaced on the host before every build
+void benchmark_skinned_refit(const vector<string>& args) {
+	const size_t triangleCount = parse_count(args, "triangles", 100000);
+	const uint32_t iterations = (uint32_t)parse_count(args, "iterations", 50);
+	const uint32_t n = (uint32_t)ceil(sqrt(triangleCount/2.0)); // quads per side
+
+	NodeGraph nodeGraph;
+	Node& instanceNode = nodeGraph.emplace("Instance");
+	auto instance = instanceNode.make_component<Instance>(args);
+	instance->create_device();
+	Device& device = instance->device();
+
+	const vk::BufferUsageFlags usage = vk::BufferUsageFlagBits::eShaderDeviceAddress|vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
+	Buffer::View<float3> vertices = make_shared<Buffer>(device, "vertices", (n+1)*(n+1)*sizeof(float3), usage, VMA_MEMORY_USAGE_CPU_TO_GPU);
+	Buffer::View<uint32_t> indices = make_shared<Buffer>(device, "indices", 6*n*n*sizeof(uint32_t), usage, VMA_MEMORY_USAGE_CPU_TO_GPU);
+	for (uint32_t y = 0; y < n; y++)
+		for (uint32_t x = 0; x < n; x++) {
+			const uint32_t i = y*(n+1) + x;
+			uint32_t* quad = &indices[6*(y*n + x)];
+			quad[0] = i;
+			quad[1] = i + 1;
+			quad[2] = i + n + 1;
+			quad[3] = i + 1;
+			quad[4] = i + n + 2;
+			quad[5] = i + n + 1;
+		}
+	float phase = 0;
+	auto deform = [&]() {
+		phase += 1/60.f;
+		for (uint32_t y = 0; y <= n; y++)
+			for (uint32_t x = 0; x <= n; x++)
+				vertices[y*(n+1) + x] = float3(x/(float)n, y/(float)n, 0.1f*sin(10*x/(float)n + phase)*cos(10*y/(float)n + phase));
+	};
+	deform();
+
+	vk::AccelerationStructureGeometryTrianglesDataKHR triangles;
+	triangles.vertexFormat = vk::Format::eR32G32B32Sfloat;
+	triangles.vertexData = vertices.device_address();
+	triangles.vertexStride = sizeof(float3);
+	triangles.maxVertex = (n+1)*(n+1);
+	triangles.indexType = vk::IndexType::eUint32;
+	triangles.indexData = indices.device_address();
+	vk::AccelerationStructureGeometryKHR geometry(vk::GeometryTypeKHR::eTriangles, triangles, vk::GeometryFlagBitsKHR::eOpaque);
+	vk::AccelerationStructureBuildRangeInfoKHR range(2*n*n);
+
+	shared_ptr<AccelerationStructure> blas;
+	{
+		auto commandBuffer = device.get_command_buffer("Initial build", vk::QueueFlagBits::eCompute);
+		blas = make_shared<AccelerationStructure>(*commandBuffer, "BLAS", vk::AccelerationStructureTypeKHR::eBottomLevel, geometry, range,
+			vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate|vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild);
+		device.submit(commandBuffer);
+		commandBuffer->completion_fence().wait();
+	}
+
+	auto time_builds = [&](vk::BuildAccelerationStructureModeKHR mode) {
+		return time_ms([&]() {
+			deform();
+			auto commandBuffer = device.get_command_buffer("Build", vk::QueueFlagBits::eCompute);
+			blas->build(*commandBuffer, geometry, range, mode);
+			device.submit(commandBuffer);
+			commandBuffer->completion_fence().wait();
+		}, iterations);
+	};
+	const double refitTime = time_builds(vk::BuildAccelerationStructureModeKHR::eUpdate);
+	const double rebuildTime = time_builds(vk::BuildAccelerationStructureModeKHR::eBuild);
+
+	cout << "SkinnedRefit: " << 2*n*n << " triangles, " << (n+1)*(n+1) << " vertices" << endl;
+	cout << "  refit (eUpdate):   " << refitTime << " ms" << endl;
+	cout << "  rebuild (eBuild):  " << rebuildTime << " ms" << endl;
+
+	blas.reset();
+	vertices.reset();
+	indices.reset();
+	device.flush();
+	nodeGraph.erase_recurse(instanceNode);
+}
+
+// Builds the environment map sampling distributions of --file:<path> (or a synthetic sky of --width:<n> x n/2 texels) with the CPU
+// build_distributions and with dist2.hlsl, and reports both times and the largest difference between the two. GPU times are measured
+// from recording to the completion fence. The shaders are loaded from the Shaders folder next to the executable
+void benchmark_environment_distribution(const vector<string>& args) {
+	const uint32_t iterations = (uint32_t)parse_count(args, "iterations", 10);
+
+	NodeGraph nodeGraph;
+	Node& instanceNode = nodeGraph.emplace("Instance");
+	auto instance = instanceNode.make_component<Instance>(args);
+	instance->create_device();
+	Device& device = instance->device();
+
+	ShaderDatabase shaders;
+	ShaderModule::load_from_dir(shaders, device, fs::path(args[0]).parent_path()/"Shaders");
+
+	ImageData image;
+	if (auto it = ranges::find_if(args, [](const string& s) { return s.starts_with("--file:"); }); it != args.end())
+		image = load_image_data(device, it->substr(7), false, 4);
+	else {
+		const uint32_t w = (uint32_t)parse_count(args, "width", 8192);
+		const uint32_t h = w/2;
+		Buffer::View<float4> pixels = make_shared<Buffer>(device, "pixels", w*h*sizeof(float4), vk::BufferUsageFlagBits::eTransferSrc, VMA_MEMORY_USAGE_CPU_TO_GPU);
+		for (uint32_t y = 0; y < h; y++)
+			for (uint32_t x = 0; x < w; x++) {
+				// a sky gradient, a black ground, and a small bright sun
+				const float sky = y < h/2 ? 0.2f + y/(float)h : 0;
+				const float sun = pow2(x/(float)w - 0.3f) + pow2(y/(float)h - 0.2f) < 1e-4f ? 5e4f : 0;
+				pixels[y*w + x] = float4(sky + sun, sky + sun, 1.5f*sky + sun, 1);
+			}
+		image = ImageData{ Buffer::TexelView(pixels, vk::Format::eR32G32B32A32Sfloat), vk::Extent3D(w, h, 1) };
+	}
+	const uint32_t w = image.extent.width;
+	const uint32_t h = image.extent.height;
+
+	Image::View img;
+	{
+		auto commandBuffer = device.get_command_buffer("Upload", vk::QueueFlagBits::eCompute);
+		img = make_shared<Image>(*commandBuffer, "environment", image, 1);
+		device.submit(commandBuffer);
+		commandBuffer->completion_fence().wait();
+	}
+
+	vector<float> marginalPDF(h), rowPDF(w*h), marginalCDF(h + 1), rowCDF((w + 1)*h);
+	const double cpuTime = time_ms([&]() {
+		hlsl::build_distributions(span<float4>(reinterpret_cast<float4*>(image.pixels.data()), image.pixels.size_bytes()/sizeof(float4)), vk::Extent2D(w, h),
+			marginalPDF, rowPDF, marginalCDF, rowCDF);
+	}, iterations);
+
+	const vk::BufferUsageFlags usage = vk::BufferUsageFlagBits::eTransferSrc|vk::BufferUsageFlagBits::eStorageBuffer;
+	Buffer::View<float> gpuMarginalPDF = make_shared<Buffer>(device, "marginal_pdf", marginalPDF.size()*sizeof(float), usage, VMA_MEMORY_USAGE_GPU_TO_CPU);
+	Buffer::View<float> gpuRowPDF      = make_shared<Buffer>(device, "row_pdf", rowPDF.size()*sizeof(float), usage, VMA_MEMORY_USAGE_GPU_TO_CPU);
+	Buffer::View<float> gpuMarginalCDF = make_shared<Buffer>(device, "marginal_cdf", marginalCDF.size()*sizeof(float), usage, VMA_MEMORY_USAGE_GPU_TO_CPU);
+	Buffer::View<float> gpuRowCDF      = make_shared<Buffer>(device, "row_cdf", rowCDF.size()*sizeof(float), usage, VMA_MEMORY_USAGE_GPU_TO_CPU);
+	const double gpuTime = time_ms([&]() {
+		auto commandBuffer = device.get_command_buffer("Build distributions", vk::QueueFlagBits::eCompute);
+		hlsl::build_distributions(*commandBuffer, shaders, img, gpuMarginalPDF, gpuRowPDF, gpuMarginalCDF, gpuRowCDF);
+		commandBuffer->barrier(gpuRowCDF, vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderWrite, vk::PipelineStageFlagBits::eHost, vk::AccessFlagBits::eHostRead);
+		device.submit(commandBuffer);
+		commandBuffer->completion_fence().wait();
+	}, iterations);
+
+	auto max_error = [](const vector<float>& ref, Buffer::View<float> v) {
+		float e = 0;
+		for (size_t i = 0; i < ref.size(); i++)
+			e = max(e, abs(ref[i] - v[i]));
+		return e;
+	};
+
+	cout << "EnvironmentDistribution: " << w << "x" << h << endl;
+	cout << "  CPU build_distributions:  " << cpuTime << " ms" << endl;
+	cout << "  GPU (dist2.hlsl):         " << gpuTime << " ms" << endl;
+	cout << "  max error: marginal pdf " << max_error(marginalPDF, gpuMarginalPDF) << ", row pdf " << max_error(rowPDF, gpuRowPDF)
+		<< ", marginal cdf " << max_error(marginalCDF, gpuMarginalCDF) << ", row cdf " << max_error(rowCDF, gpuRowCDF) << endl;
+
+	img = Image::View();
+	gpuMarginalPDF.reset();
+	gpuRowPDF.reset();
+	gpuMarginalCDF.reset();
+	gpuRowCDF.reset();
+	image.pixels.reset();
+	device.flush();
+	nodeGraph.erase_recurse(instanceNode);
+}
+
+// hash_args' fallback before hash_bytes: binary_write into a streambuf that hashes one byte per overflow() call
+template<typename T>
+inline size_t hash_args_bytewise(const T& v) {
+	class hash_streambuf : public basic_streambuf<char, char_traits<char>> {
+	public:
+		using base_t = basic_streambuf<char, char_traits<char>>;
+		size_t mValue = 0;
+		inline base_t::int_type overflow(base_t::int_type v) {
+			mValue = hash_combine(mValue, v);
+			return v;
+		}
+	};
+	hash_streambuf h;
+	ostream os(&h);
+	binary_write(os, v);
+	return h.mValue;
+}
+
+// Compares hash_bytes with the hashing that hash_args did before it, on --iterations:<n> hashes of inputs from 16 bytes to 1 MB:
+// the byte-per-call streambuf used for types without std::hash, and the per-element hash_combine used for ranges.
+// Also times a pipeline key like ComputePipelineState::get_pipeline's
+void benchmark_hash_args(const vector<string>& args) {
+	const uint32_t iterations = (uint32_t)parse_count(args, "iterations", 1000);
+
+	size_t checksum = 0;
+	cout << "HashArgs: time per hash in microseconds (streambuf / per element / hash_bytes)" << endl;
+	for (size_t bytes : { 16, 256, 4096, 65536, 1 << 20 }) {
+		vector<uint32_t> data(bytes/sizeof(uint32_t));
+		ranges::generate(data, [i = 0u]() mutable { return i++ * 2654435761u; });
+
+		const uint32_t n = max<uint32_t>(1, (uint32_t)(iterations * 4096 / max<size_t>(bytes, 4096)));
+		const double streambufTime = time_ms([&]() { checksum += hash_args_bytewise(data); }, n);
+		const double elementTime = time_ms([&]() {
+			size_t h = 0;
+			for (const uint32_t v : data)
+				h = hash_combine(h, hash<uint32_t>()(v));
+			checksum += h;
+		}, n);
+		const double bytesTime = time_ms([&]() { checksum += hash_args(data); }, n);
+		cout << "  " << bytes << " bytes: " << streambufTime*1e3 << " / " << elementTime*1e3 << " / " << bytesTime*1e3
+		     << " (" << bytes / (bytesTime*1e6) << " GB/s)" << endl;
+	}
+
+	// the key of a pt.hlsl pipeline: a few specialization constants, a descriptor binding flag and an immutable sampler.
+	// Flags stands in for a binding flag type without a std::hash, which took the streambuf
+	struct Flags {
+		uint32_t mMask;
+	};
+	const unordered_map<string, uint32_t> constants = { { "gDebugMode", 0 }, { "gModulateAlbedo", 1 }, { "gGammaCorrection", 1 }, { "gMode", 2 } };
+	const unordered_map<string, Flags> bindingFlags = { { "gImages", { 1 } } };
+	const unordered_map<string, size_t> samplers = { { "gSampler", 0x1234 } };
+	const double keyTime = time_ms([&]() { checksum += hash_args(constants, bindingFlags, samplers); }, iterations);
+	const double keyBytewiseTime = time_ms([&]() {
+		size_t h = 0;
+		for (const auto&[name, value] : constants)
+			h = hash_combine(h, hash_combine(hash_args(name), hash_args(value)));
+		for (const auto&[name, value] : bindingFlags)
+			h = hash_combine(h, hash_combine(hash_args(name), hash_args_bytewise(value)));
+		for (const auto&[name, value] : samplers)
+			h = hash_combine(h, hash_combine(hash_args(name), hash_args(value)));
+		checksum += h;
+	}, iterations);
+	cout << "  pipeline key: " << keyBytewiseTime*1e3 << " us with the streambuf, " << keyTime*1e3 << " us with hash_bytes (checksum " << checksum << ")" << endl;
+}
+
+bool run_benchmark(const string& name, const vector<string>& args) {
+	if (name == "NodeGraph")
+		benchmark_node_graph(args);
+	else if (name == "SkinnedRefit")
+		benchmark_skinned_refit(args);
+	else if (name == "EnvironmentDistribution")
+		benchmark_environment_distribution(args);
+	else if (name == "HashArgs")
+		benchmark_hash_args(args);
+	else
+		return false;
+	return true;
+}
+
+}
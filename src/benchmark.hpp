@@ -0,0 +1,10 @@
+#pragma once
+
+#include <Common/common.hpp>
+
+namespace stm {
+
+// Microbenchmarks, run with --benchmark:<name>. Returns false if there is no benchmark with the given name
+STRATUM_API bool run_benchmark(const string& name, const vector<string>& args);
+
+}
@@ -2,6 +2,7 @@
 #include "Node/Gui.hpp"
 #include "Node/RayTraceScene.hpp"
 #include "Node/XR.hpp"
+#include "benchmark.hpp"
 
 using namespace stm;
 using namespace stm::hlsl;
@@ -78,6 +79,14 @@ int main(int argc, char** argv) {
   for (int i = 0; i < argc; i++)
     args.emplace_back(argv[i]);
 
+  if (auto it = ranges::find_if(args, [](const string& s) { return s.starts_with("--benchmark:"); }); it != args.end()) {
+    if (!run_benchmark(it->substr(12), args)) {
+      cerr << "Unknown benchmark " << it->substr(12) << endl;
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
   Node& instance_node = gNodeGraph.emplace("Instance");
   Node& app_node = instance_node.make_child("Application");
 